@@ -0,0 +1,135 @@
+// Generated by tools/mime-gen from src/static/mime.types; do not edit.
+
+#define MIME_PHF_BUCKETS 61u
+#define MIME_PHF_MASK 255u
+
+static const u16 mime_phf_seeds[MIME_PHF_BUCKETS] = {
+    0, 1, 1, 2, 3, 1, 1, 1, 1, 3, 2, 1, 1, 3, 1, 1,
+    0, 2, 2, 2, 2, 1, 1, 9, 1, 1, 4, 4, 0, 0, 2, 1,
+    3, 2, 1, 1, 1, 0, 1, 1, 7, 1, 0, 2, 1, 4, 1, 3,
+    2, 3, 3, 0, 1, 0, 2, 1, 1, 1, 1, 2, 1
+};
+
+static const mime_entry_t mime_phf_table[MIME_PHF_MASK + 1] = {
+    [2] = {"ppt", "application/vnd.ms-powerpoint"},
+    [3] = {"tif", "image/tiff"},
+    [4] = {"sql", "application/sql"},
+    [7] = {"ttf", "font/ttf"},
+    [8] = {"sig", "application/pgp-signature"},
+    [9] = {"tiff", "image/tiff"},
+    [11] = {"ics", "text/calendar"},
+    [13] = {"xslt", "text/xml"},
+    [14] = {"gz", "application/gzip"},
+    [17] = {"markdown", "text/plain; charset=utf-8"},
+    [19] = {"eot", "application/vnd.ms-fontobject"},
+    [21] = {"odp", "application/vnd.oasis.opendocument.presentation"},
+    [23] = {"webmanifest", "application/manifest+json"},
+    [24] = {"odt", "application/vnd.oasis.opendocument.text"},
+    [26] = {"3gp", "video/3gpp"},
+    [27] = {"mpd", "application/dash+xml"},
+    [32] = {"xz", "application/x-xz"},
+    [38] = {"epub", "application/epub+zip"},
+    [39] = {"heic", "image/heic"},
+    [40] = {"sh", "application/x-sh"},
+    [42] = {"pdf", "application/pdf"},
+    [43] = {"woff", "font/woff"},
+    [48] = {"bin", "application/octet-stream"},
+    [49] = {"eps", "application/postscript"},
+    [52] = {"jar", "application/java-archive"},
+    [55] = {"flac", "audio/flac"},
+    [56] = {"aac", "audio/aac"},
+    [57] = {"conf", "text/plain; charset=utf-8"},
+    [58] = {"dmg", "application/octet-stream"},
+    [60] = {"mov", "video/quicktime"},
+    [62] = {"der", "application/x-x509-ca-cert"},
+    [63] = {"pptx", "application/vnd.openxmlformats-officedocument.presentationml.presentation"},
+    [65] = {"xsl", "text/xml"},
+    [67] = {"m4a", "audio/mp4"},
+    [69] = {"zip", "application/zip"},
+    [76] = {"rss", "application/rss+xml"},
+    [88] = {"map", "application/json"},
+    [90] = {"mkv", "video/x-matroska"},
+    [91] = {"yml", "application/yaml"},
+    [95] = {"rar", "application/x-rar-compressed"},
+    [96] = {"opus", "audio/ogg"},
+    [97] = {"rpm", "application/octet-stream"},
+    [101] = {"dll", "application/octet-stream"},
+    [102] = {"xlsx", "application/vnd.openxmlformats-officedocument.spreadsheetml.sheet"},
+    [103] = {"avif", "image/avif"},
+    [104] = {"midi", "audio/midi"},
+    [106] = {"weba", "audio/webm"},
+    [109] = {"md", "text/plain; charset=utf-8"},
+    [112] = {"cur", "image/x-icon"},
+    [120] = {"crt", "application/x-x509-ca-cert"},
+    [121] = {"rtf", "application/rtf"},
+    [122] = {"vtt", "text/vtt"},
+    [123] = {"iso", "application/octet-stream"},
+    [124] = {"jsonld", "application/ld+json"},
+    [125] = {"tar", "application/x-tar"},
+    [128] = {"atom", "application/atom+xml"},
+    [132] = {"bz2", "application/x-bzip2"},
+    [133] = {"text", "text/plain; charset=utf-8"},
+    [135] = {"mp3", "audio/mpeg"},
+    [136] = {"htm", "text/html; charset=utf-8"},
+    [139] = {"docx", "application/vnd.openxmlformats-officedocument.wordprocessingml.document"},
+    [141] = {"7z", "application/x-7z-compressed"},
+    [144] = {"ico", "image/x-icon"},
+    [145] = {"gif", "image/gif"},
+    [147] = {"m4v", "video/mp4"},
+    [149] = {"ai", "application/postscript"},
+    [151] = {"log", "text/plain; charset=utf-8"},
+    [153] = {"jxl", "image/jxl"},
+    [155] = {"png", "image/png"},
+    [156] = {"tgz", "application/gzip"},
+    [157] = {"ods", "application/vnd.oasis.opendocument.spreadsheet"},
+    [158] = {"xhtml", "application/xhtml+xml"},
+    [160] = {"jpg", "image/jpeg"},
+    [162] = {"txt", "text/plain; charset=utf-8"},
+    [165] = {"wav", "audio/wav"},
+    [175] = {"zst", "application/zstd"},
+    [179] = {"webm", "video/webm"},
+    [181] = {"yaml", "application/yaml"},
+    [184] = {"exe", "application/octet-stream"},
+    [185] = {"mp4", "video/mp4"},
+    [186] = {"css", "text/css; charset=utf-8"},
+    [187] = {"html", "text/html; charset=utf-8"},
+    [189] = {"ogv", "video/ogg"},
+    [190] = {"ear", "application/java-archive"},
+    [192] = {"war", "application/java-archive"},
+    [198] = {"tsv", "text/tab-separated-values"},
+    [199] = {"pem", "application/x-x509-ca-cert"},
+    [201] = {"toml", "application/toml"},
+    [202] = {"img", "application/octet-stream"},
+    [203] = {"js", "application/javascript"},
+    [204] = {"deb", "application/octet-stream"},
+    [206] = {"avi", "video/x-msvideo"},
+    [207] = {"jpeg", "image/jpeg"},
+    [208] = {"apng", "image/apng"},
+    [209] = {"svg", "image/svg+xml"},
+    [210] = {"otf", "font/otf"},
+    [211] = {"json", "application/json"},
+    [212] = {"mpg", "video/mpeg"},
+    [214] = {"oga", "audio/ogg"},
+    [216] = {"jpe", "image/jpeg"},
+    [222] = {"wasm", "application/wasm"},
+    [225] = {"xls", "application/vnd.ms-excel"},
+    [226] = {"mpeg", "video/mpeg"},
+    [227] = {"msi", "application/octet-stream"},
+    [230] = {"cjs", "application/javascript"},
+    [231] = {"m3u8", "application/vnd.apple.mpegurl"},
+    [234] = {"doc", "application/msword"},
+    [237] = {"csv", "text/csv; charset=utf-8"},
+    [239] = {"asc", "application/pgp-signature"},
+    [240] = {"ttc", "font/collection"},
+    [243] = {"jfif", "image/jpeg"},
+    [244] = {"ogg", "audio/ogg"},
+    [245] = {"ini", "text/plain; charset=utf-8"},
+    [246] = {"mid", "audio/midi"},
+    [247] = {"xml", "application/xml"},
+    [248] = {"ps", "application/postscript"},
+    [249] = {"webp", "image/webp"},
+    [251] = {"bmp", "image/bmp"},
+    [252] = {"mjs", "application/javascript"},
+    [254] = {"shtml", "text/html; charset=utf-8"},
+    [255] = {"woff2", "font/woff2"},
+};
@@ -6,23 +6,15 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <time.h>
 #include <unistd.h>
 
 #include "core/log.h"
 
-static u64 fnv1a(const char *data, usize len) {
-  u64 hash = 14695981039346656037ULL;
-  for (usize i = 0; i < len; i++) {
-    hash ^= (u8)data[i];
-    hash *= 1099511628211ULL;
-  }
-  return hash;
-}
-
-static void cache_path(cache_store_t *store, const char *key, char *out, usize max) {
-  u64 h = fnv1a(key, strlen(key));
-  snprintf(out, max, "%s/%016llx.cache", store->root, (unsigned long long)h);
+static void cache_path(cache_store_t *store, const cache_key_t *key, char *out, usize max) {
+  snprintf(out, max, "%s/%016llx%016llx.cache", store->root, (unsigned long long)key->hi,
+           (unsigned long long)key->lo);
 }
 
 cache_store_t *cache_store_create(const char *root, int max_entries) {
@@ -42,18 +34,33 @@ void cache_store_destroy(cache_store_t *store) {
     free(store);
 }
 
-np_status_t cache_lookup(cache_store_t *store, const char *key, cache_entry_t *entry) {
+// Reads `len` bytes at `off`; with `nowait`, only if they are all in the page cache.
+static isize read_at(int fd, void *buf, usize len, off_t off, bool nowait) {
+  if (!nowait)
+    return pread(fd, buf, len, off);
+  struct iovec iov = {.iov_base = buf, .iov_len = len};
+  isize n = preadv2(fd, &iov, 1, off, RWF_NOWAIT);
+  if (n < 0 && errno == EOPNOTSUPP)
+    return pread(fd, buf, len, off);
+  if ((n < 0 && errno == EAGAIN) || (n > 0 && (usize)n < len))
+    return NP_ERR_AGAIN;
+  return n;
+}
+
+np_status_t cache_lookup(cache_store_t *store, const cache_key_t *key, cache_entry_t *entry,
+                         bool nowait) {
   char path[1024];
   cache_path(store, key, path, sizeof(path));
 
-  int fd = open(path, O_RDONLY);
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
   if (fd < 0)
     return NP_ERR;
 
   cache_entry_header_t hdr;
-  if (read(fd, &hdr, sizeof(hdr)) != sizeof(hdr)) {
+  isize nr = read_at(fd, &hdr, sizeof(hdr), 0, nowait);
+  if (nr != sizeof(hdr)) {
     close(fd);
-    return NP_ERR;
+    return nr == NP_ERR_AGAIN ? NP_ERR_AGAIN : NP_ERR;
   }
 
   if (hdr.expire_time > 0 && time(NULL) > hdr.expire_time) {
@@ -69,12 +76,12 @@ np_status_t cache_lookup(cache_store_t *store, const char *key, cache_entry_t *e
     return NP_ERR_NOMEM;
   }
 
-  isize nr = read(fd, data, total);
+  nr = read_at(fd, data, total, sizeof(hdr), nowait);
   close(fd);
 
   if (nr < 0 || (usize)nr != total) {
     free(data);
-    return NP_ERR;
+    return nr == NP_ERR_AGAIN ? NP_ERR_AGAIN : NP_ERR;
   }
 
   entry->hdr = hdr;
@@ -83,8 +90,9 @@ np_status_t cache_lookup(cache_store_t *store, const char *key, cache_entry_t *e
   return NP_OK;
 }
 
-np_status_t cache_insert(cache_store_t *store, const char *key, int status, const u8 *headers,
-                         usize headers_len, const u8 *body, usize body_len, int ttl) {
+np_status_t cache_insert(cache_store_t *store, const cache_key_t *key, int status,
+                         const u8 *headers, usize headers_len, const u8 *body, usize body_len,
+                         int ttl) {
   char path[1024];
   char tmp_path[1040];
   cache_path(store, key, path, sizeof(path));
@@ -128,7 +136,7 @@ np_status_t cache_insert(cache_store_t *store, const char *key, int status, cons
   return NP_OK;
 }
 
-np_status_t cache_remove(cache_store_t *store, const char *key) {
+np_status_t cache_remove(cache_store_t *store, const cache_key_t *key) {
   char path[1024];
   cache_path(store, key, path, sizeof(path));
   if (unlink(path) == 0)
@@ -136,13 +144,271 @@ np_status_t cache_remove(cache_store_t *store, const char *key) {
   return NP_ERR;
 }
 
-void cache_key_from_request(http_request_t *req, char *out, usize max) {
-  str_t host = request_header(req, STR("Host"));
-  const char *method = http_method_str(req->method);
+// ---- Keys ----
+
+// Streaming MurmurHash3 x64_128, so key components are hashed where they lie.
+typedef struct {
+  u64 h1, h2;
+  u8 tail[16];
+  usize tail_len;
+  usize total;
+} key_hasher_t;
+
+#define MM_C1 0x87c37b91114253d5ULL
+#define MM_C2 0x4cf5ad432745937fULL
+
+static inline u64 rotl64(u64 x, int r) { return (x << r) | (x >> (64 - r)); }
+
+static inline u64 fmix64(u64 k) {
+  k ^= k >> 33;
+  k *= 0xff51afd7ed558ccdULL;
+  k ^= k >> 33;
+  k *= 0xc4ceb9fe1a85ec53ULL;
+  k ^= k >> 33;
+  return k;
+}
+
+static void hasher_block(key_hasher_t *h, const u8 *b) {
+  u64 k1, k2;
+  memcpy(&k1, b, 8);
+  memcpy(&k2, b + 8, 8);
+  k1 *= MM_C1;
+  k1 = rotl64(k1, 31);
+  k1 *= MM_C2;
+  h->h1 ^= k1;
+  h->h1 = rotl64(h->h1, 27) + h->h2;
+  h->h1 = h->h1 * 5 + 0x52dce729;
+  k2 *= MM_C2;
+  k2 = rotl64(k2, 33);
+  k2 *= MM_C1;
+  h->h2 ^= k2;
+  h->h2 = rotl64(h->h2, 31) + h->h1;
+  h->h2 = h->h2 * 5 + 0x38495ab5;
+}
+
+static void hasher_update(key_hasher_t *h, const void *data, usize len) {
+  const u8 *p = data;
+  h->total += len;
+  if (h->tail_len > 0) {
+    usize n = 16 - h->tail_len < len ? 16 - h->tail_len : len;
+    memcpy(h->tail + h->tail_len, p, n);
+    h->tail_len += n;
+    p += n;
+    len -= n;
+    if (h->tail_len < 16)
+      return;
+    hasher_block(h, h->tail);
+    h->tail_len = 0;
+  }
+  for (; len >= 16; p += 16, len -= 16)
+    hasher_block(h, p);
+  memcpy(h->tail, p, len);
+  h->tail_len = len;
+}
+
+static void hasher_final(key_hasher_t *h, cache_key_t *out) {
+  u64 k1 = 0, k2 = 0;
+  for (usize i = 8; i < h->tail_len; i++)
+    k2 ^= (u64)h->tail[i] << ((i - 8) * 8);
+  if (h->tail_len > 8) {
+    k2 *= MM_C2;
+    k2 = rotl64(k2, 33);
+    k2 *= MM_C1;
+    h->h2 ^= k2;
+  }
+  for (usize i = 0; i < h->tail_len && i < 8; i++)
+    k1 ^= (u64)h->tail[i] << (i * 8);
+  if (h->tail_len > 0) {
+    k1 *= MM_C1;
+    k1 = rotl64(k1, 31);
+    k1 *= MM_C2;
+    h->h1 ^= k1;
+  }
+  u64 h1 = h->h1 ^ h->total, h2 = h->h2 ^ h->total;
+  h1 += h2;
+  h2 += h1;
+  h1 = fmix64(h1);
+  h2 = fmix64(h2);
+  h1 += h2;
+  h2 += h1;
+  out->hi = h1;
+  out->lo = h2;
+}
+
+// Hashes `s` through a small staging buffer, lower-casing it or upper-casing percent-escapes.
+static void hash_normalized(key_hasher_t *h, str_t s, bool lower, bool pct_upper) {
+  u8 chunk[64];
+  usize n = 0;
+  int hex = 0;  // hex digits of a percent-escape still to come
+  for (usize i = 0; i < s.len; i++) {
+    u8 c = (u8)s.ptr[i];
+    if (lower && c >= 'A' && c <= 'Z')
+      c = (u8)(c + 32);
+    if (pct_upper) {
+      if (hex > 0) {
+        if (c >= 'a' && c <= 'f')
+          c = (u8)(c - 32);
+        hex--;
+      } else if (c == '%') {
+        hex = 2;
+      }
+    }
+    chunk[n++] = c;
+    if (n == sizeof(chunk)) {
+      hasher_update(h, chunk, n);
+      n = 0;
+    }
+  }
+  hasher_update(h, chunk, n);
+}
+
+typedef enum {
+  KEY_LITERAL = STR_TMPL_LITERAL,
+  KEY_METHOD,
+  KEY_SCHEME,
+  KEY_HOST,
+  KEY_URI,
+  KEY_ARGS,
+  KEY_HEADER,
+  KEY_ARG,
+} key_part_type_t;
+
+struct cache_key_tmpl {
+  str_tmpl_t tmpl;
+  bool sort_args;
+};
+
+#define CACHE_KEY_MAX_PARTS 32
+#define CACHE_KEY_MAX_ARGS 64
+
+static const str_tmpl_var_t key_vars[] = {
+    {"method", KEY_METHOD, STR_TMPL_EXACT},
+    {"scheme", KEY_SCHEME, STR_TMPL_EXACT},
+    {"host", KEY_HOST, STR_TMPL_EXACT},
+    {"uri", KEY_URI, STR_TMPL_EXACT},
+    {"args", KEY_ARGS, STR_TMPL_EXACT},
+    {"query_string", KEY_ARGS, STR_TMPL_EXACT},
+    {"http_", KEY_HEADER, STR_TMPL_HEADER},
+    {"arg_", KEY_ARG, STR_TMPL_PREFIX},
+};
+
+np_status_t cache_key_compile(const char *tmpl, bool sort_args, cache_key_tmpl_t **out) {
+  cache_key_tmpl_t *t = calloc(1, sizeof(*t));
+  if (!t)
+    return NP_ERR_NOMEM;
+  t->sort_args = sort_args;
+  np_status_t rc = str_tmpl_compile(&t->tmpl, tmpl, key_vars,
+                                    sizeof(key_vars) / sizeof(key_vars[0]), CACHE_KEY_MAX_PARTS,
+                                    "cache key");
+  if (rc != NP_OK) {
+    free(t);
+    return rc;
+  }
+  *out = t;
+  return NP_OK;
+}
+
+void cache_key_tmpl_free(cache_key_tmpl_t *tmpl) {
+  if (!tmpl)
+    return;
+  str_tmpl_free(&tmpl->tmpl);
+  free(tmpl);
+}
+
+static int compare_args(const void *a, const void *b) {
+  const str_t *x = a, *y = b;
+  usize n = x->len < y->len ? x->len : y->len;
+  int c = memcmp(x->ptr, y->ptr, n);
+  if (c != 0)
+    return c;
+  return x->len < y->len ? -1 : x->len > y->len;
+}
+
+static void hash_args(key_hasher_t *h, str_t query) {
+  str_t args[CACHE_KEY_MAX_ARGS];
+  int n = 0;
+  const char *p = query.ptr, *end = query.ptr + query.len;
+  while (p < end) {
+    const char *amp = memchr(p, '&', (usize)(end - p));
+    const char *stop = amp ? amp : end;
+    if (stop > p) {
+      if (n == CACHE_KEY_MAX_ARGS) {
+        // Too many to sort: the rest is hashed as it stands.
+        args[n - 1].len = (usize)(end - args[n - 1].ptr);
+        break;
+      }
+      args[n++] = (str_t){p, (usize)(stop - p)};
+    }
+    p = stop + 1;
+  }
+  qsort(args, (usize)n, sizeof(args[0]), compare_args);
+  for (int i = 0; i < n; i++) {
+    hash_normalized(h, args[i], false, true);
+    hasher_update(h, "&", 1);
+  }
+}
+
+static str_t query_arg(str_t query, str_t name) {
+  const char *p = query.ptr, *end = query.ptr + query.len;
+  while (p < end) {
+    const char *amp = memchr(p, '&', (usize)(end - p));
+    const char *stop = amp ? amp : end;
+    if ((usize)(stop - p) > name.len && p[name.len] == '=' && memcmp(p, name.ptr, name.len) == 0)
+      return (str_t){p + name.len + 1, (usize)(stop - p) - name.len - 1};
+    p = stop + 1;
+  }
+  return STR_NULL;
+}
 
-  if (host.ptr) {
-    snprintf(out, max, "%s:" STR_FMT ":" STR_FMT, method, STR_ARG(host), STR_ARG(req->path));
-  } else {
-    snprintf(out, max, "%s:_:" STR_FMT, method, STR_ARG(req->path));
+void cache_key_build(const cache_key_tmpl_t *tmpl, const http_request_t *req, bool tls,
+                     cache_key_t *out) {
+  key_hasher_t h = {0};
+  for (int i = 0; i < tmpl->tmpl.count; i++) {
+    const str_tmpl_part_t *part = &tmpl->tmpl.parts[i];
+    usize before = h.total;
+    str_t v = STR_NULL;
+    switch ((key_part_type_t)part->kind) {
+    case KEY_LITERAL:
+      v = part->text;
+      break;
+    case KEY_METHOD:
+      v = str_from_cstr(http_method_str(req->method));
+      break;
+    case KEY_SCHEME:
+      v = tls ? STR("https") : STR("http");
+      break;
+    case KEY_HOST: {
+      v = request_header(req, STR("Host"));
+      const char *colon = v.ptr ? memchr(v.ptr, ':', v.len) : NULL;
+      if (colon && v.ptr[0] != '[')
+        v.len = (usize)(colon - v.ptr);
+      hash_normalized(&h, v, true, false);
+      v = STR_NULL;
+      break;
+    }
+    case KEY_URI:
+      hash_normalized(&h, req->path, false, true);
+      break;
+    case KEY_ARGS:
+      if (tmpl->sort_args && req->query.len > 0) {
+        hash_args(&h, req->query);
+        v = STR_NULL;
+      } else {
+        v = req->query;
+      }
+      break;
+    case KEY_HEADER:
+      v = request_header(req, part->text);
+      break;
+    case KEY_ARG:
+      v = query_arg(req->query, part->text);
+      break;
+    }
+    if (v.len > 0)
+      hasher_update(&h, v.ptr, v.len);
+    // A length suffix keeps adjacent parts from running into each other ("ab"+"c" vs "a"+"bc").
+    u32 len = (u32)(h.total - before);
+    hasher_update(&h, &len, sizeof(len));
   }
+  hasher_final(&h, out);
 }
@@ -11,6 +11,15 @@ typedef struct {
   time_t expire_time;
 } cache_entry_header_t;
 
+// 128-bit hash of the components named by the server's cache_key template.
+typedef struct {
+  u64 hi, lo;
+} cache_key_t;
+
+typedef struct cache_key_tmpl cache_key_tmpl_t;
+
+#define CACHE_KEY_DEFAULT "$method$host$uri$args"
+
 typedef struct {
   cache_entry_header_t hdr;
   u8 *data;
@@ -25,11 +34,21 @@ typedef struct {
 cache_store_t *cache_store_create(const char *root, int max_entries);
 void cache_store_destroy(cache_store_t *store);
 
-np_status_t cache_lookup(cache_store_t *store, const char *key, cache_entry_t *entry);
-np_status_t cache_insert(cache_store_t *store, const char *key, int status, const u8 *headers,
-                         usize headers_len, const u8 *body, usize body_len, int ttl);
-np_status_t cache_remove(cache_store_t *store, const char *key);
-
-void cache_key_from_request(http_request_t *req, char *out, usize max);
+// With `nowait`, returns NP_ERR_AGAIN instead of reading what is not in the page cache, for
+// the caller to repeat the lookup on an I/O thread.
+np_status_t cache_lookup(cache_store_t *store, const cache_key_t *key, cache_entry_t *entry,
+                         bool nowait);
+np_status_t cache_insert(cache_store_t *store, const cache_key_t *key, int status,
+                         const u8 *headers, usize headers_len, const u8 *body, usize body_len,
+                         int ttl);
+np_status_t cache_remove(cache_store_t *store, const cache_key_t *key);
+
+// Compiles a key template such as "$method$host$uri$args$http_x_tenant". With `sort_args`,
+// query parameters are hashed in sorted order, without empty ones and with percent-escapes
+// upper-cased, so equivalent query strings share an entry.
+np_status_t cache_key_compile(const char *tmpl, bool sort_args, cache_key_tmpl_t **out);
+void cache_key_tmpl_free(cache_key_tmpl_t *tmpl);
+void cache_key_build(const cache_key_tmpl_t *tmpl, const http_request_t *req, bool tls,
+                     cache_key_t *out);
 
 #endif
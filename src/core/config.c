@@ -6,6 +6,11 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "cache/cache.h"
+#include "features/access_log.h"
+#include "http/location.h"
+#include "http/rewrite.h"
+#include "http/vhost.h"
 #include "log.h"
 
 static void strip_comment(char *line) {
@@ -20,7 +25,157 @@ static void strip_comment(char *line) {
 }
 
 static int parse_bool(const char *v) {
-  return strcmp(v, "true") == 0 || strcmp(v, "1") == 0 || strcmp(v, "yes") == 0;
+  return strcmp(v, "true") == 0 || strcmp(v, "1") == 0 || strcmp(v, "yes") == 0 ||
+         strcmp(v, "on") == 0;
+}
+
+static i64 parse_size(const char *v) {
+  char *end;
+  long long n = strtoll(v, &end, 10);
+  if (n < 0)
+    return 0;
+  switch (*end) {
+    case 'k':
+    case 'K':
+      return (i64)n << 10;
+    case 'm':
+    case 'M':
+      return (i64)n << 20;
+    case 'g':
+    case 'G':
+      return (i64)n << 30;
+    default:
+      return (i64)n;
+  }
+}
+
+static void parse_backend(np_proxy_config_t *proxy, const char *val) {
+  if (proxy->backend_count >= CONFIG_MAX_BACKENDS)
+    return;
+  backend_entry_t *be = &proxy->backends[proxy->backend_count];
+  const char *colon = strrchr(val, ':');
+  if (colon) {
+    usize hlen = (usize)(colon - val);
+    if (hlen >= sizeof(be->host))
+      hlen = sizeof(be->host) - 1;
+    memcpy(be->host, val, hlen);
+    be->host[hlen] = '\0';
+    be->port = (u16)atoi(colon + 1);
+  } else {
+    strncpy(be->host, val, sizeof(be->host) - 1);
+    be->port = 80;
+  }
+  be->enabled = true;
+  proxy->backend_count++;
+}
+
+static np_server_config_t *add_server(np_config_t *cfg) {
+  if (cfg->server_count >= CONFIG_MAX_SERVERS)
+    return NULL;
+  if (cfg->server_count == cfg->server_cap) {
+    int cap = cfg->server_cap ? cfg->server_cap * 2 : 4;
+    np_server_config_t *s = realloc(cfg->servers, sizeof(*s) * (usize)cap);
+    if (!s)
+      return NULL;
+    cfg->servers = s;
+    cfg->server_cap = cap;
+  }
+  np_server_config_t *srv = &cfg->servers[cfg->server_count++];
+  memset(srv, 0, sizeof(*srv));
+  srv->listen_port = 8080;
+  strncpy(srv->static_root, "./www", sizeof(srv->static_root) - 1);
+
+  srv->tls.listen_port = 8443;
+
+  srv->proxy.mode = BALANCE_ROUND_ROBIN;
+  srv->proxy.connect_timeout = 5;
+  srv->proxy.upstream_timeout = 30;
+  srv->proxy.keepalive_conns = 16;
+  srv->proxy.h2_connections = 2;
+
+  srv->gzip.min_length = 256;
+  srv->gzip.level = 6;
+  return srv;
+}
+
+static rewrite_rule_t *add_rewrite(np_server_config_t *srv) {
+  if (srv->rewrite.count >= CONFIG_MAX_REWRITES)
+    return NULL;
+  rewrite_rule_t *rules =
+      realloc(srv->rewrite.rules, sizeof(*rules) * (usize)(srv->rewrite.count + 1));
+  if (!rules)
+    return NULL;
+  srv->rewrite.rules = rules;
+  rewrite_rule_t *rule = &rules[srv->rewrite.count++];
+  memset(rule, 0, sizeof(*rule));
+  return rule;
+}
+
+static np_location_t *add_location(np_server_config_t *srv) {
+  if (srv->location_count >= CONFIG_MAX_LOCATIONS)
+    return NULL;
+  np_location_t *locs = realloc(srv->locations, sizeof(*locs) * (usize)(srv->location_count + 1));
+  if (!locs)
+    return NULL;
+  srv->locations = locs;
+  np_location_t *loc = &locs[srv->location_count++];
+  memset(loc, 0, sizeof(*loc));
+  loc->cache = -1;
+  loc->rate_limit = -1;
+  return loc;
+}
+
+// match = [= | ^~ | ~ | ~*] <path or regex>
+static void parse_location_match(np_location_t *loc, const char *val) {
+  const char *arg = val;
+  loc->match = LOCATION_PREFIX;
+  if (strncmp(val, "= ", 2) == 0) {
+    loc->match = LOCATION_EXACT;
+    arg = val + 2;
+  } else if (strncmp(val, "^~ ", 3) == 0) {
+    loc->match = LOCATION_PREFIX_STOP;
+    arg = val + 3;
+  } else if (strncmp(val, "~* ", 3) == 0) {
+    loc->match = LOCATION_REGEX;
+    loc->icase = true;
+    arg = val + 3;
+  } else if (strncmp(val, "~ ", 2) == 0) {
+    loc->match = LOCATION_REGEX;
+    arg = val + 2;
+  }
+  while (isspace((unsigned char)*arg))
+    arg++;
+  strncpy(loc->path, arg, sizeof(loc->path) - 1);
+}
+
+// Fills in what the locations take from their server and compiles the rewrite, location and
+// virtual-host matchers.
+static np_status_t finish_servers(np_config_t *cfg) {
+  for (int s = 0; s < cfg->server_count; s++) {
+    np_server_config_t *srv = &cfg->servers[s];
+    for (int i = 0; i < srv->location_count; i++) {
+      np_location_t *loc = &srv->locations[i];
+      loc->id = cfg->location_count++;
+      if (loc->proxy.backend_count > 0) {
+        np_proxy_config_t own = loc->proxy;
+        loc->proxy = srv->proxy;
+        memcpy(loc->proxy.backends, own.backends, sizeof(own.backends));
+        loc->proxy.backend_count = own.backend_count;
+        loc->proxy.enabled = true;
+      }
+    }
+    if (rewrite_compile(srv) != NP_OK || location_compile(srv) != NP_OK)
+      return NP_ERR_CONFIG;
+    if (srv->cache.enabled &&
+        cache_key_compile(srv->cache.key[0] ? srv->cache.key : CACHE_KEY_DEFAULT,
+                          srv->cache.key_sort_args, &srv->cache.key_tmpl) != NP_OK)
+      return NP_ERR_CONFIG;
+    if (srv->gzip.level < 1 || srv->gzip.level > 9) {
+      log_error("config: gzip level %d is not between 1 and 9", srv->gzip.level);
+      return NP_ERR_CONFIG;
+    }
+  }
+  return vhost_build(cfg);
 }
 
 np_status_t config_load(np_config_t *cfg, const char *path) {
@@ -33,24 +188,27 @@ np_status_t config_load(np_config_t *cfg, const char *path) {
   cfg->keepalive_timeout = 75;
   cfg->read_timeout = 60;
   cfg->write_timeout = 60;
+  cfg->client_max_body_size = 1 << 20;
+  strncpy(cfg->client_body_temp_path, "/tmp", sizeof(cfg->client_body_temp_path) - 1);
+  cfg->open_file_cache.valid = 60;
+  cfg->open_file_cache.watch = true;
+  cfg->open_file_cache.memory = 16 << 20;
+  cfg->open_file_cache.memory_max = 64 * 1024;
+  cfg->sendfile.chunk = 512 * 1024;
+  cfg->sendfile.turn = 2 << 20;
+  cfg->sendfile.large = 4 << 20;
 
-  cfg->server_count = 1;
-  np_server_config_t *def = &cfg->servers[0];
-  def->listen_port = 8080;
-  strncpy(def->static_root, "./www", sizeof(def->static_root) - 1);
-
-  def->tls.listen_port = 8443;
-
-  def->proxy.mode = BALANCE_ROUND_ROBIN;
-  def->proxy.connect_timeout = 5;
-  def->proxy.upstream_timeout = 30;
-  def->proxy.keepalive_conns = 16;
+  if (!add_server(cfg))
+    return NP_ERR_NOMEM;
 
   cfg->rate_limit.requests_per_second = 1000;
   cfg->rate_limit.burst = 200;
 
   cfg->log.level = LOG_INFO;
   strncpy(cfg->log.access_log, "./logs/access.log", sizeof(cfg->log.access_log) - 1);
+  cfg->log.access_log_buffer = 64 * 1024;
+  cfg->log.access_log_flush = 1;
+  cfg->log.error_log_buffer = 256 * 1024;
   strncpy(cfg->log.error_log, "./logs/error.log", sizeof(cfg->log.error_log) - 1);
 
   strncpy(cfg->metrics.path, "/metrics", sizeof(cfg->metrics.path) - 1);
@@ -58,12 +216,14 @@ np_status_t config_load(np_config_t *cfg, const char *path) {
   FILE *fp = fopen(path, "r");
   if (!fp) {
     log_error_errno("config_load: cannot open %s", path);
+    config_destroy(cfg);
     return NP_ERR_CONFIG;
   }
 
   char line[512];
   char section[64] = "";
   bool seen_server = false;
+  np_location_t *loc = NULL;  // the [location] being read
 
   while (fgets(line, sizeof(line), fp)) {
     strip_comment(line);
@@ -86,18 +246,20 @@ np_status_t config_load(np_config_t *cfg, const char *path) {
       if (strncmp(p + 1, "server", 6) == 0) {
         if (seen_server) {
           // Not the first [server] block — allocate a new server slot
-          if (cfg->server_count < CONFIG_MAX_SERVERS) {
-            cfg->server_count++;
-            np_server_config_t *ns = &cfg->servers[cfg->server_count - 1];
-            ns->listen_port = 8080;
-            strncpy(ns->static_root, "./www", sizeof(ns->static_root) - 1);
-          }
+          if (!add_server(cfg))
+            log_error("config: too many [server] blocks, the rest extend the last one");
         }
         seen_server = true;
       }
 
       memcpy(section, p + 1, len);
       section[len] = '\0';
+      loc = NULL;
+      if (strcmp(section, "location") == 0) {
+        loc = add_location(&cfg->servers[cfg->server_count - 1]);
+        if (!loc)
+          log_error("config: too many [location] blocks, ignoring the rest");
+      }
       continue;
     }
 
@@ -142,27 +304,64 @@ np_status_t config_load(np_config_t *cfg, const char *path) {
         cfg->read_timeout = atoi(val);
       else if (strcmp(key, "write_timeout") == 0)
         cfg->write_timeout = atoi(val);
+      else if (strcmp(key, "client_max_body_size") == 0)
+        cfg->client_max_body_size = parse_size(val);
+      else if (strcmp(key, "client_body_temp_path") == 0)
+        strncpy(cfg->client_body_temp_path, val, sizeof(cfg->client_body_temp_path) - 1);
+      else if (strcmp(key, "http2") == 0)
+        cfg->http2 = parse_bool(val);
+      else if (strcmp(key, "io_threads") == 0)
+        cfg->io_threads = atoi(val);
+      else if (strcmp(key, "mime_types") == 0)
+        strncpy(cfg->mime_types, val, sizeof(cfg->mime_types) - 1);
+      else if (strcmp(key, "open_file_cache") == 0)
+        cfg->open_file_cache.max_entries = atoi(val);
+      else if (strcmp(key, "open_file_cache_valid") == 0)
+        cfg->open_file_cache.valid = atoi(val);
+      else if (strcmp(key, "open_file_cache_watch") == 0)
+        cfg->open_file_cache.watch = parse_bool(val);
+      else if (strcmp(key, "open_file_cache_memory") == 0)
+        cfg->open_file_cache.memory = parse_size(val);
+      else if (strcmp(key, "open_file_cache_memory_max") == 0)
+        cfg->open_file_cache.memory_max = parse_size(val);
+      else if (strcmp(key, "sendfile_chunk") == 0)
+        cfg->sendfile.chunk = parse_size(val);
+      else if (strcmp(key, "sendfile_turn") == 0)
+        cfg->sendfile.turn = parse_size(val);
+      else if (strcmp(key, "sendfile_large") == 0)
+        cfg->sendfile.large = parse_size(val);
       else if (strcmp(key, "static_root") == 0)
         strncpy(srv->static_root, val, sizeof(srv->static_root) - 1);
+      else if (strcmp(key, "static_bundle") == 0)
+        strncpy(srv->static_bundle, val, sizeof(srv->static_bundle) - 1);
       else if (strcmp(key, "load_module") == 0 && srv->modules.count < CONFIG_MAX_MODULES) {
         strncpy(srv->modules.paths[srv->modules.count], val, CONFIG_MAX_STR - 1);
         srv->modules.count++;
-      } else if (strcmp(key, "rewrite") == 0 && srv->rewrite.count < CONFIG_MAX_REWRITES) {
-        char *space = strchr(val, ' ');
-        if (space) {
-          *space = '\0';
-          char *repl = space + 1;
-          while (isspace((unsigned char)*repl))
-            repl++;
-          rewrite_rule_t *rule = &srv->rewrite.rules[srv->rewrite.count];
-          strncpy(rule->pattern, val, CONFIG_MAX_STR - 1);
-          strncpy(rule->replacement, repl, CONFIG_MAX_STR - 1);
-          if (regcomp(&rule->re, rule->pattern, REG_EXTENDED) == 0) {
-            srv->rewrite.count++;
-          } else {
-            log_error("config: failed to compile regex '%s'", rule->pattern);
-          }
+      } else if (strcmp(key, "rewrite") == 0) {
+        // rewrite = <regex> <replacement> [last | break]
+        char *repl = strchr(val, ' ');
+        rewrite_rule_t *rule = repl ? add_rewrite(srv) : NULL;
+        if (!rule) {
+          log_error("config: ignoring rewrite '%s'", val);
+          continue;
+        }
+        *repl++ = '\0';
+        while (isspace((unsigned char)*repl))
+          repl++;
+        char *flag = strchr(repl, ' ');
+        if (flag) {
+          *flag++ = '\0';
+          while (isspace((unsigned char)*flag))
+            flag++;
+          if (strcmp(flag, "last") == 0)
+            rule->flag = REWRITE_FLAG_LAST;
+          else if (strcmp(flag, "break") == 0)
+            rule->flag = REWRITE_FLAG_BREAK;
+          else
+            log_warn("config: unknown rewrite flag '%s'", flag);
         }
+        strncpy(rule->pattern, val, CONFIG_MAX_STR - 1);
+        strncpy(rule->replacement, repl, CONFIG_MAX_STR - 1);
       } else if (strcmp(key, "try_files") == 0) {
         char *token = strtok(val, " ");
         while (token && srv->try_files.count < CONFIG_MAX_TRY_FILES) {
@@ -170,6 +369,26 @@ np_status_t config_load(np_config_t *cfg, const char *path) {
           srv->try_files.count++;
           token = strtok(NULL, " ");
         }
+      } else if (strcmp(key, "error_page") == 0) {
+        // error_page = <status>... <file>
+        char *file = strrchr(val, ' ');
+        if (!file) {
+          log_error("config: error_page needs a status and a file");
+          continue;
+        }
+        *file++ = '\0';
+        char *token = strtok(val, " ");
+        while (token && cfg->error_pages.count < CONFIG_MAX_ERROR_PAGES) {
+          int status = atoi(token);
+          if (status < 400 || status > 599) {
+            log_error("config: error_page status '%s' is not 4xx or 5xx", token);
+          } else {
+            int i = cfg->error_pages.count++;
+            cfg->error_pages.status[i] = status;
+            strncpy(cfg->error_pages.paths[i], file, CONFIG_MAX_STR - 1);
+          }
+          token = strtok(NULL, " ");
+        }
       }
     } else if (strcmp(section, "tls") == 0) {
       if (strcmp(key, "enabled") == 0)
@@ -191,23 +410,42 @@ np_status_t config_load(np_config_t *cfg, const char *path) {
         srv->proxy.upstream_timeout = atoi(val);
       else if (strcmp(key, "keepalive_conns") == 0)
         srv->proxy.keepalive_conns = atoi(val);
+      else if (strcmp(key, "proto") == 0)
+        srv->proxy.proto = strcmp(val, "h2c") == 0 ? UPSTREAM_PROTO_H2C : UPSTREAM_PROTO_HTTP1;
+      else if (strcmp(key, "h2_connections") == 0)
+        srv->proxy.h2_connections = atoi(val);
     } else if (strcmp(section, "upstream") == 0) {
-      if (strcmp(key, "backend") == 0 && srv->proxy.backend_count < CONFIG_MAX_BACKENDS) {
-        backend_entry_t *be = &srv->proxy.backends[srv->proxy.backend_count];
-        char *colon = strrchr(val, ':');
-        if (colon) {
-          usize hlen = (usize)(colon - val);
-          if (hlen >= sizeof(be->host))
-            hlen = sizeof(be->host) - 1;
-          memcpy(be->host, val, hlen);
-          be->host[hlen] = '\0';
-          be->port = (u16)atoi(colon + 1);
+      if (strcmp(key, "backend") == 0)
+        parse_backend(&srv->proxy, val);
+    } else if (strcmp(section, "location") == 0) {
+      if (!loc)
+        continue;
+      if (strcmp(key, "match") == 0) {
+        parse_location_match(loc, val);
+      } else if (strcmp(key, "proxy") == 0) {
+        loc->handler = parse_bool(val) ? LOCATION_HANDLER_PROXY : LOCATION_HANDLER_STATIC;
+      } else if (strcmp(key, "backend") == 0) {
+        parse_backend(&loc->proxy, val);
+        loc->handler = LOCATION_HANDLER_PROXY;
+      } else if (strcmp(key, "static_root") == 0) {
+        strncpy(loc->static_root, val, sizeof(loc->static_root) - 1);
+        loc->handler = LOCATION_HANDLER_STATIC;
+      } else if (strcmp(key, "cache") == 0) {
+        loc->cache = parse_bool(val);
+      } else if (strcmp(key, "cache_ttl") == 0) {
+        loc->cache_ttl = atoi(val);
+      } else if (strcmp(key, "rate_limit") == 0) {
+        // rate_limit = off | <requests_per_second> [burst]
+        char *end;
+        long rps = strtol(val, &end, 10);
+        if (end == val || rps <= 0) {
+          loc->rate_limit = 0;
         } else {
-          strncpy(be->host, val, sizeof(be->host) - 1);
-          be->port = 80;
+          long burst = strtol(end, NULL, 10);
+          loc->rate_limit = 1;
+          loc->requests_per_second = (int)rps;
+          loc->burst = burst > 0 ? (int)burst : (int)rps;
         }
-        be->enabled = true;
-        srv->proxy.backend_count++;
       }
     } else if (strcmp(section, "rate_limit") == 0) {
       if (strcmp(key, "enabled") == 0)
@@ -228,8 +466,18 @@ np_status_t config_load(np_config_t *cfg, const char *path) {
           cfg->log.level = LOG_ERROR;
       } else if (strcmp(key, "access_log") == 0)
         strncpy(cfg->log.access_log, val, sizeof(cfg->log.access_log) - 1);
+      else if (strcmp(key, "access_log_format") == 0)
+        strncpy(cfg->log.access_log_format, val, sizeof(cfg->log.access_log_format) - 1);
+      else if (strcmp(key, "access_log_buffer") == 0)
+        cfg->log.access_log_buffer = parse_size(val);
+      else if (strcmp(key, "access_log_flush") == 0)
+        cfg->log.access_log_flush = atoi(val);
+      else if (strcmp(key, "access_log_mode") == 0)
+        cfg->log.access_log_binary = strcmp(val, "binary") == 0;
       else if (strcmp(key, "error_log") == 0)
         strncpy(cfg->log.error_log, val, sizeof(cfg->log.error_log) - 1);
+      else if (strcmp(key, "error_log_buffer") == 0)
+        cfg->log.error_log_buffer = parse_size(val);
     } else if (strcmp(section, "metrics") == 0) {
       if (strcmp(key, "enabled") == 0)
         cfg->metrics.enabled = parse_bool(val);
@@ -244,6 +492,10 @@ np_status_t config_load(np_config_t *cfg, const char *path) {
         srv->cache.default_ttl = atoi(val);
       else if (strcmp(key, "max_entries") == 0)
         srv->cache.max_entries = atoi(val);
+      else if (strcmp(key, "key") == 0)
+        strncpy(srv->cache.key, val, sizeof(srv->cache.key) - 1);
+      else if (strcmp(key, "key_sort_args") == 0)
+        srv->cache.key_sort_args = parse_bool(val);
     } else if (strcmp(section, "process") == 0) {
       if (strcmp(key, "daemon") == 0)
         cfg->process.daemon = parse_bool(val);
@@ -254,6 +506,12 @@ np_status_t config_load(np_config_t *cfg, const char *path) {
         srv->gzip.enabled = parse_bool(val);
       else if (strcmp(key, "min_length") == 0)
         srv->gzip.min_length = atoi(val);
+      else if (strcmp(key, "level") == 0)
+        srv->gzip.level = atoi(val);
+      else if (strcmp(key, "static") == 0)
+        srv->gzip.static_enabled = parse_bool(val);
+      else if (strcmp(key, "static_generate") == 0)
+        srv->gzip.static_generate = parse_bool(val);
     }
 
     if (strcmp(section, "global") == 0 && strcmp(key, "shutdown_timeout") == 0)
@@ -261,15 +519,29 @@ np_status_t config_load(np_config_t *cfg, const char *path) {
   }
 
   fclose(fp);
-  return NP_OK;
+  np_status_t rc = finish_servers(cfg);
+  if (rc == NP_OK)
+    rc = access_log_compile(cfg->log.access_log_format[0] ? cfg->log.access_log_format
+                                                          : ACCESS_LOG_FORMAT_DEFAULT,
+                            &cfg->log.access_fmt);
+  if (rc != NP_OK)
+    config_destroy(cfg);
+  return rc;
 }
 
 void config_destroy(np_config_t *cfg) {
   for (int s = 0; s < cfg->server_count; s++) {
-    for (int i = 0; s < cfg->servers[s].rewrite.count; i++) {
-      regfree(&cfg->servers[s].rewrite.rules[i].re);
-    }
+    rewrite_free(&cfg->servers[s]);
+    cache_key_tmpl_free(cfg->servers[s].cache.key_tmpl);
+    location_free(&cfg->servers[s]);
   }
+  vhost_free(cfg);
+  access_log_fmt_free(cfg->log.access_fmt);
+  cfg->log.access_fmt = NULL;
+  free(cfg->servers);
+  cfg->servers = NULL;
+  cfg->server_count = 0;
+  cfg->server_cap = 0;
 }
 
 void config_print(const np_config_t *cfg) {
@@ -8,32 +8,97 @@
 #define CONFIG_MAX_BACKENDS 64
 #define CONFIG_MAX_STR 512
 #define CONFIG_MAX_MODULES 16
-#define CONFIG_MAX_REWRITES 32
+#define CONFIG_MAX_REWRITES 128
 #define CONFIG_MAX_TRY_FILES 8
+#define CONFIG_MAX_ERROR_PAGES 32
+#define CONFIG_MAX_LOCATIONS 256
 
 typedef enum {
   BALANCE_ROUND_ROBIN = 0,
   BALANCE_LEAST_CONN = 1,
 } balance_mode_t;
 
+typedef enum {
+  UPSTREAM_PROTO_HTTP1 = 0,
+  UPSTREAM_PROTO_H2C = 1,
+} upstream_proto_t;
+
 typedef struct {
   char host[256];
   u16 port;
   bool enabled;
 } backend_entry_t;
 
+typedef enum {
+  REWRITE_FLAG_NONE,   // stop after this rule, as "break"
+  REWRITE_FLAG_BREAK,
+  REWRITE_FLAG_LAST,   // run the rules again on the rewritten path
+} rewrite_flag_t;
+
 typedef struct {
   char pattern[CONFIG_MAX_STR];
   char replacement[CONFIG_MAX_STR];
-  regex_t re;
+  rewrite_flag_t flag;
 } rewrite_rule_t;
 
-#define CONFIG_MAX_SERVERS 16
+typedef struct rewrite_set rewrite_set_t;
+
+typedef struct {
+  bool enabled;
+  balance_mode_t mode;
+  upstream_proto_t proto;
+  int h2_connections;
+  int connect_timeout;
+  int upstream_timeout;
+  int keepalive_conns;
+  backend_entry_t backends[CONFIG_MAX_BACKENDS];
+  int backend_count;
+} np_proxy_config_t;
+
+// How a [location] matches the request path, in nginx's terms.
+typedef enum {
+  LOCATION_PREFIX = 0,    // "/api/": longest prefix wins unless a regex location matches
+  LOCATION_PREFIX_STOP,   // "^~ /assets/": longest prefix that skips the regex locations
+  LOCATION_EXACT,         // "= /login"
+  LOCATION_REGEX,         // "~ \.php$", or "~*" to ignore case; first match in file order
+} location_match_t;
+
+typedef enum {
+  LOCATION_HANDLER_INHERIT = 0,
+  LOCATION_HANDLER_PROXY,
+  LOCATION_HANDLER_STATIC,
+} location_handler_t;
+
+typedef struct {
+  location_match_t match;
+  char path[CONFIG_MAX_STR];
+  bool icase;
+  regex_t re;
+  location_handler_t handler;
+  // Own backends, with the server's [proxy] settings; without any, the server's pool is used.
+  np_proxy_config_t proxy;
+  char static_root[CONFIG_MAX_STR];
+  int cache;       // -1 follows the server, 0 off, 1 on
+  int cache_ttl;   // 0 follows the server
+  int rate_limit;  // -1 follows [rate_limit], 0 off, 1 own zone
+  int requests_per_second;
+  int burst;
+  int id;          // position among all locations of the config
+} np_location_t;
+
+typedef struct location_trie location_trie_t;
+
+typedef struct vhost_table vhost_table_t;
+typedef struct cache_key_tmpl cache_key_tmpl_t;
+typedef struct access_log_fmt access_log_fmt_t;
+
+#define CONFIG_MAX_SERVERS 4096
 
 typedef struct {
   u16 listen_port;
   char server_name[CONFIG_MAX_STR];
   char static_root[CONFIG_MAX_STR];
+  char static_bundle[CONFIG_MAX_STR];  // nproxy-pack file served in place of static_root
 
   struct {
     char paths[CONFIG_MAX_MODULES][CONFIG_MAX_STR];
@@ -41,8 +106,9 @@ typedef struct {
   } modules;
 
   struct {
-    rewrite_rule_t rules[CONFIG_MAX_REWRITES];
+    rewrite_rule_t *rules;
     int count;
+    rewrite_set_t *compiled;
   } rewrite;
 
   struct {
@@ -57,26 +123,29 @@ typedef struct {
     char key_file[CONFIG_MAX_STR];
   } tls;
 
-  struct {
-    bool enabled;
-    balance_mode_t mode;
-    int connect_timeout;
-    int upstream_timeout;
-    int keepalive_conns;
-    backend_entry_t backends[CONFIG_MAX_BACKENDS];
-    int backend_count;
-  } proxy;
+  np_proxy_config_t proxy;
+
+  // [location] blocks in file order; exact and prefix ones are also compiled into a trie.
+  np_location_t *locations;
+  int location_count;
+  location_trie_t *location_trie;
 
   struct {
     bool enabled;
     char root[CONFIG_MAX_STR];
     int default_ttl;
     int max_entries;
+    char key[CONFIG_MAX_STR];  // template; empty means CACHE_KEY_DEFAULT
+    bool key_sort_args;
+    cache_key_tmpl_t *key_tmpl;
   } cache;
 
   struct {
     bool enabled;
     int min_length;
+    int level;
+    bool static_enabled;   // serve foo.gz in place of foo when it is current
+    bool static_generate;  // write missing or stale .gz files at startup and reload
   } gzip;
 } np_server_config_t;
 
@@ -88,9 +157,41 @@ typedef struct {
   int keepalive_timeout;
   int read_timeout;
   int write_timeout;
+  i64 client_max_body_size;
+  char client_body_temp_path[CONFIG_MAX_STR];
+  bool http2;
+  int io_threads;  // per worker, for file reads that would block the event loop; 0 = none
+  char mime_types[CONFIG_MAX_STR];  // extra "type ext..." lines; empty means built-ins only
+
+  // Per-worker cache of open static files.
+  struct {
+    int max_entries;  // 0 disables it
+    int valid;        // seconds an entry is trusted before a stat() checks it
+    bool watch;       // inotify on the files' directories invalidates entries sooner
+    i64 memory;       // bytes of small files also kept in memory
+    i64 memory_max;   // largest file kept in memory
+  } open_file_cache;
+
+  // How sendfile() responses share a worker.
+  struct {
+    i64 chunk;  // most bytes one sendfile() call sends; 0 = no limit
+    i64 turn;   // most bytes a connection sends before other ready ones go; 0 = no limit
+    i64 large;  // responses this big get readahead hints and TCP_CORK; 0 = none do
+  } sendfile;
 
-  np_server_config_t servers[CONFIG_MAX_SERVERS];
+  // [server] blocks in file order, heap-allocated; servers[0] is the default virtual host.
+  np_server_config_t *servers;
   int server_count;
+  int server_cap;
+  vhost_table_t *vhosts;
+  int location_count;
+
+  // Custom bodies for error responses, shared by all servers.
+  struct {
+    int status[CONFIG_MAX_ERROR_PAGES];
+    char paths[CONFIG_MAX_ERROR_PAGES][CONFIG_MAX_STR];
+    int count;
+  } error_pages;
 
   struct {
     bool enabled;
@@ -101,7 +202,13 @@ typedef struct {
   struct {
     int level;
     char access_log[CONFIG_MAX_STR];
+    char access_log_format[CONFIG_MAX_STR];  // empty means ACCESS_LOG_FORMAT_DEFAULT
+    i64 access_log_buffer;                   // bytes per worker; 0 writes every line at once
+    int access_log_flush;                    // seconds between flushes of a partial buffer
+    bool access_log_binary;                  // access_log_mode = binary
+    access_log_fmt_t *access_fmt;
     char error_log[CONFIG_MAX_STR];
+    i64 error_log_buffer;  // bytes of the per-worker ring; 0 writes each message at once
   } log;
 
   struct {
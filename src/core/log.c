@@ -2,15 +2,27 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdarg.h>
+#include <stdatomic.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
 #include <time.h>
 #include <unistd.h>
 
+// How long queued lines may wait for the logging thread when the ring is not filling up.
+#define LOG_ASYNC_INTERVAL_MS 50
+
+log_level_t g_log_level = LOG_INFO;
+
 static int g_log_fd = STDERR_FILENO;
-static log_level_t g_log_level = LOG_INFO;
+static pid_t g_log_pid;
 
 static const char *level_str[] = {
     [LOG_ERROR] = "ERROR",
@@ -19,8 +31,37 @@ static const char *level_str[] = {
     [LOG_DEBUG] = "DEBUG",
 };
 
+// Single-producer, single-consumer byte ring. The owner appends whole lines and publishes them
+// by advancing `head`; the logging thread writes out [tail, head) and advances `tail`. Both
+// only ever grow, so their difference is the number of bytes queued.
+static struct {
+  char *buf;
+  usize cap;  // a power of two
+  _Atomic u64 head;
+  _Atomic u64 tail;
+  _Atomic u64 dropped;
+  _Atomic bool sleeping;  // the logging thread waits on `wake_fd`
+  _Atomic bool stop;
+  int wake_fd;
+  pthread_t owner;
+  pthread_t thread;
+  _Atomic bool running;
+} g_ring = {.wake_fd = -1};
+
+static void refresh_pid(void) {
+  g_log_pid = getpid();
+}
+
 void log_init(const char *path, log_level_t level) {
   g_log_level = level;
+  if (level > NP_LOG_MAX_LEVEL)
+    fprintf(stderr, "log_init: this build has no messages above level %d\n", NP_LOG_MAX_LEVEL);
+  refresh_pid();
+  static bool atfork_registered;
+  if (!atfork_registered) {
+    pthread_atfork(NULL, NULL, refresh_pid);
+    atfork_registered = true;
+  }
   if (!path || path[0] == '\0')
     return;
   int fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
@@ -32,34 +73,184 @@ void log_init(const char *path, log_level_t level) {
 }
 
 void log_close(void) {
+  log_async_stop();
   if (g_log_fd != STDERR_FILENO) {
     close(g_log_fd);
     g_log_fd = STDERR_FILENO;
   }
 }
 
+// Writes the "time [level] [pid] " prefix. The date is formatted once a second per thread.
+static int format_prefix(char *buf, usize size, log_level_t level) {
+  static _Thread_local time_t cached_sec = -1;
+  static _Thread_local char cached_date[24];
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  if (ts.tv_sec != cached_sec) {
+    struct tm tm;
+    gmtime_r(&ts.tv_sec, &tm);
+    strftime(cached_date, sizeof(cached_date), "%Y-%m-%dT%H:%M:%S", &tm);
+    cached_sec = ts.tv_sec;
+  }
+  int n = snprintf(buf, size, "%s.%03ldZ [%s] [%d] ", cached_date, ts.tv_nsec / 1000000L,
+                   level_str[level], (int)g_log_pid);
+  return n < 0 ? 0 : n;
+}
+
+static void write_out(const struct iovec *iov, int count) {
+  ssize_t n;
+  do
+    n = writev(g_log_fd, iov, count);
+  while (n < 0 && errno == EINTR);
+}
+
+static void ring_write_out(void) {
+  u64 tail = atomic_load_explicit(&g_ring.tail, memory_order_relaxed);
+  u64 head = atomic_load_explicit(&g_ring.head, memory_order_acquire);
+  if (head == tail)
+    return;
+  usize at = (usize)(tail & (g_ring.cap - 1));
+  usize len = (usize)(head - tail);
+  usize first = len < g_ring.cap - at ? len : g_ring.cap - at;
+  struct iovec iov[2] = {{g_ring.buf + at, first}, {g_ring.buf, len - first}};
+  write_out(iov, len > first ? 2 : 1);
+  atomic_store_explicit(&g_ring.tail, head, memory_order_release);
+}
+
+static void *ring_thread(void *arg) {
+  NP_UNUSED(arg);
+  u64 reported = 0;
+  for (;;) {
+    ring_write_out();
+    u64 dropped = atomic_load(&g_ring.dropped);
+    if (dropped != reported) {
+      char line[128];
+      int n = format_prefix(line, sizeof(line), LOG_WARN);
+      n += snprintf(line + n, sizeof(line) - (usize)n, "log: dropped %llu message(s)\n",
+                    (unsigned long long)(dropped - reported));
+      write_out(&(struct iovec){line, (usize)n}, 1);
+      reported = dropped;
+    }
+    if (atomic_load(&g_ring.stop))
+      break;
+
+    // Sleeping is announced before the last look at the ring, and ring_push() publishes before
+    // looking at the flag, so a wake-up cannot fall between the two.
+    atomic_store(&g_ring.sleeping, true);
+    if (atomic_load(&g_ring.head) == atomic_load(&g_ring.tail) && !atomic_load(&g_ring.stop)) {
+      struct pollfd pfd = {g_ring.wake_fd, POLLIN, 0};
+      if (poll(&pfd, 1, LOG_ASYNC_INTERVAL_MS) > 0) {
+        u64 count;
+        ssize_t n = read(g_ring.wake_fd, &count, sizeof(count));
+        NP_UNUSED(n);
+      }
+    }
+    atomic_store(&g_ring.sleeping, false);
+  }
+  ring_write_out();
+  return NULL;
+}
+
+void log_async_start(usize ring_size) {
+  if (g_ring.running || ring_size == 0)
+    return;
+  usize cap = 4096;
+  while (cap < ring_size)
+    cap <<= 1;
+  g_ring.buf = malloc(cap);
+  g_ring.wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (!g_ring.buf || g_ring.wake_fd < 0) {
+    log_error_errno("log: cannot set up the log ring, logging synchronously");
+    free(g_ring.buf);
+    g_ring.buf = NULL;
+    if (g_ring.wake_fd >= 0)
+      close(g_ring.wake_fd);
+    g_ring.wake_fd = -1;
+    return;
+  }
+  g_ring.cap = cap;
+  atomic_store(&g_ring.head, 0);
+  atomic_store(&g_ring.tail, 0);
+  atomic_store(&g_ring.stop, false);
+  g_ring.owner = pthread_self();
+
+  // The logging thread must not take signals meant for the event loop's signalfd.
+  sigset_t all, old;
+  sigfillset(&all);
+  pthread_sigmask(SIG_BLOCK, &all, &old);
+  int rc = pthread_create(&g_ring.thread, NULL, ring_thread, NULL);
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  if (rc != 0) {
+    errno = rc;
+    log_error_errno("log: pthread_create, logging synchronously");
+    free(g_ring.buf);
+    g_ring.buf = NULL;
+    close(g_ring.wake_fd);
+    g_ring.wake_fd = -1;
+    return;
+  }
+  atomic_store(&g_ring.running, true);
+}
+
+void log_async_stop(void) {
+  if (!g_ring.running)
+    return;
+  atomic_store(&g_ring.stop, true);
+  u64 one = 1;
+  ssize_t n = write(g_ring.wake_fd, &one, sizeof(one));
+  NP_UNUSED(n);
+  atomic_store(&g_ring.running, false);
+  pthread_join(g_ring.thread, NULL);
+  close(g_ring.wake_fd);
+  g_ring.wake_fd = -1;
+  free(g_ring.buf);
+  g_ring.buf = NULL;
+}
+
+u64 log_dropped(void) {
+  return atomic_load_explicit(&g_ring.dropped, memory_order_relaxed);
+}
+
+// Queues a formatted line for the logging thread, or drops it if the ring is full.
+static void ring_push(const char *line, usize len) {
+  u64 head = atomic_load_explicit(&g_ring.head, memory_order_relaxed);
+  u64 tail = atomic_load_explicit(&g_ring.tail, memory_order_acquire);
+  usize used = (usize)(head - tail);
+  if (len > g_ring.cap - used) {
+    atomic_fetch_add_explicit(&g_ring.dropped, 1, memory_order_relaxed);
+    return;
+  }
+  usize at = (usize)(head & (g_ring.cap - 1));
+  usize first = len < g_ring.cap - at ? len : g_ring.cap - at;
+  memcpy(g_ring.buf + at, line, first);
+  memcpy(g_ring.buf, line + first, len - first);
+  atomic_store(&g_ring.head, head + len);
+
+  // The thread wakes up on its own every LOG_ASYNC_INTERVAL_MS; it is only hurried along once
+  // the ring is half full, so logging rarely costs a syscall.
+  if (used + len >= g_ring.cap / 2 && atomic_load(&g_ring.sleeping) &&
+      atomic_exchange(&g_ring.sleeping, false)) {
+    u64 one = 1;
+    ssize_t n = write(g_ring.wake_fd, &one, sizeof(one));
+    NP_UNUSED(n);
+  }
+}
+
 static void log_vwrite(log_level_t level, const char *fmt, va_list ap, int use_errno) {
   if (level > g_log_level)
     return;
 
+  int saved_errno = errno;
   char buf[4096];
-  struct timespec ts;
-  clock_gettime(CLOCK_REALTIME, &ts);
-  struct tm tm;
-  gmtime_r(&ts.tv_sec, &tm);
-
-  int hdr = snprintf(buf, sizeof(buf), "%04d-%02d-%02dT%02d:%02d:%02d.%03ldZ [%s] [%d] ",
-                     tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec,
-                     ts.tv_nsec / 1000000L, level_str[level], (int)getpid());
-
-  if (hdr < 0)
-    hdr = 0;
+  int hdr = format_prefix(buf, sizeof(buf), level);
 
   int body = vsnprintf(buf + hdr, sizeof(buf) - (usize)hdr, fmt, ap);
   int total = hdr + (body > 0 ? body : 0);
+  if (total > (int)sizeof(buf) - 1)
+    total = (int)sizeof(buf) - 1;
 
   if (use_errno && total < (int)sizeof(buf) - 64) {
-    total += snprintf(buf + total, sizeof(buf) - (usize)total, ": %s", strerror(errno));
+    total += snprintf(buf + total, sizeof(buf) - (usize)total, ": %s", strerror(saved_errno));
   }
 
   if (total < (int)sizeof(buf) - 1) {
@@ -67,8 +258,12 @@ static void log_vwrite(log_level_t level, const char *fmt, va_list ap, int use_e
   }
   buf[total] = '\0';
 
-  ssize_t _wr = write(g_log_fd, buf, (usize)total);
-  NP_UNUSED(_wr);
+  // Other threads, and the process before and after the async window, write directly.
+  if (g_ring.running && pthread_equal(pthread_self(), g_ring.owner)) {
+    ring_push(buf, (usize)total);
+    return;
+  }
+  write_out(&(struct iovec){buf, (usize)total}, 1);
 }
 
 void log_write(log_level_t level, const char *fmt, ...) {
@@ -12,15 +12,41 @@ typedef enum {
   LOG_DEBUG = 3,
 } log_level_t;
 
+// Levels above NP_LOG_MAX_LEVEL are compiled out: with -DNP_LOG_MAX_LEVEL=2, log_debug() calls
+// and their arguments vanish from the binary.
+#ifndef NP_LOG_MAX_LEVEL
+#define NP_LOG_MAX_LEVEL 3
+#endif
+
+// The configured level, checked inline so a disabled message costs one comparison.
+extern log_level_t g_log_level;
+
+#define LOG_ENABLED(level) ((level) <= NP_LOG_MAX_LEVEL && (level) <= g_log_level)
+
 void log_init(const char *path, log_level_t level);
 void log_close(void);
 void log_write(log_level_t level, const char *fmt, ...);
 void log_write_errno(log_level_t level, const char *fmt, ...);
 
-#define log_error(...) log_write(LOG_ERROR, __VA_ARGS__)
-#define log_warn(...) log_write(LOG_WARN, __VA_ARGS__)
-#define log_info(...) log_write(LOG_INFO, __VA_ARGS__)
-#define log_debug(...) log_write(LOG_DEBUG, __VA_ARGS__)
-#define log_error_errno(...) log_write_errno(LOG_ERROR, __VA_ARGS__)
+// Hands this process's log lines to a logging thread through a ring of `ring_size` bytes, so a
+// slow log disk cannot block the caller. Lines that do not fit are dropped and counted. Only
+// lines from the thread that called log_async_start() go through the ring; other threads keep
+// writing directly. log_async_stop() writes out what is left. A ring_size of 0 keeps logging
+// synchronous.
+void log_async_start(usize ring_size);
+void log_async_stop(void);
+u64 log_dropped(void);
+
+#define LOG_AT(level, fn, ...)                                                                  \
+  do {                                                                                          \
+    if (LOG_ENABLED(level))                                                                     \
+      fn(level, __VA_ARGS__);                                                                   \
+  } while (0)
+
+#define log_error(...) LOG_AT(LOG_ERROR, log_write, __VA_ARGS__)
+#define log_warn(...) LOG_AT(LOG_WARN, log_write, __VA_ARGS__)
+#define log_info(...) LOG_AT(LOG_INFO, log_write, __VA_ARGS__)
+#define log_debug(...) LOG_AT(LOG_DEBUG, log_write, __VA_ARGS__)
+#define log_error_errno(...) LOG_AT(LOG_ERROR, log_write_errno, __VA_ARGS__)
 
 #endif
@@ -4,6 +4,8 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "log.h"
+
 int np_strncasecmp(const char *a, const char *b, usize n) {
   for (usize i = 0; i < n; i++) {
     int ca = tolower((unsigned char)a[i]);
@@ -79,6 +81,35 @@ int str_to_int(str_t s, i64 *out) {
   return 0;
 }
 
+static const char DEC_PAIRS[201] =
+    "0001020304050607080910111213141516171819"
+    "2021222324252627282930313233343536373839"
+    "4041424344454647484950515253545556575859"
+    "6061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+// Two digits per step, written backwards into a scratch buffer.
+usize np_u64_to_dec(char *out, u64 v) {
+  char tmp[20];
+  char *p = tmp + sizeof(tmp);
+  while (v >= 100) {
+    const char *d = DEC_PAIRS + (v % 100) * 2;
+    v /= 100;
+    *--p = d[1];
+    *--p = d[0];
+  }
+  if (v >= 10) {
+    const char *d = DEC_PAIRS + v * 2;
+    *--p = d[1];
+    *--p = d[0];
+  } else {
+    *--p = (char)('0' + v);
+  }
+  usize n = (usize)(tmp + sizeof(tmp) - p);
+  memcpy(out, p, n);
+  return n;
+}
+
 char *str_dup_cstr(const char *s, usize len) {
   char *buf = malloc(len + 1);
   if (!buf)
@@ -106,3 +137,79 @@ bool str_contains_i(str_t haystack, str_t needle) {
   }
   return false;
 }
+
+static const str_tmpl_var_t *tmpl_lookup(const str_tmpl_var_t *vars, usize var_count,
+                                         const char *name, usize len) {
+  for (usize i = 0; i < var_count; i++) {
+    usize n = strlen(vars[i].name);
+    bool fits = vars[i].match == STR_TMPL_EXACT ? n == len : n < len;
+    if (fits && memcmp(name, vars[i].name, n) == 0)
+      return &vars[i];
+  }
+  return NULL;
+}
+
+np_status_t str_tmpl_compile(str_tmpl_t *t, const char *src, const str_tmpl_var_t *vars,
+                             usize var_count, int max_parts, const char *what) {
+  *t = (str_tmpl_t){0};
+  t->text = strdup(src);
+  t->parts = calloc((usize)max_parts, sizeof(*t->parts));
+  if (!t->text || !t->parts) {
+    str_tmpl_free(t);
+    return NP_ERR_NOMEM;
+  }
+
+  char *p = t->text;
+  while (*p) {
+    if (t->count == max_parts) {
+      log_error("config: %s '%s' has more than %d parts", what, src, max_parts);
+      str_tmpl_free(t);
+      return NP_ERR_CONFIG;
+    }
+    str_tmpl_part_t *part = &t->parts[t->count++];
+    if (*p != '$') {
+      char *end = strchr(p, '$');
+      usize len = end ? (usize)(end - p) : strlen(p);
+      *part = (str_tmpl_part_t){STR_TMPL_LITERAL, {p, len}};
+      p += len;
+      continue;
+    }
+
+    // $name or ${name}
+    bool braced = p[1] == '{';
+    char *name = p + 1 + braced;
+    char *end = name;
+    while ((*end >= 'a' && *end <= 'z') || (*end >= '0' && *end <= '9') || *end == '_' ||
+           (*end >= 'A' && *end <= 'Z'))
+      end++;
+    usize len = (usize)(end - name);
+    if (braced && *end != '}') {
+      log_error("config: %s '%s': missing '}'", what, src);
+      str_tmpl_free(t);
+      return NP_ERR_CONFIG;
+    }
+    p = end + braced;
+
+    const str_tmpl_var_t *var = tmpl_lookup(vars, var_count, name, len);
+    if (!var) {
+      log_error("config: %s '%s': unknown variable '$%.*s'", what, src, (int)len, name);
+      str_tmpl_free(t);
+      return NP_ERR_CONFIG;
+    }
+    part->kind = var->kind;
+    if (var->match != STR_TMPL_EXACT) {
+      usize n = strlen(var->name);
+      part->text = (str_t){name + n, len - n};
+      for (usize i = n; i < len && var->match == STR_TMPL_HEADER; i++)
+        if (name[i] == '_')
+          name[i] = '-';
+    }
+  }
+  return NP_OK;
+}
+
+void str_tmpl_free(str_tmpl_t *t) {
+  free(t->parts);
+  free(t->text);
+  *t = (str_tmpl_t){0};
+}
@@ -35,6 +35,42 @@ bool str_contains_i(str_t haystack, str_t needle);
 
 char *str_dup_cstr(const char *s, usize len);
 
+// Writes `v` in decimal to `out` (room for 20 digits, no terminator); returns the length.
+usize np_u64_to_dec(char *out, u64 v);
+
 int np_strncasecmp(const char *a, const char *b, usize n);
 
+// Templates of literal text and $name or ${name} variables (access_log_format, cache keys),
+// compiled against a table of the variables the caller knows.
+#define STR_TMPL_LITERAL (-1)
+
+typedef enum {
+  STR_TMPL_EXACT = 0,
+  STR_TMPL_PREFIX,  // the name followed by a non-empty rest, which becomes the part's text
+  STR_TMPL_HEADER,  // a prefix whose rest names a header: $http_user_agent is User-Agent
+} str_tmpl_match_t;
+
+typedef struct {
+  const char *name;
+  int kind;
+  str_tmpl_match_t match;
+} str_tmpl_var_t;
+
+typedef struct {
+  int kind;    // STR_TMPL_LITERAL or the variable's kind
+  str_t text;  // literal text, or the rest of a prefix variable
+} str_tmpl_part_t;
+
+typedef struct {
+  str_tmpl_part_t *parts;
+  int count;
+  char *text;  // backing store for the parts' text
+} str_tmpl_t;
+
+// Splits `src` into at most `max_parts` parts, matching variables against `vars` in order.
+// Errors are logged as "config: <what> '<src>': ..." and return NP_ERR_CONFIG.
+np_status_t str_tmpl_compile(str_tmpl_t *t, const char *src, const str_tmpl_var_t *vars,
+                             usize var_count, int max_parts, const char *what);
+void str_tmpl_free(str_tmpl_t *t);
+
 #endif
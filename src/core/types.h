@@ -40,6 +40,8 @@ typedef enum {
 #define NP_MAX_WORKERS 64
 #define NP_EPOLL_EVENTS 1024
 #define NP_TIMEOUT_BUCKETS 512
+// Idle deflate streams a worker keeps for reuse; each holds about 270 KB of zlib state.
+#define NP_GZIP_POOL_SIZE 32
 
 #ifndef LIKELY
 #define LIKELY(x) __builtin_expect(!!(x), 1)
@@ -3,50 +3,570 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <arpa/inet.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
 #include <time.h>
 #include <unistd.h>
 
-static int g_access_fd = -1;
+#include "core/log.h"
+#include "features/access_log_bin.h"
 
-void access_log_init(const char *path) {
-  if (!path || path[0] == '\0') {
-    g_access_fd = STDOUT_FILENO;
-    return;
-  }
-  g_access_fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
-}
+// Longer lines are cut short; the buffer always has room for one.
+#define ACCESS_LOG_MAX_LINE 4096
+#define ACCESS_LOG_MAX_PARTS 64
 
-void access_log_close(void) {
-  if (g_access_fd >= 0 && g_access_fd != STDOUT_FILENO) {
-    close(g_access_fd);
-    g_access_fd = -1;
+typedef enum {
+  AL_LITERAL = STR_TMPL_LITERAL,
+  AL_REMOTE_ADDR,
+  AL_TIME_LOCAL,
+  AL_TIME_ISO8601,
+  AL_REQUEST,
+  AL_METHOD,
+  AL_URI,
+  AL_ARGS,
+  AL_PROTOCOL,
+  AL_STATUS,
+  AL_BYTES_SENT,
+  AL_REQUEST_TIME,
+  AL_REQUEST_TIME_US,
+  AL_HOST,
+  AL_HEADER,
+} al_part_type_t;
+
+struct access_log_fmt {
+  str_tmpl_t tmpl;
+  bool timed;  // some part needs the request's latency
+};
+
+static const str_tmpl_var_t al_vars[] = {
+    {"remote_addr", AL_REMOTE_ADDR, STR_TMPL_EXACT},
+    {"time_local", AL_TIME_LOCAL, STR_TMPL_EXACT},
+    {"time_iso8601", AL_TIME_ISO8601, STR_TMPL_EXACT},
+    {"request", AL_REQUEST, STR_TMPL_EXACT},
+    {"request_method", AL_METHOD, STR_TMPL_EXACT},
+    {"method", AL_METHOD, STR_TMPL_EXACT},
+    {"uri", AL_URI, STR_TMPL_EXACT},
+    {"args", AL_ARGS, STR_TMPL_EXACT},
+    {"query_string", AL_ARGS, STR_TMPL_EXACT},
+    {"server_protocol", AL_PROTOCOL, STR_TMPL_EXACT},
+    {"status", AL_STATUS, STR_TMPL_EXACT},
+    {"bytes_sent", AL_BYTES_SENT, STR_TMPL_EXACT},
+    {"request_time", AL_REQUEST_TIME, STR_TMPL_EXACT},
+    {"request_time_us", AL_REQUEST_TIME_US, STR_TMPL_EXACT},
+    {"host", AL_HOST, STR_TMPL_EXACT},
+    {"http_", AL_HEADER, STR_TMPL_HEADER},
+};
+
+np_status_t access_log_compile(const char *fmt, access_log_fmt_t **out) {
+  access_log_fmt_t *f = calloc(1, sizeof(*f));
+  if (!f)
+    return NP_ERR_NOMEM;
+  np_status_t rc = str_tmpl_compile(&f->tmpl, fmt, al_vars, sizeof(al_vars) / sizeof(al_vars[0]),
+                                    ACCESS_LOG_MAX_PARTS, "access_log_format");
+  if (rc != NP_OK) {
+    free(f);
+    return rc;
+  }
+  for (int i = 0; i < f->tmpl.count; i++) {
+    int kind = f->tmpl.parts[i].kind;
+    if (kind == AL_REQUEST_TIME || kind == AL_REQUEST_TIME_US)
+      f->timed = true;
   }
+  *out = f;
+  return NP_OK;
 }
 
-void access_log_write(const http_request_t *req, int status, usize bytes,
-                      const struct timespec *start) {
-  if (g_access_fd < 0)
+void access_log_fmt_free(access_log_fmt_t *fmt) {
+  if (!fmt)
     return;
+  str_tmpl_free(&fmt->tmpl);
+  free(fmt);
+}
 
-  struct timespec end;
-  clock_gettime(CLOCK_MONOTONIC, &end);
-  long latency_us =
-      (long)((end.tv_sec - start->tv_sec) * 1000000L + (end.tv_nsec - start->tv_nsec) / 1000L);
+// Per worker: the open log, its line buffer and the timestamps of the current second.
+static struct {
+  int fd;
+  int timer_fd;
+  const access_log_fmt_t *fmt;
+  char *buf;
+  usize cap;
+  usize len;
+  time_t ts_sec;
+  char time_local[32];
+  char time_iso8601[32];
+} g_log = {.fd = -1, .timer_fd = -1};
 
+static void refresh_timestamps(void) {
   time_t now = time(NULL);
+  if (LIKELY(now == g_log.ts_sec))
+    return;
   struct tm tm;
   gmtime_r(&now, &tm);
-  char tsbuf[32];
-  strftime(tsbuf, sizeof(tsbuf), "%d/%b/%Y:%H:%M:%S +0000", &tm);
+  strftime(g_log.time_local, sizeof(g_log.time_local), "%d/%b/%Y:%H:%M:%S +0000", &tm);
+  strftime(g_log.time_iso8601, sizeof(g_log.time_iso8601), "%Y-%m-%dT%H:%M:%S+00:00", &tm);
+  g_log.ts_sec = now;
+}
+
+static void write_all(const char *p, usize len) {
+  while (len > 0) {
+    ssize_t n = write(g_log.fd, p, len);
+    if (n < 0 && errno == EINTR)
+      continue;
+    // A full disk or a closed pipe loses the lines rather than stalling the worker.
+    if (n <= 0)
+      return;
+    p += n;
+    len -= (usize)n;
+  }
+}
+
+void access_log_flush(void) {
+  if (g_log.len > 0 && g_log.fd >= 0)
+    write_all(g_log.buf, g_log.len);
+  g_log.len = 0;
+}
+
+static void on_flush_timer(int fd, u32 events, void *ctx) {
+  NP_UNUSED(events);
+  NP_UNUSED(ctx);
+  u64 expirations;
+  ssize_t n = read(fd, &expirations, sizeof(expirations));
+  NP_UNUSED(n);
+  access_log_flush();
+}
+
+// Binary mode: records are stored into a shared mapping of the file, so logging a request is a
+// few stores and no syscall. The file grows a window at a time.
+#define ACCESS_LOG_BIN_WINDOW (8u << 20)
+// Paths are interned per worker; the table starts over, with new ids, once it is half full or
+// its text store runs out, which bounds it when paths carry ids of their own.
+#define ACCESS_LOG_BIN_PATH_SLOTS 16384
+#define ACCESS_LOG_BIN_PATH_TEXT (1u << 20)
+#define ACCESS_LOG_BIN_MAX_PATH 1024
+
+typedef struct {
+  u32 hash;
+  u32 id;  // 0 for an empty slot
+  u32 off;
+  u32 len;
+} path_slot_t;
+
+static struct {
+  int fd;
+  access_log_bin_header_t *hdr;
+  u8 *win;
+  u64 win_off;
+  path_slot_t *paths;
+  u32 path_count;
+  char *text;
+  u32 text_len;
+} g_bin = {.fd = -1};
+
+static u32 path_hash(const char *s, usize len) {
+  u32 h = 2166136261u;
+  for (usize i = 0; i < len; i++) {
+    h ^= (u8)s[i];
+    h *= 16777619u;
+  }
+  return h;
+}
+
+static bool bin_map_window(u64 at) {
+  u64 off = at - at % ACCESS_LOG_BIN_WINDOW;
+  if (g_bin.win)
+    munmap(g_bin.win, ACCESS_LOG_BIN_WINDOW);
+  g_bin.win = NULL;
+  struct stat st;
+  if (fstat(g_bin.fd, &st) < 0 ||
+      ((u64)st.st_size < off + ACCESS_LOG_BIN_WINDOW &&
+       ftruncate(g_bin.fd, (off_t)(off + ACCESS_LOG_BIN_WINDOW)) < 0)) {
+    log_error_errno("access_log: grow binary log");
+    return false;
+  }
+  void *p = mmap(NULL, ACCESS_LOG_BIN_WINDOW, PROT_READ | PROT_WRITE, MAP_SHARED, g_bin.fd,
+                 (off_t)off);
+  if (p == MAP_FAILED) {
+    log_error_errno("access_log: mmap binary log");
+    return false;
+  }
+  g_bin.win = p;
+  g_bin.win_off = off;
+  return true;
+}
+
+// Copies `n` bytes to file offset *at, across windows if need be.
+static bool bin_put(u64 *at, const void *src, usize n) {
+  const u8 *p = src;
+  while (n > 0) {
+    if (!g_bin.win || *at < g_bin.win_off || *at >= g_bin.win_off + ACCESS_LOG_BIN_WINDOW) {
+      if (!bin_map_window(*at))
+        return false;
+    }
+    usize room = (usize)(g_bin.win_off + ACCESS_LOG_BIN_WINDOW - *at);
+    usize chunk = n < room ? n : room;
+    memcpy(g_bin.win + (*at - g_bin.win_off), p, chunk);
+    *at += chunk;
+    p += chunk;
+    n -= chunk;
+  }
+  return true;
+}
 
-  char line[1024];
-  int n = snprintf(line, sizeof(line), "%s - - [%s] \"%s " STR_FMT " HTTP/1.%d\" %d %zu %ldus\n",
-                   req->remote_ip, tsbuf, http_method_str(req->method), STR_ARG(req->path),
-                   req->version == HTTP_11 ? 1 : 0, status, bytes, latency_us);
+static void bin_close(void) {
+  if (g_bin.win)
+    munmap(g_bin.win, ACCESS_LOG_BIN_WINDOW);
+  if (g_bin.hdr) {
+    // The unused part of the last window is cut off.
+    if (ftruncate(g_bin.fd, (off_t)g_bin.hdr->tail) < 0)
+      log_error_errno("access_log: trim binary log");
+    munmap(g_bin.hdr, sizeof(*g_bin.hdr));
+  }
+  if (g_bin.fd >= 0)
+    close(g_bin.fd);
+  free(g_bin.paths);
+  free(g_bin.text);
+  memset(&g_bin, 0, sizeof(g_bin));
+  g_bin.fd = -1;
+}
 
-  if (n > 0) {
-    ssize_t _w = write(g_access_fd, line, (usize)n);
-    NP_UNUSED(_w);
+// Opens or continues `path`. A file left by an earlier run of the same worker is appended to;
+// its path ids stay valid and new ones carry on from where it stopped.
+static bool bin_open(const char *path) {
+  g_bin.fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  struct stat st;
+  if (g_bin.fd < 0 || fstat(g_bin.fd, &st) < 0) {
+    log_error_errno("access_log: open %s", path);
+    bin_close();
+    return false;
+  }
+  bool fresh = (usize)st.st_size < sizeof(access_log_bin_header_t);
+  if (fresh && ftruncate(g_bin.fd, sizeof(access_log_bin_header_t)) < 0) {
+    log_error_errno("access_log: truncate %s", path);
+    bin_close();
+    return false;
+  }
+  void *p = mmap(NULL, sizeof(access_log_bin_header_t), PROT_READ | PROT_WRITE, MAP_SHARED,
+                 g_bin.fd, 0);
+  g_bin.paths = calloc(ACCESS_LOG_BIN_PATH_SLOTS, sizeof(*g_bin.paths));
+  g_bin.text = malloc(ACCESS_LOG_BIN_PATH_TEXT);
+  if (p == MAP_FAILED || !g_bin.paths || !g_bin.text) {
+    if (p != MAP_FAILED)
+      munmap(p, sizeof(access_log_bin_header_t));
+    log_error("access_log: cannot set up binary log %s", path);
+    bin_close();
+    return false;
   }
+  g_bin.hdr = p;
+
+  access_log_bin_header_t *h = g_bin.hdr;
+  if (fresh) {
+    memcpy(h->magic, ACCESS_LOG_BIN_MAGIC, sizeof(h->magic));
+    h->version = ACCESS_LOG_BIN_VERSION;
+    h->record_size = sizeof(access_log_bin_record_t);
+    h->tail = sizeof(*h);
+    h->next_path_id = 1;
+  } else if (memcmp(h->magic, ACCESS_LOG_BIN_MAGIC, sizeof(h->magic)) != 0 ||
+             h->version != ACCESS_LOG_BIN_VERSION ||
+             h->record_size != sizeof(access_log_bin_record_t) || h->tail < sizeof(*h) ||
+             h->tail > (u64)st.st_size) {
+    log_error("access_log: %s is not a binary access log this version can append to", path);
+    munmap(g_bin.hdr, sizeof(*g_bin.hdr));
+    g_bin.hdr = NULL;
+    bin_close();
+    return false;
+  }
+  return true;
+}
+
+// Returns the id of `path`, writing its definition at *at first if it is new to the table.
+static u32 bin_intern(str_t path, u64 *at) {
+  if (path.len > ACCESS_LOG_BIN_MAX_PATH)
+    path.len = ACCESS_LOG_BIN_MAX_PATH;
+  u32 hash = path_hash(path.ptr, path.len);
+  u32 mask = ACCESS_LOG_BIN_PATH_SLOTS - 1;
+  u32 i = hash & mask;
+  for (; g_bin.paths[i].id != 0; i = (i + 1) & mask) {
+    path_slot_t *e = &g_bin.paths[i];
+    if (e->hash == hash && e->len == path.len &&
+        memcmp(g_bin.text + e->off, path.ptr, path.len) == 0)
+      return e->id;
+  }
+
+  if (g_bin.path_count * 2 >= ACCESS_LOG_BIN_PATH_SLOTS ||
+      g_bin.text_len + path.len > ACCESS_LOG_BIN_PATH_TEXT) {
+    memset(g_bin.paths, 0, ACCESS_LOG_BIN_PATH_SLOTS * sizeof(*g_bin.paths));
+    g_bin.path_count = 0;
+    g_bin.text_len = 0;
+    i = hash & mask;
+  }
+
+  access_log_bin_record_t def = {.kind = ACCESS_LOG_BIN_PATH,
+                                 .path_id = g_bin.hdr->next_path_id,
+                                 .bytes = path.len};
+  usize rs = sizeof(access_log_bin_record_t);
+  usize pad = (rs - path.len % rs) % rs;
+  static const u8 zeros[sizeof(access_log_bin_record_t)];
+  if (!bin_put(at, &def, sizeof(def)) || !bin_put(at, path.ptr, path.len) ||
+      !bin_put(at, zeros, pad))
+    return 0;
+
+  g_bin.hdr->next_path_id++;
+  memcpy(g_bin.text + g_bin.text_len, path.ptr, path.len);
+  g_bin.paths[i] = (path_slot_t){hash, def.path_id, g_bin.text_len, (u32)path.len};
+  g_bin.text_len += (u32)path.len;
+  g_bin.path_count++;
+  return def.path_id;
+}
+
+static void bin_write(const http_request_t *req, int status, u64 bytes, int upstream,
+                      u64 latency_us) {
+  u64 at = g_bin.hdr->tail;
+  u32 path_id = bin_intern(req->path, &at);
+  if (path_id == 0)
+    return;
+
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  access_log_bin_record_t r = {
+      .ts_us = (u64)now.tv_sec * 1000000 + (u64)now.tv_nsec / 1000,
+      .bytes = bytes,
+      .latency_us = latency_us > UINT32_MAX ? UINT32_MAX : (u32)latency_us,
+      .path_id = path_id,
+      .status = (u16)status,
+      .upstream_id = (u16)upstream,
+      .kind = ACCESS_LOG_BIN_REQUEST,
+      .method = (u8)req->method,
+      .version = (u8)req->version,
+  };
+  inet_pton(AF_INET, req->remote_ip, &r.ip);
+  // The tail moves only once the whole record is in place.
+  if (bin_put(&at, &r, sizeof(r)))
+    g_bin.hdr->tail = at;
+}
+
+void access_log_init(const np_config_t *cfg, event_loop_t *loop, int worker_id) {
+  const char *path = cfg->log.access_log;
+  if (cfg->log.access_log_binary) {
+    // Each worker maps a file of its own.
+    if (!path || path[0] == '\0') {
+      log_error("access_log: binary mode needs an access_log file");
+      return;
+    }
+    char bin_path[CONFIG_MAX_STR + 16];
+    snprintf(bin_path, sizeof(bin_path), "%s.%d", path, worker_id);
+    bin_open(bin_path);
+    return;
+  }
+
+  g_log.fmt = cfg->log.access_fmt;
+  if (!path || path[0] == '\0')
+    g_log.fd = STDOUT_FILENO;
+  else
+    g_log.fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+  if (g_log.fd < 0 || !g_log.fmt)
+    return;
+
+  usize cap = cfg->log.access_log_buffer > 0 ? (usize)cfg->log.access_log_buffer : 0;
+  if (cap > 0 && cap < ACCESS_LOG_MAX_LINE)
+    cap = ACCESS_LOG_MAX_LINE;
+  if (cap > 0)
+    g_log.buf = malloc(cap);
+  g_log.cap = g_log.buf ? cap : 0;
+  g_log.len = 0;
+  if (g_log.cap == 0 || cfg->log.access_log_flush <= 0)
+    return;
+
+  g_log.timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (g_log.timer_fd < 0) {
+    log_error_errno("access_log: timerfd_create");
+    return;
+  }
+  struct itimerspec its = {.it_interval = {cfg->log.access_log_flush, 0},
+                           .it_value = {cfg->log.access_log_flush, 0}};
+  timerfd_settime(g_log.timer_fd, 0, &its, NULL);
+  event_loop_add(loop, g_log.timer_fd, EV_READ, on_flush_timer, NULL);
+}
+
+void access_log_close(void) {
+  bin_close();
+  access_log_flush();
+  if (g_log.timer_fd >= 0) {
+    close(g_log.timer_fd);
+    g_log.timer_fd = -1;
+  }
+  free(g_log.buf);
+  g_log.buf = NULL;
+  g_log.cap = 0;
+  if (g_log.fd >= 0 && g_log.fd != STDOUT_FILENO)
+    close(g_log.fd);
+  g_log.fd = -1;
+}
+
+typedef struct {
+  char *p;
+  char *end;
+} line_t;
+
+static void put_raw(line_t *l, const char *s, usize len) {
+  usize room = (usize)(l->end - l->p);
+  if (len > room)
+    len = room;
+  memcpy(l->p, s, len);
+  l->p += len;
+}
+
+// Request data is escaped so a line stays one line: quotes, backslashes, control and non-ASCII
+// bytes are written as \xHH.
+static void put_escaped(line_t *l, str_t s) {
+  static const char hex[] = "0123456789ABCDEF";
+  for (usize i = 0; i < s.len && l->p < l->end; i++) {
+    u8 c = (u8)s.ptr[i];
+    if (c >= 0x20 && c < 0x7f && c != '"' && c != '\\') {
+      *l->p++ = (char)c;
+    } else if (l->end - l->p >= 4) {
+      l->p[0] = '\\';
+      l->p[1] = 'x';
+      l->p[2] = hex[c >> 4];
+      l->p[3] = hex[c & 15];
+      l->p += 4;
+    } else {
+      l->p = l->end;
+    }
+  }
+}
+
+static void put_uint(line_t *l, u64 v) {
+  char tmp[24];
+  int i = (int)sizeof(tmp);
+  do {
+    tmp[--i] = (char)('0' + v % 10);
+    v /= 10;
+  } while (v > 0);
+  put_raw(l, tmp + i, sizeof(tmp) - (usize)i);
+}
+
+static void put_str(line_t *l, str_t s) {
+  if (s.len == 0)
+    put_raw(l, "-", 1);
+  else
+    put_escaped(l, s);
+}
+
+static str_t protocol_str(const http_request_t *req) {
+  return req->version == HTTP_11 ? STR("HTTP/1.1") : STR("HTTP/1.0");
+}
+
+static void format_line(line_t *l, const http_request_t *req, int status, u64 bytes,
+                        u64 latency_us) {
+  const access_log_fmt_t *fmt = g_log.fmt;
+  for (int i = 0; i < fmt->tmpl.count; i++) {
+    const str_tmpl_part_t *part = &fmt->tmpl.parts[i];
+    switch ((al_part_type_t)part->kind) {
+    case AL_LITERAL:
+      put_raw(l, part->text.ptr, part->text.len);
+      break;
+    case AL_REMOTE_ADDR:
+      put_raw(l, req->remote_ip, strlen(req->remote_ip));
+      break;
+    case AL_TIME_LOCAL:
+      put_raw(l, g_log.time_local, strlen(g_log.time_local));
+      break;
+    case AL_TIME_ISO8601:
+      put_raw(l, g_log.time_iso8601, strlen(g_log.time_iso8601));
+      break;
+    case AL_REQUEST: {
+      const char *method = http_method_str(req->method);
+      put_raw(l, method, strlen(method));
+      put_raw(l, " ", 1);
+      put_escaped(l, request_target(req));
+      put_raw(l, " ", 1);
+      str_t proto = protocol_str(req);
+      put_raw(l, proto.ptr, proto.len);
+      break;
+    }
+    case AL_METHOD: {
+      const char *method = http_method_str(req->method);
+      put_raw(l, method, strlen(method));
+      break;
+    }
+    case AL_URI:
+      put_str(l, req->path);
+      break;
+    case AL_ARGS:
+      put_str(l, req->query);
+      break;
+    case AL_PROTOCOL: {
+      str_t proto = protocol_str(req);
+      put_raw(l, proto.ptr, proto.len);
+      break;
+    }
+    case AL_STATUS:
+      put_uint(l, (u64)status);
+      break;
+    case AL_BYTES_SENT:
+      put_uint(l, bytes);
+      break;
+    case AL_REQUEST_TIME: {
+      char tmp[32];
+      int n = snprintf(tmp, sizeof(tmp), "%llu.%03llu", (unsigned long long)(latency_us / 1000000),
+                       (unsigned long long)(latency_us / 1000 % 1000));
+      put_raw(l, tmp, (usize)n);
+      break;
+    }
+    case AL_REQUEST_TIME_US:
+      put_uint(l, latency_us);
+      break;
+    case AL_HOST:
+      put_str(l, request_header(req, STR("Host")));
+      break;
+    case AL_HEADER:
+      put_str(l, request_header(req, part->text));
+      break;
+    }
+  }
+}
+
+static u64 elapsed_us(const http_request_t *req) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  u64 now_us = (u64)now.tv_sec * 1000000 + (u64)(now.tv_nsec / 1000);
+  return now_us > req->recv_ts_us ? now_us - req->recv_ts_us : 0;
+}
+
+bool access_log_enabled(void) {
+  return g_bin.hdr || (g_log.fd >= 0 && g_log.fmt);
+}
+
+void access_log_write(const http_request_t *req, int status, u64 bytes, int upstream) {
+  if (g_bin.hdr) {
+    bin_write(req, status, bytes, upstream, elapsed_us(req));
+    return;
+  }
+  if (g_log.fd < 0 || !g_log.fmt)
+    return;
+
+  u64 latency_us = g_log.fmt->timed ? elapsed_us(req) : 0;
+  refresh_timestamps();
+
+  char stack[ACCESS_LOG_MAX_LINE];
+  char *dst = stack;
+  if (g_log.cap > 0) {
+    if (g_log.cap - g_log.len < ACCESS_LOG_MAX_LINE)
+      access_log_flush();
+    dst = g_log.buf + g_log.len;
+  }
+  // One byte is kept back for the newline.
+  line_t l = {dst, dst + ACCESS_LOG_MAX_LINE - 1};
+  format_line(&l, req, status, bytes, latency_us);
+  *l.p++ = '\n';
+  usize n = (usize)(l.p - dst);
+
+  if (g_log.cap > 0)
+    g_log.len += n;
+  else
+    write_all(dst, n);
 }
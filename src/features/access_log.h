@@ -1,13 +1,31 @@
 #ifndef NPROXY_ACCESS_LOG_H
 #define NPROXY_ACCESS_LOG_H
 
-#include <time.h>
-
+#include "core/config.h"
 #include "http/request.h"
+#include "net/event_loop.h"
+
+// Combined Log Format plus latency, the format used when access_log_format is not set.
+#define ACCESS_LOG_FORMAT_DEFAULT                                                               \
+  "$remote_addr - - [$time_local] \"$request\" $status $bytes_sent ${request_time_us}us"
+
+// Compiles an access_log_format template of literal text and $variables at config load.
+np_status_t access_log_compile(const char *fmt, access_log_fmt_t **out);
+void access_log_fmt_free(access_log_fmt_t *fmt);
 
-void access_log_init(const char *path);
+// Opens the worker's access log. Lines collect in a buffer of cfg->log.access_log_buffer bytes
+// that is written out when full, every access_log_flush seconds (a timer on `loop`) and by
+// access_log_close(); a zero-sized buffer writes each line as it is logged. In binary mode
+// (access_log_mode = binary) worker `worker_id` instead maps "<access_log>.<worker_id>" and
+// stores fixed-size records into it, see access_log_bin.h.
+void access_log_init(const np_config_t *cfg, event_loop_t *loop, int worker_id);
+void access_log_flush(void);
 void access_log_close(void);
-void access_log_write(const http_request_t *req, int status, usize bytes,
-                      const struct timespec *start);
+// Whether access_log_write() records anything in this worker.
+bool access_log_enabled(void);
+// Logs `req` once its response is out: `bytes` were written to the client for it and the
+// latency runs from req->recv_ts_us. `upstream` is the index + 1 of the backend that served a
+// proxied request, 0 otherwise.
+void access_log_write(const http_request_t *req, int status, u64 bytes, int upstream);
 
 #endif
@@ -0,0 +1,44 @@
+#ifndef NPROXY_ACCESS_LOG_BIN_H
+#define NPROXY_ACCESS_LOG_BIN_H
+
+#include "core/types.h"
+
+// On-disk layout of the binary access log (access_log_mode = binary), shared with
+// tools/nproxy-logcat. A file is one header followed by fixed-size slots in host byte order.
+// A slot holds a request, or defines a path id; the path's text then fills as many of the
+// following slots as it needs. Ids are defined before the first request that uses them.
+#define ACCESS_LOG_BIN_MAGIC "NPXALOG\0"
+#define ACCESS_LOG_BIN_VERSION 1
+
+typedef struct {
+  char magic[8];
+  u32 version;
+  u32 record_size;
+  u64 tail;  // file offset just past the last complete slot
+  u32 next_path_id;
+  u32 reserved[9];
+} access_log_bin_header_t;
+
+typedef enum {
+  ACCESS_LOG_BIN_REQUEST = 1,
+  ACCESS_LOG_BIN_PATH = 2,
+} access_log_bin_kind_t;
+
+typedef struct {
+  u64 ts_us;  // wall clock, microseconds since the epoch
+  u64 bytes;  // response bytes written, head included; for a path, the length of its text
+  u32 ip;     // IPv4 address, network byte order
+  u32 latency_us;
+  u32 path_id;
+  u16 status;
+  u16 upstream_id;  // index + 1 of the backend in the pool that served it; 0 if served locally
+  u8 kind;          // access_log_bin_kind_t
+  u8 method;        // http_method_t
+  u8 version;       // 10 or 11
+  u8 reserved[5];
+} access_log_bin_record_t;
+
+_Static_assert(sizeof(access_log_bin_header_t) == 64, "binary log header is 64 bytes");
+_Static_assert(sizeof(access_log_bin_record_t) == 40, "binary log slots are 40 bytes");
+
+#endif
@@ -1,56 +1,205 @@
 #include "features/compress.h"
 
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <zlib.h>
 
-#include "core/string_util.h"
+#define GZIP_STAGE_SIZE (16 * 1024)
+// Chunk header is written as a fixed-width "%08zx\r\n" in front of the deflate output.
+#define GZIP_CHUNK_HDR_LEN 10
+// Header, trailing CRLF and room for the last chunk.
+#define GZIP_CHUNK_OVERHEAD (GZIP_CHUNK_HDR_LEN + 2 + 5)
+#define GZIP_MIN_CHUNK 64
+
+struct gzip_stream {
+  z_stream zs;
+  gzip_pool_t *pool;
+  gzip_stream_t *next;
+  int level;
+  bool done;
+  u8 stage[GZIP_STAGE_SIZE];
+};
+
+struct gzip_pool {
+  gzip_stream_t *free_head;
+  int free_count;
+  int max_free;
+};
+
+// True for a q-value of zero ("q=0", "q=0.000"), which refuses the coding.
+static bool qvalue_zero(str_t params) {
+  while (params.len > 0) {
+    const char *semi = memchr(params.ptr, ';', params.len);
+    usize len = semi ? (usize)(semi - params.ptr) : params.len;
+    str_t p = str_trim((str_t){params.ptr, len});
+    if (p.len >= 2 && (p.ptr[0] == 'q' || p.ptr[0] == 'Q') && p.ptr[1] == '=') {
+      str_t v = str_trim(str_slice(p, 2, p.len));
+      if (v.len == 0 || v.ptr[0] != '0')
+        return false;
+      for (usize i = 1; i < v.len; i++) {
+        if (v.ptr[i] != '0' && v.ptr[i] != '.')
+          return false;
+      }
+      return true;
+    }
+    if (!semi)
+      break;
+    params = str_slice(params, len + 1, params.len);
+  }
+  return false;
+}
 
 bool client_accepts_gzip(http_request_t *req) {
   str_t ae = request_header(req, STR("Accept-Encoding"));
-  if (!ae.ptr || ae.len == 0)
-    return false;
-  char buf[512];
-  usize len = ae.len < sizeof(buf) - 1 ? ae.len : sizeof(buf) - 1;
-  memcpy(buf, ae.ptr, len);
-  buf[len] = '\0';
-  return strstr(buf, "gzip") != NULL;
+  bool star = false;
+  while (ae.len > 0) {
+    const char *comma = memchr(ae.ptr, ',', ae.len);
+    usize len = comma ? (usize)(comma - ae.ptr) : ae.len;
+    str_t item = {ae.ptr, len};
+    const char *semi = memchr(item.ptr, ';', item.len);
+    str_t coding = str_trim(semi ? (str_t){item.ptr, (usize)(semi - item.ptr)} : item);
+    str_t params = semi ? str_slice(item, (usize)(semi - item.ptr) + 1, item.len) : STR_NULL;
+
+    if (str_ieq(coding, STR("gzip")) || str_ieq(coding, STR("x-gzip")))
+      return !qvalue_zero(params);
+    if (str_eq(coding, STR("*")))
+      star = !qvalue_zero(params);
+    if (!comma)
+      break;
+    ae = str_slice(ae, len + 1, ae.len);
+  }
+  return star;
 }
 
-bool should_compress(const char *content_type) {
-  if (!content_type)
+bool should_compress(str_t content_type) {
+  if (content_type.len == 0)
     return false;
-  if (strncmp(content_type, "text/", 5) == 0)
-    return true;
-  if (strstr(content_type, "json"))
-    return true;
-  if (strstr(content_type, "javascript"))
+  if (str_starts_with(content_type, STR("text/")))
     return true;
-  if (strstr(content_type, "xml"))
-    return true;
-  if (strstr(content_type, "svg"))
-    return true;
-  return false;
+  return str_contains_i(content_type, STR("json")) ||
+         str_contains_i(content_type, STR("javascript")) ||
+         str_contains_i(content_type, STR("xml")) || str_contains_i(content_type, STR("svg"));
 }
 
-np_status_t gzip_compress(const u8 *in, usize in_len, u8 *out, usize out_cap, usize *out_len) {
-  z_stream zs;
-  memset(&zs, 0, sizeof(zs));
+gzip_pool_t *gzip_pool_create(int max_free) {
+  gzip_pool_t *pool = calloc(1, sizeof(*pool));
+  if (!pool)
+    return NULL;
+  pool->max_free = max_free;
+  return pool;
+}
+
+static void stream_free(gzip_stream_t *gz) {
+  deflateEnd(&gz->zs);
+  free(gz);
+}
+
+void gzip_pool_destroy(gzip_pool_t *pool) {
+  if (!pool)
+    return;
+  gzip_stream_t *gz = pool->free_head;
+  while (gz) {
+    gzip_stream_t *next = gz->next;
+    stream_free(gz);
+    gz = next;
+  }
+  free(pool);
+}
 
-  if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, MAX_WBITS + 16, 8, Z_DEFAULT_STRATEGY) !=
-      Z_OK)
-    return NP_ERR;
+gzip_stream_t *gzip_stream_acquire(gzip_pool_t *pool, int level) {
+  gzip_stream_t *gz = pool->free_head;
+  if (gz) {
+    pool->free_head = gz->next;
+    pool->free_count--;
+  } else {
+    gz = malloc(sizeof(*gz));
+    if (!gz)
+      return NULL;
+    memset(&gz->zs, 0, sizeof(gz->zs));
+    // windowBits + 16 writes the gzip header and trailer around the deflate data.
+    if (deflateInit2(&gz->zs, level, Z_DEFLATED, MAX_WBITS + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+      free(gz);
+      return NULL;
+    }
+    gz->pool = pool;
+    gz->level = level;
+  }
+  // A reset stream has no input yet, so changing the level flushes nothing.
+  if (gz->level != level && deflateParams(&gz->zs, level, Z_DEFAULT_STRATEGY) == Z_OK)
+    gz->level = level;
+  gz->next = NULL;
+  gz->done = false;
+  gz->zs.next_in = gz->stage;
+  gz->zs.avail_in = 0;
+  return gz;
+}
+
+void gzip_stream_release(gzip_stream_t *gz) {
+  gzip_pool_t *pool = gz->pool;
+  if (pool->free_count >= pool->max_free || deflateReset(&gz->zs) != Z_OK) {
+    stream_free(gz);
+    return;
+  }
+  gz->next = pool->free_head;
+  pool->free_head = gz;
+  pool->free_count++;
+}
 
-  zs.next_in = (Bytef *)in;
-  zs.avail_in = (uInt)in_len;
-  zs.next_out = (Bytef *)out;
-  zs.avail_out = (uInt)out_cap;
+u8 *gzip_stream_input(gzip_stream_t *gz, usize *room) {
+  z_stream *zs = &gz->zs;
+  if (zs->avail_in == 0) {
+    zs->next_in = gz->stage;
+  } else if (zs->next_in != gz->stage) {
+    memmove(gz->stage, zs->next_in, zs->avail_in);
+    zs->next_in = gz->stage;
+  }
+  *room = gz->done ? 0 : GZIP_STAGE_SIZE - zs->avail_in;
+  return gz->stage + zs->avail_in;
+}
+
+void gzip_stream_commit(gzip_stream_t *gz, usize n) {
+  gz->zs.avail_in += (uInt)n;
+}
 
-  int ret = deflate(&zs, Z_FINISH);
-  deflateEnd(&zs);
+np_status_t gzip_stream_deflate(gzip_stream_t *gz, np_buf_t *out, gzip_flush_t flush) {
+  static const int zflush[] = {Z_NO_FLUSH, Z_SYNC_FLUSH, Z_FINISH};
+  z_stream *zs = &gz->zs;
+  while (!gz->done) {
+    buf_compact(out);
+    usize space = buf_writable(out);
+    if (space < GZIP_CHUNK_OVERHEAD + GZIP_MIN_CHUNK)
+      return NP_ERR_AGAIN;
+    usize cap = space - GZIP_CHUNK_OVERHEAD;
+    if (cap > UINT32_MAX)
+      cap = UINT32_MAX;
 
-  if (ret != Z_STREAM_END)
-    return NP_ERR;
+    u8 *dst = buf_write_ptr(out);
+    zs->next_out = dst + GZIP_CHUNK_HDR_LEN;
+    zs->avail_out = (uInt)cap;
+    int ret = deflate(zs, zflush[flush]);
+    // Z_BUF_ERROR only says there was nothing to do, e.g. a second flush in a row.
+    if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR)
+      return NP_ERR;
 
-  *out_len = (usize)zs.total_out;
+    usize produced = cap - zs->avail_out;
+    usize n = 0;
+    if (produced > 0) {
+      char hdr[24];
+      snprintf(hdr, sizeof(hdr), "%08zx\r\n", produced);
+      memcpy(dst, hdr, GZIP_CHUNK_HDR_LEN);
+      memcpy(dst + GZIP_CHUNK_HDR_LEN + produced, "\r\n", 2);
+      n = GZIP_CHUNK_HDR_LEN + produced + 2;
+    }
+    if (ret == Z_STREAM_END) {
+      memcpy(dst + n, "0\r\n\r\n", 5);
+      n += 5;
+      gz->done = true;
+    }
+    buf_produce(out, n);
+    // Output room left over means deflate took all the input and flushed what was asked.
+    if (zs->avail_out > 0 && flush != GZIP_FINISH)
+      return NP_OK;
+  }
   return NP_OK;
 }
@@ -1,11 +1,39 @@
 #ifndef NPROXY_COMPRESS_H
 #define NPROXY_COMPRESS_H
 
+#include "core/string_util.h"
 #include "core/types.h"
 #include "http/request.h"
+#include "net/buffer.h"
+
+typedef struct gzip_pool gzip_pool_t;
+typedef struct gzip_stream gzip_stream_t;
+
+typedef enum {
+  GZIP_NO_FLUSH = 0,
+  GZIP_SYNC_FLUSH,  // everything given so far goes out, the stream stays open
+  GZIP_FINISH,      // gzip trailer and the terminating zero-length chunk
+} gzip_flush_t;
 
 bool client_accepts_gzip(http_request_t *req);
-bool should_compress(const char *content_type);
-np_status_t gzip_compress(const u8 *in, usize in_len, u8 *out, usize out_cap, usize *out_len);
+bool should_compress(str_t content_type);
+
+// Per-worker free list of deflate streams. deflateInit2() runs once per stream; a released
+// stream is reset and handed to the next response. Up to `max_free` idle streams are kept.
+gzip_pool_t *gzip_pool_create(int max_free);
+void gzip_pool_destroy(gzip_pool_t *pool);
+
+gzip_stream_t *gzip_stream_acquire(gzip_pool_t *pool, int level);
+void gzip_stream_release(gzip_stream_t *gz);
+
+// Input side: bytes are staged in the stream and taken by gzip_stream_deflate(). Returns where
+// the next bytes go and how many fit; 0 until deflate has made room.
+u8 *gzip_stream_input(gzip_stream_t *gz, usize *room);
+void gzip_stream_commit(gzip_stream_t *gz, usize n);
+
+// Compresses the staged input into `out` as HTTP/1.1 chunks. Returns NP_OK once all of it
+// (and, for GZIP_FINISH, the end of the body) is in `out`, NP_ERR_AGAIN when `out` filled up
+// first, NP_ERR if zlib failed.
+np_status_t gzip_stream_deflate(gzip_stream_t *gz, np_buf_t *out, gzip_flush_t flush);
 
 #endif
@@ -4,36 +4,40 @@
 
 #include "http/response.h"
 
-static const char HEALTHZ_RESPONSE_KA[] =
-    "HTTP/1.1 200 OK\r\n"
+// Everything after the status and Date lines, one per keep-alive setting.
+static const char HEALTHZ_TAIL_KA[] =
     "Content-Type: application/json\r\n"
-    "Content-Length: 16\r\n"
+    "Content-Length: 15\r\n"
     "Connection: keep-alive\r\n"
     "\r\n"
     "{\"status\":\"ok\"}";
 
-static const char HEALTHZ_RESPONSE_CLOSE[] =
-    "HTTP/1.1 200 OK\r\n"
+static const char HEALTHZ_TAIL_CLOSE[] =
     "Content-Type: application/json\r\n"
-    "Content-Length: 16\r\n"
+    "Content-Length: 15\r\n"
     "Connection: close\r\n"
     "\r\n"
     "{\"status\":\"ok\"}";
 
 void health_handle(conn_t *conn, http_request_t *req) {
-  const char *resp;
+  const char *tail;
   usize len;
   if (req->keep_alive) {
-    resp = HEALTHZ_RESPONSE_KA;
-    len = sizeof(HEALTHZ_RESPONSE_KA) - 1;
+    tail = HEALTHZ_TAIL_KA;
+    len = sizeof(HEALTHZ_TAIL_KA) - 1;
   } else {
-    resp = HEALTHZ_RESPONSE_CLOSE;
-    len = sizeof(HEALTHZ_RESPONSE_CLOSE) - 1;
+    tail = HEALTHZ_TAIL_CLOSE;
+    len = sizeof(HEALTHZ_TAIL_CLOSE) - 1;
   }
 
-  if (buf_writable(&conn->wbuf) >= len) {
-    memcpy(buf_write_ptr(&conn->wbuf), resp, len);
-    buf_produce(&conn->wbuf, len);
+  str_t line = response_status_line(200);
+  str_t date = response_date_line();
+  if (buf_writable(&conn->wbuf) >= line.len + date.len + len) {
+    u8 *p = buf_write_ptr(&conn->wbuf);
+    memcpy(p, line.ptr, line.len);
+    memcpy(p + line.len, date.ptr, date.len);
+    memcpy(p + line.len + date.len, tail, len);
+    buf_produce(&conn->wbuf, line.len + date.len + len);
   }
   conn->state = CONN_WRITING_RESPONSE;
 }
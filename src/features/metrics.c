@@ -5,6 +5,7 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "core/log.h"
 #include "core/types.h"
 #include "http/response.h"
 
@@ -91,13 +92,17 @@ void metrics_handle(np_metrics_t *m, conn_t *conn, http_request_t *req) {
                 "nproxy_active_connections %llu\n"
                 "# HELP nproxy_upstream_errors_total Upstream errors\n"
                 "# TYPE nproxy_upstream_errors_total counter\n"
-                "nproxy_upstream_errors_total %llu\n",
+                "nproxy_upstream_errors_total %llu\n"
+                "# HELP nproxy_log_dropped_total Error log messages dropped on a full ring\n"
+                "# TYPE nproxy_log_dropped_total counter\n"
+                "nproxy_log_dropped_total %llu\n",
                 (unsigned long long)atomic_load(&m->requests_total),
                 (unsigned long long)atomic_load(&m->requests_2xx),
                 (unsigned long long)atomic_load(&m->requests_4xx),
                 (unsigned long long)atomic_load(&m->requests_5xx),
                 (unsigned long long)atomic_load(&m->active_connections),
-                (unsigned long long)atomic_load(&m->upstream_errors));
+                (unsigned long long)atomic_load(&m->upstream_errors),
+                (unsigned long long)log_dropped());
 
   n += snprintf(body + n, sizeof(body) - (usize)n,
                 "# HELP nproxy_request_duration_seconds Request duration histogram\n"
@@ -28,12 +28,12 @@ static u32 ip_hash(const char *ip) {
   return h;
 }
 
-rate_limiter_t *rate_limiter_create(const np_config_t *cfg) {
+rate_limiter_t *rate_limiter_create(int requests_per_second, int burst) {
   rate_limiter_t *rl = calloc(1, sizeof(*rl));
   if (!rl)
     return NULL;
-  rl->rate = (double)cfg->rate_limit.requests_per_second;
-  rl->burst = (double)cfg->rate_limit.burst;
+  rl->rate = (double)requests_per_second;
+  rl->burst = (double)burst;
   return rl;
 }
 
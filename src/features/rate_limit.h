@@ -6,7 +6,7 @@
 
 typedef struct rate_limiter rate_limiter_t;
 
-rate_limiter_t *rate_limiter_create(const np_config_t *cfg);
+rate_limiter_t *rate_limiter_create(int requests_per_second, int burst);
 void rate_limiter_destroy(rate_limiter_t *rl);
 np_status_t rate_limit_check(rate_limiter_t *rl, const char *ip);
 
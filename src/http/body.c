@@ -0,0 +1,206 @@
+#include "http/body.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+enum {
+  CHUNK_SIZE_START = 0,
+  CHUNK_SIZE,
+  CHUNK_EXT,
+  CHUNK_SIZE_LF,
+  CHUNK_DATA,
+  CHUNK_DATA_CR,
+  CHUNK_DATA_LF,
+  CHUNK_TRAILER,
+  CHUNK_TRAILER_LINE,
+  CHUNK_TRAILER_LF,
+  CHUNK_END_LF,
+};
+
+void http_body_init(http_body_t *b, i64 content_length, bool chunked, i64 max_size) {
+  memset(b, 0, sizeof(*b));
+  b->max_size = max_size;
+  if (chunked) {
+    b->mode = BODY_CHUNKED;
+    b->chunk_state = CHUNK_SIZE_START;
+  } else if (content_length > 0) {
+    b->mode = BODY_LENGTH;
+    b->remaining = content_length;
+  } else {
+    b->mode = BODY_NONE;
+    b->done = true;
+  }
+}
+
+void http_body_keep_trailers(http_body_t *b, u8 *buf, usize cap) {
+  b->trailers = buf;
+  b->trailer_cap = cap;
+  b->trailer_len = 0;
+}
+
+static void keep_trailer_byte(http_body_t *b, u8 c) {
+  if (!b->trailers)
+    return;
+  if (b->trailer_len == b->trailer_cap) {
+    b->trailers = NULL;
+    b->trailer_len = 0;
+    return;
+  }
+  b->trailers[b->trailer_len++] = c;
+}
+
+static int hex_value(u8 c) {
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  if (c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F')
+    return c - 'A' + 10;
+  return -1;
+}
+
+static usize copy_payload(http_body_t *b, const u8 *in, usize n, u8 *out, usize out_cap,
+                          usize *out_len) {
+  if (out) {
+    if (n > out_cap - *out_len)
+      n = out_cap - *out_len;
+    if (out + *out_len != in)
+      memmove(out + *out_len, in, n);
+    *out_len += n;
+  }
+  b->remaining -= (i64)n;
+  b->received += (i64)n;
+  return n;
+}
+
+body_result_t http_body_decode(http_body_t *b, const u8 *in, usize in_len, usize *consumed,
+                               u8 *out, usize out_cap, usize *out_len) {
+  *consumed = 0;
+  *out_len = 0;
+  if (b->done)
+    return BODY_DONE;
+
+  if (b->mode == BODY_LENGTH) {
+    if (b->max_size > 0 && b->received + b->remaining > b->max_size)
+      return BODY_TOO_LARGE;
+    usize n = in_len;
+    if ((i64)n > b->remaining)
+      n = (usize)b->remaining;
+    *consumed = copy_payload(b, in, n, out, out_cap, out_len);
+    if (b->remaining == 0)
+      b->done = true;
+    return b->done ? BODY_DONE : BODY_INCOMPLETE;
+  }
+
+  usize i = 0;
+  bool out_full = false;
+  while (i < in_len && !b->done && !out_full) {
+    u8 c = in[i];
+    switch (b->chunk_state) {
+      case CHUNK_SIZE_START:
+      case CHUNK_SIZE: {
+        int v = hex_value(c);
+        if (v >= 0) {
+          if (b->remaining > (INT64_MAX >> 4))
+            return BODY_ERROR;
+          b->remaining = (b->remaining << 4) | v;
+          b->chunk_state = CHUNK_SIZE;
+        } else if (b->chunk_state == CHUNK_SIZE_START) {
+          return BODY_ERROR;
+        } else if (c == ';' || c == ' ' || c == '\t') {
+          b->chunk_state = CHUNK_EXT;
+        } else if (c == '\r') {
+          b->chunk_state = CHUNK_SIZE_LF;
+        } else {
+          return BODY_ERROR;
+        }
+        i++;
+        break;
+      }
+      case CHUNK_EXT:
+        if (c == '\r')
+          b->chunk_state = CHUNK_SIZE_LF;
+        i++;
+        break;
+      case CHUNK_SIZE_LF:
+        if (c != '\n')
+          return BODY_ERROR;
+        if (b->max_size > 0 && b->received + b->remaining > b->max_size)
+          return BODY_TOO_LARGE;
+        b->chunk_state = b->remaining == 0 ? CHUNK_TRAILER : CHUNK_DATA;
+        i++;
+        break;
+      case CHUNK_DATA: {
+        usize n = in_len - i;
+        if ((i64)n > b->remaining)
+          n = (usize)b->remaining;
+        n = copy_payload(b, in + i, n, out, out_cap, out_len);
+        i += n;
+        if (b->remaining == 0)
+          b->chunk_state = CHUNK_DATA_CR;
+        else if (n == 0)
+          out_full = true;
+        break;
+      }
+      case CHUNK_DATA_CR:
+        if (c != '\r')
+          return BODY_ERROR;
+        b->chunk_state = CHUNK_DATA_LF;
+        i++;
+        break;
+      case CHUNK_DATA_LF:
+        if (c != '\n')
+          return BODY_ERROR;
+        b->chunk_state = CHUNK_SIZE_START;
+        i++;
+        break;
+      case CHUNK_TRAILER:
+        b->chunk_state = c == '\r' ? CHUNK_END_LF : CHUNK_TRAILER_LINE;
+        if (c != '\r')
+          keep_trailer_byte(b, c);
+        i++;
+        break;
+      case CHUNK_TRAILER_LINE:
+        if (c == '\r')
+          b->chunk_state = CHUNK_TRAILER_LF;
+        keep_trailer_byte(b, c);
+        i++;
+        break;
+      case CHUNK_TRAILER_LF:
+        if (c != '\n')
+          return BODY_ERROR;
+        b->chunk_state = CHUNK_TRAILER;
+        keep_trailer_byte(b, c);
+        i++;
+        break;
+      case CHUNK_END_LF:
+        if (c != '\n')
+          return BODY_ERROR;
+        b->done = true;
+        i++;
+        break;
+      default:
+        return BODY_ERROR;
+    }
+  }
+
+  *consumed = i;
+  return b->done ? BODY_DONE : BODY_INCOMPLETE;
+}
+
+int http_body_spool_open(const char *dir) {
+  const char *d = (dir && dir[0] != '\0') ? dir : "/tmp";
+  int fd = open(d, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+  if (fd >= 0)
+    return fd;
+
+  char tmpl[1024];
+  snprintf(tmpl, sizeof(tmpl), "%s/nproxy-body-XXXXXX", d);
+  fd = mkostemp(tmpl, O_CLOEXEC);
+  if (fd >= 0)
+    unlink(tmpl);
+  return fd;
+}
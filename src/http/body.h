@@ -0,0 +1,45 @@
+#ifndef NPROXY_HTTP_BODY_H
+#define NPROXY_HTTP_BODY_H
+
+#include "core/types.h"
+
+typedef enum {
+  BODY_NONE = 0,
+  BODY_LENGTH = 1,
+  BODY_CHUNKED = 2,
+} body_mode_t;
+
+typedef enum {
+  BODY_INCOMPLETE = 0,
+  BODY_DONE = 1,
+  BODY_ERROR = -1,
+  BODY_TOO_LARGE = -2,
+} body_result_t;
+
+typedef struct {
+  body_mode_t mode;
+  int chunk_state;
+  i64 remaining;
+  i64 received;
+  i64 max_size;
+  bool done;
+  u8 *trailers;
+  usize trailer_len;
+  usize trailer_cap;
+} http_body_t;
+
+void http_body_init(http_body_t *b, i64 content_length, bool chunked, i64 max_size);
+
+// Keeps the raw trailer section of a chunked body ("name: value\r\n" lines) in `buf`.
+// A trailer section that does not fit is dropped as a whole.
+void http_body_keep_trailers(http_body_t *b, u8 *buf, usize cap);
+
+// Decodes raw message-body bytes (Content-Length or chunked) into payload bytes.
+// `out` may alias `in` for in-place de-chunking, or be NULL to only advance the framing
+// state. Stops at the end of the body; bytes past it are left unconsumed.
+body_result_t http_body_decode(http_body_t *b, const u8 *in, usize in_len, usize *consumed,
+                               u8 *out, usize out_cap, usize *out_len);
+
+int http_body_spool_open(const char *dir);
+
+#endif
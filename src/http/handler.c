@@ -1,21 +1,24 @@
 #include "http/handler.h"
 
 #include <arpa/inet.h>
-#include <regex.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <time.h>
 
 #include "cache/cache.h"
 #include "core/log.h"
 #include "core/string_util.h"
-#include "features/access_log.h"
+#include "features/compress.h"
 #include "features/health.h"
 #include "features/metrics.h"
 #include "features/rate_limit.h"
+#include "http/location.h"
 #include "http/response.h"
+#include "http/rewrite.h"
+#include "http/vhost.h"
 #include "module/module.h"
+#include "net/io_pool.h"
+#include "proc/worker.h"
 #include "proxy/proxy_conn.h"
 #include "static/file_server.h"
 
@@ -26,83 +29,177 @@ static bool path_matches(str_t path, const char *prefix) {
   return str_starts_with(path, p);
 }
 
-void handler_dispatch(conn_t *conn, http_request_t *req, handler_ctx_t *ctx) {
-  struct timespec start;
-  clock_gettime(CLOCK_MONOTONIC, &start);
+np_server_config_t *handler_select_server(handler_ctx_t *ctx, http_request_t *req) {
+  int idx = vhost_find(ctx->config, request_header(req, STR("Host")));
+  return &ctx->config->servers[idx >= 0 ? idx : 0];
+}
 
-  inet_ntop(AF_INET, &conn->peer.sin_addr, req->remote_ip, sizeof(req->remote_ip));
+void *handler_proxy_pool(handler_ctx_t *ctx, np_server_config_t *server,
+                         const np_location_t *loc) {
+  void *server_pool = server->proxy.enabled ? ctx->upstream_pools[server - ctx->config->servers]
+                                            : NULL;
+  if (!loc || loc->handler == LOCATION_HANDLER_INHERIT)
+    return server_pool;
+  if (loc->handler == LOCATION_HANDLER_STATIC)
+    return NULL;
+  if (loc->proxy.backend_count > 0)
+    return ctx->location_pools[loc->id];
+  return ctx->upstream_pools[server - ctx->config->servers];
+}
+
+// Answers from a cache entry; false if it holds nothing to send.
+static bool serve_cached(conn_t *conn, const cache_entry_t *entry) {
+  if (!entry->data || entry->data_len == 0)
+    return false;
+  if (buf_writable(&conn->wbuf) >= entry->data_len) {
+    memcpy(buf_write_ptr(&conn->wbuf), entry->data, entry->data_len);
+    buf_produce(&conn->wbuf, entry->data_len);
+  }
+  conn->state = CONN_WRITING_RESPONSE;
+  conn_log_response(conn, entry->hdr.status);
+  return true;
+}
+
+// Everything after the cache: proxying, static files or a 404.
+static void dispatch_uncached(conn_t *conn, http_request_t *req, handler_ctx_t *ctx,
+                              np_server_config_t *server, const np_location_t *loc,
+                              bool cache_on, const cache_key_t *cache_key) {
+  int s_idx = server - ctx->config->servers;
+
+  // Chunked framing carries the compressed body, so HTTP/1.0 clients get it as is; HTTP/2
+  // streams are never compressed.
+  conn->gzip_pool = NULL;
+  if (server->gzip.enabled && ctx->gzip_pool && !conn->h2_stream && req->version == HTTP_11 &&
+      client_accepts_gzip(req)) {
+    conn->gzip_pool = ctx->gzip_pool;
+    conn->gzip_level = server->gzip.level;
+    conn->gzip_min_length = server->gzip.min_length;
+  }
+
+  void *pool = handler_proxy_pool(ctx, server, loc);
+  if (pool) {
+    if (cache_on) {
+      conn->cache_store = ctx->cache_stores[s_idx];
+      conn->cache_ttl = loc && loc->cache_ttl > 0 ? loc->cache_ttl : server->cache.default_ttl;
+      conn->cache_key = *cache_key;
+    }
+    proxy_handle(conn, req, ctx, server, pool);
+    return;
+  }
 
-  np_server_config_t *server = &ctx->config->servers[0];
-  str_t host_hdr = request_header(req, STR("Host"));
-  if (host_hdr.ptr) {
-    char host_buf[256] = {0};
-    usize copy_len = host_hdr.len < 255 ? host_hdr.len : 255;
-    memcpy(host_buf, host_hdr.ptr, copy_len);
-
-    char *colon = strchr(host_buf, ':');
-    if (colon)
-      *colon = '\0';
-
-    for (int i = 0; i < ctx->config->server_count; i++) {
-      if (ctx->config->servers[i].server_name[0] != '\0' &&
-          strcmp(ctx->config->servers[i].server_name, host_buf) == 0) {
-        server = &ctx->config->servers[i];
-        break;
-      }
+  bool own_root = loc && loc->static_root[0] != '\0';
+  if (!own_root && server->static_bundle[0] != '\0') {
+    // A bundle that failed to open at worker start leaves nothing to serve.
+    int status = 503;
+    if (ctx->bundles[s_idx]) {
+      status = file_server_handle_bundle(conn, req, server, ctx->bundles[s_idx]);
+    } else {
+      response_send_error(conn, 503, req->keep_alive);
+      conn->state = CONN_WRITING_RESPONSE;
     }
+    conn_log_response(conn, status);
+    return;
+  }
+
+  const char *root = own_root ? loc->static_root : server->static_root;
+  if (root[0] != '\0') {
+    int status = file_server_handle(conn, req, server, root);
+    conn_log_response(conn, status);
+    return;
+  }
+
+  response_send_error(conn, 404, req->keep_alive);
+  metrics_inc_requests(ctx->metrics, 404);
+  conn_log_response(conn, 404);
+  conn->state = CONN_WRITING_RESPONSE;
+}
+
+// A cache lookup repeated on an I/O thread because its entry was not in the page cache. The
+// request waits in CONN_WAITING_IO and goes on from cache_read_done().
+typedef struct {
+  io_job_t job;
+  handler_ctx_t *ctx;
+  np_server_config_t *server;
+  const np_location_t *loc;
+  cache_store_t *store;
+  cache_key_t key;
+  np_status_t rc;
+  cache_entry_t entry;
+} cache_read_t;
+
+static void cache_read_run(io_job_t *job) {
+  cache_read_t *r = (cache_read_t *)job;
+  r->rc = cache_lookup(r->store, &r->key, &r->entry, false);
+}
+
+static void cache_read_done(io_job_t *job) {
+  cache_read_t *r = (cache_read_t *)job;
+  conn_t *conn = job->owner;
+  if (conn) {
+    conn->io_job = NULL;
+    http_request_t *req = (http_request_t *)conn->request;
+    if (r->rc != NP_OK || !serve_cached(conn, &r->entry))
+      dispatch_uncached(conn, req, r->ctx, r->server, r->loc, true, &r->key);
+    worker_dispatch_resume(conn);
   }
+  if (r->rc == NP_OK)
+    free(r->entry.data);
+  free(r);
+}
+
+static bool cache_read_start(conn_t *conn, handler_ctx_t *ctx, np_server_config_t *server,
+                             const np_location_t *loc, cache_store_t *store,
+                             const cache_key_t *key) {
+  // handle_read keeps reading into rbuf while the request is parked, and dispatch_uncached()
+  // may still route, proxy or serve on it afterwards.
+  if (conn_detach_request(conn) != NP_OK)
+    return false;
+  cache_read_t *r = malloc(sizeof(*r));
+  if (!r)
+    return false;
+  *r = (cache_read_t){.job = {.run = cache_read_run, .done = cache_read_done, .owner = conn},
+                      .ctx = ctx,
+                      .server = server,
+                      .loc = loc,
+                      .store = store,
+                      .key = *key,
+                      .rc = NP_ERR};
+  conn->io_job = &r->job;
+  conn->state = CONN_WAITING_IO;
+  io_pool_submit(&r->job);
+  return true;
+}
+
+void handler_dispatch(conn_t *conn, http_request_t *req, handler_ctx_t *ctx) {
+  inet_ntop(AF_INET, &conn->peer.sin_addr, req->remote_ip, sizeof(req->remote_ip));
+
+  np_server_config_t *server = handler_select_server(ctx, req);
 
   // We temporarily cast server to config to avoid breaking module interfaces
   if (module_run_request_handlers(conn, req, ctx->config) == NP_MODULE_HANDLED) {
-    access_log_write(req, 200, 0, &start);
+    conn_log_response(conn, 200);
     return;
   }
 
-  for (int i = 0; i < server->rewrite.count; i++) {
-    rewrite_rule_t *rule = &server->rewrite.rules[i];
-    regmatch_t matches[10];
-    char path_buf[1024];
-    usize plen = req->path.len < sizeof(path_buf) - 1 ? req->path.len : sizeof(path_buf) - 1;
-    memcpy(path_buf, req->path.ptr, plen);
-    path_buf[plen] = '\0';
-
-    if (regexec(&rule->re, path_buf, 10, matches, 0) == 0) {
-      char new_path[1024] = {0};
-      char *dest = new_path;
-      char *src = rule->replacement;
-      while (*src && (dest - new_path) < (isize)sizeof(new_path) - 1) {
-        if (*src == '$' && *(src + 1) >= '0' && *(src + 1) <= '9') {
-          int idx = *(src + 1) - '0';
-          if (matches[idx].rm_so != -1) {
-            int len = matches[idx].rm_eo - matches[idx].rm_so;
-            if (len > 0 && (dest - new_path + len) < (isize)sizeof(new_path) - 1) {
-              memcpy(dest, path_buf + matches[idx].rm_so, len);
-              dest += len;
-            }
-          }
-          src += 2;
-        } else {
-          *dest++ = *src++;
-        }
-      }
-      *dest = '\0';
-      usize nlen = strlen(new_path);
-      char *p = arena_alloc(conn->arena, nlen + 1);
-      if (p) {
-        memcpy(p, new_path, nlen + 1);
-        req->path.ptr = p;
-        req->path.len = nlen;
-      }
-      break;
-    }
+  if (rewrite_apply(server, req, conn->arena) != NP_OK) {
+    response_send_error(conn, 500, req->keep_alive);
+    metrics_inc_requests(ctx->metrics, 500);
+    conn_log_response(conn, 500);
+    conn->state = CONN_WRITING_RESPONSE;
+    return;
   }
 
-  if (ctx->rate_limiter) {
-    np_status_t rl = rate_limit_check(ctx->rate_limiter, req->remote_ip);
+  const np_location_t *loc = location_find(server, req->path);
+
+  void *limiter = ctx->rate_limiter;
+  if (loc && loc->rate_limit >= 0)
+    limiter = loc->rate_limit ? ctx->location_limiters[loc->id] : NULL;
+  if (limiter) {
+    np_status_t rl = rate_limit_check(limiter, req->remote_ip);
     if (rl != NP_OK) {
-      response_write_error(&conn->wbuf, 429, req->keep_alive);
+      response_send_error(conn, 429, req->keep_alive);
       metrics_inc_requests(ctx->metrics, 429);
-      access_log_write(req, 429, 0, &start);
+      conn_log_response(conn, 429);
       conn->state = CONN_WRITING_RESPONSE;
       return;
     }
@@ -110,55 +207,42 @@ void handler_dispatch(conn_t *conn, http_request_t *req, handler_ctx_t *ctx) {
 
   if (ctx->metrics && path_matches(req->path, ctx->config->metrics.path)) {
     metrics_handle(ctx->metrics, conn, req);
-    access_log_write(req, 200, 0, &start);
+    conn_log_response(conn, 200);
     return;
   }
 
   if (path_matches(req->path, "/healthz")) {
     health_handle(conn, req);
-    access_log_write(req, 200, 0, &start);
+    conn_log_response(conn, 200);
     return;
   }
 
   int s_idx = server - ctx->config->servers;
-
-  if (server->cache.enabled && ctx->cache_stores[s_idx] && req->method == HTTP_METHOD_GET) {
-    char cache_key[1024];
-    cache_key_from_request(req, cache_key, sizeof(cache_key));
+  bool cache_on = server->cache.enabled && ctx->cache_stores[s_idx];
+  if (loc && loc->cache >= 0)
+    cache_on = loc->cache && ctx->cache_stores[s_idx];
+  conn->cache_store = NULL;
+
+  // Only GET responses are cached or served from the cache.
+  cache_on = cache_on && req->method == HTTP_METHOD_GET;
+  cache_key_t cache_key;
+  if (cache_on) {
+    cache_key_build(server->cache.key_tmpl, req, conn->tls, &cache_key);
+    // With I/O threads, an entry that is not in the page cache is read on one of them; stream
+    // connections answer synchronously and always read inline.
+    bool nowait = io_pool_running() && !conn->h2_stream;
     cache_entry_t entry;
-    if (cache_lookup(ctx->cache_stores[s_idx], cache_key, &entry) == NP_OK) {
-      if (entry.data && entry.data_len > 0) {
-        if (buf_writable(&conn->wbuf) >= entry.data_len) {
-          memcpy(buf_write_ptr(&conn->wbuf), entry.data, entry.data_len);
-          buf_produce(&conn->wbuf, entry.data_len);
-        }
-        free(entry.data);
-        conn->state = CONN_WRITING_RESPONSE;
-        access_log_write(req, entry.hdr.status, 0, &start);
+    np_status_t rc = cache_lookup(ctx->cache_stores[s_idx], &cache_key, &entry, nowait);
+    if (rc == NP_ERR_AGAIN &&
+        cache_read_start(conn, ctx, server, loc, ctx->cache_stores[s_idx], &cache_key))
+      return;
+    if (rc == NP_OK) {
+      bool served = serve_cached(conn, &entry);
+      free(entry.data);
+      if (served)
         return;
-      }
     }
   }
 
-  if (server->proxy.enabled && ctx->upstream_pools[s_idx]) {
-    if (server->cache.enabled && ctx->cache_stores[s_idx]) {
-      conn->cache_store = ctx->cache_stores[s_idx];
-      char cache_key[1024];
-      cache_key_from_request(req, cache_key, sizeof(cache_key));
-      strncpy(conn->cache_key, cache_key, sizeof(conn->cache_key) - 1);
-    }
-    proxy_handle(conn, req, ctx, server, ctx->upstream_pools[s_idx]);
-    return;
-  }
-
-  if (server->static_root[0] != '\0') {
-    int status = file_server_handle(conn, req, server);
-    access_log_write(req, status, 0, &start);
-    return;
-  }
-
-  response_write_error(&conn->wbuf, 404, req->keep_alive);
-  metrics_inc_requests(ctx->metrics, 404);
-  access_log_write(req, 404, 0, &start);
-  conn->state = CONN_WRITING_RESPONSE;
+  dispatch_uncached(conn, req, ctx, server, loc, cache_on, &cache_key);
 }
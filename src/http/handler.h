@@ -10,12 +10,24 @@ typedef struct handler_ctx handler_ctx_t;
 
 struct handler_ctx {
   np_config_t *config;
-  void *upstream_pools[CONFIG_MAX_SERVERS];
-  void *cache_stores[CONFIG_MAX_SERVERS];
+  // Indexed like config->servers.
+  void **upstream_pools;
+  void **cache_stores;
+  void **bundles;  // bundle_t of servers with a static_bundle
   void *rate_limiter;
   void *metrics;
+  void *gzip_pool;
+  // Indexed by np_location_t.id: pools of locations with their own backends and limiters of
+  // locations with their own rate_limit zone.
+  void **location_pools;
+  void **location_limiters;
 };
 
+np_server_config_t *handler_select_server(handler_ctx_t *ctx, http_request_t *req);
+// The upstream pool for a request on `server` that matched `loc` (NULL if no location did), or
+// NULL when such a request is not proxied.
+void *handler_proxy_pool(handler_ctx_t *ctx, np_server_config_t *server,
+                         const np_location_t *loc);
 void handler_dispatch(conn_t *conn, http_request_t *req, handler_ctx_t *ctx);
 
 #endif
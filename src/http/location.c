@@ -0,0 +1,217 @@
+#include "http/location.h"
+
+#include <regex.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "core/log.h"
+
+// Radix trie over the exact and prefix location paths. Edge labels point into the paths held
+// by the locations themselves; children are kept sorted by their first byte.
+typedef struct loc_node {
+  const char *label;
+  usize label_len;
+  struct loc_node **children;
+  int child_count;
+  int prefix;  // location whose prefix ends here, or -1
+  int exact;   // location matching exactly this path, or -1
+} loc_node_t;
+
+struct location_trie {
+  loc_node_t root;
+  int *regex;  // regex locations in file order
+  int regex_count;
+};
+
+static loc_node_t *node_create(const char *label, usize len) {
+  loc_node_t *n = calloc(1, sizeof(*n));
+  if (!n)
+    return NULL;
+  n->label = label;
+  n->label_len = len;
+  n->prefix = -1;
+  n->exact = -1;
+  return n;
+}
+
+static void node_free(loc_node_t *n) {
+  for (int i = 0; i < n->child_count; i++) {
+    node_free(n->children[i]);
+    free(n->children[i]);
+  }
+  free(n->children);
+}
+
+// Index of the child whose label starts with `c`, or where it would be inserted.
+static int child_slot(const loc_node_t *n, u8 c, bool *found) {
+  int lo = 0, hi = n->child_count;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    u8 m = (u8)n->children[mid]->label[0];
+    if (m == c) {
+      *found = true;
+      return mid;
+    }
+    if (m < c)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  *found = false;
+  return lo;
+}
+
+static np_status_t child_insert(loc_node_t *n, int slot, loc_node_t *child) {
+  loc_node_t **nc = realloc(n->children, sizeof(*nc) * (usize)(n->child_count + 1));
+  if (!nc)
+    return NP_ERR_NOMEM;
+  memmove(nc + slot + 1, nc + slot, sizeof(*nc) * (usize)(n->child_count - slot));
+  nc[slot] = child;
+  n->children = nc;
+  n->child_count++;
+  return NP_OK;
+}
+
+static np_status_t trie_insert(location_trie_t *t, const char *path, int idx, bool exact) {
+  loc_node_t *node = &t->root;
+  usize len = strlen(path);
+  usize pos = 0;
+
+  while (pos < len) {
+    bool found;
+    int slot = child_slot(node, (u8)path[pos], &found);
+    if (!found) {
+      loc_node_t *leaf = node_create(path + pos, len - pos);
+      if (!leaf || child_insert(node, slot, leaf) != NP_OK) {
+        free(leaf);
+        return NP_ERR_NOMEM;
+      }
+      node = leaf;
+      break;
+    }
+
+    loc_node_t *c = node->children[slot];
+    usize common = 0;
+    while (common < c->label_len && pos + common < len && c->label[common] == path[pos + common])
+      common++;
+    if (common < c->label_len) {
+      // The new path diverges inside this edge: split it at the shared part.
+      loc_node_t *mid = node_create(c->label, common);
+      if (!mid)
+        return NP_ERR_NOMEM;
+      mid->children = malloc(sizeof(*mid->children));
+      if (!mid->children) {
+        free(mid);
+        return NP_ERR_NOMEM;
+      }
+      c->label += common;
+      c->label_len -= common;
+      mid->children[0] = c;
+      mid->child_count = 1;
+      node->children[slot] = mid;
+      c = mid;
+    }
+    node = c;
+    pos += common;
+  }
+
+  int *target = exact ? &node->exact : &node->prefix;
+  if (*target >= 0)
+    log_warn("config: duplicate location '%s', the first one applies", path);
+  else
+    *target = idx;
+  return NP_OK;
+}
+
+np_status_t location_compile(np_server_config_t *srv) {
+  if (srv->location_count == 0)
+    return NP_OK;
+
+  location_trie_t *t = calloc(1, sizeof(*t));
+  if (!t)
+    return NP_ERR_NOMEM;
+  t->root.prefix = -1;
+  t->root.exact = -1;
+  t->regex = calloc((usize)srv->location_count, sizeof(*t->regex));
+  srv->location_trie = t;
+  if (!t->regex)
+    return NP_ERR_NOMEM;
+
+  for (int i = 0; i < srv->location_count; i++) {
+    np_location_t *loc = &srv->locations[i];
+    if (loc->path[0] == '\0') {
+      log_error("config: [location] without a match");
+      return NP_ERR_CONFIG;
+    }
+    if (loc->match == LOCATION_REGEX) {
+      int flags = REG_EXTENDED | REG_NOSUB | (loc->icase ? REG_ICASE : 0);
+      if (regcomp(&loc->re, loc->path, flags) != 0) {
+        log_error("config: failed to compile location regex '%s'", loc->path);
+        return NP_ERR_CONFIG;
+      }
+      t->regex[t->regex_count++] = i;
+      continue;
+    }
+    np_status_t rc = trie_insert(t, loc->path, i, loc->match == LOCATION_EXACT);
+    if (rc != NP_OK)
+      return rc;
+  }
+  return NP_OK;
+}
+
+void location_free(np_server_config_t *srv) {
+  location_trie_t *t = srv->location_trie;
+  if (t) {
+    for (int i = 0; i < t->regex_count; i++)
+      regfree(&srv->locations[t->regex[i]].re);
+    node_free(&t->root);
+    free(t->regex);
+    free(t);
+  }
+  free(srv->locations);
+  srv->locations = NULL;
+  srv->location_count = 0;
+  srv->location_trie = NULL;
+}
+
+const np_location_t *location_find(const np_server_config_t *srv, str_t path) {
+  const location_trie_t *t = srv->location_trie;
+  if (!t)
+    return NULL;
+
+  const loc_node_t *node = &t->root;
+  int prefix = node->prefix;
+  int exact = -1;
+  usize pos = 0;
+  for (;;) {
+    if (pos == path.len) {
+      exact = node->exact;
+      break;
+    }
+    bool found;
+    int slot = child_slot(node, (u8)path.ptr[pos], &found);
+    if (!found)
+      break;
+    const loc_node_t *c = node->children[slot];
+    if (c->label_len > path.len - pos || memcmp(c->label, path.ptr + pos, c->label_len) != 0)
+      break;
+    node = c;
+    pos += c->label_len;
+    if (node->prefix >= 0)
+      prefix = node->prefix;
+  }
+
+  if (exact >= 0)
+    return &srv->locations[exact];
+  if (prefix >= 0 && srv->locations[prefix].match == LOCATION_PREFIX_STOP)
+    return &srv->locations[prefix];
+
+  for (int i = 0; i < t->regex_count; i++) {
+    const np_location_t *loc = &srv->locations[t->regex[i]];
+    // REG_STARTEND bounds the match, so the path needs no terminating copy.
+    regmatch_t m = {.rm_so = 0, .rm_eo = (regoff_t)path.len};
+    if (regexec(&loc->re, path.ptr, 1, &m, REG_STARTEND) == 0)
+      return loc;
+  }
+  return prefix >= 0 ? &srv->locations[prefix] : NULL;
+}
@@ -0,0 +1,17 @@
+#ifndef NPROXY_LOCATION_H
+#define NPROXY_LOCATION_H
+
+#include "core/config.h"
+#include "core/string_util.h"
+#include "core/types.h"
+
+// Compiles the server's [location] blocks: regexes are built and exact and prefix paths go
+// into a radix trie, so matching costs one walk over the request path.
+np_status_t location_compile(np_server_config_t *srv);
+void location_free(np_server_config_t *srv);
+
+// Picks the location for `path` the way nginx does: an exact match, else the longest prefix
+// if it is "^~", else the first matching regex, else the longest prefix. NULL if none applies.
+const np_location_t *location_find(const np_server_config_t *srv, str_t path);
+
+#endif
@@ -10,7 +10,7 @@ void http_parse_state_init(http_parse_state_t *s) {
   s->content_length = -1;
 }
 
-static http_method_t parse_method(const char *p, usize len) {
+http_method_t http_method_parse(const char *p, usize len) {
   if (len == 3 && memcmp(p, "GET", 3) == 0)
     return HTTP_METHOD_GET;
   if (len == 4 && memcmp(p, "POST", 4) == 0)
@@ -49,7 +49,7 @@ parse_result_t http_parse_request(http_parse_state_t *s, const u8 *data, usize l
   if (!sp1)
     return PARSE_ERROR;
 
-  s->method = parse_method(cur, (usize)(sp1 - cur));
+  s->method = http_method_parse(cur, (usize)(sp1 - cur));
   cur = sp1 + 1;
 
   const char *sp2 = memchr(cur, ' ', (usize)(line_end - cur));
@@ -94,8 +94,9 @@ parse_result_t http_parse_request(http_parse_state_t *s, const u8 *data, usize l
 
     if (str_ieq(name, STR("Content-Length"))) {
       i64 cl;
-      if (str_to_int(value, &cl) == 0)
-        s->content_length = cl;
+      if (str_to_int(value, &cl) != 0 || cl < 0)
+        return PARSE_ERROR;
+      s->content_length = cl;
     } else if (str_ieq(name, STR("Transfer-Encoding"))) {
       if (str_ieq(value, STR("chunked")))
         s->chunked = true;
@@ -107,6 +108,11 @@ parse_result_t http_parse_request(http_parse_state_t *s, const u8 *data, usize l
       }
     } else if (str_ieq(name, STR("Upgrade"))) {
       s->upgrade_protocol = value;
+    } else if (str_ieq(name, STR("Expect"))) {
+      if (str_ieq(value, STR("100-continue")))
+        s->expect_continue = true;
+      else
+        s->expect_unknown = true;
     }
 
     cur = line_end + 2;
@@ -114,6 +120,9 @@ parse_result_t http_parse_request(http_parse_state_t *s, const u8 *data, usize l
 
   if (!s->has_connection_header)
     s->keep_alive = (s->version == HTTP_11);
+  // HTTP/1.0 clients cannot be relied on to wait for the interim response.
+  if (s->version != HTTP_11)
+    s->expect_continue = false;
 
   if (s->version == HTTP_11 && !s->chunked && s->content_length < 0) {
     s->content_length = 0;
@@ -122,13 +131,79 @@ parse_result_t http_parse_request(http_parse_state_t *s, const u8 *data, usize l
   s->body_offset = (usize)(cur - buf);
   s->parsed_bytes = s->body_offset;
 
-  if (s->content_length > 0) {
-    usize body_avail = len - s->body_offset;
-    if (body_avail < (usize)s->content_length)
+  return PARSE_DONE;
+}
+
+void http_response_state_init(http_response_state_t *s) {
+  memset(s, 0, sizeof(*s));
+  s->content_length = -1;
+}
+
+parse_result_t http_parse_response(http_response_state_t *s, const u8 *data, usize len) {
+  const char *buf = (const char *)data;
+  const char *end = buf + len;
+  const char *cur = buf;
+
+  const char *line_end = find_crlf(cur, len);
+  if (!line_end)
+    return PARSE_INCOMPLETE;
+
+  if (line_end - cur < 12 || memcmp(cur, "HTTP/1.", 7) != 0 || cur[8] != ' ')
+    return PARSE_ERROR;
+  s->version = cur[7] == '0' ? HTTP_10 : HTTP_11;
+
+  s->status = 0;
+  for (int i = 9; i < 12; i++) {
+    if (!isdigit((unsigned char)cur[i]))
+      return PARSE_ERROR;
+    s->status = s->status * 10 + (cur[i] - '0');
+  }
+
+  cur = line_end + 2;
+
+  bool head_done = false;
+  while (!head_done) {
+    line_end = find_crlf(cur, (usize)(end - cur));
+    if (!line_end)
       return PARSE_INCOMPLETE;
-    s->parsed_bytes += (usize)s->content_length;
+
+    if (line_end == cur) {
+      cur += 2;
+      head_done = true;
+      continue;
+    }
+
+    const char *colon = memchr(cur, ':', (usize)(line_end - cur));
+    if (!colon || s->header_count >= NP_MAX_HEADERS)
+      return PARSE_ERROR;
+
+    str_t name = str_trim((str_t){.ptr = cur, .len = (usize)(colon - cur)});
+    str_t value = str_trim((str_t){.ptr = colon + 1, .len = (usize)(line_end - colon - 1)});
+
+    s->headers[s->header_count].name = name;
+    s->headers[s->header_count].value = value;
+    s->header_count++;
+
+    if (str_ieq(name, STR("Content-Length"))) {
+      i64 cl;
+      if (str_to_int(value, &cl) != 0 || cl < 0)
+        return PARSE_ERROR;
+      s->content_length = cl;
+    } else if (str_ieq(name, STR("Transfer-Encoding"))) {
+      if (str_ieq(value, STR("chunked")))
+        s->chunked = true;
+    } else if (str_ieq(name, STR("Connection"))) {
+      s->has_connection_header = true;
+      s->keep_alive = !str_ieq(value, STR("close"));
+    }
+
+    cur = line_end + 2;
   }
 
+  if (!s->has_connection_header)
+    s->keep_alive = (s->version == HTTP_11);
+
+  s->body_offset = (usize)(cur - buf);
   return PARSE_DONE;
 }
 
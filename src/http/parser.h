@@ -43,13 +43,35 @@ typedef struct {
   bool has_connection_header;
   bool upgrade;
   str_t upgrade_protocol;
+  // "Expect: 100-continue" on an HTTP/1.1 request; any other expectation sets expect_unknown.
+  bool expect_continue;
+  bool expect_unknown;
   usize body_offset;
   usize parsed_bytes;
 } http_parse_state_t;
 
+typedef struct {
+  http_version_t version;
+  int status;
+  http_header_t headers[NP_MAX_HEADERS];
+  int header_count;
+  i64 content_length;
+  bool chunked;
+  bool keep_alive;
+  bool has_connection_header;
+  usize body_offset;
+} http_response_state_t;
+
 void http_parse_state_init(http_parse_state_t *s);
 parse_result_t http_parse_request(http_parse_state_t *s, const u8 *data, usize len);
 
+// Parses an HTTP/1.x status line and header block. `content_length` stays -1 when the
+// response does not carry one.
+void http_response_state_init(http_response_state_t *s);
+parse_result_t http_parse_response(http_response_state_t *s, const u8 *data, usize len);
+
+http_method_t http_method_parse(const char *p, usize len);
+
 const char *http_method_str(http_method_t m);
 
 #endif
@@ -19,8 +19,7 @@ http_request_t *request_create(arena_t *arena) {
   return req;
 }
 
-np_status_t request_populate(http_request_t *req, http_parse_state_t *ps, const u8 *raw,
-                             usize len) {
+np_status_t request_populate(http_request_t *req, http_parse_state_t *ps) {
   req->method = ps->method;
   req->version = ps->version;
   req->content_length = ps->content_length;
@@ -29,8 +28,16 @@ np_status_t request_populate(http_request_t *req, http_parse_state_t *ps, const
   req->header_count = ps->header_count;
   req->upgrade = ps->upgrade;
   req->upgrade_protocol = ps->upgrade_protocol;
+  req->expect_continue = ps->expect_continue;
 
-  str_t uri = ps->uri;
+  request_set_uri(req, ps->uri);
+  memcpy(req->headers, ps->headers, (usize)ps->header_count * sizeof(http_header_t));
+  request_mark_received(req);
+
+  return NP_OK;
+}
+
+void request_set_uri(http_request_t *req, str_t uri) {
   const char *q = memchr(uri.ptr, '?', uri.len);
   if (q) {
     req->path = (str_t){.ptr = uri.ptr, .len = (usize)(q - uri.ptr)};
@@ -39,18 +46,42 @@ np_status_t request_populate(http_request_t *req, http_parse_state_t *ps, const
     req->path = uri;
     req->query = STR_NULL;
   }
+}
 
-  memcpy(req->headers, ps->headers, (usize)ps->header_count * sizeof(http_header_t));
-
-  if (ps->content_length > 0 && ps->body_offset + (usize)ps->content_length <= len) {
-    req->body.ptr = (const char *)(raw + ps->body_offset);
-    req->body.len = (usize)ps->content_length;
-  }
+str_t request_target(const http_request_t *req) {
+  if (req->query.ptr && req->query.ptr == req->path.ptr + req->path.len + 1)
+    return (str_t){.ptr = req->path.ptr, .len = req->path.len + 1 + req->query.len};
+  return req->path;
+}
 
+void request_mark_received(http_request_t *req) {
   struct timespec ts;
   clock_gettime(CLOCK_MONOTONIC, &ts);
   req->recv_ts_us = (u64)ts.tv_sec * 1000000ULL + (u64)(ts.tv_nsec / 1000);
+}
+
+static void rebase(str_t *s, const char *from, usize len, const char *to) {
+  if (s->ptr >= from && s->ptr < from + len)
+    s->ptr = to + (s->ptr - from);
+}
+
+// Moves the request head out of the read buffer so the buffer can be reused for the body.
+// Fields (and a buffered body) pointing into raw[0..head_len) are rebased onto an arena copy.
+np_status_t request_detach(http_request_t *req, arena_t *arena, const u8 *raw, usize head_len) {
+  char *copy = arena_alloc(arena, head_len);
+  if (!copy)
+    return NP_ERR_NOMEM;
+  memcpy(copy, raw, head_len);
 
+  const char *from = (const char *)raw;
+  rebase(&req->path, from, head_len, copy);
+  rebase(&req->query, from, head_len, copy);
+  rebase(&req->upgrade_protocol, from, head_len, copy);
+  rebase(&req->body, from, head_len, copy);
+  for (int i = 0; i < req->header_count; i++) {
+    rebase(&req->headers[i].name, from, head_len, copy);
+    rebase(&req->headers[i].value, from, head_len, copy);
+  }
   return NP_OK;
 }
 
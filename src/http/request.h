@@ -21,12 +21,21 @@ typedef struct {
   bool upgrade;
   str_t upgrade_protocol;
   str_t body;
+  bool body_pending;
+  // The client holds its body back until it sees "100 Continue".
+  bool expect_continue;
   char remote_ip[INET_ADDRSTRLEN];
   u64 recv_ts_us;
 } http_request_t;
 
 http_request_t *request_create(arena_t *arena);
-np_status_t request_populate(http_request_t *req, http_parse_state_t *ps, const u8 *raw, usize len);
+np_status_t request_populate(http_request_t *req, http_parse_state_t *ps);
+void request_set_uri(http_request_t *req, str_t uri);
+// "path?query" as sent upstream. request_set_uri() and rewrites keep the query right after
+// the path, so this is a view, not a copy.
+str_t request_target(const http_request_t *req);
+void request_mark_received(http_request_t *req);
+np_status_t request_detach(http_request_t *req, arena_t *arena, const u8 *raw, usize head_len);
 str_t request_header(const http_request_t *req, str_t name);
 
 #endif
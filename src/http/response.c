@@ -1,9 +1,12 @@
 #include "http/response.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include "core/log.h"
+#include "static/mime.h"
 
 http_response_t *response_create(arena_t *arena) {
   http_response_t *r = arena_new(arena, http_response_t);
@@ -33,55 +36,245 @@ void response_set_header(http_response_t *r, arena_t *arena, const char *name, c
   r->header_count++;
 }
 
-static const char *status_reason(int status) {
-  switch (status) {
-    case 200:
-      return "OK";
-    case 201:
-      return "Created";
-    case 204:
-      return "No Content";
-    case 206:
-      return "Partial Content";
-    case 301:
-      return "Moved Permanently";
-    case 302:
-      return "Found";
-    case 304:
-      return "Not Modified";
-    case 400:
-      return "Bad Request";
-    case 403:
-      return "Forbidden";
-    case 404:
-      return "Not Found";
-    case 405:
-      return "Method Not Allowed";
-    case 413:
-      return "Payload Too Large";
-    case 429:
-      return "Too Many Requests";
-    case 500:
-      return "Internal Server Error";
-    case 502:
-      return "Bad Gateway";
-    case 503:
-      return "Service Unavailable";
-    case 504:
-      return "Gateway Timeout";
-    default:
-      return "Unknown";
+typedef struct {
+  int status;
+  const char *reason;
+} status_desc_t;
+
+static const status_desc_t STATUSES[] = {
+    {100, "Continue"},
+    {101, "Switching Protocols"},
+    {200, "OK"},
+    {201, "Created"},
+    {204, "No Content"},
+    {206, "Partial Content"},
+    {301, "Moved Permanently"},
+    {302, "Found"},
+    {304, "Not Modified"},
+    {307, "Temporary Redirect"},
+    {308, "Permanent Redirect"},
+    {400, "Bad Request"},
+    {401, "Unauthorized"},
+    {403, "Forbidden"},
+    {404, "Not Found"},
+    {405, "Method Not Allowed"},
+    {408, "Request Timeout"},
+    {411, "Length Required"},
+    {413, "Payload Too Large"},
+    {414, "URI Too Long"},
+    {416, "Range Not Satisfiable"},
+    {417, "Expectation Failed"},
+    {429, "Too Many Requests"},
+    {431, "Request Header Fields Too Large"},
+    {500, "Internal Server Error"},
+    {501, "Not Implemented"},
+    {502, "Bad Gateway"},
+    {503, "Service Unavailable"},
+    {504, "Gateway Timeout"},
+    {505, "HTTP Version Not Supported"},
+};
+
+#define STATUS_MIN 100
+#define STATUS_MAX 599
+
+// Everything about a status that does not change between responses. Canned error responses are
+// split around the Date line: `line` comes first, then Date, then error_tail[keep_alive].
+typedef struct {
+  const char *reason;
+  char line[64];
+  usize line_len;
+  char *error_tail[2];
+  usize error_tail_len[2];
+} status_entry_t;
+
+static status_entry_t *status_table[STATUS_MAX - STATUS_MIN + 1];
+
+#define CONNECTION_CLOSE "Connection: close\r\n\r\n"
+#define CONNECTION_KEEP_ALIVE "Connection: keep-alive\r\n\r\n"
+
+static const str_t CONNECTION_END[2] = {
+    {.ptr = CONNECTION_CLOSE, .len = sizeof(CONNECTION_CLOSE) - 1},
+    {.ptr = CONNECTION_KEEP_ALIVE, .len = sizeof(CONNECTION_KEEP_ALIVE) - 1},
+};
+
+// The Date line is per worker process and only reformatted when the second changes.
+static struct {
+  time_t sec;
+  char line[64];
+  usize len;
+} date_cache = {.sec = -1};
+
+// Scratch for statuses outside the table; workers are single-threaded.
+static char status_scratch[64];
+
+static status_entry_t *status_lookup(int status) {
+  if (UNLIKELY(status < STATUS_MIN || status > STATUS_MAX))
+    return NULL;
+  return status_table[status - STATUS_MIN];
+}
+
+const char *response_status_reason(int status) {
+  status_entry_t *e = status_lookup(status);
+  if (LIKELY(e != NULL))
+    return e->reason;
+  for (usize i = 0; i < sizeof(STATUSES) / sizeof(STATUSES[0]); i++) {
+    if (STATUSES[i].status == status)
+      return STATUSES[i].reason;
+  }
+  return "Unknown";
+}
+
+static usize format_status_line(char *out, int status, const char *reason) {
+  usize n = 0;
+  memcpy(out, "HTTP/1.1 ", 9);
+  n += 9;
+  n += np_u64_to_dec(out + n, (u64)(status < 0 ? 0 : status));
+  out[n++] = ' ';
+  usize rlen = strlen(reason);
+  if (rlen > 40)
+    rlen = 40;
+  memcpy(out + n, reason, rlen);
+  n += rlen;
+  out[n++] = '\r';
+  out[n++] = '\n';
+  return n;
+}
+
+static int error_page_body(char *out, usize cap, int status, const char *reason) {
+  return snprintf(
+      out, cap,
+      "<!DOCTYPE html>\n"
+      "<html>\n"
+      "<head><title>%d %s</title></head>\n"
+      "<body style=\"font-family:-apple-system,BlinkMacSystemFont,'Segoe UI',Roboto,sans-serif;"
+      "display:flex;justify-content:center;align-items:center;min-height:100vh;margin:0;"
+      "background:#0f0f0f;color:#e0e0e0\">\n"
+      "<div style=\"text-align:center;padding:40px\">\n"
+      "<h1 style=\"font-size:72px;font-weight:200;margin:0;color:#ff6b6b\">%d</h1>\n"
+      "<p style=\"font-size:20px;color:#888;margin:12px 0 32px\">%s</p>\n"
+      "<hr style=\"border:none;border-top:1px solid #333;width:280px;margin:0 auto 16px\">\n"
+      "<p style=\"font-size:13px;color:#555\">nproxy/1.0</p>\n"
+      "</div>\n"
+      "</body>\n"
+      "</html>\n",
+      status, reason, status, reason);
+}
+
+// Everything after the Date line of an error response: its headers and the page itself.
+static char *build_error_tail(const char *content_type, const char *body, usize blen,
+                              bool keep_alive, usize *len) {
+  char head[256];
+  int hn = snprintf(head, sizeof(head), "Content-Type: %s\r\nContent-Length: %zu\r\n%s",
+                    content_type, blen, CONNECTION_END[keep_alive].ptr);
+  if (hn < 0 || (usize)hn >= sizeof(head))
+    return NULL;
+  char *tail = malloc((usize)hn + blen);
+  if (!tail)
+    return NULL;
+  memcpy(tail, head, (usize)hn);
+  memcpy(tail + hn, body, blen);
+  *len = (usize)hn + blen;
+  return tail;
+}
+
+static status_entry_t *status_entry(int status, const char *reason) {
+  status_entry_t *e = status_table[status - STATUS_MIN];
+  if (e)
+    return e;
+  e = calloc(1, sizeof(*e));
+  if (!e)
+    return NULL;
+  e->reason = reason;
+  e->line_len = format_status_line(e->line, status, reason);
+  status_table[status - STATUS_MIN] = e;
+  return e;
+}
+
+static void set_error_body(status_entry_t *e, const char *content_type, const char *body,
+                           usize blen) {
+  for (int ka = 0; ka < 2; ka++) {
+    free(e->error_tail[ka]);
+    e->error_tail[ka] = build_error_tail(content_type, body, blen, ka, &e->error_tail_len[ka]);
+  }
+}
+
+// Custom pages are read once; anything that would not fit a stream's write buffer is refused.
+static void load_error_page(int status, const char *path) {
+  FILE *fp = fopen(path, "rb");
+  if (!fp) {
+    log_error_errno("error_page %d: cannot open %s", status, path);
+    return;
+  }
+  char *body = malloc(NP_READ_BUF_SIZE);
+  usize blen = body ? fread(body, 1, NP_READ_BUF_SIZE, fp) : 0;
+  bool too_big = body && blen == NP_READ_BUF_SIZE && fgetc(fp) != EOF;
+  fclose(fp);
+  if (!body || too_big) {
+    log_error("error_page %d: %s is larger than %d bytes", status, path, NP_READ_BUF_SIZE - 1);
+    free(body);
+    return;
+  }
+
+  status_entry_t *e = status_entry(status, response_status_reason(status));
+  const char *dot = strrchr(path, '.');
+  const char *mime = dot ? mime_by_extension(dot + 1) : "text/html";
+  if (e)
+    set_error_body(e, mime, body, blen);
+  free(body);
+}
+
+void response_init(const np_config_t *cfg) {
+  for (usize i = 0; i < sizeof(STATUSES) / sizeof(STATUSES[0]); i++) {
+    int status = STATUSES[i].status;
+    if (status_table[status - STATUS_MIN])
+      continue;
+    status_entry_t *e = status_entry(status, STATUSES[i].reason);
+    if (!e) {
+      log_error("response_init: out of memory");
+      return;
+    }
+    if (status >= 400) {
+      char body[2048];
+      int blen = error_page_body(body, sizeof(body), status, e->reason);
+      if (blen > 0 && (usize)blen < sizeof(body))
+        set_error_body(e, "text/html", body, (usize)blen);
+    }
   }
+
+  for (int i = 0; cfg && i < cfg->error_pages.count; i++)
+    load_error_page(cfg->error_pages.status[i], cfg->error_pages.paths[i]);
+}
+
+str_t response_status_line(int status) {
+  status_entry_t *e = status_lookup(status);
+  if (LIKELY(e != NULL))
+    return (str_t){.ptr = e->line, .len = e->line_len};
+  usize n = format_status_line(status_scratch, status, response_status_reason(status));
+  return (str_t){.ptr = status_scratch, .len = n};
+}
+
+str_t response_date_line(void) {
+  time_t now = time(NULL);
+  if (UNLIKELY(now != date_cache.sec)) {
+    struct tm tm;
+    gmtime_r(&now, &tm);
+    date_cache.len = strftime(date_cache.line, sizeof(date_cache.line),
+                              "Date: %a, %d %b %Y %H:%M:%S GMT\r\n", &tm);
+    date_cache.sec = now;
+  }
+  return (str_t){.ptr = date_cache.line, .len = date_cache.len};
 }
 
 np_status_t response_serialize(http_response_t *r, np_buf_t *buf) {
-  const char *reason = r->reason ? r->reason : status_reason(r->status);
-  char tmp[256];
-  int n = snprintf(tmp, sizeof(tmp), "HTTP/1.1 %d %s\r\n", r->status, reason);
-  if (buf_writable(buf) < (usize)n)
+  str_t line = response_status_line(r->status);
+  if (r->reason && strcmp(r->reason, response_status_reason(r->status)) != 0) {
+    usize n = format_status_line(status_scratch, r->status, r->reason);
+    line = (str_t){.ptr = status_scratch, .len = n};
+  }
+  if (buf_writable(buf) < line.len)
     buf_compact(buf);
-  memcpy(buf_write_ptr(buf), tmp, (usize)n);
-  buf_produce(buf, (usize)n);
+  memcpy(buf_write_ptr(buf), line.ptr, line.len);
+  buf_produce(buf, line.len);
 
   for (int i = 0; i < r->header_count; i++) {
     usize hlen = r->headers[i].name.len + r->headers[i].value.len + 4;
@@ -122,23 +315,81 @@ np_status_t response_serialize(http_response_t *r, np_buf_t *buf) {
   return NP_OK;
 }
 
+usize response_format_tail(char *dst, str_t content_type, u64 content_length, str_t extra,
+                           bool keep_alive) {
+  str_t conn = CONNECTION_END[keep_alive];
+  char *p = dst;
+  if (content_type.len > 0) {
+    memcpy(p, "Content-Type: ", 14);
+    p += 14;
+    memcpy(p, content_type.ptr, content_type.len);
+    p += content_type.len;
+    *p++ = '\r';
+    *p++ = '\n';
+  }
+  if (content_length == RESPONSE_CHUNKED) {
+    memcpy(p, "Transfer-Encoding: chunked\r\n", 28);
+    p += 28;
+  } else {
+    memcpy(p, "Content-Length: ", 16);
+    p += 16;
+    p += np_u64_to_dec(p, content_length);
+    *p++ = '\r';
+    *p++ = '\n';
+  }
+  memcpy(p, extra.ptr, extra.len);
+  p += extra.len;
+  memcpy(p, conn.ptr, conn.len);
+  p += conn.len;
+  return (usize)(p - dst);
+}
+
+static bool write_head(np_buf_t *buf, str_t line, str_t content_type, u64 content_length,
+                       str_t extra, bool keep_alive) {
+  str_t date = response_date_line();
+  usize need = line.len + date.len + RESPONSE_TAIL_MAX(content_type.len, extra.len);
+  if (buf_writable(buf) < need)
+    return false;
+
+  char *p = (char *)buf_write_ptr(buf);
+  memcpy(p, line.ptr, line.len);
+  memcpy(p + line.len, date.ptr, date.len);
+  usize n = line.len + date.len;
+  n += response_format_tail(p + n, content_type, content_length, extra, keep_alive);
+  buf_produce(buf, n);
+  return true;
+}
+
+bool response_write_tail(np_buf_t *buf, int status, const char *tail, usize tail_len) {
+  str_t line = response_status_line(status);
+  str_t date = response_date_line();
+  if (buf_writable(buf) < line.len + date.len + tail_len)
+    return false;
+  u8 *p = buf_write_ptr(buf);
+  memcpy(p, line.ptr, line.len);
+  memcpy(p + line.len, date.ptr, date.len);
+  memcpy(p + line.len + date.len, tail, tail_len);
+  buf_produce(buf, line.len + date.len + tail_len);
+  return true;
+}
+
+bool response_write_head(np_buf_t *buf, int status, str_t content_type, u64 content_length,
+                         str_t extra, bool keep_alive) {
+  return write_head(buf, response_status_line(status), content_type, content_length, extra,
+                    keep_alive);
+}
+
 void response_write_simple(np_buf_t *buf, int status, const char *reason, const char *content_type,
                            const char *body, bool keep_alive) {
-  usize body_len = body ? strlen(body) : 0;
-  const char *conn = keep_alive ? "keep-alive" : "close";
-  char header[512];
-  int hn = snprintf(header, sizeof(header),
-                    "HTTP/1.1 %d %s\r\n"
-                    "Content-Type: %s\r\n"
-                    "Content-Length: %zu\r\n"
-                    "Connection: %s\r\n"
-                    "\r\n",
-                    status, reason ? reason : status_reason(status),
-                    content_type ? content_type : "text/plain", body_len, conn);
-  if (hn > 0 && buf_writable(buf) >= (usize)hn) {
-    memcpy(buf_write_ptr(buf), header, (usize)hn);
-    buf_produce(buf, (usize)hn);
+  str_t line = response_status_line(status);
+  if (reason && strcmp(reason, response_status_reason(status)) != 0) {
+    usize n = format_status_line(status_scratch, status, reason);
+    line = (str_t){.ptr = status_scratch, .len = n};
   }
+  usize body_len = body ? strlen(body) : 0;
+  str_t ctype = content_type ? str_from_cstr(content_type) : STR("text/plain");
+  if (!write_head(buf, line, ctype, body_len, STR_NULL, keep_alive))
+    return;
   if (body_len > 0 && buf_writable(buf) >= body_len) {
     memcpy(buf_write_ptr(buf), body, body_len);
     buf_produce(buf, body_len);
@@ -146,42 +397,58 @@ void response_write_simple(np_buf_t *buf, int status, const char *reason, const
 }
 
 void response_write_error(np_buf_t *buf, int status, bool keep_alive) {
-  const char *reason = status_reason(status);
-  char body[2048];
-  int blen = snprintf(
-      body, sizeof(body),
-      "<!DOCTYPE html>\n"
-      "<html>\n"
-      "<head><title>%d %s</title></head>\n"
-      "<body style=\"font-family:-apple-system,BlinkMacSystemFont,'Segoe UI',Roboto,sans-serif;"
-      "display:flex;justify-content:center;align-items:center;min-height:100vh;margin:0;"
-      "background:#0f0f0f;color:#e0e0e0\">\n"
-      "<div style=\"text-align:center;padding:40px\">\n"
-      "<h1 style=\"font-size:72px;font-weight:200;margin:0;color:#ff6b6b\">%d</h1>\n"
-      "<p style=\"font-size:20px;color:#888;margin:12px 0 32px\">%s</p>\n"
-      "<hr style=\"border:none;border-top:1px solid #333;width:280px;margin:0 auto 16px\">\n"
-      "<p style=\"font-size:13px;color:#555\">nproxy/1.0</p>\n"
-      "</div>\n"
-      "</body>\n"
-      "</html>\n",
-      status, reason, status, reason);
-
-  const char *conn = keep_alive ? "keep-alive" : "close";
-  char header[512];
-  int hn = snprintf(header, sizeof(header),
-                    "HTTP/1.1 %d %s\r\n"
-                    "Content-Type: text/html\r\n"
-                    "Content-Length: %d\r\n"
-                    "Connection: %s\r\n"
-                    "\r\n",
-                    status, reason, blen, conn);
-
-  if (hn > 0 && buf_writable(buf) >= (usize)hn) {
-    memcpy(buf_write_ptr(buf), header, (usize)hn);
-    buf_produce(buf, (usize)hn);
+  status_entry_t *e = status_lookup(status);
+  const char *tail = e ? e->error_tail[keep_alive] : NULL;
+  if (UNLIKELY(tail == NULL)) {
+    // Not one of the canned statuses: build the page on the spot.
+    char body[2048];
+    int blen = error_page_body(body, sizeof(body), status, response_status_reason(status));
+    if (blen > 0 && response_write_head(buf, status, STR("text/html"), (u64)blen, STR_NULL,
+                                        keep_alive) &&
+        buf_writable(buf) >= (usize)blen) {
+      memcpy(buf_write_ptr(buf), body, (usize)blen);
+      buf_produce(buf, (usize)blen);
+    }
+    return;
   }
-  if (blen > 0 && buf_writable(buf) >= (usize)blen) {
-    memcpy(buf_write_ptr(buf), body, (usize)blen);
-    buf_produce(buf, (usize)blen);
+
+  str_t date = response_date_line();
+  usize tail_len = e->error_tail_len[keep_alive];
+  if (buf_writable(buf) < e->line_len + date.len + tail_len)
+    return;
+  u8 *p = buf_write_ptr(buf);
+  memcpy(p, e->line, e->line_len);
+  memcpy(p + e->line_len, date.ptr, date.len);
+  memcpy(p + e->line_len + date.len, tail, tail_len);
+  buf_produce(buf, e->line_len + date.len + tail_len);
+}
+
+void response_send_continue(conn_t *conn) {
+  status_entry_t *e = status_lookup(100);
+  if (conn->fd < 0 || !e || buf_writable(&conn->wbuf) < e->line_len + 2)
+    return;
+  u8 *p = buf_write_ptr(&conn->wbuf);
+  memcpy(p, e->line, e->line_len);
+  memcpy(p + e->line_len, "\r\n", 2);
+  buf_produce(&conn->wbuf, e->line_len + 2);
+  conn_flush(conn);
+}
+
+void response_send_error(conn_t *conn, int status, bool keep_alive) {
+  status_entry_t *e = status_lookup(status);
+  // Stream connections hand wbuf to the HTTP/2 layer as text, so they always get a copy.
+  if (conn->h2_stream || !e || !e->error_tail[keep_alive]) {
+    response_write_error(&conn->wbuf, status, keep_alive);
+    return;
   }
+
+  str_t date = response_date_line();
+  if (buf_writable(&conn->wbuf) < e->line_len + date.len)
+    return;
+  u8 *p = buf_write_ptr(&conn->wbuf);
+  memcpy(p, e->line, e->line_len);
+  memcpy(p + e->line_len, date.ptr, date.len);
+  buf_produce(&conn->wbuf, e->line_len + date.len);
+  conn->wref = (const u8 *)e->error_tail[keep_alive];
+  conn->wref_len = e->error_tail_len[keep_alive];
 }
@@ -1,11 +1,13 @@
 #ifndef NPROXY_RESPONSE_H
 #define NPROXY_RESPONSE_H
 
+#include "core/config.h"
 #include "core/memory.h"
 #include "core/string_util.h"
 #include "core/types.h"
 #include "http/parser.h"
 #include "net/buffer.h"
+#include "net/conn.h"
 
 typedef struct {
   int status;
@@ -21,8 +23,42 @@ http_response_t *response_create(arena_t *arena);
 void response_set_header(http_response_t *r, arena_t *arena, const char *name, const char *value);
 np_status_t response_serialize(http_response_t *r, np_buf_t *buf);
 
+// Builds the status lines and canned error responses, including the operator's error_page
+// files; each worker calls it once at startup.
+void response_init(const np_config_t *cfg);
+
+// "HTTP/1.1 <status> <reason>\r\n", precomputed for the statuses nproxy knows about.
+str_t response_status_line(int status);
+// "Date: ...\r\n" for the current second, reformatted at most once a second.
+str_t response_date_line(void);
+
+// content_length for a body sent with Transfer-Encoding: chunked.
+#define RESPONSE_CHUNKED UINT64_MAX
+
+// Writes a complete head for a response of known length, or a chunked one; `extra` holds any
+// further header lines. Returns false, writing nothing, when `buf` lacks room.
+bool response_write_head(np_buf_t *buf, int status, str_t content_type, u64 content_length,
+                         str_t extra, bool keep_alive);
+
+// Everything write_head() puts after the Date line: Content-Type, Content-Length or chunked
+// framing, `extra` and Connection. Responses that never change can format it once and send it
+// with response_write_tail(). `dst` needs RESPONSE_TAIL_MAX bytes; returns the length.
+#define RESPONSE_TAIL_MAX(content_type_len, extra_len) ((content_type_len) + (extra_len) + 96)
+usize response_format_tail(char *dst, str_t content_type, u64 content_length, str_t extra,
+                           bool keep_alive);
+// Writes a status line, the current Date line and a preformatted tail. Returns false, writing
+// nothing, when `buf` lacks room.
+bool response_write_tail(np_buf_t *buf, int status, const char *tail, usize tail_len);
+
 void response_write_simple(np_buf_t *buf, int status, const char *reason, const char *content_type,
                            const char *body, bool keep_alive);
 void response_write_error(np_buf_t *buf, int status, bool keep_alive);
+// Like response_write_error() on conn->wbuf, but only the status and Date lines are copied:
+// the rest of the canned response is sent straight from memory shared by all connections.
+void response_send_error(conn_t *conn, int status, bool keep_alive);
+// Sends the interim "100 Continue" a client waits for before its body. Whatever the socket
+// does not take at once stays at the front of conn->wbuf.
+void response_send_continue(conn_t *conn);
+const char *response_status_reason(int status);
 
 #endif
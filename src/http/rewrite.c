@@ -0,0 +1,909 @@
+#include "http/rewrite.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "core/log.h"
+
+// Rewrite patterns are POSIX extended regexes. They are compiled into instructions for a Pike
+// VM (Thompson NFA simulation): every position of the path is visited once, with no
+// backtracking. Submatches follow leftmost-first priority, which agrees with POSIX
+// leftmost-longest for the usual "^/prefix/(.*)" style of rule.
+
+#define RX_MAX_GROUPS 10  // $0 .. $9
+#define RX_NSLOT (RX_MAX_GROUPS * 2)
+#define RX_MAX_INSTS 16384
+#define RX_MAX_REPEAT 255
+#define REWRITE_MAX_CYCLES 10
+
+typedef enum {
+  RX_CHAR,
+  RX_ANY,
+  RX_CLASS,
+  RX_BOL,
+  RX_EOL,
+  RX_SPLIT,  // try x first, then y
+  RX_JMP,
+  RX_SAVE,   // record the position in capture slot x
+  RX_MATCH,
+} rx_op_t;
+
+typedef struct {
+  u8 op;
+  u8 c;
+  u16 rule;
+  int x, y;  // jump targets, the capture slot, or the class index
+} rx_inst_t;
+
+typedef struct {
+  int start;  // first instruction of the rule's program
+  bool anchored;
+  // Literal the path must start with (anchored rules) or contain (the others).
+  const char *lit;
+  usize lit_len;
+} rx_rule_t;
+
+struct rewrite_set {
+  rx_inst_t *code;
+  int code_len;
+  u8 (*classes)[32];
+  int class_count;
+  rx_rule_t *rules;
+  int rule_count;
+  char *lits;  // storage for the prefilter literals
+};
+
+// ---- Parser: pattern -> syntax tree ----
+
+typedef enum {
+  N_EMPTY,
+  N_CHAR,
+  N_ANY,
+  N_CLASS,
+  N_BOL,
+  N_EOL,
+  N_CAT,
+  N_ALT,
+  N_REP,
+  N_GROUP,
+} rx_ntype_t;
+
+typedef struct {
+  u8 type;
+  u8 c;
+  int a, b;   // children; N_REP keeps its minimum count in b, N_CLASS its class in a
+  int max;    // N_REP maximum count, -1 for unbounded
+  int group;  // capture group number, or -1
+} rx_node_t;
+
+typedef struct {
+  const char *p;
+  int depth;
+  int groups;
+  rx_node_t *nodes;
+  int node_count;
+  struct rewrite_set *set;
+  const char *err;
+} rx_parser_t;
+
+static int new_node(rx_parser_t *ps, rx_ntype_t type, int a, int b) {
+  if (ps->node_count % 64 == 0) {
+    rx_node_t *n = realloc(ps->nodes, sizeof(*n) * (usize)(ps->node_count + 64));
+    if (!n) {
+      ps->err = "out of memory";
+      return -1;
+    }
+    ps->nodes = n;
+  }
+  rx_node_t *n = &ps->nodes[ps->node_count];
+  *n = (rx_node_t){.type = (u8)type, .a = a, .b = b, .max = -1, .group = -1};
+  return ps->node_count++;
+}
+
+static int new_class(rx_parser_t *ps) {
+  struct rewrite_set *set = ps->set;
+  if (set->class_count % 16 == 0) {
+    u8(*c)[32] = realloc(set->classes, sizeof(*c) * (usize)(set->class_count + 16));
+    if (!c) {
+      ps->err = "out of memory";
+      return -1;
+    }
+    set->classes = c;
+  }
+  memset(set->classes[set->class_count], 0, 32);
+  return set->class_count++;
+}
+
+static inline void bit_set(u8 *bits, u8 c) { bits[c >> 3] |= (u8)(1u << (c & 7)); }
+static inline bool bit_test(const u8 *bits, u8 c) { return bits[c >> 3] & (1u << (c & 7)); }
+
+static bool named_class(u8 *bits, const char *name, usize len) {
+  static const struct {
+    const char *name;
+    const char *members;  // ranges as pairs of bytes
+  } table[] = {
+      {"alpha", "azAZ"}, {"digit", "09"}, {"alnum", "azAZ09"}, {"upper", "AZ"},
+      {"lower", "az"},   {"space", "\t\r  "}, {"blank", "\t\t  "}, {"xdigit", "09afAF"},
+      {"punct", "!/:@[`{~"}, {"print", " ~"}, {"graph", "!~"}, {"cntrl", "\x01\x1f\x7f\x7f"},
+  };
+  for (usize i = 0; i < sizeof(table) / sizeof(table[0]); i++) {
+    if (strlen(table[i].name) != len || memcmp(table[i].name, name, len) != 0)
+      continue;
+    for (const char *m = table[i].members; m[0]; m += 2)
+      for (int c = (u8)m[0]; c <= (u8)m[1]; c++)
+        bit_set(bits, (u8)c);
+    if (strcmp(table[i].name, "cntrl") == 0)
+      bit_set(bits, 0);
+    return true;
+  }
+  return false;
+}
+
+// Bracket expression; ps->p is just past the '['.
+static int parse_class(rx_parser_t *ps) {
+  int cls = new_class(ps);
+  if (cls < 0)
+    return -1;
+  u8 *bits = ps->set->classes[cls];
+  bool negate = false;
+  if (*ps->p == '^') {
+    negate = true;
+    ps->p++;
+  }
+  bool first = true;
+  for (;;) {
+    const char *p = ps->p;
+    if (*p == '\0') {
+      ps->err = "unterminated bracket expression";
+      return -1;
+    }
+    if (*p == ']' && !first)
+      break;
+    first = false;
+
+    u8 lo;
+    if (p[0] == '[' && (p[1] == ':' || p[1] == '=' || p[1] == '.')) {
+      char kind = p[1];
+      const char *end = strchr(p + 2, kind);
+      if (!end || end[1] != ']') {
+        ps->err = "bad bracket expression";
+        return -1;
+      }
+      if (kind == ':') {
+        if (!named_class(bits, p + 2, (usize)(end - p - 2))) {
+          ps->err = "unknown character class";
+          return -1;
+        }
+        ps->p = end + 2;
+        continue;
+      }
+      // Only single-character collating elements exist in the C locale.
+      if (end - p != 3) {
+        ps->err = "unsupported collating element";
+        return -1;
+      }
+      lo = (u8)p[2];
+      ps->p = end + 2;
+    } else {
+      lo = (u8)*p;
+      ps->p = p + 1;
+    }
+
+    u8 hi = lo;
+    if (ps->p[0] == '-' && ps->p[1] != ']' && ps->p[1] != '\0') {
+      hi = (u8)ps->p[1];
+      ps->p += 2;
+      if (hi < lo) {
+        ps->err = "invalid range";
+        return -1;
+      }
+    }
+    for (int c = lo; c <= hi; c++)
+      bit_set(bits, (u8)c);
+  }
+  ps->p++;  // ']'
+  if (negate)
+    for (int i = 0; i < 32; i++)
+      bits[i] = (u8)~bits[i];
+
+  int n = new_node(ps, N_CLASS, cls, 0);
+  return n;
+}
+
+static int parse_alt(rx_parser_t *ps);
+
+// The GNU escapes \w \W \s \S, which patterns written against glibc may use.
+static int escape_class(rx_parser_t *ps, char e) {
+  int cls = new_class(ps);
+  if (cls < 0)
+    return -1;
+  u8 *bits = ps->set->classes[cls];
+  if (e == 'w' || e == 'W') {
+    named_class(bits, "alnum", 5);
+    bit_set(bits, '_');
+  } else {
+    named_class(bits, "space", 5);
+    bit_set(bits, '\n');
+    bit_set(bits, '\v');
+    bit_set(bits, '\f');
+  }
+  if (e == 'W' || e == 'S')
+    for (int i = 0; i < 32; i++)
+      bits[i] = (u8)~bits[i];
+  return new_node(ps, N_CLASS, cls, 0);
+}
+
+static int parse_atom(rx_parser_t *ps) {
+  char c = *ps->p++;
+  switch (c) {
+  case '(': {
+    int group = ++ps->groups;
+    ps->depth++;
+    int inner = parse_alt(ps);
+    if (inner < 0)
+      return -1;
+    if (*ps->p != ')') {
+      ps->err = "missing ')'";
+      return -1;
+    }
+    ps->p++;
+    ps->depth--;
+    int n = new_node(ps, N_GROUP, inner, 0);
+    if (n >= 0)
+      ps->nodes[n].group = group < RX_MAX_GROUPS ? group : -1;
+    return n;
+  }
+  case '[':
+    return parse_class(ps);
+  case '.':
+    return new_node(ps, N_ANY, 0, 0);
+  case '^':
+    return new_node(ps, N_BOL, 0, 0);
+  case '$':
+    return new_node(ps, N_EOL, 0, 0);
+  case '*':
+  case '+':
+  case '?':
+    ps->err = "repetition operator without an operand";
+    return -1;
+  case '\\': {
+    char e = *ps->p;
+    if (e == '\0') {
+      ps->err = "trailing backslash";
+      return -1;
+    }
+    ps->p++;
+    if (e == 'w' || e == 'W' || e == 's' || e == 'S')
+      return escape_class(ps, e);
+    if ((e >= '1' && e <= '9') || e == 'b' || e == 'B' || e == '<' || e == '>') {
+      ps->err = "backreferences and word boundaries are not supported";
+      return -1;
+    }
+    c = e;
+    break;
+  }
+  default:
+    break;
+  }
+  int n = new_node(ps, N_CHAR, 0, 0);
+  if (n >= 0)
+    ps->nodes[n].c = (u8)c;
+  return n;
+}
+
+// "{n}", "{n,}" or "{n,m}" at ps->p; false (and nothing consumed) if it is not a bound.
+static bool parse_bound(rx_parser_t *ps, int *min, int *max) {
+  const char *p = ps->p + 1;
+  if (*p < '0' || *p > '9')
+    return false;
+  long lo = strtol(p, (char **)&p, 10), hi = lo;
+  if (*p == ',') {
+    p++;
+    hi = -1;
+    if (*p >= '0' && *p <= '9')
+      hi = strtol(p, (char **)&p, 10);
+  }
+  if (*p != '}')
+    return false;
+  if (lo > RX_MAX_REPEAT || hi > RX_MAX_REPEAT || (hi >= 0 && hi < lo)) {
+    ps->err = "invalid repetition count";
+    return false;
+  }
+  ps->p = p + 1;
+  *min = (int)lo;
+  *max = (int)hi;
+  return true;
+}
+
+static int parse_repeat(rx_parser_t *ps) {
+  int atom = parse_atom(ps);
+  while (atom >= 0) {
+    int min, max;
+    char c = *ps->p;
+    if (c == '*') {
+      min = 0, max = -1;
+    } else if (c == '+') {
+      min = 1, max = -1;
+    } else if (c == '?') {
+      min = 0, max = 1;
+    } else if (c == '{') {
+      if (!parse_bound(ps, &min, &max))
+        return ps->err ? -1 : atom;
+      atom = new_node(ps, N_REP, atom, min);
+      if (atom >= 0)
+        ps->nodes[atom].max = max;
+      continue;
+    } else {
+      break;
+    }
+    ps->p++;
+    atom = new_node(ps, N_REP, atom, min);
+    if (atom >= 0)
+      ps->nodes[atom].max = max;
+  }
+  return atom;
+}
+
+static int parse_concat(rx_parser_t *ps) {
+  int left = -1;
+  while (*ps->p && *ps->p != '|' && !(*ps->p == ')' && ps->depth > 0)) {
+    int right = parse_repeat(ps);
+    if (right < 0)
+      return -1;
+    left = left < 0 ? right : new_node(ps, N_CAT, left, right);
+    if (left < 0)
+      return -1;
+  }
+  return left < 0 ? new_node(ps, N_EMPTY, 0, 0) : left;
+}
+
+static int parse_alt(rx_parser_t *ps) {
+  int left = parse_concat(ps);
+  while (left >= 0 && *ps->p == '|') {
+    ps->p++;
+    int right = parse_concat(ps);
+    if (right < 0)
+      return -1;
+    left = new_node(ps, N_ALT, left, right);
+  }
+  return left;
+}
+
+// ---- Code generation ----
+
+typedef struct {
+  struct rewrite_set *set;
+  const rx_node_t *nodes;
+  u16 rule;
+  int cap;
+} rx_gen_t;
+
+static int emit(rx_gen_t *g, rx_op_t op, int x, int y) {
+  struct rewrite_set *set = g->set;
+  if (set->code_len >= RX_MAX_INSTS)
+    return -1;
+  if (set->code_len == g->cap) {
+    int cap = g->cap ? g->cap * 2 : 256;
+    rx_inst_t *code = realloc(set->code, sizeof(*code) * (usize)cap);
+    if (!code)
+      return -1;
+    set->code = code;
+    g->cap = cap;
+  }
+  set->code[set->code_len] = (rx_inst_t){.op = (u8)op, .rule = g->rule, .x = x, .y = y};
+  return set->code_len++;
+}
+
+static bool gen(rx_gen_t *g, int idx) {
+  const rx_node_t *n = &g->nodes[idx];
+  rx_inst_t *code;
+  int pc;
+  switch (n->type) {
+  case N_EMPTY:
+    return true;
+  case N_CHAR:
+    if ((pc = emit(g, RX_CHAR, 0, 0)) < 0)
+      return false;
+    g->set->code[pc].c = n->c;
+    return true;
+  case N_ANY:
+    return emit(g, RX_ANY, 0, 0) >= 0;
+  case N_CLASS:
+    return emit(g, RX_CLASS, n->a, 0) >= 0;
+  case N_BOL:
+    return emit(g, RX_BOL, 0, 0) >= 0;
+  case N_EOL:
+    return emit(g, RX_EOL, 0, 0) >= 0;
+  case N_CAT:
+    return gen(g, n->a) && gen(g, n->b);
+  case N_GROUP:
+    if (n->group < 0)
+      return gen(g, n->a);
+    return emit(g, RX_SAVE, n->group * 2, 0) >= 0 && gen(g, n->a) &&
+           emit(g, RX_SAVE, n->group * 2 + 1, 0) >= 0;
+  case N_ALT: {
+    int split = emit(g, RX_SPLIT, 0, 0);
+    if (split < 0 || !gen(g, n->a))
+      return false;
+    int jmp = emit(g, RX_JMP, 0, 0);
+    if (jmp < 0)
+      return false;
+    code = g->set->code;
+    code[split].x = split + 1;
+    code[split].y = g->set->code_len;
+    if (!gen(g, n->b))
+      return false;
+    g->set->code[jmp].x = g->set->code_len;
+    return true;
+  }
+  case N_REP: {
+    int min = n->b, max = n->max;
+    int body = n->a;
+    if (max < 0 && min > 0) {
+      // e{n,}: n-1 copies, then "L: e; SPLIT L, next".
+      for (int i = 0; i < min - 1; i++)
+        if (!gen(g, body))
+          return false;
+      int loop = g->set->code_len;
+      if (!gen(g, body) || (pc = emit(g, RX_SPLIT, loop, 0)) < 0)
+        return false;
+      g->set->code[pc].y = pc + 1;
+      return true;
+    }
+    for (int i = 0; i < min; i++)
+      if (!gen(g, body))
+        return false;
+    if (max < 0) {
+      // e*: "L: SPLIT body, end; body: e; JMP L"
+      int split = emit(g, RX_SPLIT, 0, 0);
+      if (split < 0 || !gen(g, body) || emit(g, RX_JMP, split, 0) < 0)
+        return false;
+      g->set->code[split].x = split + 1;
+      g->set->code[split].y = g->set->code_len;
+      return true;
+    }
+    // Optional copies all skip to the same end: "SPLIT b1, end; b1: e; SPLIT b2, end; ..."
+    int first = g->set->code_len;
+    for (int i = min; i < max; i++) {
+      int split = emit(g, RX_SPLIT, 0, -1);
+      if (split < 0)
+        return false;
+      g->set->code[split].x = split + 1;
+      if (!gen(g, body))
+        return false;
+    }
+    code = g->set->code;
+    for (int i = first; i < g->set->code_len; i++)
+      if (code[i].op == RX_SPLIT && code[i].y == -1)
+        code[i].y = g->set->code_len;
+    return true;
+  }
+  }
+  return false;
+}
+
+// Collects the leading literal after '^' (anchored), or the longest literal run of the
+// top-level concatenation otherwise. Alternation at the top level yields no literal.
+static void flatten(const rx_node_t *nodes, int idx, int *out, int *count, int cap) {
+  if (nodes[idx].type == N_CAT) {
+    flatten(nodes, nodes[idx].a, out, count, cap);
+    flatten(nodes, nodes[idx].b, out, count, cap);
+  } else if (*count < cap) {
+    out[(*count)++] = idx;
+  }
+}
+
+static void prefilter(const rx_node_t *nodes, int root, rx_rule_t *r, char *lit) {
+  int seq[CONFIG_MAX_STR];
+  int count = 0;
+  flatten(nodes, root, seq, &count, CONFIG_MAX_STR);
+
+  r->anchored = count > 0 && nodes[seq[0]].type == N_BOL;
+  r->lit = lit;
+  r->lit_len = 0;
+  if (r->anchored) {
+    for (int i = 1; i < count && nodes[seq[i]].type == N_CHAR; i++)
+      lit[r->lit_len++] = (char)nodes[seq[i]].c;
+    return;
+  }
+  usize run = 0;
+  for (int i = 0; i <= count; i++) {
+    if (i < count && nodes[seq[i]].type == N_CHAR) {
+      run++;
+      continue;
+    }
+    if (run > r->lit_len) {
+      r->lit_len = run;
+      for (usize k = 0; k < run; k++)
+        lit[k] = (char)nodes[seq[i - run + k]].c;
+    }
+    run = 0;
+  }
+}
+
+np_status_t rewrite_compile(np_server_config_t *srv) {
+  if (srv->rewrite.count == 0)
+    return NP_OK;
+
+  struct rewrite_set *set = calloc(1, sizeof(*set));
+  if (!set)
+    return NP_ERR_NOMEM;
+  srv->rewrite.compiled = set;
+  set->rules = calloc((usize)srv->rewrite.count, sizeof(*set->rules));
+  set->lits = malloc((usize)srv->rewrite.count * CONFIG_MAX_STR);
+  if (!set->rules || !set->lits)
+    return NP_ERR_NOMEM;
+
+  rx_gen_t g = {.set = set};
+  for (int i = 0; i < srv->rewrite.count; i++) {
+    const rewrite_rule_t *rule = &srv->rewrite.rules[i];
+    rx_parser_t ps = {.p = rule->pattern, .set = set};
+    int root = parse_alt(&ps);
+    if (root >= 0 && *ps.p != '\0')
+      ps.err = "unmatched ')'";
+    if (root < 0 || ps.err) {
+      log_error("config: rewrite '%s': %s", rule->pattern, ps.err ? ps.err : "invalid pattern");
+      free(ps.nodes);
+      return NP_ERR_CONFIG;
+    }
+
+    rx_rule_t *r = &set->rules[i];
+    prefilter(ps.nodes, root, r, set->lits + (usize)i * CONFIG_MAX_STR);
+    r->start = set->code_len;
+    g.nodes = ps.nodes;
+    g.rule = (u16)i;
+    bool ok = emit(&g, RX_SAVE, 0, 0) >= 0 && gen(&g, root) && emit(&g, RX_SAVE, 1, 0) >= 0 &&
+              emit(&g, RX_MATCH, 0, 0) >= 0;
+    free(ps.nodes);
+    if (!ok) {
+      log_error("config: rewrite '%s' is too large", rule->pattern);
+      return NP_ERR_CONFIG;
+    }
+  }
+  set->rule_count = srv->rewrite.count;
+  return NP_OK;
+}
+
+void rewrite_free(np_server_config_t *srv) {
+  struct rewrite_set *set = srv->rewrite.compiled;
+  if (set) {
+    free(set->code);
+    free(set->classes);
+    free(set->rules);
+    free(set->lits);
+    free(set);
+  }
+  free(srv->rewrite.rules);
+  srv->rewrite.rules = NULL;
+  srv->rewrite.count = 0;
+  srv->rewrite.compiled = NULL;
+}
+
+// ---- Pike VM ----
+
+typedef struct {
+  int *dense;
+  int *sparse;
+  int *caps;  // RX_NSLOT per dense entry
+  int n;
+} rx_list_t;
+
+// Workers are single-threaded, so the thread lists are shared by every set in the process and
+// grown to the largest program seen.
+static struct {
+  rx_list_t lists[2];
+  int cap;
+} scratch;
+
+static bool scratch_reserve(int n) {
+  if (n <= scratch.cap)
+    return true;
+  for (int i = 0; i < 2; i++) {
+    rx_list_t *l = &scratch.lists[i];
+    int *d = realloc(l->dense, sizeof(int) * (usize)n);
+    if (d)
+      l->dense = d;
+    int *s = realloc(l->sparse, sizeof(int) * (usize)n);
+    if (s)
+      l->sparse = s;
+    int *c = realloc(l->caps, sizeof(int) * RX_NSLOT * (usize)n);
+    if (c)
+      l->caps = c;
+    if (!d || !s || !c)
+      return false;
+    // Stale sparse entries are harmless once the list is reset, but must be initialized.
+    memset(l->sparse, 0, sizeof(int) * (usize)n);
+  }
+  scratch.cap = n;
+  return true;
+}
+
+static inline bool list_has(const rx_list_t *l, int pc) {
+  int i = l->sparse[pc];
+  return i < l->n && l->dense[i] == pc;
+}
+
+static inline int list_add(rx_list_t *l, int pc) {
+  l->sparse[pc] = l->n;
+  l->dense[l->n] = pc;
+  return l->n++;
+}
+
+// Follows the empty transitions from `pc`; with `caps` set, records the submatches each
+// thread carries. `caps` is restored before returning.
+static void add_thread(const struct rewrite_set *set, rx_list_t *l, int pc, usize pos, usize len,
+                       int *caps) {
+  if (list_has(l, pc))
+    return;
+  int i = list_add(l, pc);
+  const rx_inst_t *in = &set->code[pc];
+  switch (in->op) {
+  case RX_JMP:
+    add_thread(set, l, in->x, pos, len, caps);
+    break;
+  case RX_SPLIT:
+    add_thread(set, l, in->x, pos, len, caps);
+    add_thread(set, l, in->y, pos, len, caps);
+    break;
+  case RX_SAVE:
+    if (caps) {
+      int old = caps[in->x];
+      caps[in->x] = (int)pos;
+      add_thread(set, l, pc + 1, pos, len, caps);
+      caps[in->x] = old;
+    } else {
+      add_thread(set, l, pc + 1, pos, len, caps);
+    }
+    break;
+  case RX_BOL:
+    if (pos == 0)
+      add_thread(set, l, pc + 1, pos, len, caps);
+    break;
+  case RX_EOL:
+    if (pos == len)
+      add_thread(set, l, pc + 1, pos, len, caps);
+    break;
+  default:
+    if (caps)
+      memcpy(&l->caps[i * RX_NSLOT], caps, sizeof(int) * RX_NSLOT);
+    break;
+  }
+}
+
+static inline bool consumes(const struct rewrite_set *set, const rx_inst_t *in, u8 c) {
+  switch (in->op) {
+  case RX_CHAR:
+    return in->c == c;
+  case RX_ANY:
+    return true;
+  case RX_CLASS:
+    return bit_test(set->classes[in->x], c);
+  default:
+    return false;
+  }
+}
+
+// `present` has a bit for every byte value that occurs in the path.
+static bool passes_prefilter(const rx_rule_t *r, str_t path, const u8 *present) {
+  if (r->lit_len == 0)
+    return true;
+  if (r->anchored)
+    return path.len >= r->lit_len && memcmp(path.ptr, r->lit, r->lit_len) == 0;
+  for (usize i = 0; i < r->lit_len; i++)
+    if (!bit_test(present, (u8)r->lit[i]))
+      return false;
+  // Literals are short and paths shorter still: scanning for the first byte beats memmem's
+  // setup cost.
+  const char *p = path.ptr, *end = path.ptr + path.len;
+  while ((usize)(end - p) >= r->lit_len && (p = memchr(p, r->lit[0], (usize)(end - p)))) {
+    if ((usize)(end - p) < r->lit_len)
+      break;
+    if (memcmp(p + 1, r->lit + 1, r->lit_len - 1) == 0)
+      return true;
+    p++;
+  }
+  return false;
+}
+
+// Fills `cand` with the rules whose prefilter passes, in order; returns how many.
+static int candidates(const struct rewrite_set *set, str_t path, int *cand) {
+  u8 present[32] = {0};
+  for (usize i = 0; i < path.len; i++)
+    bit_set(present, (u8)path.ptr[i]);
+
+  int ncand = 0;
+  for (int i = 0; i < set->rule_count; i++)
+    if (passes_prefilter(&set->rules[i], path, present))
+      cand[ncand++] = i;
+  return ncand;
+}
+
+// One pass over `path` for all candidate rules at once, tracking only which instructions are
+// live. Returns the lowest-numbered rule that matches, or -1.
+static int match_any(const struct rewrite_set *set, str_t path, const int *cand, int ncand) {
+  rx_list_t *cl = &scratch.lists[0], *nl = &scratch.lists[1];
+  cl->n = 0;
+  int best = set->rule_count;
+  const u8 *s = (const u8 *)path.ptr;
+  for (usize pos = 0;; pos++) {
+    bool restart = false;
+    for (int k = 0; k < ncand && cand[k] < best; k++) {
+      const rx_rule_t *r = &set->rules[cand[k]];
+      if (r->anchored && pos > 0)
+        continue;
+      add_thread(set, cl, r->start, pos, path.len, NULL);
+      restart |= !r->anchored;
+    }
+    if (cl->n == 0 && !restart)
+      break;
+
+    nl->n = 0;
+    for (int i = 0; i < cl->n; i++) {
+      const rx_inst_t *in = &set->code[cl->dense[i]];
+      if (in->rule >= best)
+        continue;
+      if (in->op == RX_MATCH)
+        best = in->rule;
+      else if (pos < path.len && consumes(set, in, s[pos]))
+        add_thread(set, nl, cl->dense[i] + 1, pos + 1, path.len, NULL);
+    }
+    rx_list_t *t = cl;
+    cl = nl;
+    nl = t;
+    if (pos == path.len)
+      break;
+  }
+  return best < set->rule_count ? best : -1;
+}
+
+// Runs rule `r` alone with submatch tracking; fills caps with byte offsets (-1 if unset).
+static bool match_captures(const struct rewrite_set *set, int r, str_t path, int *caps) {
+  rx_list_t *cl = &scratch.lists[0], *nl = &scratch.lists[1];
+  cl->n = 0;
+  const rx_rule_t *rule = &set->rules[r];
+  const u8 *s = (const u8 *)path.ptr;
+  int init[RX_NSLOT];
+  bool matched = false;
+
+  for (usize pos = 0;; pos++) {
+    if (!matched && (!rule->anchored || pos == 0)) {
+      for (int i = 0; i < RX_NSLOT; i++)
+        init[i] = -1;
+      add_thread(set, cl, rule->start, pos, path.len, init);
+    }
+    if (cl->n == 0)
+      break;
+
+    nl->n = 0;
+    for (int i = 0; i < cl->n; i++) {
+      int pc = cl->dense[i];
+      const rx_inst_t *in = &set->code[pc];
+      int *tcaps = &cl->caps[i * RX_NSLOT];
+      if (in->op == RX_MATCH) {
+        memcpy(caps, tcaps, sizeof(int) * RX_NSLOT);
+        matched = true;
+        break;  // lower-priority threads can only give a worse match
+      }
+      if (pos < path.len && consumes(set, in, s[pos]))
+        add_thread(set, nl, pc + 1, pos + 1, path.len, tcaps);
+    }
+    rx_list_t *t = cl;
+    cl = nl;
+    nl = t;
+    if (pos == path.len)
+      break;
+  }
+  return matched;
+}
+
+// ---- Replacement ----
+
+typedef struct {
+  char *buf;
+  usize len, cap;
+} uri_buf_t;
+
+static bool put(uri_buf_t *b, const char *s, usize n) {
+  if (b->len + n > b->cap)
+    return false;
+  memcpy(b->buf + b->len, s, n);
+  b->len += n;
+  return true;
+}
+
+// Expands $0-$9 and $args into "path[?args]". Arguments from the replacement come first and
+// the original query is appended after them, unless the replacement ends in '?'.
+static bool expand(const rewrite_rule_t *rule, str_t path, str_t query, const int *caps,
+                   uri_buf_t *b, usize *path_len, bool *has_query) {
+  const char *r = rule->replacement;
+  usize rlen = strlen(r);
+  const char *qmark = memchr(r, '?', rlen);
+  bool keep_args = true;
+  if (qmark && r[rlen - 1] == '?') {
+    keep_args = false;
+    rlen--;
+  }
+
+  *path_len = 0;
+  *has_query = false;
+  for (usize i = 0; i < rlen; i++) {
+    if (r + i == qmark) {
+      *path_len = b->len;
+      *has_query = true;
+      if (!put(b, "?", 1))
+        return false;
+      continue;
+    }
+    if (r[i] == '$' && i + 1 < rlen && r[i + 1] >= '0' && r[i + 1] <= '9') {
+      int g = r[i + 1] - '0';
+      if (caps[g * 2] >= 0 && caps[g * 2 + 1] >= 0 &&
+          !put(b, path.ptr + caps[g * 2], (usize)(caps[g * 2 + 1] - caps[g * 2])))
+        return false;
+      i++;
+    } else if (r[i] == '$' && rlen - i >= 5 && memcmp(r + i + 1, "args", 4) == 0) {
+      if (query.len > 0 && !put(b, query.ptr, query.len))
+        return false;
+      i += 4;
+    } else if (!put(b, r + i, 1)) {
+      return false;
+    }
+  }
+  if (!*has_query)
+    *path_len = b->len;
+
+  if (keep_args && query.ptr) {
+    if (!*has_query) {
+      *has_query = true;
+      if (!put(b, "?", 1))
+        return false;
+    } else if (b->len > *path_len + 1 && query.len > 0 && !put(b, "&", 1)) {
+      return false;
+    }
+    if (!put(b, query.ptr, query.len))
+      return false;
+  }
+  return true;
+}
+
+np_status_t rewrite_apply(const np_server_config_t *srv, http_request_t *req, arena_t *arena) {
+  const struct rewrite_set *set = srv->rewrite.compiled;
+  if (!set)
+    return NP_OK;
+  if (!scratch_reserve(set->code_len))
+    return NP_ERR_NOMEM;
+
+  for (int cycle = 0; cycle < REWRITE_MAX_CYCLES; cycle++) {
+    int cand[CONFIG_MAX_REWRITES];
+    int ncand = candidates(set, req->path, cand);
+    if (ncand == 0)
+      return NP_OK;
+    // A single candidate needs no combined pass: the capture pass alone decides.
+    int r = ncand == 1 ? cand[0] : match_any(set, req->path, cand, ncand);
+    int caps[RX_NSLOT];
+    if (r < 0 || !match_captures(set, r, req->path, caps))
+      return NP_OK;
+
+    const rewrite_rule_t *rule = &srv->rewrite.rules[r];
+    char tmp[NP_MAX_URI_LEN];
+    uri_buf_t b = {.buf = tmp, .cap = sizeof(tmp)};
+    usize path_len;
+    bool has_query;
+    if (!expand(rule, req->path, req->query, caps, &b, &path_len, &has_query)) {
+      log_warn("rewrite '%s': result longer than %d bytes", rule->pattern, NP_MAX_URI_LEN);
+      return NP_ERR_NOMEM;
+    }
+    char *uri = arena_alloc(arena, b.len);
+    if (!uri)
+      return NP_ERR_NOMEM;
+    memcpy(uri, tmp, b.len);
+    req->path = (str_t){.ptr = uri, .len = path_len};
+    req->query = has_query ? (str_t){.ptr = uri + path_len + 1, .len = b.len - path_len - 1}
+                           : STR_NULL;
+    log_debug("rewrite '%s' -> " STR_FMT, rule->pattern, (int)b.len, uri);
+
+    if (rule->flag != REWRITE_FLAG_LAST)
+      return NP_OK;
+  }
+  log_error("rewrite cycle: more than %d \"last\" rewrites", REWRITE_MAX_CYCLES);
+  return NP_ERR;
+}
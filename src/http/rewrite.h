@@ -0,0 +1,20 @@
+#ifndef NPROXY_REWRITE_H
+#define NPROXY_REWRITE_H
+
+#include "core/config.h"
+#include "core/memory.h"
+#include "core/types.h"
+#include "http/request.h"
+
+// Compiles the server's rewrite rules into one program. Each rule gets a literal prefilter, and
+// the rules that pass it are tested together in a single backtracking-free pass over the path.
+np_status_t rewrite_compile(np_server_config_t *srv);
+void rewrite_free(np_server_config_t *srv);
+
+// Rewrites req->path and req->query with the first matching rule; the new URI is allocated
+// from `arena`. A "last" rule starts the rules over on its result. Returns NP_OK whether or
+// not anything matched, NP_ERR if "last" rules keep cycling, NP_ERR_NOMEM if the arena or the
+// URI buffer ran out.
+np_status_t rewrite_apply(const np_server_config_t *srv, http_request_t *req, arena_t *arena);
+
+#endif
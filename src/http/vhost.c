@@ -0,0 +1,311 @@
+#include "http/vhost.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "core/log.h"
+
+#define VHOST_MAX_LABELS 128
+
+typedef struct {
+  const char *name;  // lowercase; NULL for an empty slot
+  usize len;
+  u32 hash;
+  int server;
+} vhost_entry_t;
+
+// One DNS label of a wildcard name. Children are sorted so lookups can binary-search them.
+typedef struct vhost_node {
+  const char *label;
+  usize len;
+  int server;  // wildcard server ending at this label, or -1
+  struct vhost_node *children;
+  int child_count;
+} vhost_node_t;
+
+struct vhost_table {
+  vhost_entry_t *slots;  // open addressing, power-of-two size, at most half full
+  usize mask;
+  vhost_node_t head;  // "*.example.com", walked from the last label
+  vhost_node_t tail;  // "www.example.*", walked from the first label
+  char *names;        // lowercased copies of every server_name, split in place
+};
+
+typedef struct {
+  const char *ptr;
+  usize len;
+} label_t;
+
+static inline u8 lower(u8 c) { return c >= 'A' && c <= 'Z' ? (u8)(c + 32) : c; }
+
+static u32 host_hash(const char *s, usize len) {
+  u32 h = 2166136261u;
+  for (usize i = 0; i < len; i++) {
+    h ^= lower((u8)s[i]);
+    h *= 16777619u;
+  }
+  return h;
+}
+
+// Orders a stored (lowercase) label against raw header bytes.
+static int label_cmp(const char *stored, usize slen, const char *raw, usize rlen) {
+  usize n = slen < rlen ? slen : rlen;
+  for (usize i = 0; i < n; i++) {
+    u8 a = (u8)stored[i], b = lower((u8)raw[i]);
+    if (a != b)
+      return a < b ? -1 : 1;
+  }
+  return slen < rlen ? -1 : slen > rlen;
+}
+
+static int child_slot(const vhost_node_t *n, const char *label, usize len, bool *found) {
+  int lo = 0, hi = n->child_count;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    int c = label_cmp(n->children[mid].label, n->children[mid].len, label, len);
+    if (c == 0) {
+      *found = true;
+      return mid;
+    }
+    if (c < 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  *found = false;
+  return lo;
+}
+
+static void node_free(vhost_node_t *n) {
+  for (int i = 0; i < n->child_count; i++)
+    node_free(&n->children[i]);
+  free(n->children);
+}
+
+static np_status_t trie_insert(vhost_node_t *root, const label_t *labels, int count, int server,
+                               const char *name) {
+  vhost_node_t *node = root;
+  for (int i = 0; i < count; i++) {
+    bool found;
+    int slot = child_slot(node, labels[i].ptr, labels[i].len, &found);
+    if (!found) {
+      vhost_node_t *nc = realloc(node->children, sizeof(*nc) * (usize)(node->child_count + 1));
+      if (!nc)
+        return NP_ERR_NOMEM;
+      memmove(nc + slot + 1, nc + slot, sizeof(*nc) * (usize)(node->child_count - slot));
+      nc[slot] = (vhost_node_t){.label = labels[i].ptr, .len = labels[i].len, .server = -1};
+      node->children = nc;
+      node->child_count++;
+    }
+    node = &node->children[slot];
+  }
+  if (node->server >= 0)
+    log_warn("config: duplicate server_name '%s', the first one applies", name);
+  else
+    node->server = server;
+  return NP_OK;
+}
+
+static np_status_t hash_insert(vhost_table_t *t, const char *name, usize len, int server) {
+  u32 h = host_hash(name, len);
+  for (usize i = h & t->mask;; i = (i + 1) & t->mask) {
+    vhost_entry_t *e = &t->slots[i];
+    if (!e->name) {
+      *e = (vhost_entry_t){.name = name, .len = len, .hash = h, .server = server};
+      return NP_OK;
+    }
+    if (e->hash == h && e->len == len && memcmp(e->name, name, len) == 0) {
+      log_warn("config: duplicate server_name '%s', the first one applies", name);
+      return NP_OK;
+    }
+  }
+}
+
+// Splits "a.b.c" into labels, last label first when `reverse` is set. Returns -1 on an empty
+// label or too many of them.
+static int split_labels(const char *s, usize len, bool reverse, label_t *out) {
+  int count = 0;
+  usize start = 0;
+  for (usize i = 0; i <= len; i++) {
+    if (i < len && s[i] != '.')
+      continue;
+    if (i == start || count == VHOST_MAX_LABELS)
+      return -1;
+    out[count++] = (label_t){s + start, i - start};
+    start = i + 1;
+  }
+  if (reverse) {
+    for (int i = 0; i < count / 2; i++) {
+      label_t tmp = out[i];
+      out[i] = out[count - 1 - i];
+      out[count - 1 - i] = tmp;
+    }
+  }
+  return count;
+}
+
+static np_status_t add_name(vhost_table_t *t, char *name, int server) {
+  usize len = strlen(name);
+  label_t labels[VHOST_MAX_LABELS];
+  vhost_node_t *root = NULL;
+  const char *base = name;
+  usize base_len = len;
+  bool exact_too = false;
+
+  if (len > 2 && name[0] == '*' && name[1] == '.') {
+    root = &t->head;
+    base += 2;
+    base_len -= 2;
+  } else if (len > 2 && name[len - 1] == '*' && name[len - 2] == '.') {
+    root = &t->tail;
+    base_len -= 2;
+  } else if (len > 1 && name[0] == '.') {
+    // ".example.com" is shorthand for "example.com" plus "*.example.com".
+    root = &t->head;
+    base += 1;
+    base_len -= 1;
+    exact_too = true;
+  }
+  if (memchr(base, '*', base_len)) {
+    log_error("config: invalid wildcard server_name '%s'", name);
+    return NP_ERR_CONFIG;
+  }
+  if (!root)
+    return hash_insert(t, name, len, server);
+
+  int count = split_labels(base, base_len, root == &t->head, labels);
+  if (count < 0) {
+    log_error("config: invalid server_name '%s'", name);
+    return NP_ERR_CONFIG;
+  }
+  np_status_t rc = trie_insert(root, labels, count, server, name);
+  if (rc == NP_OK && exact_too)
+    rc = hash_insert(t, base, base_len, server);
+  return rc;
+}
+
+np_status_t vhost_build(np_config_t *cfg) {
+  usize total = 0;
+  usize names = 0;
+  for (int s = 0; s < cfg->server_count; s++) {
+    const char *p = cfg->servers[s].server_name;
+    total += strlen(p) + 1;
+    // Every space could start another name.
+    for (names++; *p; p++)
+      names += *p == ' ';
+  }
+
+  vhost_table_t *t = calloc(1, sizeof(*t));
+  if (!t)
+    return NP_ERR_NOMEM;
+  cfg->vhosts = t;
+  t->head.server = -1;
+  t->tail.server = -1;
+
+  usize size = 16;
+  while (size < names * 2)
+    size <<= 1;
+  t->slots = calloc(size, sizeof(*t->slots));
+  t->names = malloc(total);
+  if (!t->slots || !t->names)
+    return NP_ERR_NOMEM;
+  t->mask = size - 1;
+
+  char *out = t->names;
+  for (int s = 0; s < cfg->server_count; s++) {
+    const char *src = cfg->servers[s].server_name;
+    char *name = out;
+    for (; *src; src++)
+      *out++ = (char)lower((u8)*src);
+    *out++ = '\0';
+
+    // server_name may list several names separated by whitespace.
+    char *save = NULL;
+    for (char *tok = strtok_r(name, " \t", &save); tok; tok = strtok_r(NULL, " \t", &save)) {
+      np_status_t rc = add_name(t, tok, s);
+      if (rc != NP_OK)
+        return rc;
+    }
+  }
+  return NP_OK;
+}
+
+void vhost_free(np_config_t *cfg) {
+  vhost_table_t *t = cfg->vhosts;
+  if (!t)
+    return;
+  node_free(&t->head);
+  node_free(&t->tail);
+  free(t->slots);
+  free(t->names);
+  free(t);
+  cfg->vhosts = NULL;
+}
+
+// Longest wildcard in `root` covering `host`, requiring at least one label beyond it.
+static int trie_find(const vhost_node_t *root, const char *host, usize len, bool from_right) {
+  const vhost_node_t *node = root;
+  int best = -1;
+  usize lo = 0, hi = len;  // the labels not consumed yet
+  while (lo < hi) {
+    usize start, end;
+    if (from_right) {
+      const char *dot = memrchr(host + lo, '.', hi - lo);
+      start = dot ? (usize)(dot - host) + 1 : lo;
+      end = hi;
+    } else {
+      const char *dot = memchr(host + lo, '.', hi - lo);
+      start = lo;
+      end = dot ? (usize)(dot - host) : hi;
+    }
+    bool found;
+    int slot = child_slot(node, host + start, end - start, &found);
+    if (!found)
+      break;
+    node = &node->children[slot];
+    bool more = from_right ? start > lo : end < hi;
+    if (!more)
+      break;
+    if (node->server >= 0)
+      best = node->server;
+    if (from_right)
+      hi = start - 1;
+    else
+      lo = end + 1;
+  }
+  return best;
+}
+
+int vhost_find(const np_config_t *cfg, str_t host) {
+  const vhost_table_t *t = cfg->vhosts;
+  if (!t || !host.ptr)
+    return -1;
+
+  // Drop the port ("[::1]:8080" keeps its brackets) and a trailing root dot.
+  usize len = host.len;
+  if (len > 0 && host.ptr[0] == '[') {
+    const char *rb = memchr(host.ptr, ']', len);
+    if (rb)
+      len = (usize)(rb - host.ptr) + 1;
+  } else {
+    const char *colon = memchr(host.ptr, ':', len);
+    if (colon)
+      len = (usize)(colon - host.ptr);
+  }
+  if (len > 0 && host.ptr[len - 1] == '.')
+    len--;
+  if (len == 0)
+    return -1;
+
+  u32 h = host_hash(host.ptr, len);
+  for (usize i = h & t->mask; t->slots[i].name; i = (i + 1) & t->mask) {
+    const vhost_entry_t *e = &t->slots[i];
+    if (e->hash == h && label_cmp(e->name, e->len, host.ptr, len) == 0)
+      return e->server;
+  }
+
+  int s = trie_find(&t->head, host.ptr, len, true);
+  if (s < 0)
+    s = trie_find(&t->tail, host.ptr, len, false);
+  return s;
+}
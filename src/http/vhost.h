@@ -0,0 +1,18 @@
+#ifndef NPROXY_VHOST_H
+#define NPROXY_VHOST_H
+
+#include "core/config.h"
+#include "core/string_util.h"
+#include "core/types.h"
+
+// Builds the virtual-host index from every server_name: exact names go into a hash table,
+// "*.example.com" and "www.example.*" into label tries walked from the right and the left.
+np_status_t vhost_build(np_config_t *cfg);
+void vhost_free(np_config_t *cfg);
+
+// Index of the server for a raw Host header value, or -1 if no server_name matches. The port
+// and a trailing dot are ignored and the comparison is case-insensitive. An exact name wins,
+// then the longest leading wildcard, then the longest trailing wildcard.
+int vhost_find(const np_config_t *cfg, str_t host);
+
+#endif
@@ -0,0 +1,1022 @@
+#include "http2/h2_conn.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "core/config.h"
+#include "core/log.h"
+#include "http/body.h"
+#include "http/handler.h"
+#include "http/parser.h"
+#include "http/request.h"
+#include "http/response.h"
+#include "http2/h2_frame.h"
+#include "http2/hpack.h"
+#include "net/event_loop.h"
+#include "proc/worker.h"
+#include "proxy/proxy_conn.h"
+#include "static/file_server.h"
+
+#define H2_MAX_HEADER_BLOCK NP_READ_BUF_SIZE
+#define H2_WINDOW_UPDATE_THRESHOLD (H2_DEFAULT_WINDOW / 2)
+#define H2_MAX_TRAILERS 4096
+
+typedef struct h2_session h2_session_t;
+
+typedef struct {
+  h2_session_t *session;
+  conn_t *sc;
+  u32 id;
+  i64 send_window;
+  i64 recv_credit;
+  i64 body_len;
+  np_buf_t *src;
+  http_body_t resp;
+  bool remote_open;
+  bool dispatched;
+  bool dispatching;
+  bool head_sent;
+  bool head_only;
+  bool close_delimited;
+  bool source_done;
+  bool trailers_pending;
+  bool end_sent;
+  bool upstream_blocked;
+} h2_stream_t;
+
+struct h2_session {
+  conn_t *conn;
+  handler_ctx_t *ctx;
+  hpack_table_t hpack;
+  h2_stream_t streams[H2_MAX_STREAMS];
+  int active;
+  int rr;
+  u32 last_stream_id;
+  i64 peer_initial_window;
+  i64 send_window;
+  i64 recv_credit;
+  u8 *hdr_block;
+  usize hdr_len;
+  u32 hdr_stream;
+  bool hdr_end_stream;
+  bool hdr_opens_stream;
+  bool preface_done;
+  bool goaway_received;
+  bool want_write;
+  bool dead;
+  // Stream whose connection is further up the call stack; it must not be released yet.
+  h2_stream_t *pinned;
+};
+
+typedef struct {
+  http_request_t *req;
+  str_t method;
+  str_t path;
+  str_t scheme;
+  str_t authority;
+  bool regular_seen;
+  bool bad;
+} h2_request_builder_t;
+
+static void connection_error(h2_session_t *s, h2_error_t code) {
+  log_debug("h2: connection error %d fd=%d", (int)code, s->conn->fd);
+  h2_frame_put_goaway(&s->conn->wbuf, s->last_stream_id, code);
+  s->dead = true;
+}
+
+static h2_stream_t *find_stream(h2_session_t *s, u32 id) {
+  for (int i = 0; i < H2_MAX_STREAMS; i++) {
+    if (s->streams[i].sc && s->streams[i].id == id)
+      return &s->streams[i];
+  }
+  return NULL;
+}
+
+static h2_stream_t *open_stream(h2_session_t *s, u32 id) {
+  for (int i = 0; i < H2_MAX_STREAMS; i++) {
+    h2_stream_t *st = &s->streams[i];
+    if (st->sc)
+      continue;
+    conn_t *sc = worker_conn_spawn(s->conn);
+    if (!sc)
+      return NULL;
+    memset(st, 0, sizeof(*st));
+    st->session = s;
+    st->sc = sc;
+    st->id = id;
+    st->send_window = s->peer_initial_window;
+    sc->h2_stream = st;
+    sc->keep_alive = true;
+    s->active++;
+    return st;
+  }
+  return NULL;
+}
+
+static void release_stream(h2_session_t *s, h2_stream_t *st) {
+  conn_t *sc = st->sc;
+  st->sc = NULL;
+  s->active--;
+  sc->h2_stream = NULL;
+  worker_conn_release(sc);
+}
+
+static void stream_finish(h2_session_t *s, h2_stream_t *st) {
+  st->end_sent = true;
+  if (st->remote_open) {
+    // The response is complete; the rest of the request body is not needed.
+    h2_frame_put_u32(&s->conn->wbuf, H2_RST_STREAM, st->id, H2_NO_ERROR);
+    st->remote_open = false;
+  }
+  if (s->pinned != st)
+    release_stream(s, st);
+}
+
+static void stream_reset(h2_session_t *s, h2_stream_t *st, h2_error_t code) {
+  h2_frame_put_u32(&s->conn->wbuf, H2_RST_STREAM, st->id, (u32)code);
+  st->remote_open = false;
+  st->end_sent = true;
+  if (s->pinned != st)
+    release_stream(s, st);
+}
+
+static void session_flush(h2_session_t *s) {
+  conn_t *conn = s->conn;
+  isize n;
+  do {
+    n = buf_write_fd(&conn->wbuf, conn->fd);
+  } while (n > 0);
+  if (n == NP_ERR) {
+    s->dead = true;
+    return;
+  }
+
+  bool want = buf_readable(&conn->wbuf) > 0;
+  if (want != s->want_write) {
+    s->want_write = want;
+    worker_client_event_mod(conn, (want ? EV_WRITE : 0) | EV_READ | EV_HUP | EV_EDGE);
+  }
+}
+
+static void send_window_updates(h2_session_t *s) {
+  np_buf_t *out = &s->conn->wbuf;
+  if (s->recv_credit >= H2_WINDOW_UPDATE_THRESHOLD &&
+      h2_frame_put_u32(out, H2_WINDOW_UPDATE, 0, (u32)s->recv_credit) == NP_OK)
+    s->recv_credit = 0;
+
+  for (int i = 0; i < H2_MAX_STREAMS; i++) {
+    h2_stream_t *st = &s->streams[i];
+    if (st->sc && st->remote_open && st->recv_credit >= H2_WINDOW_UPDATE_THRESHOLD &&
+        h2_frame_put_u32(out, H2_WINDOW_UPDATE, st->id, (u32)st->recv_credit) == NP_OK)
+      st->recv_credit = 0;
+  }
+}
+
+static bool is_hop_by_hop(str_t name) {
+  return str_ieq(name, STR("Connection")) || str_ieq(name, STR("Keep-Alive")) ||
+         str_ieq(name, STR("Proxy-Connection")) || str_ieq(name, STR("Transfer-Encoding")) ||
+         str_ieq(name, STR("Upgrade"));
+}
+
+// Parses the HTTP/1 response head the handler produced and queues it as HEADERS (plus
+// CONTINUATION frames when the block exceeds one frame). Returns false while the
+// head is incomplete or the output buffer has no room for it.
+static bool send_response_head(h2_session_t *s, h2_stream_t *st) {
+  conn_t *sc = st->sc;
+  np_buf_t *out = &s->conn->wbuf;
+  if (!st->src)
+    st->src = sc->state == CONN_PROXYING ? &sc->upstream_rbuf : &sc->wbuf;
+
+  for (;;) {
+    np_buf_t *src = st->src;
+    http_response_state_t rs;
+    http_response_state_init(&rs);
+    parse_result_t pr = PARSE_INCOMPLETE;
+    if (buf_readable(src) > 0)
+      pr = http_parse_response(&rs, buf_read_ptr(src), buf_readable(src));
+    if (pr == PARSE_INCOMPLETE) {
+      if (!st->source_done && buf_readable(src) < src->cap)
+        return false;
+      pr = PARSE_ERROR;
+    }
+    if (pr == PARSE_ERROR) {
+      log_warn("h2: stream %u produced no valid response head", st->id);
+      buf_reset(&sc->wbuf);
+      response_write_error(&sc->wbuf, 502, true);
+      st->src = &sc->wbuf;
+      st->source_done = true;
+      continue;
+    }
+    // Interim responses (100 Continue) are not forwarded.
+    if (rs.status < 200) {
+      buf_consume(src, rs.body_offset);
+      continue;
+    }
+
+    usize cap = 16;
+    for (int i = 0; i < rs.header_count; i++)
+      cap += rs.headers[i].name.len + rs.headers[i].value.len + 12;
+    u8 *block = arena_alloc(sc->arena, cap);
+    if (!block) {
+      stream_reset(s, st, H2_INTERNAL_ERROR);
+      return true;
+    }
+    usize len = hpack_encode_status(block, cap, rs.status);
+    for (int i = 0; i < rs.header_count; i++) {
+      if (is_hop_by_hop(rs.headers[i].name))
+        continue;
+      len += hpack_encode_header(block + len, cap - len, rs.headers[i].name, rs.headers[i].value);
+    }
+
+    usize frames = (len + H2_DEFAULT_FRAME_SIZE - 1) / H2_DEFAULT_FRAME_SIZE;
+    if (frames == 0)
+      frames = 1;
+    if (buf_writable(out) < len + frames * H2_FRAME_HEADER_LEN)
+      buf_compact(out);
+    if (buf_writable(out) < len + frames * H2_FRAME_HEADER_LEN)
+      return false;
+
+    bool no_body = st->head_only || rs.status == 204 || rs.status == 304 ||
+                   (!rs.chunked && rs.content_length == 0);
+    usize off = 0;
+    u8 type = H2_HEADERS;
+    do {
+      usize n = len - off < H2_DEFAULT_FRAME_SIZE ? len - off : H2_DEFAULT_FRAME_SIZE;
+      u8 flags = 0;
+      if (type == H2_HEADERS && no_body)
+        flags |= H2_FLAG_END_STREAM;
+      if (off + n == len)
+        flags |= H2_FLAG_END_HEADERS;
+      h2_frame_put(out, type, flags, st->id, block + off, n);
+      off += n;
+      type = H2_CONTINUATION;
+    } while (off < len);
+
+    buf_consume(src, rs.body_offset);
+    // A stream counts the header blocks and DATA payloads queued for it as sent.
+    sc->bytes_sent += len;
+    st->head_sent = true;
+    if (no_body) {
+      stream_finish(s, st);
+    } else if (rs.chunked) {
+      http_body_init(&st->resp, 0, true, 0);
+      u8 *trailers = arena_alloc(sc->arena, H2_MAX_TRAILERS);
+      if (trailers)
+        http_body_keep_trailers(&st->resp, trailers, H2_MAX_TRAILERS);
+    } else if (rs.content_length > 0) {
+      http_body_init(&st->resp, rs.content_length, false, 0);
+    } else {
+      st->close_delimited = true;
+    }
+    return true;
+  }
+}
+
+// Re-encodes the trailer section of a chunked response ("name: value\r\n" lines) as a final
+// HEADERS frame. Returns false if the output buffer has no room for it yet.
+static bool send_trailers(h2_session_t *s, h2_stream_t *st) {
+  const char *p = (const char *)st->resp.trailers;
+  const char *end = p + st->resp.trailer_len;
+  u8 block[H2_MAX_TRAILERS + 256];
+  usize len = 0;
+  while (p < end) {
+    const char *eol = memchr(p, '\n', (usize)(end - p));
+    if (!eol)
+      eol = end;
+    const char *colon = memchr(p, ':', (usize)(eol - p));
+    if (colon && colon > p) {
+      str_t name = {.ptr = p, .len = (usize)(colon - p)};
+      str_t value = str_trim((str_t){.ptr = colon + 1, .len = (usize)(eol - colon - 1)});
+      if (!is_hop_by_hop(name))
+        len += hpack_encode_header(block + len, sizeof(block) - len, name, value);
+    }
+    p = eol + 1;
+  }
+  if (h2_frame_put(&s->conn->wbuf, H2_HEADERS, H2_FLAG_END_STREAM | H2_FLAG_END_HEADERS, st->id,
+                   block, len) != NP_OK)
+    return false;
+  st->sc->bytes_sent += len;
+  st->trailers_pending = false;
+  stream_finish(s, st);
+  return true;
+}
+
+static bool body_complete(h2_stream_t *st) {
+  if (st->close_delimited)
+    return st->source_done && buf_readable(st->src) == 0;
+  return st->resp.done;
+}
+
+// Translates what the stream connection has produced so far into frames, bounded by the flow
+// control windows, the output buffer and `budget`. Returns true if anything was queued.
+static bool stream_pump(h2_session_t *s, h2_stream_t *st, usize budget) {
+  conn_t *sc = st->sc;
+  np_buf_t *out = &s->conn->wbuf;
+  bool progress = false;
+
+  if (!st->dispatched || st->dispatching || st->end_sent)
+    return false;
+  if (!st->head_sent) {
+    if (!send_response_head(s, st))
+      return false;
+    if (st->end_sent)
+      return true;
+    progress = true;
+  }
+
+  while (!st->end_sent) {
+    if (st->trailers_pending) {
+      progress |= send_trailers(s, st);
+      break;
+    }
+    i64 window = st->send_window < s->send_window ? st->send_window : s->send_window;
+    usize room = window > 0 ? (usize)window : 0;
+    if (room > H2_DEFAULT_FRAME_SIZE)
+      room = H2_DEFAULT_FRAME_SIZE;
+    if (room > budget)
+      room = budget;
+    if (buf_writable(out) < H2_FRAME_HEADER_LEN + room)
+      buf_compact(out);
+    if (buf_writable(out) <= H2_FRAME_HEADER_LEN)
+      break;
+    if (room > buf_writable(out) - H2_FRAME_HEADER_LEN)
+      room = buf_writable(out) - H2_FRAME_HEADER_LEN;
+
+    u8 *frame = buf_write_ptr(out);
+    u8 *payload = frame + H2_FRAME_HEADER_LEN;
+    np_buf_t *src = st->src;
+    usize consumed = 0, n = 0;
+    if (room > 0 && buf_readable(src) > 0) {
+      if (st->close_delimited) {
+        n = buf_readable(src) < room ? buf_readable(src) : room;
+        memcpy(payload, buf_read_ptr(src), n);
+        consumed = n;
+      } else if (http_body_decode(&st->resp, buf_read_ptr(src), buf_readable(src), &consumed,
+                                  payload, room, &n) < 0) {
+        log_warn("h2: stream %u has a malformed response body", st->id);
+        stream_reset(s, st, H2_INTERNAL_ERROR);
+        return true;
+      }
+      buf_consume(src, consumed);
+    } else if (room > 0 && sc->state == CONN_SENDFILE && sc->file_remaining > 0) {
+      usize want = (usize)sc->file_remaining < room ? (usize)sc->file_remaining : room;
+      isize r = pread(sc->file_fd, payload, want, sc->file_offset);
+      if (r <= 0) {
+        log_error_errno("h2: pread fd=%d", sc->file_fd);
+        stream_reset(s, st, H2_INTERNAL_ERROR);
+        return true;
+      }
+      sc->file_offset += r;
+      sc->file_remaining -= r;
+      if (sc->file_remaining == 0)
+        file_server_next_part(sc);
+      consumed = (usize)r;
+      http_body_decode(&st->resp, payload, (usize)r, &consumed, payload, (usize)r, &n);
+    }
+
+    bool done = body_complete(st);
+    if (n == 0 && !done) {
+      if (consumed > 0)
+        continue;
+      bool more = buf_readable(src) > 0 || (sc->state == CONN_SENDFILE && sc->file_remaining > 0);
+      if (st->source_done && !more) {
+        log_warn("h2: stream %u response ended early", st->id);
+        stream_reset(s, st, H2_INTERNAL_ERROR);
+        return true;
+      }
+      break;
+    }
+
+    // Trailers, if the response carried any, end the stream instead of the last DATA frame.
+    bool trailers = done && st->resp.trailer_len > 0;
+    if (n > 0 || !trailers) {
+      h2_frame_write_header(frame, (u32)n, H2_DATA, done && !trailers ? H2_FLAG_END_STREAM : 0,
+                            st->id);
+      buf_produce(out, H2_FRAME_HEADER_LEN + n);
+      st->send_window -= (i64)n;
+      s->send_window -= (i64)n;
+      sc->bytes_sent += n;
+      budget -= n < budget ? n : budget;
+      progress = true;
+    }
+    if (trailers)
+      st->trailers_pending = true;
+    else if (done)
+      stream_finish(s, st);
+    else if (budget == 0)
+      break;
+  }
+  return progress;
+}
+
+static void resume_upstreams(h2_session_t *s) {
+  for (int i = 0; i < H2_MAX_STREAMS && !s->dead; i++) {
+    h2_stream_t *st = &s->streams[i];
+    if (!st->sc || !st->upstream_blocked)
+      continue;
+    conn_t *sc = st->sc;
+    if (sc->state != CONN_PROXYING || (sc->upstream_fd < 0 && !sc->upstream_h2)) {
+      st->upstream_blocked = false;
+      continue;
+    }
+    if (buf_readable(&sc->upstream_rbuf) == sc->upstream_rbuf.cap)
+      continue;
+    st->upstream_blocked = false;
+    proxy_resume_upstream(sc);
+  }
+}
+
+static void session_run(h2_session_t *s) {
+  np_buf_t *out = &s->conn->wbuf;
+  send_window_updates(s);
+
+  for (;;) {
+    bool progress = false;
+    bool pass = true;
+    // One frame per stream per pass keeps concurrent responses interleaved.
+    while (pass && !s->dead && out->cap - buf_readable(out) > H2_DEFAULT_FRAME_SIZE) {
+      pass = false;
+      for (int k = 0; k < H2_MAX_STREAMS; k++) {
+        h2_stream_t *st = &s->streams[(s->rr + k) % H2_MAX_STREAMS];
+        if (st->sc && stream_pump(s, st, H2_DEFAULT_FRAME_SIZE))
+          pass = true;
+      }
+      s->rr = (s->rr + 1) % H2_MAX_STREAMS;
+      progress |= pass;
+    }
+    usize queued = buf_readable(out);
+    session_flush(s);
+    // Without progress the streams may only have lacked room in `out`; once the socket has
+    // taken all of it they get another go, as no EV_WRITE is coming to wake them.
+    if (s->dead || buf_readable(out) > 0 || (!progress && queued == 0))
+      break;
+  }
+
+  resume_upstreams(s);
+}
+
+static np_status_t build_request_field(void *arg, str_t name, str_t value) {
+  h2_request_builder_t *b = (h2_request_builder_t *)arg;
+  http_request_t *req = b->req;
+
+  if (name.len > 0 && name.ptr[0] == ':') {
+    if (b->regular_seen)
+      b->bad = true;
+    else if (str_eq(name, STR(":method")))
+      b->method = value;
+    else if (str_eq(name, STR(":path")))
+      b->path = value;
+    else if (str_eq(name, STR(":scheme")))
+      b->scheme = value;
+    else if (str_eq(name, STR(":authority")))
+      b->authority = value;
+    else
+      b->bad = true;
+    return NP_OK;
+  }
+
+  b->regular_seen = true;
+  // Connection-specific fields mean nothing inside a stream.
+  if (is_hop_by_hop(name))
+    return NP_OK;
+  if (req->header_count >= NP_MAX_HEADERS) {
+    b->bad = true;
+    return NP_OK;
+  }
+  if (str_eq(name, STR("content-length"))) {
+    i64 cl;
+    if (str_to_int(value, &cl) != 0 || cl < 0)
+      b->bad = true;
+    else
+      req->content_length = cl;
+  }
+  req->headers[req->header_count].name = name;
+  req->headers[req->header_count].value = value;
+  req->header_count++;
+  return NP_OK;
+}
+
+static np_status_t discard_field(void *arg, str_t name, str_t value) {
+  NP_UNUSED(arg);
+  NP_UNUSED(name);
+  NP_UNUSED(value);
+  return NP_OK;
+}
+
+static void stream_dispatch(h2_session_t *s, h2_stream_t *st) {
+  conn_t *sc = st->sc;
+  st->dispatched = true;
+  st->dispatching = true;
+  handler_dispatch(sc, (http_request_t *)sc->request, s->ctx);
+  st->dispatching = false;
+  if (sc->state != CONN_PROXYING && sc->state != CONN_SENDFILE)
+    st->source_done = true;
+}
+
+static void stream_respond_error(h2_session_t *s, h2_stream_t *st, int status) {
+  conn_t *sc = st->sc;
+  NP_UNUSED(s);
+  buf_reset(&sc->wbuf);
+  response_write_error(&sc->wbuf, status, true);
+  sc->state = CONN_WRITING_RESPONSE;
+  st->dispatched = true;
+  st->source_done = true;
+}
+
+static void finish_request_body(h2_session_t *s, h2_stream_t *st) {
+  conn_t *sc = st->sc;
+  http_request_t *req = (http_request_t *)sc->request;
+  st->remote_open = false;
+  if (st->dispatched)
+    return;
+
+  if (sc->body_fd >= 0 && st->body_len > 0) {
+    void *map = mmap(NULL, (usize)st->body_len, PROT_READ, MAP_PRIVATE, sc->body_fd, 0);
+    if (map == MAP_FAILED) {
+      log_error_errno("h2: request body spool mmap");
+      stream_respond_error(s, st, 500);
+      return;
+    }
+    sc->body_map = map;
+    sc->body_map_len = (usize)st->body_len;
+    req->body = (str_t){.ptr = map, .len = (usize)st->body_len};
+  } else if (buf_readable(&sc->rbuf) > 0) {
+    req->body = (str_t){.ptr = (const char *)buf_read_ptr(&sc->rbuf), .len = buf_readable(&sc->rbuf)};
+  }
+  stream_dispatch(s, st);
+}
+
+// Request bodies are collected in the stream connection's read buffer and spill into a spool
+// file past that, like HTTP/1 bodies for local handlers.
+static void append_request_body(h2_session_t *s, h2_stream_t *st, const u8 *data, usize len) {
+  conn_t *sc = st->sc;
+  np_config_t *cfg = s->ctx->config;
+
+  st->body_len += (i64)len;
+  if (cfg->client_max_body_size > 0 && st->body_len > cfg->client_max_body_size) {
+    stream_respond_error(s, st, 413);
+    return;
+  }
+  if (sc->body_fd < 0 && buf_writable(&sc->rbuf) >= len) {
+    memcpy(buf_write_ptr(&sc->rbuf), data, len);
+    buf_produce(&sc->rbuf, len);
+    return;
+  }
+
+  if (sc->body_fd < 0) {
+    sc->body_fd = http_body_spool_open(cfg->client_body_temp_path);
+    usize held = buf_readable(&sc->rbuf);
+    if (sc->body_fd < 0 || write(sc->body_fd, buf_read_ptr(&sc->rbuf), held) != (isize)held) {
+      log_error_errno("h2: cannot spool request body in %s", cfg->client_body_temp_path);
+      stream_respond_error(s, st, 500);
+      return;
+    }
+    buf_reset(&sc->rbuf);
+  }
+  if (write(sc->body_fd, data, len) != (isize)len) {
+    log_error_errno("h2: request body spool write");
+    stream_respond_error(s, st, 500);
+  }
+}
+
+static void finish_header_block(h2_session_t *s) {
+  u32 id = s->hdr_stream;
+  s->hdr_stream = 0;
+
+  h2_stream_t *st = find_stream(s, id);
+  if (st && st->remote_open) {
+    // Trailers: decoded to keep the HPACK state in sync, then dropped.
+    if (hpack_decode(&s->hpack, s->hdr_block, s->hdr_len, st->sc->arena, discard_field, NULL) !=
+        NP_OK) {
+      connection_error(s, H2_COMPRESSION_ERROR);
+      return;
+    }
+    finish_request_body(s, st);
+    return;
+  }
+
+  if (!s->hdr_opens_stream || s->goaway_received || s->active >= H2_MAX_STREAMS ||
+      !(st = open_stream(s, id))) {
+    np_status_t rc =
+        hpack_decode(&s->hpack, s->hdr_block, s->hdr_len, s->conn->arena, discard_field, NULL);
+    arena_reset(s->conn->arena);
+    if (rc != NP_OK)
+      connection_error(s, H2_COMPRESSION_ERROR);
+    else if (s->hdr_opens_stream)
+      h2_frame_put_u32(&s->conn->wbuf, H2_RST_STREAM, id, H2_REFUSED_STREAM);
+    return;
+  }
+
+  conn_t *sc = st->sc;
+  http_request_t *req = request_create(sc->arena);
+  if (!req) {
+    stream_reset(s, st, H2_INTERNAL_ERROR);
+    return;
+  }
+  h2_request_builder_t b;
+  memset(&b, 0, sizeof(b));
+  b.req = req;
+  if (hpack_decode(&s->hpack, s->hdr_block, s->hdr_len, sc->arena, build_request_field, &b) !=
+      NP_OK) {
+    connection_error(s, H2_COMPRESSION_ERROR);
+    return;
+  }
+  if (b.bad || b.method.len == 0 || b.path.len == 0 || b.scheme.len == 0) {
+    stream_reset(s, st, H2_PROTOCOL_ERROR);
+    return;
+  }
+
+  req->method = http_method_parse(b.method.ptr, b.method.len);
+  req->version = HTTP_11;
+  req->keep_alive = true;
+  request_set_uri(req, b.path);
+  if (b.authority.len > 0 && !request_header(req, STR("Host")).ptr) {
+    if (req->header_count >= NP_MAX_HEADERS) {
+      stream_reset(s, st, H2_PROTOCOL_ERROR);
+      return;
+    }
+    req->headers[req->header_count].name = STR("host");
+    req->headers[req->header_count].value = b.authority;
+    req->header_count++;
+  }
+  request_mark_received(req);
+  sc->request = req;
+  st->head_only = req->method == HTTP_METHOD_HEAD;
+
+  if (s->hdr_end_stream) {
+    stream_dispatch(s, st);
+  } else {
+    st->remote_open = true;
+    if (req->content_length > 0 && s->ctx->config->client_max_body_size > 0 &&
+        req->content_length > s->ctx->config->client_max_body_size)
+      stream_respond_error(s, st, 413);
+  }
+}
+
+static bool strip_padding(const h2_frame_hdr_t *h, const u8 **payload, usize *len) {
+  *len = h->length;
+  if (!(h->flags & H2_FLAG_PADDED))
+    return true;
+  if (*len < 1)
+    return false;
+  u8 pad = (*payload)[0];
+  (*payload)++;
+  (*len)--;
+  if (pad > *len)
+    return false;
+  *len -= pad;
+  return true;
+}
+
+static void on_headers(h2_session_t *s, const h2_frame_hdr_t *h, const u8 *payload) {
+  if (h->stream_id == 0 || !(h->stream_id & 1)) {
+    connection_error(s, H2_PROTOCOL_ERROR);
+    return;
+  }
+  const u8 *p = payload;
+  usize len;
+  if (!strip_padding(h, &p, &len)) {
+    connection_error(s, H2_PROTOCOL_ERROR);
+    return;
+  }
+  if (h->flags & H2_FLAG_PRIORITY) {
+    if (len < 5) {
+      connection_error(s, H2_FRAME_SIZE_ERROR);
+      return;
+    }
+    p += 5;
+    len -= 5;
+  }
+
+  s->hdr_opens_stream = h->stream_id > s->last_stream_id;
+  if (s->hdr_opens_stream)
+    s->last_stream_id = h->stream_id;
+  memcpy(s->hdr_block, p, len);
+  s->hdr_len = len;
+  s->hdr_stream = h->stream_id;
+  s->hdr_end_stream = (h->flags & H2_FLAG_END_STREAM) != 0;
+  if (h->flags & H2_FLAG_END_HEADERS)
+    finish_header_block(s);
+}
+
+static void on_continuation(h2_session_t *s, const h2_frame_hdr_t *h, const u8 *payload) {
+  if (s->hdr_stream == 0) {
+    connection_error(s, H2_PROTOCOL_ERROR);
+    return;
+  }
+  if (s->hdr_len + h->length > H2_MAX_HEADER_BLOCK) {
+    connection_error(s, H2_PROTOCOL_ERROR);
+    return;
+  }
+  memcpy(s->hdr_block + s->hdr_len, payload, h->length);
+  s->hdr_len += h->length;
+  if (h->flags & H2_FLAG_END_HEADERS)
+    finish_header_block(s);
+}
+
+static void on_data(h2_session_t *s, const h2_frame_hdr_t *h, const u8 *payload) {
+  if (h->stream_id == 0) {
+    connection_error(s, H2_PROTOCOL_ERROR);
+    return;
+  }
+  const u8 *p = payload;
+  usize len;
+  if (!strip_padding(h, &p, &len)) {
+    connection_error(s, H2_PROTOCOL_ERROR);
+    return;
+  }
+
+  // Bodies are buffered or spooled rather than throttled, so received bytes are credited back
+  // right away (batched in send_window_updates). Until then recv_credit is what the peer has
+  // used of the window we advertised, and a frame may not overrun it (RFC 9113 6.9.1).
+  if (s->recv_credit + h->length > H2_DEFAULT_WINDOW) {
+    connection_error(s, H2_FLOW_CONTROL_ERROR);
+    return;
+  }
+  s->recv_credit += h->length;
+
+  h2_stream_t *st = find_stream(s, h->stream_id);
+  if (!st || !st->remote_open) {
+    if (h->stream_id > s->last_stream_id)
+      connection_error(s, H2_PROTOCOL_ERROR);
+    return;
+  }
+  if (st->recv_credit + h->length > H2_DEFAULT_WINDOW) {
+    stream_reset(s, st, H2_FLOW_CONTROL_ERROR);
+    return;
+  }
+  st->recv_credit += h->length;
+  if (!st->dispatched)
+    append_request_body(s, st, p, len);
+  if (h->flags & H2_FLAG_END_STREAM)
+    finish_request_body(s, st);
+}
+
+static void on_settings(h2_session_t *s, const h2_frame_hdr_t *h, const u8 *payload) {
+  if (h->stream_id != 0) {
+    connection_error(s, H2_PROTOCOL_ERROR);
+    return;
+  }
+  if (h->flags & H2_FLAG_ACK) {
+    if (h->length != 0)
+      connection_error(s, H2_FRAME_SIZE_ERROR);
+    return;
+  }
+  if (h->length % 6 != 0) {
+    connection_error(s, H2_FRAME_SIZE_ERROR);
+    return;
+  }
+
+  for (u32 off = 0; off < h->length; off += 6) {
+    u16 id = (u16)((payload[off] << 8) | payload[off + 1]);
+    u32 value = h2_get_u32(payload + off + 2);
+    if (id == H2_SETTINGS_INITIAL_WINDOW_SIZE) {
+      if (value > H2_MAX_WINDOW) {
+        connection_error(s, H2_FLOW_CONTROL_ERROR);
+        return;
+      }
+      i64 delta = (i64)value - s->peer_initial_window;
+      for (int i = 0; i < H2_MAX_STREAMS; i++) {
+        if (s->streams[i].sc)
+          s->streams[i].send_window += delta;
+      }
+      s->peer_initial_window = value;
+    } else if (id == H2_SETTINGS_MAX_FRAME_SIZE) {
+      // Valid, but frames are never sent larger than the default anyway.
+      if (value < H2_DEFAULT_FRAME_SIZE || value > H2_MAX_FRAME_SIZE) {
+        connection_error(s, H2_PROTOCOL_ERROR);
+        return;
+      }
+    } else if (id == H2_SETTINGS_ENABLE_PUSH && value > 1) {
+      connection_error(s, H2_PROTOCOL_ERROR);
+      return;
+    }
+  }
+  h2_frame_put(&s->conn->wbuf, H2_SETTINGS, H2_FLAG_ACK, 0, NULL, 0);
+}
+
+static void on_window_update(h2_session_t *s, const h2_frame_hdr_t *h, const u8 *payload) {
+  if (h->length != 4) {
+    connection_error(s, H2_FRAME_SIZE_ERROR);
+    return;
+  }
+  u32 inc = h2_get_u32(payload) & 0x7fffffff;
+  if (h->stream_id == 0) {
+    s->send_window += inc;
+    if (inc == 0 || s->send_window > H2_MAX_WINDOW)
+      connection_error(s, inc == 0 ? H2_PROTOCOL_ERROR : H2_FLOW_CONTROL_ERROR);
+    return;
+  }
+
+  h2_stream_t *st = find_stream(s, h->stream_id);
+  if (!st)
+    return;
+  st->send_window += inc;
+  if (inc == 0 || st->send_window > H2_MAX_WINDOW)
+    stream_reset(s, st, inc == 0 ? H2_PROTOCOL_ERROR : H2_FLOW_CONTROL_ERROR);
+}
+
+static void on_rst_stream(h2_session_t *s, const h2_frame_hdr_t *h) {
+  if (h->stream_id == 0 || h->stream_id > s->last_stream_id) {
+    connection_error(s, H2_PROTOCOL_ERROR);
+    return;
+  }
+  if (h->length != 4) {
+    connection_error(s, H2_FRAME_SIZE_ERROR);
+    return;
+  }
+  h2_stream_t *st = find_stream(s, h->stream_id);
+  if (st) {
+    st->remote_open = false;
+    st->end_sent = true;
+    release_stream(s, st);
+  }
+}
+
+static void handle_frame(h2_session_t *s, const h2_frame_hdr_t *h, const u8 *payload) {
+  // A header block must be finished by CONTINUATION frames before anything else.
+  if (s->hdr_stream != 0 && (h->type != H2_CONTINUATION || h->stream_id != s->hdr_stream)) {
+    connection_error(s, H2_PROTOCOL_ERROR);
+    return;
+  }
+
+  switch (h->type) {
+    case H2_DATA:
+      on_data(s, h, payload);
+      break;
+    case H2_HEADERS:
+      on_headers(s, h, payload);
+      break;
+    case H2_CONTINUATION:
+      on_continuation(s, h, payload);
+      break;
+    case H2_SETTINGS:
+      on_settings(s, h, payload);
+      break;
+    case H2_WINDOW_UPDATE:
+      on_window_update(s, h, payload);
+      break;
+    case H2_RST_STREAM:
+      on_rst_stream(s, h);
+      break;
+    case H2_PING:
+      if (h->stream_id != 0 || h->length != 8)
+        connection_error(s, h->stream_id != 0 ? H2_PROTOCOL_ERROR : H2_FRAME_SIZE_ERROR);
+      else if (!(h->flags & H2_FLAG_ACK))
+        h2_frame_put(&s->conn->wbuf, H2_PING, H2_FLAG_ACK, 0, payload, 8);
+      break;
+    case H2_GOAWAY:
+      s->goaway_received = true;
+      break;
+    case H2_PUSH_PROMISE:
+      connection_error(s, H2_PROTOCOL_ERROR);
+      break;
+    default:
+      // PRIORITY and unknown frame types are ignored.
+      break;
+  }
+}
+
+static void process_frames(h2_session_t *s) {
+  np_buf_t *in = &s->conn->rbuf;
+
+  while (!s->dead) {
+    u8 *p = buf_read_ptr(in);
+    usize avail = buf_readable(in);
+
+    if (!s->preface_done) {
+      if (avail < H2_PREFACE_LEN)
+        break;
+      if (h2_preface_check(p, avail) != 1) {
+        s->dead = true;
+        break;
+      }
+      buf_consume(in, H2_PREFACE_LEN);
+      s->preface_done = true;
+      continue;
+    }
+
+    if (avail < H2_FRAME_HEADER_LEN)
+      break;
+    h2_frame_hdr_t h;
+    h2_frame_parse_header(p, &h);
+    if (h.length > H2_DEFAULT_FRAME_SIZE) {
+      connection_error(s, H2_FRAME_SIZE_ERROR);
+      break;
+    }
+    if (avail < H2_FRAME_HEADER_LEN + h.length)
+      break;
+    handle_frame(s, &h, p + H2_FRAME_HEADER_LEN);
+    buf_consume(in, H2_FRAME_HEADER_LEN + h.length);
+  }
+  if (!s->dead)
+    send_window_updates(s);
+}
+
+static void session_read(h2_session_t *s) {
+  conn_t *conn = s->conn;
+  for (;;) {
+    process_frames(s);
+    if (s->dead)
+      return;
+    isize n = buf_read_fd(&conn->rbuf, conn->fd);
+    if (n == NP_ERR_AGAIN)
+      return;
+    if (n <= 0) {
+      s->dead = true;
+      return;
+    }
+  }
+}
+
+np_status_t h2_session_start(conn_t *conn, handler_ctx_t *ctx) {
+  h2_session_t *s = calloc(1, sizeof(*s));
+  if (!s)
+    return NP_ERR_NOMEM;
+  s->hdr_block = malloc(H2_MAX_HEADER_BLOCK);
+  if (!s->hdr_block || hpack_table_init(&s->hpack, HPACK_DEFAULT_TABLE_SIZE) != NP_OK) {
+    free(s->hdr_block);
+    free(s);
+    return NP_ERR_NOMEM;
+  }
+  s->conn = conn;
+  s->ctx = ctx;
+  s->peer_initial_window = H2_DEFAULT_WINDOW;
+  s->send_window = H2_DEFAULT_WINDOW;
+
+  conn->h2 = s;
+  conn->state = CONN_H2;
+
+  u8 settings[6];
+  settings[0] = 0;
+  settings[1] = H2_SETTINGS_MAX_CONCURRENT_STREAMS;
+  h2_put_u32(settings + 2, H2_MAX_STREAMS);
+  h2_frame_put(&conn->wbuf, H2_SETTINGS, 0, 0, settings, sizeof(settings));
+  return NP_OK;
+}
+
+void h2_session_destroy(conn_t *conn) {
+  h2_session_t *s = (h2_session_t *)conn->h2;
+  conn->h2 = NULL;
+  for (int i = 0; i < H2_MAX_STREAMS; i++) {
+    if (s->streams[i].sc)
+      release_stream(s, &s->streams[i]);
+  }
+  hpack_table_free(&s->hpack);
+  free(s->hdr_block);
+  free(s);
+}
+
+void h2_on_client_event(conn_t *conn, u32 events) {
+  h2_session_t *s = (h2_session_t *)conn->h2;
+
+  if (events & EV_READ)
+    session_read(s);
+  if (!s->dead)
+    session_run(s);
+  else
+    session_flush(s);
+
+  if (s->dead || (s->goaway_received && s->active == 0))
+    worker_conn_close(conn);
+}
+
+np_status_t h2_stream_relay(conn_t *sc) {
+  h2_stream_t *st = (h2_stream_t *)sc->h2_stream;
+  h2_session_t *s = st->session;
+
+  h2_stream_t *outer = s->pinned;
+  s->pinned = st;
+  stream_pump(s, st, SIZE_MAX);
+  session_flush(s);
+  s->pinned = outer;
+  return st->end_sent || s->dead ? NP_ERR_CLOSED : NP_OK;
+}
+
+void h2_stream_wake(conn_t *sc) {
+  h2_stream_t *st = (h2_stream_t *)sc->h2_stream;
+  if (!st->dispatching && buf_readable(&sc->upstream_rbuf) > 0)
+    st->upstream_blocked = true;
+}
+
+void h2_stream_close(conn_t *sc) {
+  h2_stream_t *st = (h2_stream_t *)sc->h2_stream;
+  h2_session_t *s = st->session;
+
+  st->source_done = true;
+  st->upstream_blocked = false;
+  if (st->dispatching)
+    return;
+  if (!st->end_sent && !s->dead) {
+    h2_stream_t *outer = s->pinned;
+    s->pinned = st;
+    stream_pump(s, st, SIZE_MAX);
+    session_flush(s);
+    s->pinned = outer;
+  }
+  if (st->end_sent || s->dead)
+    release_stream(s, st);
+}
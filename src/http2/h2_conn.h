@@ -0,0 +1,23 @@
+#ifndef NPROXY_H2_CONN_H
+#define NPROXY_H2_CONN_H
+
+#include "core/types.h"
+#include "net/conn.h"
+
+#define H2_MAX_STREAMS 32
+
+typedef struct handler_ctx handler_ctx_t;
+
+// Switches a client connection whose read buffer starts with the HTTP/2 preface over to the
+// HTTP/2 session. The caller keeps calling h2_on_client_event for every event afterwards.
+np_status_t h2_session_start(conn_t *conn, handler_ctx_t *ctx);
+void h2_session_destroy(conn_t *conn);
+void h2_on_client_event(conn_t *conn, u32 events);
+
+// Every stream runs through handler_dispatch on its own stream connection (fd == -1). The
+// proxy and worker call these instead of touching the client socket for such connections.
+np_status_t h2_stream_relay(conn_t *sc);
+void h2_stream_wake(conn_t *sc);
+void h2_stream_close(conn_t *sc);
+
+#endif
@@ -0,0 +1,54 @@
+#include "http2/h2_frame.h"
+
+#include <string.h>
+
+int h2_preface_check(const u8 *data, usize len) {
+  usize n = len < H2_PREFACE_LEN ? len : H2_PREFACE_LEN;
+  if (memcmp(data, H2_PREFACE, n) != 0)
+    return -1;
+  return n == H2_PREFACE_LEN ? 1 : 0;
+}
+
+void h2_frame_parse_header(const u8 *p, h2_frame_hdr_t *h) {
+  h->length = ((u32)p[0] << 16) | ((u32)p[1] << 8) | (u32)p[2];
+  h->type = p[3];
+  h->flags = p[4];
+  h->stream_id = h2_get_u32(p + 5) & 0x7fffffff;
+}
+
+void h2_frame_write_header(u8 *p, u32 length, u8 type, u8 flags, u32 stream_id) {
+  p[0] = (u8)(length >> 16);
+  p[1] = (u8)(length >> 8);
+  p[2] = (u8)length;
+  p[3] = type;
+  p[4] = flags;
+  h2_put_u32(p + 5, stream_id & 0x7fffffff);
+}
+
+np_status_t h2_frame_put(np_buf_t *b, u8 type, u8 flags, u32 stream_id, const u8 *payload,
+                         usize len) {
+  if (buf_writable(b) < H2_FRAME_HEADER_LEN + len)
+    buf_compact(b);
+  if (buf_writable(b) < H2_FRAME_HEADER_LEN + len)
+    return NP_ERR_AGAIN;
+
+  u8 *p = buf_write_ptr(b);
+  h2_frame_write_header(p, (u32)len, type, flags, stream_id);
+  if (len > 0)
+    memcpy(p + H2_FRAME_HEADER_LEN, payload, len);
+  buf_produce(b, H2_FRAME_HEADER_LEN + len);
+  return NP_OK;
+}
+
+np_status_t h2_frame_put_u32(np_buf_t *b, u8 type, u32 stream_id, u32 value) {
+  u8 payload[4];
+  h2_put_u32(payload, value);
+  return h2_frame_put(b, type, 0, stream_id, payload, sizeof(payload));
+}
+
+np_status_t h2_frame_put_goaway(np_buf_t *b, u32 last_stream_id, h2_error_t code) {
+  u8 payload[8];
+  h2_put_u32(payload, last_stream_id & 0x7fffffff);
+  h2_put_u32(payload + 4, (u32)code);
+  return h2_frame_put(b, H2_GOAWAY, 0, 0, payload, sizeof(payload));
+}
@@ -0,0 +1,86 @@
+#ifndef NPROXY_H2_FRAME_H
+#define NPROXY_H2_FRAME_H
+
+#include "core/types.h"
+#include "net/buffer.h"
+
+#define H2_PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define H2_PREFACE_LEN 24
+
+#define H2_FRAME_HEADER_LEN 9
+#define H2_DEFAULT_WINDOW 65535
+#define H2_MAX_WINDOW 0x7fffffff
+#define H2_DEFAULT_FRAME_SIZE 16384
+#define H2_MAX_FRAME_SIZE 16777215
+
+typedef enum {
+  H2_DATA = 0x0,
+  H2_HEADERS = 0x1,
+  H2_PRIORITY = 0x2,
+  H2_RST_STREAM = 0x3,
+  H2_SETTINGS = 0x4,
+  H2_PUSH_PROMISE = 0x5,
+  H2_PING = 0x6,
+  H2_GOAWAY = 0x7,
+  H2_WINDOW_UPDATE = 0x8,
+  H2_CONTINUATION = 0x9,
+} h2_frame_type_t;
+
+#define H2_FLAG_END_STREAM 0x01
+#define H2_FLAG_ACK 0x01
+#define H2_FLAG_END_HEADERS 0x04
+#define H2_FLAG_PADDED 0x08
+#define H2_FLAG_PRIORITY 0x20
+
+typedef enum {
+  H2_SETTINGS_HEADER_TABLE_SIZE = 0x1,
+  H2_SETTINGS_ENABLE_PUSH = 0x2,
+  H2_SETTINGS_MAX_CONCURRENT_STREAMS = 0x3,
+  H2_SETTINGS_INITIAL_WINDOW_SIZE = 0x4,
+  H2_SETTINGS_MAX_FRAME_SIZE = 0x5,
+  H2_SETTINGS_MAX_HEADER_LIST_SIZE = 0x6,
+} h2_setting_t;
+
+typedef enum {
+  H2_NO_ERROR = 0x0,
+  H2_PROTOCOL_ERROR = 0x1,
+  H2_INTERNAL_ERROR = 0x2,
+  H2_FLOW_CONTROL_ERROR = 0x3,
+  H2_STREAM_CLOSED = 0x5,
+  H2_FRAME_SIZE_ERROR = 0x6,
+  H2_REFUSED_STREAM = 0x7,
+  H2_CANCEL = 0x8,
+  H2_COMPRESSION_ERROR = 0x9,
+} h2_error_t;
+
+typedef struct {
+  u32 length;
+  u8 type;
+  u8 flags;
+  u32 stream_id;
+} h2_frame_hdr_t;
+
+// Returns 1 for a complete client preface, 0 for a prefix of it, -1 for anything else.
+int h2_preface_check(const u8 *data, usize len);
+
+void h2_frame_parse_header(const u8 *p, h2_frame_hdr_t *h);
+void h2_frame_write_header(u8 *p, u32 length, u8 type, u8 flags, u32 stream_id);
+
+// Appends a complete frame to `b`; fails without writing anything if it does not fit.
+np_status_t h2_frame_put(np_buf_t *b, u8 type, u8 flags, u32 stream_id, const u8 *payload,
+                         usize len);
+np_status_t h2_frame_put_u32(np_buf_t *b, u8 type, u32 stream_id, u32 value);
+np_status_t h2_frame_put_goaway(np_buf_t *b, u32 last_stream_id, h2_error_t code);
+
+static inline u32 h2_get_u32(const u8 *p) {
+  return ((u32)p[0] << 24) | ((u32)p[1] << 16) | ((u32)p[2] << 8) | (u32)p[3];
+}
+
+static inline void h2_put_u32(u8 *p, u32 v) {
+  p[0] = (u8)(v >> 24);
+  p[1] = (u8)(v >> 16);
+  p[2] = (u8)(v >> 8);
+  p[3] = (u8)v;
+}
+
+#endif
@@ -0,0 +1,432 @@
+#include "http2/hpack.h"
+
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define HPACK_ENTRY_OVERHEAD 32
+#define HPACK_STATIC_COUNT 61
+
+typedef struct {
+  const char *name;
+  const char *value;
+} hpack_static_t;
+
+// RFC 7541 Appendix A.
+static const hpack_static_t static_table[HPACK_STATIC_COUNT + 1] = {
+    {"", ""},
+    {":authority", ""},
+    {":method", "GET"},
+    {":method", "POST"},
+    {":path", "/"},
+    {":path", "/index.html"},
+    {":scheme", "http"},
+    {":scheme", "https"},
+    {":status", "200"},
+    {":status", "204"},
+    {":status", "206"},
+    {":status", "304"},
+    {":status", "400"},
+    {":status", "404"},
+    {":status", "500"},
+    {"accept-charset", ""},
+    {"accept-encoding", "gzip, deflate"},
+    {"accept-language", ""},
+    {"accept-ranges", ""},
+    {"accept", ""},
+    {"access-control-allow-origin", ""},
+    {"age", ""},
+    {"allow", ""},
+    {"authorization", ""},
+    {"cache-control", ""},
+    {"content-disposition", ""},
+    {"content-encoding", ""},
+    {"content-language", ""},
+    {"content-length", ""},
+    {"content-location", ""},
+    {"content-range", ""},
+    {"content-type", ""},
+    {"cookie", ""},
+    {"date", ""},
+    {"etag", ""},
+    {"expect", ""},
+    {"expires", ""},
+    {"from", ""},
+    {"host", ""},
+    {"if-match", ""},
+    {"if-modified-since", ""},
+    {"if-none-match", ""},
+    {"if-range", ""},
+    {"if-unmodified-since", ""},
+    {"last-modified", ""},
+    {"link", ""},
+    {"location", ""},
+    {"max-forwards", ""},
+    {"proxy-authenticate", ""},
+    {"proxy-authorization", ""},
+    {"range", ""},
+    {"referer", ""},
+    {"refresh", ""},
+    {"retry-after", ""},
+    {"server", ""},
+    {"set-cookie", ""},
+    {"strict-transport-security", ""},
+    {"transfer-encoding", ""},
+    {"user-agent", ""},
+    {"vary", ""},
+    {"via", ""},
+    {"www-authenticate", ""},
+};
+
+// Code lengths of the RFC 7541 Appendix B Huffman code, indexed by symbol (256 is EOS). The
+// code is canonical, so the lengths alone determine every code.
+static const u8 huff_len[257] = {
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28,
+    30, 28, 28, 28, 28, 28, 28, 28, 28, 28, 6,  10, 10, 12, 13, 6,  8,  11, 10, 10, 8,  11,
+    8,  6,  6,  6,  5,  5,  5,  6,  6,  6,  6,  6,  6,  6,  7,  8,  15, 6,  12, 10, 13, 6,
+    7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,
+    8,  7,  8,  13, 19, 13, 14, 6,  15, 5,  6,  5,  6,  5,  6,  6,  6,  5,  7,  7,  6,  6,
+    6,  5,  6,  7,  6,  5,  5,  6,  7,  7,  7,  7,  7,  15, 11, 14, 13, 28, 20, 22, 20, 20,
+    22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23, 24, 24, 22, 23, 24, 23, 23, 23, 23, 21,
+    22, 23, 22, 23, 23, 24, 22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+    21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23, 26, 26, 20, 19, 22, 23,
+    22, 25, 26, 26, 26, 27, 27, 26, 24, 25, 19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26,
+    28, 27, 27, 27, 20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23, 26, 27,
+    26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26, 30,
+};
+
+#define HUFF_MAX_LEN 30
+
+static u16 huff_sym[257];
+static u32 huff_first[HUFF_MAX_LEN + 1];
+static u16 huff_index[HUFF_MAX_LEN + 1];
+static u16 huff_count[HUFF_MAX_LEN + 1];
+static bool huff_ready;
+
+static void huff_build(void) {
+  u16 n = 0;
+  u32 code = 0;
+  for (int len = 1; len <= HUFF_MAX_LEN; len++) {
+    huff_first[len] = code;
+    huff_index[len] = n;
+    huff_count[len] = 0;
+    for (int s = 0; s < 257; s++) {
+      if (huff_len[s] == len) {
+        huff_sym[n++] = (u16)s;
+        huff_count[len]++;
+      }
+    }
+    code = (code + huff_count[len]) << 1;
+  }
+  huff_ready = true;
+}
+
+static isize huff_decode(const u8 *in, usize len, char *out) {
+  if (!huff_ready)
+    huff_build();
+
+  u32 code = 0;
+  int bits = 0;
+  usize o = 0;
+  for (usize i = 0; i < len; i++) {
+    for (int b = 7; b >= 0; b--) {
+      code = (code << 1) | ((in[i] >> b) & 1u);
+      bits++;
+      u32 off = code - huff_first[bits];
+      if (off < huff_count[bits]) {
+        u16 sym = huff_sym[huff_index[bits] + off];
+        if (sym == 256)
+          return -1;
+        out[o++] = (char)sym;
+        code = 0;
+        bits = 0;
+      } else if (bits == HUFF_MAX_LEN) {
+        return -1;
+      }
+    }
+  }
+  // Only up to 7 bits of EOS prefix (all ones) may pad the last byte.
+  if (bits > 7 || code != (1u << bits) - 1)
+    return -1;
+  return (isize)o;
+}
+
+np_status_t hpack_table_init(hpack_table_t *t, usize limit) {
+  memset(t, 0, sizeof(*t));
+  t->cap = (u32)(limit / HPACK_ENTRY_OVERHEAD) + 1;
+  t->entries = calloc(t->cap, sizeof(hpack_entry_t));
+  if (!t->entries)
+    return NP_ERR_NOMEM;
+  t->limit = limit;
+  t->max_size = limit;
+  return NP_OK;
+}
+
+void hpack_table_free(hpack_table_t *t) {
+  for (u32 i = 0; i < t->count; i++)
+    free(t->entries[(t->start + i) % t->cap].data);
+  free(t->entries);
+  memset(t, 0, sizeof(*t));
+}
+
+static void table_evict(hpack_table_t *t, usize need) {
+  while (t->count > 0 && t->size + need > t->max_size) {
+    hpack_entry_t *e = &t->entries[t->start];
+    t->size -= e->name_len + e->value_len + HPACK_ENTRY_OVERHEAD;
+    free(e->data);
+    e->data = NULL;
+    t->start = (t->start + 1) % t->cap;
+    t->count--;
+  }
+}
+
+static np_status_t table_insert(hpack_table_t *t, str_t name, str_t value) {
+  usize size = name.len + value.len + HPACK_ENTRY_OVERHEAD;
+  table_evict(t, size);
+  // An entry larger than the table just empties it.
+  if (size > t->max_size || t->count == t->cap)
+    return NP_OK;
+
+  char *data = malloc(name.len + value.len + 1);
+  if (!data)
+    return NP_ERR_NOMEM;
+  memcpy(data, name.ptr, name.len);
+  memcpy(data + name.len, value.ptr, value.len);
+
+  hpack_entry_t *e = &t->entries[(t->start + t->count) % t->cap];
+  e->data = data;
+  e->name_len = (u32)name.len;
+  e->value_len = (u32)value.len;
+  t->count++;
+  t->size += size;
+  return NP_OK;
+}
+
+static np_status_t table_get(hpack_table_t *t, u32 index, arena_t *arena, str_t *name,
+                             str_t *value) {
+  if (index == 0)
+    return NP_ERR_PARSE;
+  if (index <= HPACK_STATIC_COUNT) {
+    *name = str_from_cstr(static_table[index].name);
+    *value = str_from_cstr(static_table[index].value);
+    return NP_OK;
+  }
+
+  u32 k = index - HPACK_STATIC_COUNT - 1;
+  if (k >= t->count)
+    return NP_ERR_PARSE;
+  hpack_entry_t *e = &t->entries[(t->start + t->count - 1 - k) % t->cap];
+
+  // Copied out because a later insertion in the same block may evict the entry.
+  char *copy = arena_alloc(arena, e->name_len + e->value_len + 1);
+  if (!copy)
+    return NP_ERR_NOMEM;
+  memcpy(copy, e->data, e->name_len + e->value_len);
+  *name = (str_t){.ptr = copy, .len = e->name_len};
+  *value = (str_t){.ptr = copy + e->name_len, .len = e->value_len};
+  return NP_OK;
+}
+
+static np_status_t decode_int(const u8 **p, const u8 *end, int prefix, u32 *out) {
+  if (*p >= end)
+    return NP_ERR_PARSE;
+  u32 max = (1u << prefix) - 1;
+  u32 v = **p & max;
+  (*p)++;
+  if (v < max) {
+    *out = v;
+    return NP_OK;
+  }
+
+  for (u32 shift = 0; *p < end && shift <= 21; shift += 7) {
+    u8 b = **p;
+    (*p)++;
+    v += (u32)(b & 0x7f) << shift;
+    if (!(b & 0x80)) {
+      *out = v;
+      return NP_OK;
+    }
+  }
+  return NP_ERR_PARSE;
+}
+
+static np_status_t decode_str(const u8 **p, const u8 *end, arena_t *arena, str_t *out) {
+  if (*p >= end)
+    return NP_ERR_PARSE;
+  bool huffman = (**p & 0x80) != 0;
+  u32 len;
+  if (decode_int(p, end, 7, &len) != NP_OK || (usize)(end - *p) < len)
+    return NP_ERR_PARSE;
+
+  char *buf;
+  if (huffman) {
+    buf = arena_alloc(arena, (usize)len * 8 / 5 + 1);
+    if (!buf)
+      return NP_ERR_NOMEM;
+    isize n = huff_decode(*p, len, buf);
+    if (n < 0)
+      return NP_ERR_PARSE;
+    *out = (str_t){.ptr = buf, .len = (usize)n};
+  } else {
+    buf = arena_alloc(arena, (usize)len + 1);
+    if (!buf)
+      return NP_ERR_NOMEM;
+    memcpy(buf, *p, len);
+    *out = (str_t){.ptr = buf, .len = len};
+  }
+  *p += len;
+  return NP_OK;
+}
+
+np_status_t hpack_decode(hpack_table_t *t, const u8 *in, usize len, arena_t *arena,
+                         hpack_emit_fn emit, void *arg) {
+  const u8 *p = in;
+  const u8 *end = in + len;
+  bool seen_field = false;
+
+  while (p < end) {
+    u8 b = *p;
+    u32 index;
+    str_t name, value;
+    np_status_t rc;
+
+    if (b & 0x80) {
+      if (decode_int(&p, end, 7, &index) != NP_OK)
+        return NP_ERR_PARSE;
+      rc = table_get(t, index, arena, &name, &value);
+      if (rc != NP_OK)
+        return rc;
+    } else if ((b & 0xe0) == 0x20) {
+      if (seen_field || decode_int(&p, end, 5, &index) != NP_OK || index > t->limit)
+        return NP_ERR_PARSE;
+      t->max_size = index;
+      table_evict(t, 0);
+      continue;
+    } else {
+      bool indexing = (b & 0xc0) == 0x40;
+      if (decode_int(&p, end, indexing ? 6 : 4, &index) != NP_OK)
+        return NP_ERR_PARSE;
+      if (index == 0) {
+        rc = decode_str(&p, end, arena, &name);
+      } else {
+        str_t unused;
+        rc = table_get(t, index, arena, &name, &unused);
+      }
+      if (rc != NP_OK)
+        return rc;
+      rc = decode_str(&p, end, arena, &value);
+      if (rc != NP_OK)
+        return rc;
+      if (indexing && table_insert(t, name, value) != NP_OK)
+        return NP_ERR_NOMEM;
+    }
+
+    seen_field = true;
+    rc = emit(arg, name, value);
+    if (rc != NP_OK)
+      return rc;
+  }
+  return NP_OK;
+}
+
+static usize encode_int(u8 *out, usize cap, u8 first, int prefix, u32 v) {
+  u32 max = (1u << prefix) - 1;
+  if (cap == 0)
+    return 0;
+  if (v < max) {
+    out[0] = first | (u8)v;
+    return 1;
+  }
+  out[0] = first | (u8)max;
+  v -= max;
+  usize n = 1;
+  while (v >= 0x80) {
+    if (n >= cap)
+      return 0;
+    out[n++] = (u8)(v & 0x7f) | 0x80;
+    v >>= 7;
+  }
+  if (n >= cap)
+    return 0;
+  out[n++] = (u8)v;
+  return n;
+}
+
+static usize encode_str(u8 *out, usize cap, str_t s, bool lower) {
+  usize n = encode_int(out, cap, 0x00, 7, (u32)s.len);
+  if (n == 0 || cap - n < s.len)
+    return 0;
+  if (lower) {
+    for (usize i = 0; i < s.len; i++)
+      out[n + i] = (u8)tolower((unsigned char)s.ptr[i]);
+  } else {
+    memcpy(out + n, s.ptr, s.len);
+  }
+  return n + s.len;
+}
+
+static u32 static_name_index(str_t name) {
+  for (u32 i = 15; i <= HPACK_STATIC_COUNT; i++) {
+    if (str_ieq(name, str_from_cstr(static_table[i].name)))
+      return i;
+  }
+  return 0;
+}
+
+usize hpack_encode_status(u8 *out, usize cap, int status) {
+  u8 index = 0;
+  switch (status) {
+    case 200:
+      index = 8;
+      break;
+    case 204:
+      index = 9;
+      break;
+    case 206:
+      index = 10;
+      break;
+    case 304:
+      index = 11;
+      break;
+    case 400:
+      index = 12;
+      break;
+    case 404:
+      index = 13;
+      break;
+    case 500:
+      index = 14;
+      break;
+  }
+  if (index != 0) {
+    if (cap < 1)
+      return 0;
+    out[0] = 0x80 | index;
+    return 1;
+  }
+  if (cap < 5 || status < 100 || status > 999)
+    return 0;
+  out[0] = 0x08;
+  out[1] = 3;
+  out[2] = (u8)('0' + status / 100);
+  out[3] = (u8)('0' + status / 10 % 10);
+  out[4] = (u8)('0' + status % 10);
+  return 5;
+}
+
+usize hpack_encode_header(u8 *out, usize cap, str_t name, str_t value) {
+  u32 index = static_name_index(name);
+  usize n = encode_int(out, cap, 0x00, 4, index);
+  if (n == 0)
+    return 0;
+  if (index == 0) {
+    usize m = encode_str(out + n, cap - n, name, true);
+    if (m == 0)
+      return 0;
+    n += m;
+  }
+  usize m = encode_str(out + n, cap - n, value, false);
+  if (m == 0)
+    return 0;
+  return n + m;
+}
@@ -0,0 +1,44 @@
+#ifndef NPROXY_HPACK_H
+#define NPROXY_HPACK_H
+
+#include "core/memory.h"
+#include "core/string_util.h"
+#include "core/types.h"
+
+#define HPACK_DEFAULT_TABLE_SIZE 4096
+
+typedef struct {
+  char *data;
+  u32 name_len;
+  u32 value_len;
+} hpack_entry_t;
+
+// Decoder-side dynamic table. Entries live in a ring, oldest at `start`; the memory is owned
+// by the table because entries outlive the per-request arena.
+typedef struct {
+  hpack_entry_t *entries;
+  u32 cap;
+  u32 start;
+  u32 count;
+  usize size;
+  usize max_size;
+  usize limit;
+} hpack_table_t;
+
+typedef np_status_t (*hpack_emit_fn)(void *arg, str_t name, str_t value);
+
+np_status_t hpack_table_init(hpack_table_t *t, usize limit);
+void hpack_table_free(hpack_table_t *t);
+
+// Decodes one complete header block, calling `emit` for every field in order. Decoded strings
+// are allocated from `arena` and stay valid until it is reset.
+np_status_t hpack_decode(hpack_table_t *t, const u8 *in, usize len, arena_t *arena,
+                         hpack_emit_fn emit, void *arg);
+
+// The encoder never inserts into the peer's dynamic table: fields are sent as indexed static
+// entries or literals without indexing, so no encoder state is needed. Both return the number
+// of bytes written, or 0 if `cap` is too small.
+usize hpack_encode_status(u8 *out, usize cap, int status);
+usize hpack_encode_header(u8 *out, usize cap, str_t name, str_t value);
+
+#endif
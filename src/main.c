@@ -11,6 +11,9 @@
 #include "proc/daemon.h"
 #include "proc/master.h"
 #include "proc/worker.h"
+#include "static/bundle.h"
+#include "static/gzip_static.h"
+#include "static/mime.h"
 
 static void print_usage(const char *prog) {
   fprintf(stderr,
@@ -66,6 +69,22 @@ int main(int argc, char *argv[]) {
     return 1;
   }
 
+  if (mime_load(cfg.mime_types) != NP_OK) {
+    fprintf(stderr, "nproxy: cannot load mime_types %s\n", cfg.mime_types);
+    return 1;
+  }
+
+  for (int i = 0; i < cfg.server_count; i++) {
+    if (cfg.servers[i].static_bundle[0] == '\0')
+      continue;
+    bundle_t *b = bundle_open(cfg.servers[i].static_bundle);
+    if (!b) {
+      fprintf(stderr, "nproxy: cannot load static_bundle %s\n", cfg.servers[i].static_bundle);
+      return 1;
+    }
+    bundle_close(b);
+  }
+
   if (test_only) {
     config_print(&cfg);
     fprintf(stdout, "configuration test successful\n");
@@ -109,6 +128,8 @@ int main(int argc, char *argv[]) {
     }
   }
 
+  gzip_static_spawn(&cfg);
+
   if (single_worker) {
     rc = worker_run(&cfg, listeners, listener_count, 0);
   } else {
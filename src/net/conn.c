@@ -1,17 +1,29 @@
 #include "net/conn.h"
 
+#include <errno.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 #include "core/log.h"
+#include "features/access_log.h"
+#include "features/compress.h"
+#include "http2/h2_conn.h"
 #include "net/event_loop.h"
+#include "net/io_pool.h"
+#include "proxy/upstream.h"
+#include "proxy/upstream_h2.h"
+#include "static/open_file_cache.h"
 
 static void conn_init_bufs(conn_t *c) {
   buf_reset(&c->rbuf);
   buf_reset(&c->wbuf);
   buf_reset(&c->upstream_rbuf);
   buf_reset(&c->upstream_wbuf);
+  c->wref = NULL;
+  c->wref_len = 0;
 }
 
 static conn_t *conn_alloc(void) {
@@ -41,14 +53,43 @@ static void conn_reset(conn_t *c, int fd, struct sockaddr_in *peer, event_loop_t
   c->fd = fd;
   c->upstream_fd = -1;
   c->file_fd = -1;
+  c->file_ref = NULL;
+  c->file_borrowed = false;
   c->file_offset = 0;
   c->file_remaining = 0;
+  c->file_ranges = NULL;
+  c->file_warm_start = 0;
+  c->file_warm_end = 0;
+  c->file_large = false;
+  c->file_corked = false;
+  c->file_advised = 0;
+  c->io_job = NULL;
+  http_body_init(&c->body, 0, false, 0);
+  c->body_fd = -1;
+  c->body_map = NULL;
+  c->body_map_len = 0;
+  c->body_sent = 0;
   c->state = CONN_READING_REQUEST;
   c->loop = loop;
   c->last_active = 0;
   c->keep_alive = false;
   c->tls = false;
   c->tls_conn = NULL;
+  c->h2 = NULL;
+  c->h2_stream = NULL;
+  c->upstream_h2 = NULL;
+  c->proxy_status = 0;
+  c->proxy_backend = 0;
+  c->log_pending = false;
+  c->log_status = 0;
+  c->bytes_sent = 0;
+  c->cache_store = NULL;
+  c->gzip_pool = NULL;
+  c->gzip = NULL;
+  c->upstream_phase = UPSTREAM_RESP_HEAD;
+  c->upstream_unscanned = 0;
+  c->upstream_reusable = false;
+  c->upstream_reused = false;
   c->request = NULL;
   c->response = NULL;
   c->next = NULL;
@@ -125,12 +166,99 @@ conn_t *conn_create(int fd, struct sockaddr_in *peer, event_loop_t *loop) {
   return c;
 }
 
+isize conn_write_buf(conn_t *conn, np_buf_t *b) {
+  isize n = buf_write_fd(b, conn->fd);
+  if (n > 0)
+    conn->bytes_sent += (u64)n;
+  return n;
+}
+
+isize conn_flush(conn_t *conn) {
+  if (conn->wref_len == 0)
+    return conn_write_buf(conn, &conn->wbuf);
+
+  struct iovec iov[2];
+  int cnt = 0;
+  usize head = buf_readable(&conn->wbuf);
+  if (head > 0)
+    iov[cnt++] = (struct iovec){.iov_base = buf_read_ptr(&conn->wbuf), .iov_len = head};
+  iov[cnt++] = (struct iovec){.iov_base = (void *)conn->wref, .iov_len = conn->wref_len};
+
+  isize n = writev(conn->fd, iov, cnt);
+  if (n < 0)
+    return (errno == EAGAIN || errno == EWOULDBLOCK) ? NP_ERR_AGAIN : NP_ERR;
+  usize from_buf = (usize)n < head ? (usize)n : head;
+  buf_consume(&conn->wbuf, from_buf);
+  conn->wref += (usize)n - from_buf;
+  conn->wref_len -= (usize)n - from_buf;
+  if (conn->wref_len == 0)
+    conn->wref = NULL;
+  conn->bytes_sent += (u64)n;
+  return n;
+}
+
+// Widens [*lo, *hi) to cover `s` if it points into `b`.
+static void rbuf_span(const np_buf_t *b, str_t s, const u8 **lo, const u8 **hi) {
+  const u8 *p = (const u8 *)s.ptr;
+  if (!p || p < b->data || p >= b->data + b->cap)
+    return;
+  if (!*lo) {
+    *lo = p;
+    *hi = p + s.len;
+    return;
+  }
+  if (p < *lo)
+    *lo = p;
+  if (p + s.len > *hi)
+    *hi = p + s.len;
+}
+
+np_status_t conn_detach_request(conn_t *conn) {
+  http_request_t *req = conn->request;
+  if (!req)
+    return NP_OK;
+  const u8 *lo = NULL, *hi = NULL;
+  rbuf_span(&conn->rbuf, req->path, &lo, &hi);
+  rbuf_span(&conn->rbuf, req->query, &lo, &hi);
+  rbuf_span(&conn->rbuf, req->upgrade_protocol, &lo, &hi);
+  rbuf_span(&conn->rbuf, req->body, &lo, &hi);
+  for (int i = 0; i < req->header_count; i++) {
+    rbuf_span(&conn->rbuf, req->headers[i].name, &lo, &hi);
+    rbuf_span(&conn->rbuf, req->headers[i].value, &lo, &hi);
+  }
+  if (!lo)
+    return NP_OK;
+  return request_detach(req, conn->arena, lo, (usize)(hi - lo));
+}
+
+void conn_log_response(conn_t *conn, int status) {
+  conn->log_pending = true;
+  conn->log_status = status;
+}
+
+void conn_log_request(conn_t *conn) {
+  if (conn->log_pending && conn->request)
+    access_log_write(conn->request, conn->log_status, conn->bytes_sent, conn->proxy_backend);
+  conn->log_pending = false;
+  conn->bytes_sent = 0;
+}
+
 np_status_t conn_set_upstream(conn_t *conn, int upstream_fd) {
   conn->upstream_fd = upstream_fd;
   return NP_OK;
 }
 
 void conn_close(conn_t *conn) {
+  // A response cut short is logged with what got out of it.
+  conn_log_request(conn);
+  if (conn->io_job) {
+    io_job_detach(conn->io_job);
+    conn->io_job = NULL;
+  }
+  if (conn->h2)
+    h2_session_destroy(conn);
+  if (conn->upstream_h2)
+    upstream_h2_detach(conn);
   if (conn->fd >= 0) {
     event_loop_del(conn->loop, conn->fd);
     close(conn->fd);
@@ -140,12 +268,48 @@ void conn_close(conn_t *conn) {
     event_loop_del(conn->loop, conn->upstream_fd);
     close(conn->upstream_fd);
     conn->upstream_fd = -1;
+    // Dropped mid-exchange: the backend no longer serves this request.
+    if (conn->tls_conn && conn->proxy_pool)
+      upstream_release(conn->proxy_pool, conn->tls_conn, false);
+    conn->tls_conn = NULL;
+  }
+  conn_release_file(conn);
+  conn_release_body(conn);
+  conn_release_gzip(conn);
+  conn->state = CONN_CLOSING;
+}
+
+void conn_release_body(conn_t *conn) {
+  if (conn->body_map) {
+    munmap(conn->body_map, conn->body_map_len);
+    conn->body_map = NULL;
+    conn->body_map_len = 0;
   }
-  if (conn->file_fd >= 0) {
+  if (conn->body_fd >= 0) {
+    close(conn->body_fd);
+    conn->body_fd = -1;
+  }
+  http_body_init(&conn->body, 0, false, 0);
+}
+
+void conn_release_file(conn_t *conn) {
+  if (conn->file_ref) {
+    open_file_release(conn->file_ref);
+    conn->file_ref = NULL;
+  } else if (conn->file_fd >= 0 && !conn->file_borrowed) {
     close(conn->file_fd);
-    conn->file_fd = -1;
   }
-  conn->state = CONN_CLOSING;
+  conn->file_fd = -1;
+  conn->file_borrowed = false;
+  conn->file_large = false;
+  conn->file_corked = false;
+}
+
+void conn_release_gzip(conn_t *conn) {
+  if (conn->gzip) {
+    gzip_stream_release(conn->gzip);
+    conn->gzip = NULL;
+  }
 }
 
 void conn_destroy(conn_t *conn) {
@@ -4,8 +4,10 @@
 #include <netinet/in.h>
 #include <time.h>
 
+#include "cache/cache.h"
 #include "core/memory.h"
 #include "core/types.h"
+#include "http/body.h"
 #include "net/buffer.h"
 
 typedef enum {
@@ -15,8 +17,19 @@ typedef enum {
   CONN_TUNNEL = 3,
   CONN_CLOSING = 4,
   CONN_SENDFILE = 5,
+  CONN_READING_BODY = 6,
+  CONN_H2 = 7,
+  CONN_WAITING_IO = 8,  // the handler parked the request on an I/O thread job
 } conn_state_t;
 
+// Where the framing of an HTTP/1.1 upstream response stands.
+typedef enum {
+  UPSTREAM_RESP_HEAD = 0,
+  UPSTREAM_RESP_BODY,
+  UPSTREAM_RESP_UNTIL_CLOSE,
+  UPSTREAM_RESP_DONE,
+} upstream_resp_phase_t;
+
 typedef struct conn conn_t;
 typedef struct event_loop event_loop_t;
 
@@ -27,27 +40,74 @@ struct conn {
   arena_t *arena;
   np_buf_t rbuf;
   np_buf_t wbuf;
+  // Response bytes borrowed from memory that outlives the connection (canned error pages),
+  // sent after wbuf drains.
+  const u8 *wref;
+  usize wref_len;
   np_buf_t upstream_rbuf;
   np_buf_t upstream_wbuf;
   struct sockaddr_in peer;
   time_t last_active;
   int file_fd;
+  void *file_ref;  // open_file_t that file_fd belongs to, released instead of closing it
+  bool file_borrowed;  // file_fd is a static bundle's and stays open
   off_t file_offset;
   off_t file_remaining;
+  // Parts of a multipart/byteranges response still to come, in the request arena.
+  void *file_ranges;
+  // Bytes of the file known to be in the page cache, so sendfile() will not wait on the disk
+  // (io_threads only).
+  off_t file_warm_start;
+  off_t file_warm_end;
+  // A response of at least sendfile_large bytes: readahead is requested up to file_advised,
+  // and the socket stays corked until the first chunk follows the header.
+  bool file_large;
+  bool file_corked;
+  off_t file_advised;
+  // The io_job_t the connection waits on; detached if the connection closes first.
+  void *io_job;
+  http_body_t body;
+  int body_fd;
+  void *body_map;
+  usize body_map_len;
+  usize body_sent;
   bool keep_alive;
   bool tls;
   void *proxy_pool;
   void *tls_conn;
+  void *h2;
+  void *h2_stream;
+  void *upstream_h2;
   void *request;
   void *response;
   event_loop_t *loop;
   void *worker_state;
   void *cache_store;
-  char cache_key[256];
+  cache_key_t cache_key;
+  int cache_ttl;
   u8 *cache_buf;
   usize cache_len;
   usize cache_cap;
+  // Set by the handler when the client takes gzip; the stream itself is only taken from the pool
+  // once the response turns out to be worth compressing.
+  void *gzip_pool;
+  void *gzip;
+  int gzip_level;
+  int gzip_min_length;
   int proxy_status;
+  int proxy_backend;  // index + 1 of the pool backend serving the request, for the access log
+  // The request's access log record waits for its response to be out, or for the connection
+  // to go first; bytes_sent counts what was written to the client for it.
+  bool log_pending;
+  int log_status;
+  u64 bytes_sent;
+  // Framing of the HTTP/1.1 upstream response: bytes at the tail of upstream_rbuf not yet run
+  // through it are held back from the client.
+  upstream_resp_phase_t upstream_phase;
+  http_body_t upstream_body;
+  usize upstream_unscanned;
+  bool upstream_reusable;
+  bool upstream_reused;
   conn_t *next;
   conn_t *prev;
 };
@@ -66,6 +126,31 @@ void conn_pool_put(conn_pool_t *pool, conn_t *conn);
 conn_t *conn_create(int fd, struct sockaddr_in *peer, event_loop_t *loop);
 void conn_destroy(conn_t *conn);
 void conn_close(conn_t *conn);
+void conn_release_body(conn_t *conn);
+// Drops the response's file: back to the open-file cache, or closed.
+void conn_release_file(conn_t *conn);
+// Hands the response's gzip stream back to the worker's pool.
+void conn_release_gzip(conn_t *conn);
 np_status_t conn_set_upstream(conn_t *conn, int upstream_fd);
 
+// Writes wbuf and then the borrowed wref bytes to the client socket; same results as
+// buf_write_fd().
+isize conn_flush(conn_t *conn);
+// Writes `b` to the client socket, counted like conn_flush().
+isize conn_write_buf(conn_t *conn, np_buf_t *b);
+
+// Copies whatever of conn->request still points into rbuf to the arena. A request that is
+// still in use once handle_read() gets to rbuf again must be detached first: reading the next
+// bytes compacts rbuf and writes over the consumed head.
+np_status_t conn_detach_request(conn_t *conn);
+
+// Marks the request for the access log with `status`; conn_log_request() writes the record.
+void conn_log_response(conn_t *conn, int status);
+// Writes the pending access log record, if any, and starts counting bytes for the next one.
+void conn_log_request(conn_t *conn);
+
+static inline usize conn_pending_out(const conn_t *conn) {
+  return buf_readable(&conn->wbuf) + conn->wref_len;
+}
+
 #endif
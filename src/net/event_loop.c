@@ -98,8 +98,13 @@ np_status_t event_loop_del(event_loop_t *loop, int fd) {
   if (epoll_ctl(loop->epfd, EPOLL_CTL_DEL, fd, NULL) < 0 && errno != EBADF) {
     log_error_errno("epoll_ctl EPOLL_CTL_DEL fd=%d", fd);
   }
-  free(loop->handlers[fd]);
-  loop->handlers[fd] = NULL;
+  // The slot stays allocated: events for this fd may still be queued in the batch being
+  // dispatched, and they must find a cleared handler rather than freed memory.
+  ev_handler_t *h = loop->handlers[fd];
+  if (h) {
+    h->fn = NULL;
+    h->ctx = NULL;
+  }
   return NP_OK;
 }
 
@@ -115,7 +120,7 @@ void event_loop_run(event_loop_t *loop, int *running) {
     for (int i = 0; i < n; i++) {
       ev_handler_t *h = (ev_handler_t *)loop->events[i].data.ptr;
       u32 ev = loop->events[i].events;
-      if (LIKELY(h)) {
+      if (LIKELY(h && h->fn)) {
         h->fn(h->fd, ev, h->ctx);
       }
     }
@@ -0,0 +1,162 @@
+#include "net/io_pool.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "core/log.h"
+
+#define IO_POOL_MAX_THREADS 64
+
+typedef struct {
+  io_job_t *head;
+  io_job_t *tail;
+} job_queue_t;
+
+// Per worker.
+static struct {
+  pthread_mutex_t lock;
+  pthread_cond_t ready;  // `queued` has work, or the pool is stopping
+  job_queue_t queued;
+  job_queue_t completed;
+  bool stop;
+  int done_fd;  // eventfd the loop thread waits on for `completed`
+  event_loop_t *loop;
+  pthread_t threads[IO_POOL_MAX_THREADS];
+  int thread_count;
+} g_io = {.lock = PTHREAD_MUTEX_INITIALIZER, .ready = PTHREAD_COND_INITIALIZER, .done_fd = -1};
+
+static void queue_push(job_queue_t *q, io_job_t *job) {
+  job->next = NULL;
+  if (q->tail)
+    q->tail->next = job;
+  else
+    q->head = job;
+  q->tail = job;
+}
+
+static io_job_t *queue_take_all(job_queue_t *q) {
+  io_job_t *head = q->head;
+  q->head = q->tail = NULL;
+  return head;
+}
+
+static void *io_thread(void *arg) {
+  NP_UNUSED(arg);
+  pthread_mutex_lock(&g_io.lock);
+  for (;;) {
+    while (!g_io.queued.head && !g_io.stop)
+      pthread_cond_wait(&g_io.ready, &g_io.lock);
+    if (g_io.stop)
+      break;
+    io_job_t *job = g_io.queued.head;
+    g_io.queued.head = job->next;
+    if (!g_io.queued.head)
+      g_io.queued.tail = NULL;
+    pthread_mutex_unlock(&g_io.lock);
+
+    job->run(job);
+
+    pthread_mutex_lock(&g_io.lock);
+    bool wake = g_io.completed.head == NULL;
+    queue_push(&g_io.completed, job);
+    if (wake) {
+      u64 one = 1;
+      ssize_t n = write(g_io.done_fd, &one, sizeof(one));
+      NP_UNUSED(n);
+    }
+  }
+  pthread_mutex_unlock(&g_io.lock);
+  return NULL;
+}
+
+static void on_completions(int fd, u32 events, void *ctx) {
+  NP_UNUSED(events);
+  NP_UNUSED(ctx);
+  u64 count;
+  ssize_t n = read(fd, &count, sizeof(count));
+  NP_UNUSED(n);
+  pthread_mutex_lock(&g_io.lock);
+  io_job_t *job = queue_take_all(&g_io.completed);
+  pthread_mutex_unlock(&g_io.lock);
+  while (job) {
+    io_job_t *next = job->next;
+    job->done(job);
+    job = next;
+  }
+}
+
+np_status_t io_pool_init(int threads, event_loop_t *loop) {
+  if (threads <= 0)
+    return NP_OK;
+  if (threads > IO_POOL_MAX_THREADS)
+    threads = IO_POOL_MAX_THREADS;
+  g_io.done_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (g_io.done_fd < 0) {
+    log_error_errno("io_pool: eventfd");
+    return NP_ERR;
+  }
+  g_io.loop = loop;
+  g_io.stop = false;
+  event_loop_add(loop, g_io.done_fd, EV_READ, on_completions, NULL);
+
+  // Signals are for the event loop's signalfd, not for the I/O threads.
+  sigset_t all, old;
+  sigfillset(&all);
+  pthread_sigmask(SIG_BLOCK, &all, &old);
+  for (int i = 0; i < threads; i++) {
+    int rc = pthread_create(&g_io.threads[i], NULL, io_thread, NULL);
+    if (rc != 0) {
+      errno = rc;
+      log_error_errno("io_pool: pthread_create");
+      break;
+    }
+    g_io.thread_count++;
+  }
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  if (g_io.thread_count == 0) {
+    io_pool_destroy();
+    return NP_ERR;
+  }
+  log_debug("io_pool: %d thread(s)", g_io.thread_count);
+  return NP_OK;
+}
+
+void io_pool_destroy(void) {
+  if (g_io.done_fd < 0)
+    return;
+  pthread_mutex_lock(&g_io.lock);
+  g_io.stop = true;
+  pthread_cond_broadcast(&g_io.ready);
+  pthread_mutex_unlock(&g_io.lock);
+  for (int i = 0; i < g_io.thread_count; i++)
+    pthread_join(g_io.threads[i], NULL);
+  g_io.thread_count = 0;
+
+  io_job_t *lists[2] = {queue_take_all(&g_io.completed), queue_take_all(&g_io.queued)};
+  for (int i = 0; i < 2; i++) {
+    for (io_job_t *job = lists[i], *next; job; job = next) {
+      next = job->next;
+      job->owner = NULL;
+      job->done(job);
+    }
+  }
+  event_loop_del(g_io.loop, g_io.done_fd);
+  close(g_io.done_fd);
+  g_io.done_fd = -1;
+}
+
+bool io_pool_running(void) {
+  return g_io.thread_count > 0;
+}
+
+void io_pool_submit(io_job_t *job) {
+  pthread_mutex_lock(&g_io.lock);
+  queue_push(&g_io.queued, job);
+  pthread_cond_signal(&g_io.ready);
+  pthread_mutex_unlock(&g_io.lock);
+}
@@ -0,0 +1,31 @@
+#ifndef NPROXY_IO_POOL_H
+#define NPROXY_IO_POOL_H
+
+#include "core/types.h"
+#include "net/event_loop.h"
+
+// Blocking file work handed from a worker's event loop to its I/O threads (io_threads).
+// `run` is called on a pool thread and must not touch loop state; `done` is then called on the
+// loop thread. A job whose owner went away in the meantime is detached: it still completes,
+// and `done` sees a NULL owner and only frees what the job holds.
+typedef struct io_job io_job_t;
+struct io_job {
+  void (*run)(io_job_t *job);
+  void (*done)(io_job_t *job);
+  void *owner;
+  io_job_t *next;
+};
+
+// Starts `threads` I/O threads whose completions are delivered through `loop`. With 0 the pool
+// stays off and io_pool_running() is false.
+np_status_t io_pool_init(int threads, event_loop_t *loop);
+// Stops the threads; jobs not yet completed get done() with a NULL owner.
+void io_pool_destroy(void);
+bool io_pool_running(void);
+void io_pool_submit(io_job_t *job);
+
+static inline void io_job_detach(io_job_t *job) {
+  job->owner = NULL;
+}
+
+#endif
@@ -10,6 +10,8 @@
 #include "core/log.h"
 #include "net/socket.h"
 #include "proc/worker.h"
+#include "static/gzip_static.h"
+#include "static/mime.h"
 
 #define MAX_WORKERS 64
 
@@ -109,8 +111,11 @@ int master_run(np_config_t *cfg, np_socket_t *listeners, int listener_count,
           socket_close(listeners[i].fd);
         }
 
+        config_destroy(cfg);
         *cfg = new_cfg;
         listener_count = 0;
+        if (mime_load(cfg->mime_types) != NP_OK)
+          log_error("master: keeping the previous mime_types");
 
         u16 bound_ports[CONFIG_MAX_SERVERS];
         for (int i = 0; i < cfg->server_count; i++) {
@@ -141,8 +146,10 @@ int master_run(np_config_t *cfg, np_socket_t *listeners, int listener_count,
           spawn_worker(cfg, listeners, listener_count, i);
         }
 
+        gzip_static_spawn(cfg);
         log_info("master: reload complete, %d workers running", worker_count);
       } else {
+        config_destroy(&new_cfg);
         log_error("master: reload failed, keeping current configuration");
       }
     }
@@ -1,27 +1,41 @@
 #include "proc/worker.h"
 
 #include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/sendfile.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 #include "cache/cache.h"
 #include "core/log.h"
 #include "features/access_log.h"
+#include "features/compress.h"
 #include "features/metrics.h"
 #include "features/rate_limit.h"
+#include "http/body.h"
 #include "http/handler.h"
+#include "http/location.h"
 #include "http/parser.h"
 #include "http/request.h"
 #include "http/response.h"
+#include "http2/h2_conn.h"
+#include "http2/h2_frame.h"
 #include "net/conn.h"
 #include "net/event_loop.h"
+#include "net/io_pool.h"
 #include "net/timeout.h"
 #include "proc/signal.h"
 #include "proxy/proxy_conn.h"
 #include "proxy/upstream.h"
+#include "static/bundle.h"
+#include "static/file_server.h"
+#include "static/open_file_cache.h"
 
 typedef struct {
   np_socket_t *listeners;
@@ -44,51 +58,240 @@ static void on_conn_timeout(void *arg) {
 }
 
 static void on_client_event(int fd, u32 events, void *arg);
+static void handle_read(conn_t *conn);
+static bool process_request(conn_t *conn);
+
+static void reset_for_next_request(conn_t *conn) {
+  conn_log_request(conn);
+  conn_release_body(conn);
+  conn_release_gzip(conn);
+  conn_release_file(conn);
+  conn->file_ranges = NULL;
+  arena_reset(conn->arena);
+  conn->request = NULL;
+  conn->response = NULL;
+  conn->proxy_status = 0;
+  conn->proxy_backend = 0;
+  conn->tls_conn = NULL;
+  conn->state = CONN_READING_REQUEST;
+}
+
+// The response went out in full: close the connection or get it ready for the next request.
+// Returns false if it was closed.
+static bool finish_response(conn_t *conn) {
+  worker_state_t *ws = (worker_state_t *)conn->worker_state;
+  if (conn->state == CONN_CLOSING || !conn->keep_alive) {
+    conn_pool_put(ws->pool, conn);
+    return false;
+  }
+  reset_for_next_request(conn);
+  event_loop_mod(conn->loop, conn->fd, EV_READ | EV_HUP | EV_EDGE, on_client_event, conn);
+  return true;
+}
+
+// How much of a file one I/O thread job reads ahead of sendfile().
+#define FILE_IO_WINDOW (512 * 1024)
+#define FILE_IO_CHUNK (64 * 1024)
+// How far ahead of sendfile() a large response asks the kernel to read without I/O threads.
+#define FILE_READAHEAD (2 * 1024 * 1024)
+
+typedef struct {
+  io_job_t job;
+  int fd;  // a dup of the response's file, which may be released before the job is done
+  off_t offset;
+  off_t len;
+  u8 buf[FILE_IO_CHUNK];
+} file_read_job_t;
+
+// True if the byte at `offset` is in the page cache. Filesystems that cannot tell say yes.
+static bool file_resident(int fd, off_t offset) {
+  char c;
+  struct iovec iov = {.iov_base = &c, .iov_len = 1};
+  return preadv2(fd, &iov, 1, offset, RWF_NOWAIT) >= 0 || errno != EAGAIN;
+}
+
+// Decides whether sendfile() can go on from file_offset without blocking: the window ahead
+// must be resident at both ends. Pages between are read ahead by the kernel along with them.
+static bool file_window_ready(conn_t *conn) {
+  if (conn->file_offset >= conn->file_warm_start && conn->file_offset < conn->file_warm_end)
+    return true;
+  off_t len = conn->file_remaining < FILE_IO_WINDOW ? conn->file_remaining : FILE_IO_WINDOW;
+  if (!file_resident(conn->file_fd, conn->file_offset) ||
+      !file_resident(conn->file_fd, conn->file_offset + len - 1))
+    return false;
+  conn->file_warm_start = conn->file_offset;
+  conn->file_warm_end = conn->file_offset + len;
+  return true;
+}
+
+static void file_read_run(io_job_t *job) {
+  file_read_job_t *r = (file_read_job_t *)job;
+  for (off_t done = 0; done < r->len;) {
+    usize want = r->len - done < FILE_IO_CHUNK ? (usize)(r->len - done) : FILE_IO_CHUNK;
+    ssize_t n = pread(r->fd, r->buf, want, r->offset + done);
+    if (n <= 0)
+      break;
+    done += n;
+  }
+}
+
+// Keeps POSIX_FADV_WILLNEED readahead FILE_READAHEAD bytes ahead of the current part of a
+// large response, topping it up once half of it has been sent.
+static void file_advise(conn_t *conn) {
+  off_t end = conn->file_offset + conn->file_remaining;
+  if (conn->file_advised >= end || conn->file_advised - conn->file_offset >= FILE_READAHEAD / 2)
+    return;
+  off_t from = conn->file_advised > conn->file_offset ? conn->file_advised : conn->file_offset;
+  off_t to = conn->file_offset + FILE_READAHEAD < end ? conn->file_offset + FILE_READAHEAD : end;
+  posix_fadvise(conn->file_fd, from, to - from, POSIX_FADV_WILLNEED);
+  conn->file_advised = to;
+}
+
+static void set_cork(conn_t *conn, bool on) {
+  int v = on ? 1 : 0;
+  setsockopt(conn->fd, IPPROTO_TCP, TCP_CORK, &v, sizeof(v));
+  conn->file_corked = on;
+}
+
+void worker_sendfile_start(conn_t *conn) {
+  worker_state_t *ws = (worker_state_t *)conn->worker_state;
+  i64 large = ws->cfg->sendfile.large;
+  if (large > 0 && conn->file_remaining >= large && !conn->gzip && !conn->h2_stream) {
+    // A bundle's descriptor is shared by all of its small files; sequential readahead on it
+    // would only waste the page cache.
+    conn->file_large = true;
+    conn->file_advised = conn->file_offset;
+    if (!conn->file_borrowed)
+      posix_fadvise(conn->file_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    set_cork(conn, true);
+  }
+  conn_flush(conn);
+  worker_client_event_mod(conn, EV_WRITE | EV_READ | EV_HUP | EV_EDGE);
+}
+
+static void handle_write(conn_t *conn);
+
+static void file_read_done(io_job_t *job) {
+  file_read_job_t *r = (file_read_job_t *)job;
+  conn_t *conn = job->owner;
+  close(r->fd);
+  if (conn) {
+    // Even after a failed read the window counts as ready; sendfile() reports the error.
+    conn->io_job = NULL;
+    conn->file_warm_start = r->offset;
+    conn->file_warm_end = r->offset + r->len;
+    handle_write(conn);
+  }
+  free(r);
+}
+
+// Hands the read of the window at file_offset to an I/O thread; handle_write() is called
+// again once it is in memory. Returns false if the job could not be set up.
+static bool file_read_ahead(conn_t *conn) {
+  file_read_job_t *r = malloc(sizeof(*r));
+  if (!r)
+    return false;
+  r->fd = fcntl(conn->file_fd, F_DUPFD_CLOEXEC, 0);
+  if (r->fd < 0) {
+    free(r);
+    return false;
+  }
+  r->offset = conn->file_offset;
+  r->len = conn->file_remaining < FILE_IO_WINDOW ? conn->file_remaining : FILE_IO_WINDOW;
+  r->job = (io_job_t){.run = file_read_run, .done = file_read_done, .owner = conn};
+  conn->io_job = &r->job;
+  io_pool_submit(&r->job);
+  worker_client_event_mod(conn, EV_READ | EV_HUP | EV_EDGE);
+  return true;
+}
 
 static void handle_write(conn_t *conn) {
   worker_state_t *ws = (worker_state_t *)conn->worker_state;
   isize n;
 
+  // Waiting on an I/O thread; the job's completion picks up from here.
+  if (conn->io_job)
+    return;
+
+  if (conn->state == CONN_SENDFILE && conn->gzip) {
+    np_status_t rc = file_server_write_gzip(conn);
+    if (rc == NP_ERR) {
+      conn_pool_put(ws->pool, conn);
+    } else if (rc == NP_ERR_AGAIN) {
+      worker_client_event_mod(conn, EV_WRITE | EV_READ | EV_HUP | EV_EDGE);
+    } else {
+      conn_release_file(conn);
+      worker_response_done(conn);
+    }
+    return;
+  }
+
   if (conn->state == CONN_SENDFILE) {
-    if (buf_readable(&conn->wbuf) > 0) {
-      do {
-        n = buf_write_fd(&conn->wbuf, conn->fd);
-      } while (n > 0);
+    // One call sends at most sendfile_turn bytes. The rest goes out when EV_WRITE fires again:
+    // re-arming it while the socket is writable queues this connection behind the others
+    // that are ready, so large transfers take turns and small responses are not held up.
+    const np_config_t *cfg = ws->cfg;
+    off_t budget = cfg->sendfile.turn > 0 ? (off_t)cfg->sendfile.turn : (off_t)INT64_MAX;
+    for (;;) {
       if (buf_readable(&conn->wbuf) > 0) {
-        worker_client_event_mod(conn, EV_WRITE | EV_READ | EV_HUP | EV_EDGE);
-        return;
+        do {
+          n = conn_flush(conn);
+        } while (n > 0);
+        if (buf_readable(&conn->wbuf) > 0) {
+          worker_client_event_mod(conn, EV_WRITE | EV_READ | EV_HUP | EV_EDGE);
+          return;
+        }
       }
-    }
 
-    if (conn->file_remaining > 0) {
-      ssize_t sent;
-      do {
-        sent = sendfile(conn->fd, conn->file_fd, &conn->file_offset, (size_t)conn->file_remaining);
-        if (sent > 0) {
-          conn->file_remaining -= sent;
+      ssize_t sent = 0;
+      while (conn->file_remaining > 0 && budget > 0) {
+        off_t count = conn->file_remaining < budget ? conn->file_remaining : budget;
+        if (cfg->sendfile.chunk > 0 && count > cfg->sendfile.chunk)
+          count = (off_t)cfg->sendfile.chunk;
+        // With I/O threads, a window that is not in the page cache is read in by one of them
+        // first, and sendfile() goes no further than what is known to be resident.
+        if (io_pool_running()) {
+          bool ready = file_window_ready(conn);
+          if (!ready && file_read_ahead(conn))
+            return;
+          if (ready && conn->file_warm_end - conn->file_offset < count)
+            count = conn->file_warm_end - conn->file_offset;
+        } else if (conn->file_large) {
+          file_advise(conn);
+        }
+        sent = sendfile(conn->fd, conn->file_fd, &conn->file_offset, (size_t)count);
+        if (sent == 0) {
+          // End of file with bytes still owed: the file shrank after its size was taken (an
+          // open-file cache entry can be that old), so the response cannot be finished.
+          log_error("sendfile fd=%d: file ended %lld bytes early", conn->fd,
+                    (long long)conn->file_remaining);
+          conn_pool_put(ws->pool, conn);
+          return;
         }
-      } while (sent > 0 && conn->file_remaining > 0);
+        if (sent < 0)
+          break;
+        conn->bytes_sent += (u64)sent;
+        conn->file_remaining -= sent;
+        budget -= sent;
+      }
 
       if (sent < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
         log_error_errno("sendfile fd=%d", conn->fd);
         conn_pool_put(ws->pool, conn);
         return;
       }
+      // The head has gone out together with the first chunk.
+      if (conn->file_corked)
+        set_cork(conn, false);
+
+      // A multipart/byteranges body goes on with the next part once this one is out.
+      if (conn->file_remaining > 0 || !file_server_next_part(conn))
+        break;
     }
 
     if (conn->file_remaining == 0) {
-      close(conn->file_fd);
-      conn->file_fd = -1;
-
-      if (!conn->keep_alive) {
-        conn_pool_put(ws->pool, conn);
-        return;
-      }
-      arena_reset(conn->arena);
-      conn->request = NULL;
-      conn->response = NULL;
-      conn->state = CONN_READING_REQUEST;
-      worker_client_event_mod(conn, EV_READ | EV_HUP | EV_EDGE);
+      conn_release_file(conn);
+      worker_response_done(conn);
     } else {
       worker_client_event_mod(conn, EV_WRITE | EV_READ | EV_HUP | EV_EDGE);
     }
@@ -96,34 +299,137 @@ static void handle_write(conn_t *conn) {
   }
 
   if (conn->state == CONN_PROXYING || conn->state == CONN_TUNNEL) {
+    if (conn->state == CONN_TUNNEL) {
+      do {
+        n = conn_write_buf(conn, &conn->upstream_rbuf);
+      } while (n > 0);
+    } else if (proxy_write_client(conn) != NP_OK) {
+      worker_conn_close(conn);
+      return;
+    }
+
+    bool pending = buf_readable(&conn->upstream_rbuf) > 0 || buf_readable(&conn->wbuf) > 0;
+    event_loop_mod(conn->loop, conn->fd, (pending ? EV_WRITE : 0) | EV_READ | EV_HUP | EV_EDGE,
+                   on_client_event, conn);
+    // Upstream reads stop while upstream_rbuf is full; pick them up again now there is room.
+    if (conn->state == CONN_PROXYING &&
+        buf_readable(&conn->upstream_rbuf) < conn->upstream_rbuf.cap)
+      proxy_resume_upstream(conn);
+    return;
+  }
+
+  for (;;) {
     do {
-      n = buf_write_fd(&conn->upstream_rbuf, conn->fd);
+      n = conn_flush(conn);
     } while (n > 0);
-
-    if (buf_readable(&conn->upstream_rbuf) == 0) {
-      event_loop_mod(conn->loop, conn->fd, EV_READ | EV_HUP | EV_EDGE, on_client_event, conn);
-    } else {
-      event_loop_mod(conn->loop, conn->fd, EV_WRITE | EV_READ | EV_HUP | EV_EDGE, on_client_event,
-                     conn);
+    // A gzipped body whose end did not fit wbuf is finished as wbuf drains.
+    if (!conn->gzip || conn_pending_out(conn) > 0)
+      break;
+    np_status_t rc = gzip_stream_deflate(conn->gzip, &conn->wbuf, GZIP_FINISH);
+    if (rc == NP_ERR) {
+      worker_conn_close(conn);
+      return;
     }
-    return;
+    if (rc == NP_OK)
+      conn_release_gzip(conn);
+  }
+
+  if (conn_pending_out(conn) == 0)
+    worker_response_done(conn);
+}
+
+static void reject_request(conn_t *conn, int status) {
+  response_send_error(conn, status, false);
+  conn->keep_alive = false;
+  conn->state = CONN_WRITING_RESPONSE;
+  event_loop_mod(conn->loop, conn->fd, EV_WRITE | EV_HUP | EV_EDGE, on_client_event, conn);
+}
+
+// Sends what the handler produced. Returns true once the response is out and the connection
+// waits for its next request.
+static bool dispatch_finish(conn_t *conn) {
+  if (conn->state == CONN_PROXYING || conn->state == CONN_TUNNEL ||
+      conn->state == CONN_SENDFILE || conn->state == CONN_WAITING_IO) {
+    return false;
   }
+  // A local handler answered before the body was read; the rest of it cannot be skipped.
+  if (((http_request_t *)conn->request)->body_pending)
+    conn->keep_alive = false;
 
+  isize sent;
   do {
-    n = buf_write_fd(&conn->wbuf, conn->fd);
-  } while (n > 0);
+    sent = conn_flush(conn);
+  } while (sent > 0);
+
+  if (conn_pending_out(conn) == 0)
+    return finish_response(conn);
+  conn->state = CONN_WRITING_RESPONSE;
+  event_loop_mod(conn->loop, conn->fd, EV_WRITE | EV_HUP | EV_EDGE, on_client_event, conn);
+  return false;
+}
+
+static bool dispatch_request(conn_t *conn, http_request_t *req) {
+  worker_state_t *ws = (worker_state_t *)conn->worker_state;
+  handler_dispatch(conn, req, &ws->hctx);
+  return dispatch_finish(conn);
+}
+
+void worker_dispatch_resume(conn_t *conn) {
+  if (dispatch_finish(conn) && buf_readable(&conn->rbuf) > 0)
+    handle_read(conn);
+}
+
+static void spool_request_body(conn_t *conn) {
+  worker_state_t *ws = (worker_state_t *)conn->worker_state;
+  http_request_t *req = (http_request_t *)conn->request;
+
+  for (;;) {
+    while (!conn->body.done && buf_readable(&conn->rbuf) > 0) {
+      u8 *raw = buf_read_ptr(&conn->rbuf);
+      usize raw_len = buf_readable(&conn->rbuf);
+      usize consumed, out_len;
+      body_result_t br =
+          http_body_decode(&conn->body, raw, raw_len, &consumed, raw, raw_len, &out_len);
+      if (br == BODY_TOO_LARGE || br == BODY_ERROR) {
+        reject_request(conn, br == BODY_TOO_LARGE ? 413 : 400);
+        return;
+      }
+      if (out_len > 0 && write(conn->body_fd, raw, out_len) != (isize)out_len) {
+        log_error_errno("request body spool write");
+        reject_request(conn, 500);
+        return;
+      }
+      buf_consume(&conn->rbuf, consumed);
+    }
+    if (conn->body.done)
+      break;
 
-  if (buf_readable(&conn->wbuf) == 0) {
-    if (conn->state == CONN_CLOSING || !conn->keep_alive) {
+    isize n = buf_read_fd(&conn->rbuf, conn->fd);
+    if (n == NP_ERR_AGAIN)
+      return;
+    if (n <= 0) {
       conn_pool_put(ws->pool, conn);
       return;
     }
-    arena_reset(conn->arena);
-    conn->request = NULL;
-    conn->response = NULL;
-    conn->state = CONN_READING_REQUEST;
-    event_loop_mod(conn->loop, conn->fd, EV_READ | EV_HUP | EV_EDGE, on_client_event, conn);
   }
+
+  usize len = (usize)conn->body.received;
+  if (len > 0) {
+    void *map = mmap(NULL, len, PROT_READ, MAP_PRIVATE, conn->body_fd, 0);
+    if (map == MAP_FAILED) {
+      log_error_errno("request body spool mmap");
+      reject_request(conn, 500);
+      return;
+    }
+    conn->body_map = map;
+    conn->body_map_len = len;
+    req->body = (str_t){.ptr = map, .len = len};
+  }
+  req->body_pending = false;
+  req->keep_alive = conn->keep_alive;
+  conn->state = CONN_READING_REQUEST;
+  if (dispatch_request(conn, req) && buf_readable(&conn->rbuf) > 0)
+    handle_read(conn);
 }
 
 static void handle_read(conn_t *conn) {
@@ -162,6 +468,24 @@ static void handle_read(conn_t *conn) {
     return;
   }
 
+  if (conn->state == CONN_PROXYING && !conn->body.done) {
+    proxy_pump_request_body(conn);
+    return;
+  }
+
+  if (conn->state == CONN_READING_BODY) {
+    spool_request_body(conn);
+    return;
+  }
+
+  // The request being answered is logged once its response is done, but its fields point into
+  // rbuf, which the read below compacts and refills with whatever the client pipelined.
+  if (conn->state != CONN_READING_REQUEST && access_log_enabled() &&
+      conn_detach_request(conn) != NP_OK) {
+    conn_pool_put(ws->pool, conn);
+    return;
+  }
+
   do {
     n = buf_read_fd(&conn->rbuf, conn->fd);
   } while (n > 0);
@@ -175,58 +499,116 @@ static void handle_read(conn_t *conn) {
     return;
   }
 
+  // Pipelined requests already in rbuf are served back to back.
+  while (conn->state == CONN_READING_REQUEST && buf_readable(&conn->rbuf) > 0) {
+    if (!process_request(conn))
+      return;
+  }
+}
+
+// Parses and dispatches the request at the front of rbuf. Returns true if it was answered
+// and the connection is ready for the next one.
+static bool process_request(conn_t *conn) {
+  worker_state_t *ws = (worker_state_t *)conn->worker_state;
   usize avail = buf_readable(&conn->rbuf);
-  if (avail == 0)
-    return;
+
+  if (ws->cfg->http2) {
+    int preface = h2_preface_check(buf_read_ptr(&conn->rbuf), avail);
+    if (preface == 0)
+      return false;
+    if (preface == 1) {
+      if (h2_session_start(conn, &ws->hctx) != NP_OK) {
+        conn_pool_put(ws->pool, conn);
+        return false;
+      }
+      h2_on_client_event(conn, EV_READ);
+      return false;
+    }
+  }
 
   http_parse_state_t ps;
   http_parse_state_init(&ps);
   parse_result_t pr = http_parse_request(&ps, buf_read_ptr(&conn->rbuf), avail);
 
-  if (pr == PARSE_INCOMPLETE)
-    return;
+  if (pr == PARSE_INCOMPLETE) {
+    if (buf_writable(&conn->rbuf) == 0)
+      reject_request(conn, 431);
+    return false;
+  }
   if (pr == PARSE_ERROR) {
-    response_write_error(&conn->wbuf, 400, false);
-    conn->state = CONN_WRITING_RESPONSE;
-    event_loop_mod(conn->loop, conn->fd, EV_WRITE | EV_HUP | EV_EDGE, on_client_event, conn);
-    return;
+    reject_request(conn, 400);
+    return false;
   }
 
   http_request_t *req = request_create(conn->arena);
   if (!req) {
     conn_pool_put(ws->pool, conn);
-    return;
+    return false;
   }
-  request_populate(req, &ps, buf_read_ptr(&conn->rbuf), avail);
-  buf_consume(&conn->rbuf, ps.parsed_bytes);
+  request_populate(req, &ps);
   conn->keep_alive = ps.keep_alive;
   conn->request = req;
 
-  handler_dispatch(conn, req, &ws->hctx);
-
-  if (conn->state == CONN_PROXYING || conn->state == CONN_TUNNEL) {
-    return;
+  // Both checks run on the head alone, so a client waiting on 100-continue never sends a body
+  // that would be refused.
+  if (ps.expect_unknown) {
+    reject_request(conn, 417);
+    return false;
+  }
+  i64 max_body = ws->cfg->client_max_body_size;
+  if (max_body > 0 && ps.content_length > max_body) {
+    reject_request(conn, 413);
+    return false;
+  }
+  http_body_init(&conn->body, ps.content_length, ps.chunked, max_body);
+
+  u8 *raw = buf_read_ptr(&conn->rbuf) + ps.body_offset;
+  usize raw_len = avail - ps.body_offset;
+  usize consumed, out_len;
+  http_body_t probe = conn->body;
+  body_result_t br = http_body_decode(&probe, raw, raw_len, &consumed, NULL, 0, &out_len);
+  if (br == BODY_TOO_LARGE || br == BODY_ERROR) {
+    reject_request(conn, br == BODY_TOO_LARGE ? 413 : 400);
+    return false;
   }
 
-  isize sent;
-  do {
-    sent = buf_write_fd(&conn->wbuf, conn->fd);
-  } while (sent > 0);
+  if (br == BODY_DONE) {
+    req->expect_continue = false;
+    http_body_decode(&conn->body, raw, raw_len, &consumed, raw, raw_len, &out_len);
+    if (out_len > 0)
+      req->body = (str_t){.ptr = (const char *)raw, .len = out_len};
+    buf_consume(&conn->rbuf, ps.body_offset + consumed);
+    return dispatch_request(conn, req);
+  }
 
-  if (buf_readable(&conn->wbuf) == 0) {
-    if (!conn->keep_alive) {
-      conn_pool_put(ws->pool, conn);
-      return;
-    }
-    arena_reset(conn->arena);
-    conn->request = NULL;
-    conn->response = NULL;
-    conn->state = CONN_READING_REQUEST;
-    event_loop_mod(conn->loop, conn->fd, EV_READ | EV_HUP | EV_EDGE, on_client_event, conn);
-  } else {
-    conn->state = CONN_WRITING_RESPONSE;
-    event_loop_mod(conn->loop, conn->fd, EV_WRITE | EV_HUP | EV_EDGE, on_client_event, conn);
+  // The body extends past what is buffered: move the head out of rbuf and stream the rest,
+  // either straight to the upstream or into a spool file for local handlers.
+  if (request_detach(req, conn->arena, buf_read_ptr(&conn->rbuf), ps.body_offset) != NP_OK) {
+    conn_pool_put(ws->pool, conn);
+    return false;
   }
+  buf_consume(&conn->rbuf, ps.body_offset);
+  req->body_pending = true;
+  req->keep_alive = false;
+  // A client that already started on its body did not wait for the interim response.
+  if (raw_len > 0)
+    req->expect_continue = false;
+
+  np_server_config_t *server = handler_select_server(&ws->hctx, req);
+  if (handler_proxy_pool(&ws->hctx, server, location_find(server, req->path)))
+    return dispatch_request(conn, req);
+
+  conn->body_fd = http_body_spool_open(ws->cfg->client_body_temp_path);
+  if (conn->body_fd < 0) {
+    log_error_errno("cannot create request body spool in %s", ws->cfg->client_body_temp_path);
+    reject_request(conn, 500);
+    return false;
+  }
+  conn->state = CONN_READING_BODY;
+  if (req->expect_continue)
+    response_send_continue(conn);
+  spool_request_body(conn);
+  return false;
 }
 
 static void on_client_event(int fd, u32 events, void *arg) {
@@ -241,6 +623,11 @@ static void on_client_event(int fd, u32 events, void *arg) {
     return;
   }
 
+  if (conn->state == CONN_H2) {
+    h2_on_client_event(conn, events);
+    return;
+  }
+
   if (events & EV_READ)
     handle_read(conn);
   if (events & EV_WRITE)
@@ -296,6 +683,8 @@ int worker_run(np_config_t *cfg, np_socket_t *listeners, int listener_count, int
   ws.running = 1;
   ws.now = time(NULL);
 
+  response_init(cfg);
+
   ws.loop = event_loop_create(NP_EPOLL_EVENTS);
   if (!ws.loop)
     return 1;
@@ -309,12 +698,40 @@ int worker_run(np_config_t *cfg, np_socket_t *listeners, int listener_count, int
     return 1;
 
   ws.hctx.config = cfg;
+  ws.hctx.upstream_pools = calloc((usize)cfg->server_count, sizeof(void *));
+  ws.hctx.cache_stores = calloc((usize)cfg->server_count, sizeof(void *));
+  ws.hctx.bundles = calloc((usize)cfg->server_count, sizeof(void *));
+  if (!ws.hctx.upstream_pools || !ws.hctx.cache_stores || !ws.hctx.bundles)
+    return 1;
   for (int i = 0; i < cfg->server_count; i++) {
     ws.hctx.upstream_pools[i] =
-        cfg->servers[i].proxy.enabled ? upstream_pool_create(&cfg->servers[i]) : NULL;
+        cfg->servers[i].proxy.enabled ? upstream_pool_create(&cfg->servers[i].proxy) : NULL;
+  }
+  ws.hctx.rate_limiter = cfg->rate_limit.enabled
+                             ? rate_limiter_create(cfg->rate_limit.requests_per_second,
+                                                   cfg->rate_limit.burst)
+                             : NULL;
+  if (cfg->location_count > 0) {
+    ws.hctx.location_pools = calloc((usize)cfg->location_count, sizeof(void *));
+    ws.hctx.location_limiters = calloc((usize)cfg->location_count, sizeof(void *));
+    if (!ws.hctx.location_pools || !ws.hctx.location_limiters)
+      return 1;
+  }
+  for (int i = 0; i < cfg->server_count; i++) {
+    for (int j = 0; j < cfg->servers[i].location_count; j++) {
+      const np_location_t *loc = &cfg->servers[i].locations[j];
+      if (loc->proxy.backend_count > 0)
+        ws.hctx.location_pools[loc->id] = upstream_pool_create(&loc->proxy);
+      if (loc->rate_limit > 0)
+        ws.hctx.location_limiters[loc->id] =
+            rate_limiter_create(loc->requests_per_second, loc->burst);
+    }
   }
-  ws.hctx.rate_limiter = cfg->rate_limit.enabled ? rate_limiter_create(cfg) : NULL;
   ws.hctx.metrics = cfg->metrics.enabled ? metrics_create() : NULL;
+  for (int i = 0; i < cfg->server_count && !ws.hctx.gzip_pool; i++) {
+    if (cfg->servers[i].gzip.enabled)
+      ws.hctx.gzip_pool = gzip_pool_create(NP_GZIP_POOL_SIZE);
+  }
 
   for (int i = 0; i < cfg->server_count; i++) {
     if (cfg->servers[i].cache.enabled && cfg->servers[i].cache.root[0] != '\0') {
@@ -326,7 +743,16 @@ int worker_run(np_config_t *cfg, np_socket_t *listeners, int listener_count, int
     }
   }
 
-  access_log_init(cfg->log.access_log);
+  for (int i = 0; i < cfg->server_count; i++) {
+    if (cfg->servers[i].static_bundle[0] != '\0')
+      ws.hctx.bundles[i] = bundle_open(cfg->servers[i].static_bundle);
+  }
+
+  access_log_init(cfg, ws.loop, worker_id);
+  open_file_cache_init(cfg, ws.loop);
+  if (io_pool_init(cfg->io_threads, ws.loop) != NP_OK)
+    log_warn("worker[%d] runs without I/O threads", worker_id);
+  log_async_start(cfg->log.error_log_buffer > 0 ? (usize)cfg->log.error_log_buffer : 0);
 
   signal_init(ws.loop, &ws.running);
 
@@ -347,6 +773,7 @@ int worker_run(np_config_t *cfg, np_socket_t *listeners, int listener_count, int
   }
   if (ws.active_conns > 0)
     log_warn("worker[%d] timeout, %d connections still active", worker_id, ws.active_conns);
+  io_pool_destroy();
 
   for (int i = 0; i < ws.cfg->server_count; i++) {
     if (ws.hctx.upstream_pools[i]) {
@@ -355,27 +782,69 @@ int worker_run(np_config_t *cfg, np_socket_t *listeners, int listener_count, int
   }
   if (ws.hctx.rate_limiter)
     rate_limiter_destroy(ws.hctx.rate_limiter);
+  for (int i = 0; i < cfg->location_count; i++) {
+    if (ws.hctx.location_pools[i])
+      upstream_pool_destroy(ws.hctx.location_pools[i]);
+    if (ws.hctx.location_limiters[i])
+      rate_limiter_destroy(ws.hctx.location_limiters[i]);
+  }
+  free(ws.hctx.location_pools);
+  free(ws.hctx.location_limiters);
   if (ws.hctx.metrics)
     metrics_destroy(ws.hctx.metrics);
   for (int i = 0; i < ws.cfg->server_count; i++) {
     if (ws.hctx.cache_stores[i])
       cache_store_destroy(ws.hctx.cache_stores[i]);
   }
+  free(ws.hctx.upstream_pools);
+  free(ws.hctx.cache_stores);
   conn_pool_destroy(ws.pool);
+  for (int i = 0; i < ws.cfg->server_count; i++)
+    bundle_close(ws.hctx.bundles[i]);
+  free(ws.hctx.bundles);
+  open_file_cache_destroy();
+  gzip_pool_destroy(ws.hctx.gzip_pool);
   timeout_wheel_destroy(ws.tw);
   event_loop_destroy(ws.loop);
   access_log_close();
 
   log_info("worker[%d] exiting", worker_id);
+  log_async_stop();
   return 0;
 }
 
 void worker_conn_close(conn_t *conn) {
   worker_state_t *ws = (worker_state_t *)conn->worker_state;
+  if (conn->h2_stream) {
+    h2_stream_close(conn);
+    return;
+  }
   ws->active_conns--;
   conn_pool_put(ws->pool, conn);
 }
 
+void worker_response_done(conn_t *conn) {
+  if (finish_response(conn) && buf_readable(&conn->rbuf) > 0)
+    handle_read(conn);
+}
+
 void worker_client_event_mod(conn_t *conn, u32 events) {
+  if (conn->h2_stream) {
+    h2_stream_wake(conn);
+    return;
+  }
   event_loop_mod(conn->loop, conn->fd, events, on_client_event, conn);
 }
+
+conn_t *worker_conn_spawn(conn_t *parent) {
+  worker_state_t *ws = (worker_state_t *)parent->worker_state;
+  conn_t *conn = conn_pool_get(ws->pool, -1, &parent->peer, parent->loop);
+  if (conn)
+    conn->worker_state = ws;
+  return conn;
+}
+
+void worker_conn_release(conn_t *conn) {
+  worker_state_t *ws = (worker_state_t *)conn->worker_state;
+  conn_pool_put(ws->pool, conn);
+}
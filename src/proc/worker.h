@@ -9,5 +9,18 @@ int worker_run(np_config_t *cfg, np_socket_t *listeners, int listener_count, int
 
 void worker_conn_close(conn_t *conn);
 void worker_client_event_mod(conn_t *conn, u32 events);
+// The file server has queued the head of a CONN_SENDFILE response: sets up large-file sending,
+// writes the head and waits for the socket to take the body.
+void worker_sendfile_start(conn_t *conn);
+// The response is fully written: closes the connection or, with keep-alive, resets it and
+// serves any request the client already pipelined.
+void worker_response_done(conn_t *conn);
+// A handler that left the request in CONN_WAITING_IO has produced its response: sends it as
+// if the handler had just returned.
+void worker_dispatch_resume(conn_t *conn);
+
+// Stream connections carry one HTTP/2 stream through the handlers; they have no socket.
+conn_t *worker_conn_spawn(conn_t *parent);
+void worker_conn_release(conn_t *conn);
 
 #endif
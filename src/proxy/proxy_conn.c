@@ -1,5 +1,6 @@
 #include "proxy/proxy_conn.h"
 
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -7,19 +8,40 @@
 
 #include "cache/cache.h"
 #include "core/log.h"
-#include "features/access_log.h"
+#include "features/compress.h"
 #include "features/metrics.h"
+#include "http/body.h"
 #include "http/response.h"
+#include "http2/h2_conn.h"
 #include "net/event_loop.h"
 #include "net/socket.h"
 #include "proc/worker.h"
 #include "proxy/upstream.h"
+#include "proxy/upstream_h2.h"
 
 static void send_error(conn_t *conn, int status) {
-  response_write_error(&conn->wbuf, status, false);
+  if (!conn->body.done)
+    conn->keep_alive = false;
+  response_send_error(conn, status, conn->keep_alive);
   conn->state = CONN_WRITING_RESPONSE;
 }
 
+// Copies as much of an already buffered request body as fits; a large spooled body is fed in
+// pieces as the upstream drains.
+static void feed_buffered_body(conn_t *conn) {
+  http_request_t *req = (http_request_t *)conn->request;
+  if (!req || conn->body_sent >= req->body.len)
+    return;
+  np_buf_t *out = &conn->upstream_wbuf;
+  buf_compact(out);
+  usize n = req->body.len - conn->body_sent;
+  if (n > buf_writable(out))
+    n = buf_writable(out);
+  memcpy(buf_write_ptr(out), req->body.ptr + conn->body_sent, n);
+  buf_produce(out, n);
+  conn->body_sent += n;
+}
+
 static void build_proxy_request(conn_t *conn, http_request_t *req) {
   char buf[NP_MAX_HEADER_LEN];
   int n = snprintf(buf, sizeof(buf),
@@ -30,13 +52,15 @@ static void build_proxy_request(conn_t *conn, http_request_t *req) {
                    "X-Real-IP: %s\r\n"
                    "X-Forwarded-For: %s\r\n"
                    "Connection: %s\r\n",
-                   http_method_str(req->method), STR_ARG(req->path),
+                   http_method_str(req->method), STR_ARG(request_target(req)),
                    STR_ARG(request_header(req, STR("Host"))), req->remote_ip, req->remote_ip,
                    req->upgrade ? "Upgrade" : "keep-alive");
 
   for (int i = 0; i < req->header_count; i++) {
     str_t name = req->headers[i].name;
-    if (str_ieq(name, STR("Host")) || str_ieq(name, STR("Connection")))
+    if (str_ieq(name, STR("Host")) || str_ieq(name, STR("Connection")) ||
+        str_ieq(name, STR("Content-Length")) || str_ieq(name, STR("Transfer-Encoding")) ||
+        str_ieq(name, STR("Expect")))
       continue;
     int hn = snprintf(buf + n, sizeof(buf) - (usize)n, STR_FMT ": " STR_FMT "\r\n", STR_ARG(name),
                       STR_ARG(req->headers[i].value));
@@ -44,6 +68,22 @@ static void build_proxy_request(conn_t *conn, http_request_t *req) {
       n += hn;
   }
 
+  // The body is re-framed: a fully buffered body is sent with its decoded length, a streamed
+  // chunked body is re-chunked as it is decoded.
+  if (req->body_pending && conn->body.mode == BODY_CHUNKED) {
+    n += snprintf(buf + n, sizeof(buf) - (usize)n, "Transfer-Encoding: chunked\r\n");
+  } else if (req->body_pending) {
+    n += snprintf(buf + n, sizeof(buf) - (usize)n, "Content-Length: %lld\r\n",
+                  (long long)req->content_length);
+  } else if (req->body.len > 0 || req->chunked || request_header(req, STR("Content-Length")).ptr) {
+    n += snprintf(buf + n, sizeof(buf) - (usize)n, "Content-Length: %zu\r\n", req->body.len);
+  }
+
+  // The client still waits for a go-ahead: the backend gives it, and its interim response is
+  // relayed like any other.
+  if (req->body_pending && req->expect_continue)
+    n += snprintf(buf + n, sizeof(buf) - (usize)n, "Expect: 100-continue\r\n");
+
   n += snprintf(buf + n, sizeof(buf) - (usize)n, "\r\n");
 
   if (n > 0 && buf_writable(&conn->upstream_wbuf) >= (usize)n) {
@@ -51,24 +91,403 @@ static void build_proxy_request(conn_t *conn, http_request_t *req) {
     buf_produce(&conn->upstream_wbuf, (usize)n);
   }
 
-  if (req->body.len > 0 && buf_writable(&conn->upstream_wbuf) >= req->body.len) {
-    memcpy(buf_write_ptr(&conn->upstream_wbuf), req->body.ptr, req->body.len);
-    buf_produce(&conn->upstream_wbuf, req->body.len);
+  conn->body_sent = 0;
+  feed_buffered_body(conn);
+}
+
+// The record is written once what the client is still owed has gone out.
+static void log_proxied(conn_t *conn) {
+  conn_log_response(conn, conn->proxy_status);
+}
+
+// Copies freshly read upstream bytes into the response being captured for the cache.
+static void cache_capture(conn_t *conn, const u8 *data, usize len) {
+  if (!conn->cache_store || len == 0)
+    return;
+  usize needed = conn->cache_len + len;
+  if (needed > conn->cache_cap) {
+    usize new_cap = needed * 2;
+    if (new_cap < 8192)
+      new_cap = 8192;
+    u8 *nb = realloc(conn->cache_buf, new_cap);
+    if (nb) {
+      conn->cache_buf = nb;
+      conn->cache_cap = new_cap;
+    }
+  }
+  if (conn->cache_buf && conn->cache_len + len <= conn->cache_cap) {
+    memcpy(conn->cache_buf + conn->cache_len, data, len);
+    conn->cache_len += len;
+  }
+}
+
+static void cache_commit(conn_t *conn) {
+  if (conn->cache_store && conn->cache_buf && conn->cache_len > 0)
+    cache_insert(conn->cache_store, &conn->cache_key, 200, conn->cache_buf, conn->cache_len, NULL,
+                 0, conn->cache_ttl > 0 ? conn->cache_ttl : 10);
+  free(conn->cache_buf);
+  conn->cache_buf = NULL;
+  conn->cache_len = 0;
+  conn->cache_cap = 0;
+}
+
+// A response is compressed when the client takes gzip and the backend did not encode it
+// already; statuses, types and sizes follow the usual gzip_types defaults.
+static bool gzip_wanted(const conn_t *conn, const http_response_state_t *rs) {
+  if (!conn->gzip_pool || (rs->status != 200 && rs->status != 403 && rs->status != 404))
+    return false;
+  if (conn->upstream_phase == UPSTREAM_RESP_DONE ||
+      (rs->content_length >= 0 && rs->content_length < conn->gzip_min_length))
+    return false;
+  bool typed = false;
+  for (int i = 0; i < rs->header_count; i++) {
+    const http_header_t *h = &rs->headers[i];
+    if (str_ieq(h->name, STR("Content-Encoding")) && !str_ieq(h->value, STR("identity")))
+      return false;
+    if (str_ieq(h->name, STR("Cache-Control")) && str_contains_i(h->value, STR("no-transform")))
+      return false;
+    if (str_ieq(h->name, STR("Content-Type")))
+      typed = should_compress(h->value);
+  }
+  return typed;
+}
+
+static void put(np_buf_t *out, const void *p, usize n) {
+  memcpy(buf_write_ptr(out), p, n);
+  buf_produce(out, n);
+}
+
+#define PUT_STR(out, s) put((out), (s), sizeof(s) - 1)
+
+// Switches the response whose head of `head_len` bytes was just framed over to gzip:
+// the head is rewritten into wbuf for a chunked, gzip-encoded body, and from here on body bytes
+// are taken out of upstream_rbuf by the gzip stream rather than relayed. Interim heads still
+// waiting in upstream_rbuf move to wbuf first to keep their order. Returns false, changing
+// nothing, if no stream is free or wbuf lacks room.
+static bool gzip_start(conn_t *conn, const http_response_state_t *rs, usize head_len) {
+  np_buf_t *b = &conn->upstream_rbuf;
+  np_buf_t *out = &conn->wbuf;
+  const u8 *head = buf_write_ptr(b) - conn->upstream_unscanned - head_len;
+  usize interim = (usize)(head - buf_read_ptr(b));
+  buf_compact(out);
+  if (buf_writable(out) < interim + head_len + 4 * (usize)rs->header_count + 128)
+    return false;
+  conn->gzip = gzip_stream_acquire(conn->gzip_pool, conn->gzip_level);
+  if (!conn->gzip)
+    return false;
+
+  put(out, buf_read_ptr(b), interim);
+  const u8 *eol = memchr(head, '\n', head_len);
+  put(out, head, (usize)(eol - head) + 1);
+  bool vary = false;
+  for (int i = 0; i < rs->header_count; i++) {
+    const http_header_t *h = &rs->headers[i];
+    if (str_ieq(h->name, STR("Content-Length")) || str_ieq(h->name, STR("Transfer-Encoding")) ||
+        str_ieq(h->name, STR("Content-Encoding")) || str_ieq(h->name, STR("Accept-Ranges")))
+      continue;
+    put(out, h->name.ptr, h->name.len);
+    PUT_STR(out, ": ");
+    if (str_ieq(h->name, STR("ETag")) && h->value.len > 0 && h->value.ptr[0] == '"')
+      PUT_STR(out, "W/");
+    put(out, h->value.ptr, h->value.len);
+    if (str_ieq(h->name, STR("Vary"))) {
+      vary = true;
+      if (!str_contains_i(h->value, STR("Accept-Encoding")) && !str_eq(h->value, STR("*")))
+        PUT_STR(out, ", Accept-Encoding");
+    }
+    PUT_STR(out, "\r\n");
+  }
+  if (!vary)
+    PUT_STR(out, "Vary: Accept-Encoding\r\n");
+  PUT_STR(out, "Content-Encoding: gzip\r\nTransfer-Encoding: chunked\r\n\r\n");
+
+  buf_consume(b, interim + head_len);
+  return true;
+}
+
+// Decodes buffered upstream body bytes into the gzip stream and deflates them into wbuf. Stops
+// when wbuf is full; proxy_write_client() carries on as the client drains it.
+static np_status_t gzip_upstream_body(conn_t *conn) {
+  np_buf_t *b = &conn->upstream_rbuf;
+  for (;;) {
+    bool starved = false;
+    usize room;
+    u8 *in = gzip_stream_input(conn->gzip, &room);
+    while (room > 0 && conn->upstream_unscanned > 0 &&
+           conn->upstream_phase != UPSTREAM_RESP_DONE) {
+      usize consumed, out_len;
+      if (conn->upstream_phase == UPSTREAM_RESP_UNTIL_CLOSE) {
+        consumed = out_len = conn->upstream_unscanned < room ? conn->upstream_unscanned : room;
+        memcpy(in, buf_read_ptr(b), consumed);
+      } else {
+        body_result_t br = http_body_decode(&conn->upstream_body, buf_read_ptr(b),
+                                            conn->upstream_unscanned, &consumed, in, room,
+                                            &out_len);
+        if (br == BODY_ERROR || br == BODY_TOO_LARGE)
+          return NP_ERR;
+        if (br == BODY_DONE) {
+          conn->upstream_phase = UPSTREAM_RESP_DONE;
+        } else if (consumed == 0) {
+          starved = true;
+          break;
+        }
+      }
+      buf_consume(b, consumed);
+      conn->upstream_unscanned -= consumed;
+      gzip_stream_commit(conn->gzip, out_len);
+      in += out_len;
+      room -= out_len;
+    }
+
+    bool done = conn->upstream_phase == UPSTREAM_RESP_DONE;
+    np_status_t rc =
+        gzip_stream_deflate(conn->gzip, &conn->wbuf, done ? GZIP_FINISH : GZIP_NO_FLUSH);
+    if (rc != NP_OK)
+      return rc == NP_ERR_AGAIN ? NP_OK : NP_ERR;
+    if (done || starved || conn->upstream_unscanned == 0)
+      return NP_OK;
+  }
+}
+
+// Runs the unscanned tail of upstream_rbuf through the HTTP/1.1 response framing: status
+// line and headers, then a Content-Length, chunked or close-delimited body. Interim 1xx
+// heads pass through. Bytes past the end of the response are dropped and the socket is not
+// reused. Returns NP_ERR for a response that cannot be framed.
+static np_status_t frame_upstream_response(conn_t *conn) {
+  np_buf_t *b = &conn->upstream_rbuf;
+  while (conn->upstream_unscanned > 0) {
+    const u8 *p = buf_write_ptr(b) - conn->upstream_unscanned;
+
+    if (conn->upstream_phase == UPSTREAM_RESP_HEAD) {
+      http_response_state_t rs;
+      http_response_state_init(&rs);
+      parse_result_t pr = http_parse_response(&rs, p, conn->upstream_unscanned);
+      if (pr == PARSE_INCOMPLETE)
+        return conn->upstream_unscanned < b->cap ? NP_OK : NP_ERR;
+      if (pr == PARSE_ERROR)
+        return NP_ERR;
+      conn->upstream_unscanned -= rs.body_offset;
+      if (rs.status < 200)
+        continue;
+
+      http_request_t *req = (http_request_t *)conn->request;
+      conn->proxy_status = rs.status;
+      conn->upstream_reusable = rs.keep_alive;
+      if ((req && req->method == HTTP_METHOD_HEAD) || rs.status == 204 || rs.status == 304) {
+        conn->upstream_phase = UPSTREAM_RESP_DONE;
+      } else if (rs.chunked || rs.content_length >= 0) {
+        http_body_init(&conn->upstream_body, rs.content_length, rs.chunked, 0);
+        conn->upstream_phase = conn->upstream_body.done ? UPSTREAM_RESP_DONE : UPSTREAM_RESP_BODY;
+      } else {
+        conn->upstream_reusable = false;
+        conn->upstream_phase = UPSTREAM_RESP_UNTIL_CLOSE;
+      }
+      if (gzip_wanted(conn, &rs))
+        gzip_start(conn, &rs, rs.body_offset);
+    } else if (conn->gzip && conn->upstream_phase != UPSTREAM_RESP_DONE) {
+      if (gzip_upstream_body(conn) != NP_OK)
+        return NP_ERR;
+      if (conn->upstream_phase != UPSTREAM_RESP_DONE)
+        return NP_OK;
+    } else if (conn->upstream_phase == UPSTREAM_RESP_BODY) {
+      usize consumed, out_len;
+      body_result_t br = http_body_decode(&conn->upstream_body, p, conn->upstream_unscanned,
+                                          &consumed, NULL, 0, &out_len);
+      if (br == BODY_ERROR || br == BODY_TOO_LARGE)
+        return NP_ERR;
+      conn->upstream_unscanned -= consumed;
+      if (br == BODY_DONE)
+        conn->upstream_phase = UPSTREAM_RESP_DONE;
+      else if (consumed == 0)
+        return NP_OK;
+    } else if (conn->upstream_phase == UPSTREAM_RESP_UNTIL_CLOSE) {
+      conn->upstream_unscanned = 0;
+    } else {
+      log_warn("proxy: %zu stray bytes after upstream response", conn->upstream_unscanned);
+      b->write_pos -= conn->upstream_unscanned;
+      conn->upstream_unscanned = 0;
+      conn->upstream_reusable = false;
+    }
+  }
+  return NP_OK;
+}
+
+// A gzipped response goes out of wbuf, which is refilled from upstream_rbuf as it drains.
+static np_status_t write_gzipped(conn_t *conn) {
+  for (;;) {
+    if (frame_upstream_response(conn) != NP_OK)
+      return NP_ERR;
+    isize n = conn_flush(conn);
+    if (n == NP_ERR_AGAIN)
+      return NP_OK;
+    if (n < 0)
+      return NP_ERR;
+    // Nothing came out: with the upstream gone, a body that cannot go on from what is
+    // buffered was cut short.
+    if (n == 0)
+      return conn->upstream_fd < 0 && conn->upstream_phase != UPSTREAM_RESP_DONE ? NP_ERR : NP_OK;
+  }
+}
+
+np_status_t proxy_write_client(conn_t *conn) {
+  if (conn->gzip)
+    return write_gzipped(conn);
+  np_buf_t *b = &conn->upstream_rbuf;
+  for (;;) {
+    usize ready = buf_readable(b) - conn->upstream_unscanned;
+    if (ready == 0)
+      return NP_OK;
+    isize n = write(conn->fd, buf_read_ptr(b), ready);
+    if (n > 0) {
+      buf_consume(b, (usize)n);
+      conn->bytes_sent += (u64)n;
+    } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      return NP_OK;
+    } else {
+      return NP_ERR;
+    }
+  }
+}
+
+// Takes the upstream socket off the connection: back into the backend's idle pool when the
+// exchange left it clean, closed otherwise.
+static void release_upstream(conn_t *conn, bool reuse, bool failed) {
+  upstream_pool_t *pool = (upstream_pool_t *)conn->proxy_pool;
+  upstream_backend_t *be = (upstream_backend_t *)conn->tls_conn;
+  int fd = conn->upstream_fd;
+  if (fd >= 0) {
+    event_loop_del(conn->loop, fd);
+    conn->upstream_fd = -1;
+    if (reuse && be)
+      upstream_put_connection(pool, be, fd);
+    else
+      close(fd);
+  }
+  if (be) {
+    upstream_release(pool, be, failed);
+    conn->tls_conn = NULL;
+  }
+}
+
+// The upstream response is fully in upstream_rbuf; what the client has not taken yet goes out
+// like a local response. The client connection then stays open for its next request unless
+// part of this request's body was never read.
+static void finish_client_response(conn_t *conn) {
+  if (!conn->body.done)
+    conn->keep_alive = false;
+  // The compressed tail is in wbuf or still to be produced; the write path finishes it.
+  if (conn->gzip) {
+    conn->state = CONN_WRITING_RESPONSE;
+    worker_client_event_mod(conn, EV_WRITE | EV_HUP | EV_EDGE);
+    return;
+  }
+  usize left = buf_readable(&conn->upstream_rbuf);
+  if (left == 0) {
+    worker_response_done(conn);
+    return;
+  }
+  buf_reset(&conn->wbuf);
+  memcpy(buf_write_ptr(&conn->wbuf), buf_read_ptr(&conn->upstream_rbuf), left);
+  buf_produce(&conn->wbuf, left);
+  buf_reset(&conn->upstream_rbuf);
+  conn->state = CONN_WRITING_RESPONSE;
+  worker_client_event_mod(conn, EV_WRITE | EV_HUP | EV_EDGE);
+}
+
+static void complete_upstream(conn_t *conn) {
+  http_request_t *req = (http_request_t *)conn->request;
+  // An early response leaves request body bytes in flight; that socket cannot be reused.
+  bool clean = conn->body.done && buf_readable(&conn->upstream_wbuf) == 0 &&
+               (!req || conn->body_sent >= req->body.len);
+  log_proxied(conn);
+  cache_commit(conn);
+  release_upstream(conn, conn->upstream_reusable && clean, false);
+  if (conn->h2_stream) {
+    worker_conn_close(conn);
+    return;
   }
+  // The client got the backend's head as is: a response that announced Connection: close or
+  // ran until the backend closed leaves the client nothing to frame a next response with.
+  if (!conn->upstream_reusable || !clean)
+    conn->keep_alive = false;
+  finish_client_response(conn);
+}
+
+// The upstream failed or sent something unframeable. A client that has not seen a final
+// response head yet gets a 502; otherwise the response is cut short.
+static void fail_upstream(conn_t *conn) {
+  bool started = conn->proxy_status != 0;
+  release_upstream(conn, false, true);
+  free(conn->cache_buf);
+  conn->cache_buf = NULL;
+  conn->cache_len = 0;
+  conn->cache_cap = 0;
+  if (!started) {
+    conn->proxy_status = 502;
+    buf_reset(&conn->upstream_rbuf);
+    conn->upstream_unscanned = 0;
+  }
+  log_proxied(conn);
+  if (started || conn->h2_stream) {
+    worker_conn_close(conn);
+    return;
+  }
+  send_error(conn, 502);
+  worker_client_event_mod(conn, EV_WRITE | EV_HUP | EV_EDGE);
+}
+
+static void start_upstream(conn_t *conn, http_request_t *req, int ufd, bool reused) {
+  conn_set_upstream(conn, ufd);
+  conn->upstream_reused = reused;
+  conn->upstream_phase = UPSTREAM_RESP_HEAD;
+  conn->upstream_unscanned = 0;
+  conn->upstream_reusable = false;
+  buf_reset(&conn->upstream_wbuf);
+  buf_reset(&conn->upstream_rbuf);
+  build_proxy_request(conn, req);
+  conn->state = req->upgrade ? CONN_TUNNEL : CONN_PROXYING;
+  event_loop_add(conn->loop, ufd, EV_WRITE | EV_READ | EV_HUP | EV_EDGE, proxy_on_upstream_event,
+                 conn);
+}
+
+// A pooled socket may have been closed by the backend while it sat idle. If nothing came back
+// on it and the request can be replayed, it is sent again on a fresh connection.
+static bool retry_upstream(conn_t *conn) {
+  http_request_t *req = (http_request_t *)conn->request;
+  upstream_backend_t *be = (upstream_backend_t *)conn->tls_conn;
+  if (!conn->upstream_reused || !req || req->body_pending || !be)
+    return false;
+
+  event_loop_del(conn->loop, conn->upstream_fd);
+  close(conn->upstream_fd);
+  conn->upstream_fd = -1;
+  int ufd;
+  if (socket_connect_nonblock(&ufd, be->host, be->port) != NP_OK)
+    return false;
+  log_debug("proxy: idle upstream %s:%d went away, retrying fd=%d", be->host, be->port, conn->fd);
+  start_upstream(conn, req, ufd, false);
+  return true;
 }
 
 void proxy_on_upstream_event(int fd, u32 events, void *arg) {
   conn_t *conn = (conn_t *)arg;
 
   if (events & EV_WRITE) {
-    isize n = buf_write_fd(&conn->upstream_wbuf, fd);
+    isize n;
+    do {
+      n = buf_write_fd(&conn->upstream_wbuf, fd);
+      if (n > 0)
+        feed_buffered_body(conn);
+    } while (n > 0);
     if (n < 0 && n != NP_ERR_AGAIN) {
-      send_error(conn, 502);
-      buf_write_fd(&conn->wbuf, conn->fd);
-      worker_conn_close(conn);
+      if (!retry_upstream(conn))
+        fail_upstream(conn);
       return;
     }
-    if (buf_readable(&conn->upstream_wbuf) == 0) {
+    if (!conn->body.done && conn->state == CONN_PROXYING) {
+      if (proxy_pump_request_body(conn) != NP_OK)
+        return;
+    } else if (buf_readable(&conn->upstream_wbuf) == 0) {
       event_loop_mod(conn->loop, fd, EV_READ | EV_HUP | EV_EDGE, proxy_on_upstream_event, conn);
     }
   }
@@ -78,81 +497,262 @@ void proxy_on_upstream_event(int fd, u32 events, void *arg) {
     do {
       n = buf_read_fd(&conn->upstream_rbuf, fd);
       if (n > 0) {
-        if (conn->proxy_status == 0) {
-          u8 *p = buf_read_ptr(&conn->upstream_rbuf);
-          usize readable = buf_readable(&conn->upstream_rbuf);
-          if (readable >= 12 && p[0] == 'H' && p[1] == 'T' && p[2] == 'T' && p[3] == 'P') {
-            char *sp = memchr(p, ' ', readable);
-            if (sp && (usize)(sp - (char *)p) + 4 <= readable) {
-              conn->proxy_status = atoi(sp + 1);
-            }
+        conn->upstream_reused = false;
+        if (conn->state == CONN_PROXYING) {
+          conn->upstream_unscanned += (usize)n;
+          cache_capture(conn, buf_write_ptr(&conn->upstream_rbuf) - n, (usize)n);
+          if (frame_upstream_response(conn) != NP_OK) {
+            log_warn("proxy: malformed response from upstream fd=%d", fd);
+            fail_upstream(conn);
+            return;
           }
         }
-        usize readable = buf_readable(&conn->upstream_rbuf);
-        if (conn->cache_store && readable > 0) {
-          usize needed = conn->cache_len + readable;
-          if (needed > conn->cache_cap) {
-            usize new_cap = needed * 2;
-            if (new_cap < 8192)
-              new_cap = 8192;
-            u8 *nb = realloc(conn->cache_buf, new_cap);
-            if (nb) {
-              conn->cache_buf = nb;
-              conn->cache_cap = new_cap;
-            }
-          }
-          if (conn->cache_buf && conn->cache_len + readable <= conn->cache_cap) {
-            memcpy(conn->cache_buf + conn->cache_len, buf_read_ptr(&conn->upstream_rbuf), readable);
-            conn->cache_len += readable;
-          }
+        np_status_t rc;
+        if (conn->h2_stream) {
+          rc = h2_stream_relay(conn);
+        } else if (conn->state == CONN_TUNNEL) {
+          isize wn;
+          do {
+            wn = conn_write_buf(conn, &conn->upstream_rbuf);
+          } while (wn > 0);
+          rc = NP_OK;
+        } else {
+          rc = proxy_write_client(conn);
+        }
+        if (conn->state == CONN_PROXYING && conn->upstream_phase == UPSTREAM_RESP_DONE) {
+          complete_upstream(conn);
+          return;
+        }
+        if (rc != NP_OK) {
+          log_proxied(conn);
+          release_upstream(conn, false, false);
+          worker_conn_close(conn);
+          return;
         }
-        isize wn;
-        do {
-          wn = buf_write_fd(&conn->upstream_rbuf, conn->fd);
-        } while (wn > 0);
       }
     } while (n > 0);
 
-    if (buf_readable(&conn->upstream_rbuf) > 0) {
-      worker_client_event_mod(conn, EV_WRITE | EV_READ | EV_HUP | EV_EDGE);
+    // Nothing more from the backend for now: what was compressed so far goes out instead of
+    // waiting in the deflate window for a response that trickles in.
+    if (n == NP_ERR_AGAIN && conn->gzip && conn->upstream_unscanned == 0 &&
+        gzip_stream_deflate(conn->gzip, &conn->wbuf, GZIP_SYNC_FLUSH) == NP_ERR) {
+      release_upstream(conn, false, false);
+      worker_conn_close(conn);
+      return;
     }
 
-    /* If read returns error and we didn't send anything yet, could be a 502.
-     * However, the connection is closed. We just close cleanly here. */
+    if (buf_readable(&conn->upstream_rbuf) > 0 || (conn->gzip && buf_readable(&conn->wbuf) > 0))
+      worker_client_event_mod(conn, EV_WRITE | EV_READ | EV_HUP | EV_EDGE);
+
     if (n == NP_ERR_CLOSED || n == NP_ERR) {
-      event_loop_del(conn->loop, fd);
-      conn->upstream_fd = -1;  // Unlink so worker_conn_close doesn't double close
-
-      upstream_pool_t *pool = (upstream_pool_t *)conn->proxy_pool;
-
-      if (n == NP_ERR_CLOSED && conn->state != CONN_TUNNEL) {
-        if (conn->cache_store && conn->cache_buf && conn->cache_len > 0) {
-          cache_insert(conn->cache_store, conn->cache_key, 200, conn->cache_buf, conn->cache_len,
-                       NULL, 0, 10);
-          free(conn->cache_buf);
-          conn->cache_buf = NULL;
-          conn->cache_len = 0;
-          conn->cache_cap = 0;
+      if (conn->state == CONN_TUNNEL) {
+        release_upstream(conn, false, false);
+        worker_conn_close(conn);
+      } else if (n == NP_ERR_CLOSED && conn->gzip && conn->upstream_unscanned > 0) {
+        // The client holds up the compressor and the backend is done sending: the socket goes
+        // now and the body is finished from what upstream_rbuf holds.
+        if (conn->upstream_phase == UPSTREAM_RESP_UNTIL_CLOSE) {
+          http_body_init(&conn->upstream_body, (i64)conn->upstream_unscanned, false, 0);
+          conn->upstream_phase = UPSTREAM_RESP_BODY;
         }
-
-        upstream_backend_t *be = (upstream_backend_t *)conn->tls_conn;
-        if (be) {
-          http_request_t *req = (http_request_t *)conn->request;
-          if (req) {
-            struct timespec now;
-            clock_gettime(CLOCK_MONOTONIC, &now);
-            access_log_write(req, conn->proxy_status, 0, &now);
-          }
-          upstream_put_connection(pool, be, fd);
+        release_upstream(conn, false, false);
+        if (proxy_write_client(conn) != NP_OK) {
+          log_proxied(conn);
           worker_conn_close(conn);
-          return;
+        } else if (conn->upstream_phase == UPSTREAM_RESP_DONE) {
+          complete_upstream(conn);
         }
+      } else if (n == NP_ERR_CLOSED && conn->upstream_phase == UPSTREAM_RESP_UNTIL_CLOSE) {
+        conn->upstream_phase = UPSTREAM_RESP_DONE;
+        complete_upstream(conn);
+      } else if (!retry_upstream(conn)) {
+        fail_upstream(conn);
       }
+    }
+  }
+}
 
-      close(fd);
+// Called by the h2c session with NP_OK when more of the translated response is in
+// conn->upstream_rbuf, NP_ERR_CLOSED once all of it is, and NP_ERR if the stream failed.
+void proxy_on_upstream_h2(conn_t *conn, np_status_t rc) {
+  if (rc == NP_ERR && conn->proxy_status == 0) {
+    buf_reset(&conn->upstream_rbuf);
+    response_write_error(&conn->upstream_rbuf, 502, false);
+    conn->proxy_status = 502;
+    rc = NP_ERR_CLOSED;
+  }
+  // A stream that fails mid-response is cut short; the client sees an unterminated body.
+  if (rc == NP_ERR) {
+    if (conn->h2_stream) {
+      h2_stream_relay(conn);
+    } else {
+      isize wn;
+      do {
+        wn = conn_write_buf(conn, &conn->upstream_rbuf);
+      } while (wn > 0);
+    }
+    log_proxied(conn);
+    worker_conn_close(conn);
+    return;
+  }
+
+  if (conn->h2_stream) {
+    if (h2_stream_relay(conn) != NP_OK || rc == NP_ERR_CLOSED) {
+      log_proxied(conn);
       worker_conn_close(conn);
+    } else if (buf_readable(&conn->upstream_rbuf) > 0) {
+      worker_client_event_mod(conn, EV_WRITE | EV_READ | EV_HUP | EV_EDGE);
     }
+    return;
   }
+
+  isize wn;
+  do {
+    wn = conn_write_buf(conn, &conn->upstream_rbuf);
+  } while (wn > 0);
+  if (wn == NP_ERR) {
+    worker_conn_close(conn);
+    return;
+  }
+  if (rc == NP_OK) {
+    if (buf_readable(&conn->upstream_rbuf) > 0)
+      worker_client_event_mod(conn, EV_WRITE | EV_READ | EV_HUP | EV_EDGE);
+    return;
+  }
+
+  log_proxied(conn);
+  finish_client_response(conn);
+}
+
+void proxy_resume_upstream(conn_t *conn) {
+  // A gzipped response can reach its end while the client drains wbuf.
+  if (conn->gzip && conn->upstream_phase == UPSTREAM_RESP_DONE)
+    complete_upstream(conn);
+  else if (conn->upstream_h2)
+    upstream_h2_resume(conn);
+  else if (conn->upstream_fd >= 0)
+    proxy_on_upstream_event(conn->upstream_fd, EV_READ, conn);
+}
+
+// Chunk header is written as a fixed-width "%08zx\r\n" so the payload can be decoded in place.
+#define CHUNK_HDR_LEN 10
+#define CHUNK_OVERHEAD (CHUNK_HDR_LEN + 2 + 5)
+
+static bool pump_buffered_body(conn_t *conn, bool rechunk) {
+  np_buf_t *in = &conn->rbuf;
+  np_buf_t *out = &conn->upstream_wbuf;
+
+  while (!conn->body.done && buf_readable(in) > 0) {
+    buf_compact(out);
+    usize space = buf_writable(out);
+    if (space <= CHUNK_OVERHEAD)
+      break;
+
+    u8 *dst = buf_write_ptr(out);
+    u8 *payload = rechunk ? dst + CHUNK_HDR_LEN : dst;
+    usize cap = rechunk ? space - CHUNK_OVERHEAD : space;
+    usize consumed, out_len;
+    body_result_t br = http_body_decode(&conn->body, buf_read_ptr(in), buf_readable(in),
+                                        &consumed, payload, cap, &out_len);
+    if (br == BODY_ERROR || br == BODY_TOO_LARGE)
+      return false;
+    buf_consume(in, consumed);
+
+    if (rechunk) {
+      usize produced = 0;
+      if (out_len > 0) {
+        char hdr[24];
+        snprintf(hdr, sizeof(hdr), "%08zx\r\n", out_len);
+        memcpy(dst, hdr, CHUNK_HDR_LEN);
+        memcpy(payload + out_len, "\r\n", 2);
+        produced = CHUNK_HDR_LEN + out_len + 2;
+      }
+      if (br == BODY_DONE) {
+        memcpy(dst + produced, "0\r\n\r\n", 5);
+        produced += 5;
+      }
+      buf_produce(out, produced);
+    } else {
+      buf_produce(out, out_len);
+    }
+
+    if (consumed == 0)
+      break;
+  }
+  return true;
+}
+
+// An h2c upstream takes the decoded body as DATA frames; nothing is re-chunked.
+static np_status_t pump_h2_request_body(conn_t *conn) {
+  http_request_t *req = (http_request_t *)conn->request;
+  for (;;) {
+    feed_buffered_body(conn);
+    if (!pump_buffered_body(conn, false)) {
+      log_warn("proxy: malformed or oversized request body from fd=%d", conn->fd);
+      worker_conn_close(conn);
+      return NP_ERR_CLOSED;
+    }
+
+    bool last = conn->body.done && conn->body_sent >= req->body.len;
+    if (upstream_h2_send_body(conn, last) != NP_OK) {
+      proxy_on_upstream_h2(conn, NP_ERR);
+      return NP_ERR_CLOSED;
+    }
+    // Stop once the stream is done or flow control holds the rest back; it is woken again.
+    if (last || !conn->upstream_h2 || buf_readable(&conn->upstream_wbuf) > 0)
+      break;
+    if (buf_readable(&conn->rbuf) > 0 || conn->body_sent < req->body.len)
+      continue;
+    if (conn->fd < 0 || conn->body.done)
+      break;
+
+    isize n = buf_read_fd(&conn->rbuf, conn->fd);
+    if (n == NP_ERR_AGAIN || n == 0)
+      break;
+    if (n < 0) {
+      worker_conn_close(conn);
+      return NP_ERR_CLOSED;
+    }
+  }
+  return NP_OK;
+}
+
+np_status_t proxy_pump_request_body(conn_t *conn) {
+  if (conn->upstream_h2)
+    return pump_h2_request_body(conn);
+  for (;;) {
+    if (!pump_buffered_body(conn, conn->body.mode == BODY_CHUNKED)) {
+      log_warn("proxy: malformed or oversized request body from fd=%d", conn->fd);
+      worker_conn_close(conn);
+      return NP_ERR_CLOSED;
+    }
+
+    isize wn;
+    do {
+      wn = buf_write_fd(&conn->upstream_wbuf, conn->upstream_fd);
+    } while (wn > 0);
+    if (wn == NP_ERR) {
+      fail_upstream(conn);
+      return NP_ERR_CLOSED;
+    }
+
+    if (conn->body.done || buf_readable(&conn->rbuf) > 0)
+      break;
+
+    isize n = buf_read_fd(&conn->rbuf, conn->fd);
+    if (n == NP_ERR_AGAIN || n == 0)
+      break;
+    if (n < 0) {
+      worker_conn_close(conn);
+      return NP_ERR_CLOSED;
+    }
+  }
+
+  u32 ev = EV_READ | EV_HUP | EV_EDGE;
+  if (buf_readable(&conn->upstream_wbuf) > 0)
+    ev |= EV_WRITE;
+  event_loop_mod(conn->loop, conn->upstream_fd, ev, proxy_on_upstream_event, conn);
+  return NP_OK;
 }
 
 void proxy_handle(conn_t *conn, http_request_t *req, handler_ctx_t *ctx, np_server_config_t *server,
@@ -164,27 +764,41 @@ void proxy_handle(conn_t *conn, http_request_t *req, handler_ctx_t *ctx, np_serv
   upstream_backend_t *be = upstream_select(pool);
 
   if (!be) {
-    response_write_error(&conn->wbuf, 503, req->keep_alive);
+    response_send_error(conn, 503, req->keep_alive);
     conn->state = CONN_WRITING_RESPONSE;
     metrics_inc_upstream_errors(ctx->metrics);
     return;
   }
+  conn->proxy_backend = (int)(be - pool->backends) + 1;
+
+  if (pool->proto == UPSTREAM_PROTO_H2C && !req->upgrade) {
+    conn->tls_conn = be;
+    conn->body_sent = 0;
+    conn->state = CONN_PROXYING;
+    if (upstream_h2_open(pool, be, conn, req, req->body_pending || req->body.len > 0) != NP_OK) {
+      upstream_release(pool, be, true);
+      response_send_error(conn, 502, req->keep_alive);
+      conn->state = CONN_WRITING_RESPONSE;
+      metrics_inc_upstream_errors(ctx->metrics);
+      return;
+    }
+    // h2c backends rarely send interim responses, and flow control already bounds what the
+    // stream takes, so the go-ahead comes from here.
+    if (req->body_pending && req->expect_continue)
+      response_send_continue(conn);
+    return;
+  }
 
-  int ufd = upstream_get_connection(pool, be);
+  bool reused;
+  int ufd = upstream_get_connection(pool, be, &reused);
   if (ufd < 0) {
     upstream_release(pool, be, true);
-    response_write_error(&conn->wbuf, 502, req->keep_alive);
+    response_send_error(conn, 502, req->keep_alive);
     conn->state = CONN_WRITING_RESPONSE;
     metrics_inc_upstream_errors(ctx->metrics);
     return;
   }
 
   conn->tls_conn = be;
-
-  conn_set_upstream(conn, ufd);
-  build_proxy_request(conn, req);
-  conn->state = req->upgrade ? CONN_TUNNEL : CONN_PROXYING;
-
-  event_loop_add(conn->loop, ufd, EV_WRITE | EV_READ | EV_HUP | EV_EDGE, proxy_on_upstream_event,
-                 conn);
+  start_upstream(conn, req, ufd, reused);
 }
@@ -9,5 +9,12 @@
 void proxy_handle(conn_t *conn, http_request_t *req, handler_ctx_t *ctx, np_server_config_t *server,
                   void *upstream_pool);
 void proxy_on_upstream_event(int fd, u32 events, void *arg);
+np_status_t proxy_pump_request_body(conn_t *conn);
+void proxy_on_upstream_h2(conn_t *conn, np_status_t rc);
+// Writes the framed part of conn->upstream_rbuf to the client socket; NP_ERR if the client
+// is gone.
+np_status_t proxy_write_client(conn_t *conn);
+// The client drained conn->upstream_rbuf; pulls in more of the upstream response.
+void proxy_resume_upstream(conn_t *conn);
 
 #endif
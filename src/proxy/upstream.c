@@ -7,32 +7,47 @@
 #include "core/log.h"
 #include "net/socket.h"
 #include "proxy/balancer.h"
+#include "proxy/upstream_h2.h"
 
-upstream_pool_t *upstream_pool_create(const np_server_config_t *cfg) {
+upstream_pool_t *upstream_pool_create(const np_proxy_config_t *cfg) {
   upstream_pool_t *pool = malloc(sizeof(*pool));
   if (!pool)
     return NULL;
   memset(pool, 0, sizeof(*pool));
-  pool->mode = cfg->proxy.mode;
+  pool->mode = cfg->mode;
   pool->rr_index = 0;
-  pool->count = cfg->proxy.backend_count;
-  pool->keepalive_conns = cfg->proxy.keepalive_conns;
+  pool->count = cfg->backend_count;
+  pool->keepalive_conns = cfg->keepalive_conns;
+  pool->proto = cfg->proto;
+  pool->h2_conns = cfg->h2_connections;
+  if (pool->h2_conns <= 0)
+    pool->h2_conns = 2;
+  if (pool->h2_conns > UPSTREAM_H2_MAX_CONNS)
+    pool->h2_conns = UPSTREAM_H2_MAX_CONNS;
 
   for (int i = 0; i < pool->count; i++) {
-    strncpy(pool->backends[i].host, cfg->proxy.backends[i].host,
+    strncpy(pool->backends[i].host, cfg->backends[i].host,
             sizeof(pool->backends[i].host) - 1);
-    pool->backends[i].port = cfg->proxy.backends[i].port;
+    pool->backends[i].port = cfg->backends[i].port;
     pool->backends[i].healthy = true;
     pool->backends[i].active_conns = 0;
     pool->backends[i].error_count = 0;
     pool->backends[i].idle_count = 0;
   }
-  log_info("upstream pool: %d backends, mode=%s", pool->count,
-           pool->mode == BALANCE_LEAST_CONN ? "least_conn" : "round_robin");
+  log_info("upstream pool: %d backends, mode=%s, proto=%s", pool->count,
+           pool->mode == BALANCE_LEAST_CONN ? "least_conn" : "round_robin",
+           pool->proto == UPSTREAM_PROTO_H2C ? "h2c" : "http/1.1");
   return pool;
 }
 
 void upstream_pool_destroy(upstream_pool_t *pool) {
+  for (int i = 0; i < pool->count; i++) {
+    upstream_backend_t *be = &pool->backends[i];
+    upstream_h2_close_all(be);
+    for (int j = 0; j < be->idle_count; j++)
+      close(be->idle_fds[j]);
+    be->idle_count = 0;
+  }
   free(pool);
 }
 
@@ -69,8 +84,9 @@ void upstream_release(upstream_pool_t *pool, upstream_backend_t *be, bool error)
   }
 }
 
-int upstream_get_connection(upstream_pool_t *pool, upstream_backend_t *be) {
+int upstream_get_connection(upstream_pool_t *pool, upstream_backend_t *be, bool *reused) {
   NP_UNUSED(pool);
+  *reused = be->idle_count > 0;
   if (be->idle_count > 0) {
     be->idle_count--;
     int fd = be->idle_fds[be->idle_count];
@@ -4,8 +4,11 @@
 #include "core/config.h"
 #include "core/types.h"
 
+#define UPSTREAM_H2_MAX_CONNS 8
+
 typedef struct upstream_backend upstream_backend_t;
 typedef struct upstream_pool upstream_pool_t;
+typedef struct upstream_h2_session upstream_h2_session_t;
 
 struct upstream_backend {
   char host[256];
@@ -16,6 +19,9 @@ struct upstream_backend {
   bool healthy;
   int idle_fds[64];
   int idle_count;
+  // Multiplexed connections when the pool speaks h2c.
+  upstream_h2_session_t *h2_sessions[UPSTREAM_H2_MAX_CONNS];
+  int h2_count;
 };
 
 struct upstream_pool {
@@ -24,14 +30,18 @@ struct upstream_pool {
   int rr_index;
   balance_mode_t mode;
   int keepalive_conns;
+  upstream_proto_t proto;
+  int h2_conns;
 };
 
-upstream_pool_t *upstream_pool_create(const np_server_config_t *cfg);
+upstream_pool_t *upstream_pool_create(const np_proxy_config_t *cfg);
 void upstream_pool_destroy(upstream_pool_t *pool);
 upstream_backend_t *upstream_select(upstream_pool_t *pool);
 void upstream_release(upstream_pool_t *pool, upstream_backend_t *be, bool error);
 
-int upstream_get_connection(upstream_pool_t *pool, upstream_backend_t *be);
+// Hands out an idle keep-alive socket when there is one (`*reused` is set), otherwise
+// starts a new non-blocking connect. Returns -1 on failure.
+int upstream_get_connection(upstream_pool_t *pool, upstream_backend_t *be, bool *reused);
 void upstream_put_connection(upstream_pool_t *pool, upstream_backend_t *be, int fd);
 
 #endif
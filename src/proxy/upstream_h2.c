@@ -0,0 +1,1099 @@
+#include "proxy/upstream_h2.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "core/log.h"
+#include "http/response.h"
+#include "http2/h2_frame.h"
+#include "http2/hpack.h"
+#include "net/event_loop.h"
+#include "net/socket.h"
+#include "proxy/proxy_conn.h"
+
+// Each stream may have at most this much response data in flight. Window updates are only
+// sent while the client side has room for twice as much, so a slow client throttles its own
+// stream instead of stalling the whole connection.
+#define UH2_STREAM_WINDOW 16384
+#define UH2_CONN_WINDOW (16 * 1024 * 1024)
+#define UH2_MAX_HEADER_BLOCK NP_READ_BUF_SIZE
+// Chunk-size line and CRLFs around one re-chunked DATA frame, plus the last chunk.
+#define UH2_CHUNK_OVERHEAD 24
+
+typedef struct {
+  upstream_h2_session_t *session;
+  conn_t *conn;
+  u32 id;  // 0 while queued behind the peer's concurrent stream limit
+  i64 send_window;
+  i64 recv_window;
+  i64 recv_credit;
+  int status;
+  bool has_body;
+  bool head_only;
+  bool no_body;
+  bool chunked;
+  // The client sent "TE: trailers", so the response is chunked to leave room for them.
+  bool te_trailers;
+  bool end_sent;
+  bool remote_done;
+  bool done;
+  bool failed;
+  bool notify;
+  bool want_body;
+  bool body_blocked;
+  // Translated text that did not fit in conn->upstream_rbuf yet.
+  u8 *pending;
+  usize pending_len;
+} uh2_stream_t;
+
+struct upstream_h2_session {
+  upstream_pool_t *pool;
+  upstream_backend_t *be;
+  event_loop_t *loop;
+  int fd;
+  np_buf_t rbuf;
+  np_buf_t wbuf;
+  arena_t *arena;
+  hpack_table_t hpack;
+  // Response heads are rebuilt as HTTP/1.1 text here; request heads are encoded here too.
+  u8 *head;
+  usize head_len;
+  u8 *hdr_block;
+  usize hdr_len;
+  u32 hdr_stream;
+  bool hdr_end_stream;
+  uh2_stream_t streams[UPSTREAM_H2_MAX_STREAMS];
+  int used;
+  int open;
+  int depth;
+  u32 next_id;
+  u32 peer_max_streams;
+  i64 peer_initial_window;
+  i64 send_window;
+  i64 recv_credit;
+  // Stream whose client has no room for the next frame; reading stops until it drains.
+  uh2_stream_t *stalled;
+  // Streams wait for the peer's SETTINGS so its stream limit is known before they start.
+  bool settings_seen;
+  bool want_write;
+  bool goaway;
+  bool dead;
+};
+
+typedef struct {
+  upstream_h2_session_t *s;
+  int status;
+  bool trailers;
+  bool regular_seen;
+  bool has_length;
+  bool announces_trailers;
+  // Where the content-length line sits in the rebuilt head.
+  usize length_off;
+  usize length_len;
+  bool bad;
+  bool overflow;
+} uh2_head_builder_t;
+
+static void session_read(upstream_h2_session_t *s);
+static void session_on_event(int fd, u32 events, void *arg);
+
+static void session_unlink(upstream_h2_session_t *s) {
+  upstream_backend_t *be = s->be;
+  for (int i = 0; i < be->h2_count; i++) {
+    if (be->h2_sessions[i] == s) {
+      be->h2_sessions[i] = be->h2_sessions[--be->h2_count];
+      be->h2_sessions[be->h2_count] = NULL;
+      return;
+    }
+  }
+}
+
+static void session_free(upstream_h2_session_t *s) {
+  if (s->fd >= 0) {
+    event_loop_del(s->loop, s->fd);
+    close(s->fd);
+  }
+  hpack_table_free(&s->hpack);
+  buf_free(&s->rbuf);
+  buf_free(&s->wbuf);
+  if (s->arena)
+    arena_destroy(s->arena);
+  free(s->head);
+  free(s->hdr_block);
+  free(s);
+}
+
+// Drops the connection. Every stream that has not received its whole response fails.
+static void session_fail(upstream_h2_session_t *s, const char *why) {
+  if (s->dead)
+    return;
+  if (s->used > 0)
+    log_warn("upstream h2 %s:%d: %s", s->be->host, s->be->port, why);
+  else
+    log_debug("upstream h2 %s:%d: %s", s->be->host, s->be->port, why);
+  s->dead = true;
+  s->stalled = NULL;
+  session_unlink(s);
+  event_loop_del(s->loop, s->fd);
+  close(s->fd);
+  s->fd = -1;
+  for (int i = 0; i < UPSTREAM_H2_MAX_STREAMS; i++) {
+    uh2_stream_t *st = &s->streams[i];
+    if (!st->conn)
+      continue;
+    if (!st->done)
+      st->failed = true;
+    st->done = st->remote_done = st->end_sent = true;
+  }
+}
+
+static void session_flush(upstream_h2_session_t *s) {
+  if (s->dead)
+    return;
+  isize n;
+  do {
+    n = buf_write_fd(&s->wbuf, s->fd);
+  } while (n > 0);
+  if (n == NP_ERR || n == NP_ERR_CLOSED) {
+    session_fail(s, "write failed");
+    return;
+  }
+
+  bool want = buf_readable(&s->wbuf) > 0;
+  if (want != s->want_write) {
+    s->want_write = want;
+    event_loop_mod(s->loop, s->fd, (want ? EV_WRITE : 0) | EV_READ | EV_HUP | EV_EDGE,
+                   session_on_event, s);
+  }
+}
+
+static void session_error(upstream_h2_session_t *s, h2_error_t code) {
+  if (s->dead)
+    return;
+  log_debug("upstream h2: connection error %d fd=%d", (int)code, s->fd);
+  h2_frame_put_goaway(&s->wbuf, 0, code);
+  session_flush(s);
+  session_fail(s, "protocol error");
+}
+
+static uh2_stream_t *find_stream(upstream_h2_session_t *s, u32 id) {
+  for (int i = 0; i < UPSTREAM_H2_MAX_STREAMS; i++) {
+    if (s->streams[i].conn && s->streams[i].id == id)
+      return &s->streams[i];
+  }
+  return NULL;
+}
+
+static void stream_abort(upstream_h2_session_t *s, uh2_stream_t *st, h2_error_t code,
+                         const char *why) {
+  log_warn("upstream h2 %s:%d: stream %u: %s", s->be->host, s->be->port, st->id, why);
+  if (!s->dead)
+    h2_frame_put_u32(&s->wbuf, H2_RST_STREAM, st->id, (u32)code);
+  st->done = st->failed = true;
+  st->remote_done = st->end_sent = true;
+}
+
+static void stream_release(upstream_h2_session_t *s, uh2_stream_t *st) {
+  if (st->id != 0) {
+    if (!s->dead && !(st->end_sent && st->remote_done))
+      h2_frame_put_u32(&s->wbuf, H2_RST_STREAM, st->id, H2_CANCEL);
+    s->open--;
+  }
+  if (s->stalled == st)
+    s->stalled = NULL;
+  st->conn->upstream_h2 = NULL;
+  free(st->pending);
+  memset(st, 0, sizeof(*st));
+  s->used--;
+}
+
+static bool is_connection_field(str_t name) {
+  return str_ieq(name, STR("Connection")) || str_ieq(name, STR("Keep-Alive")) ||
+         str_ieq(name, STR("Proxy-Connection")) || str_ieq(name, STR("Transfer-Encoding")) ||
+         str_ieq(name, STR("Upgrade"));
+}
+
+// Encodes the request head as HEADERS (plus CONTINUATION frames). Returns false if the
+// output buffer has no room for it yet.
+static bool stream_start(upstream_h2_session_t *s, uh2_stream_t *st) {
+  http_request_t *req = (http_request_t *)st->conn->request;
+  u8 *block = s->head;
+  usize cap = UH2_MAX_HEADER_BLOCK;
+  usize len = 0;
+
+  str_t authority = request_header(req, STR("Host"));
+  if (!authority.ptr)
+    authority = str_from_cstr(s->be->host);
+  str_t remote_ip = str_from_cstr(req->remote_ip);
+  len += hpack_encode_header(block + len, cap - len, STR(":method"),
+                             str_from_cstr(http_method_str(req->method)));
+  len += hpack_encode_header(block + len, cap - len, STR(":scheme"), STR("http"));
+  len += hpack_encode_header(block + len, cap - len, STR(":authority"), authority);
+  len += hpack_encode_header(block + len, cap - len, STR(":path"), request_target(req));
+
+  for (int i = 0; i < req->header_count; i++) {
+    str_t name = req->headers[i].name;
+    str_t value = req->headers[i].value;
+    if (str_ieq(name, STR("Host")) || str_ieq(name, STR("Content-Length")) ||
+        str_ieq(name, STR("Expect")) || is_connection_field(name))
+      continue;
+    // "te: trailers" is how gRPC clients announce trailer support; other values are hop-by-hop.
+    if (str_ieq(name, STR("TE")) && !str_ieq(str_trim(value), STR("trailers")))
+      continue;
+    len += hpack_encode_header(block + len, cap - len, name, value);
+  }
+  len += hpack_encode_header(block + len, cap - len, STR("x-real-ip"), remote_ip);
+  len += hpack_encode_header(block + len, cap - len, STR("x-forwarded-for"), remote_ip);
+
+  char cl[32];
+  int cl_len = 0;
+  if (req->body_pending && st->conn->body.mode == BODY_LENGTH)
+    cl_len = snprintf(cl, sizeof(cl), "%lld", (long long)req->content_length);
+  else if (!req->body_pending && (req->body.len > 0 || request_header(req, STR("Content-Length")).ptr))
+    cl_len = snprintf(cl, sizeof(cl), "%zu", req->body.len);
+  if (cl_len > 0)
+    len += hpack_encode_header(block + len, cap - len, STR("content-length"),
+                               (str_t){.ptr = cl, .len = (usize)cl_len});
+
+  usize frames = (len + H2_DEFAULT_FRAME_SIZE - 1) / H2_DEFAULT_FRAME_SIZE;
+  if (frames == 0)
+    frames = 1;
+  if (buf_writable(&s->wbuf) < len + frames * H2_FRAME_HEADER_LEN)
+    buf_compact(&s->wbuf);
+  if (buf_writable(&s->wbuf) < len + frames * H2_FRAME_HEADER_LEN)
+    return false;
+
+  st->id = s->next_id;
+  s->next_id += 2;
+  s->open++;
+  st->send_window = s->peer_initial_window;
+  st->recv_window = UH2_STREAM_WINDOW;
+  usize off = 0;
+  u8 type = H2_HEADERS;
+  do {
+    usize n = len - off < H2_DEFAULT_FRAME_SIZE ? len - off : H2_DEFAULT_FRAME_SIZE;
+    u8 flags = 0;
+    if (type == H2_HEADERS && !st->has_body)
+      flags |= H2_FLAG_END_STREAM;
+    if (off + n == len)
+      flags |= H2_FLAG_END_HEADERS;
+    h2_frame_put(&s->wbuf, type, flags, st->id, block + off, n);
+    off += n;
+    type = H2_CONTINUATION;
+  } while (off < len);
+  st->end_sent = !st->has_body;
+  return true;
+}
+
+static void start_queued(upstream_h2_session_t *s) {
+  if (!s->settings_seen)
+    return;
+  for (int i = 0; i < UPSTREAM_H2_MAX_STREAMS && !s->dead && !s->goaway; i++) {
+    uh2_stream_t *st = &s->streams[i];
+    if (!st->conn || st->id != 0 || st->done)
+      continue;
+    if ((u32)s->open >= s->peer_max_streams || s->next_id > H2_MAX_WINDOW)
+      return;
+    if (!stream_start(s, st))
+      return;
+    st->want_body = st->has_body;
+  }
+}
+
+static void wake_senders(upstream_h2_session_t *s) {
+  for (int i = 0; i < UPSTREAM_H2_MAX_STREAMS; i++) {
+    uh2_stream_t *st = &s->streams[i];
+    if (st->conn && st->body_blocked) {
+      st->body_blocked = false;
+      st->want_body = true;
+    }
+  }
+}
+
+static usize client_room(const conn_t *c) {
+  return c->upstream_rbuf.cap - buf_readable(&c->upstream_rbuf);
+}
+
+static void client_append(conn_t *c, const void *data, usize len) {
+  np_buf_t *out = &c->upstream_rbuf;
+  if (buf_writable(out) < len)
+    buf_compact(out);
+  memcpy(buf_write_ptr(out), data, len);
+  buf_produce(out, len);
+}
+
+static void grant_window(upstream_h2_session_t *s, uh2_stream_t *st) {
+  if (s->dead || st->id == 0 || st->remote_done || st->pending ||
+      st->recv_credit < UH2_STREAM_WINDOW / 2 || client_room(st->conn) < 2 * UH2_STREAM_WINDOW)
+    return;
+  if (h2_frame_put_u32(&s->wbuf, H2_WINDOW_UPDATE, st->id, (u32)st->recv_credit) == NP_OK) {
+    st->recv_window += st->recv_credit;
+    st->recv_credit = 0;
+  }
+}
+
+// Hands translated text to the client side, parking it if the client buffer is full.
+static void deliver(upstream_h2_session_t *s, uh2_stream_t *st, const u8 *data, usize len) {
+  if (len == 0)
+    return;
+  st->notify = true;
+  if (!st->pending && client_room(st->conn) >= len) {
+    client_append(st->conn, data, len);
+    return;
+  }
+  u8 *p = realloc(st->pending, st->pending_len + len);
+  if (!p) {
+    stream_abort(s, st, H2_INTERNAL_ERROR, "out of memory");
+    return;
+  }
+  memcpy(p + st->pending_len, data, len);
+  st->pending = p;
+  st->pending_len += len;
+  s->stalled = st;
+}
+
+static void head_append(uh2_head_builder_t *b, const void *p, usize n) {
+  upstream_h2_session_t *s = b->s;
+  if (s->head_len + n > UH2_MAX_HEADER_BLOCK) {
+    b->overflow = true;
+    return;
+  }
+  memcpy(s->head + s->head_len, p, n);
+  s->head_len += n;
+}
+
+static bool field_value_ok(str_t value) {
+  for (usize i = 0; i < value.len; i++) {
+    if (value.ptr[i] == '\r' || value.ptr[i] == '\n' || value.ptr[i] == '\0')
+      return false;
+  }
+  return true;
+}
+
+static np_status_t build_response_field(void *arg, str_t name, str_t value) {
+  uh2_head_builder_t *b = (uh2_head_builder_t *)arg;
+
+  if (name.len > 0 && name.ptr[0] == ':') {
+    i64 status;
+    if (b->trailers || b->regular_seen || b->status != 0 || !str_eq(name, STR(":status")) ||
+        str_to_int(value, &status) != 0 || status < 100 || status > 999) {
+      b->bad = true;
+      return NP_OK;
+    }
+    b->status = (int)status;
+    str_t line = response_status_line(b->status);
+    head_append(b, line.ptr, line.len);
+    return NP_OK;
+  }
+
+  b->regular_seen = true;
+  if ((!b->trailers && b->status == 0) || !field_value_ok(value)) {
+    b->bad = true;
+    return NP_OK;
+  }
+  if (is_connection_field(name))
+    return NP_OK;
+  if (str_eq(name, STR("trailer")))
+    b->announces_trailers = true;
+  usize off = b->s->head_len;
+  head_append(b, name.ptr, name.len);
+  head_append(b, ": ", 2);
+  head_append(b, value.ptr, value.len);
+  head_append(b, "\r\n", 2);
+  if (str_eq(name, STR("content-length"))) {
+    b->has_length = true;
+    b->length_off = off;
+    b->length_len = b->s->head_len - off;
+  }
+  return NP_OK;
+}
+
+// A response head becomes an HTTP/1.1 head; a body without a length is chunked so that
+// trailers (grpc-status and friends) can follow it, and so is one with a length when trailers
+// were announced or asked for. Trailers end the chunked body.
+static void finish_headers(upstream_h2_session_t *s) {
+  u32 id = s->hdr_stream;
+  s->hdr_stream = 0;
+
+  uh2_stream_t *st = find_stream(s, id);
+  uh2_head_builder_t b;
+  memset(&b, 0, sizeof(b));
+  b.s = s;
+  b.trailers = st && st->status != 0;
+  s->head_len = 0;
+  if (b.trailers && st->chunked)
+    head_append(&b, "0\r\n", 3);
+  np_status_t rc =
+      hpack_decode(&s->hpack, s->hdr_block, s->hdr_len, s->arena, build_response_field, &b);
+  arena_reset(s->arena);
+  if (rc != NP_OK) {
+    session_error(s, H2_COMPRESSION_ERROR);
+    return;
+  }
+  if (!st) {
+    if (id >= s->next_id)
+      session_error(s, H2_PROTOCOL_ERROR);
+    return;
+  }
+  if (st->remote_done)
+    return;
+  if (b.bad || (!b.trailers && b.status == 0)) {
+    stream_abort(s, st, H2_PROTOCOL_ERROR, "malformed response header block");
+    return;
+  }
+  if (b.overflow) {
+    stream_abort(s, st, H2_INTERNAL_ERROR, "response head too large");
+    return;
+  }
+
+  if (b.trailers) {
+    if (!s->hdr_end_stream) {
+      stream_abort(s, st, H2_PROTOCOL_ERROR, "trailers without END_STREAM");
+      return;
+    }
+    // A body sent with its Content-Length (no trailers announced or asked for) has no room
+    // for them over HTTP/1.1.
+    if (st->chunked) {
+      head_append(&b, "\r\n", 2);
+      deliver(s, st, s->head, s->head_len);
+    }
+    st->remote_done = st->done = true;
+    st->notify = true;
+    return;
+  }
+
+  // Interim responses are not forwarded.
+  if (b.status < 200) {
+    if (s->hdr_end_stream)
+      stream_abort(s, st, H2_PROTOCOL_ERROR, "interim response ends the stream");
+    return;
+  }
+
+  st->status = b.status;
+  st->conn->proxy_status = b.status;
+  st->no_body = st->head_only || b.status == 204 || b.status == 304;
+  if (!st->no_body && !s->hdr_end_stream &&
+      (!b.has_length || b.announces_trailers || st->te_trailers)) {
+    if (b.has_length) {
+      u8 *line = s->head + b.length_off;
+      memmove(line, line + b.length_len, s->head_len - b.length_off - b.length_len);
+      s->head_len -= b.length_len;
+    }
+    head_append(&b, "Transfer-Encoding: chunked\r\n", 28);
+    st->chunked = true;
+  } else if (!b.has_length && !st->no_body) {
+    head_append(&b, "Content-Length: 0\r\n", 19);
+  }
+  if (st->conn->keep_alive)
+    head_append(&b, "Connection: keep-alive\r\n\r\n", 26);
+  else
+    head_append(&b, "Connection: close\r\n\r\n", 21);
+  if (b.overflow) {
+    stream_abort(s, st, H2_INTERNAL_ERROR, "response head too large");
+    return;
+  }
+  deliver(s, st, s->head, s->head_len);
+  if (s->hdr_end_stream)
+    st->remote_done = st->done = true;
+}
+
+static bool strip_padding(const h2_frame_hdr_t *h, const u8 **payload, usize *len) {
+  *len = h->length;
+  if (!(h->flags & H2_FLAG_PADDED))
+    return true;
+  if (*len < 1)
+    return false;
+  u8 pad = (*payload)[0];
+  (*payload)++;
+  (*len)--;
+  if (pad > *len)
+    return false;
+  *len -= pad;
+  return true;
+}
+
+static void on_headers(upstream_h2_session_t *s, const h2_frame_hdr_t *h, const u8 *payload) {
+  if (h->stream_id == 0) {
+    session_error(s, H2_PROTOCOL_ERROR);
+    return;
+  }
+  const u8 *p = payload;
+  usize len;
+  if (!strip_padding(h, &p, &len)) {
+    session_error(s, H2_PROTOCOL_ERROR);
+    return;
+  }
+  if (h->flags & H2_FLAG_PRIORITY) {
+    if (len < 5) {
+      session_error(s, H2_FRAME_SIZE_ERROR);
+      return;
+    }
+    p += 5;
+    len -= 5;
+  }
+  memcpy(s->hdr_block, p, len);
+  s->hdr_len = len;
+  s->hdr_stream = h->stream_id;
+  s->hdr_end_stream = (h->flags & H2_FLAG_END_STREAM) != 0;
+  if (h->flags & H2_FLAG_END_HEADERS)
+    finish_headers(s);
+}
+
+static void on_continuation(upstream_h2_session_t *s, const h2_frame_hdr_t *h,
+                            const u8 *payload) {
+  if (s->hdr_len + h->length > UH2_MAX_HEADER_BLOCK) {
+    session_error(s, H2_PROTOCOL_ERROR);
+    return;
+  }
+  memcpy(s->hdr_block + s->hdr_len, payload, h->length);
+  s->hdr_len += h->length;
+  if (h->flags & H2_FLAG_END_HEADERS)
+    finish_headers(s);
+}
+
+// Returns false, leaving the frame unread, when the client side has no room for it.
+static bool on_data(upstream_h2_session_t *s, const h2_frame_hdr_t *h, const u8 *payload) {
+  if (h->stream_id == 0) {
+    session_error(s, H2_PROTOCOL_ERROR);
+    return true;
+  }
+  const u8 *p = payload;
+  usize len;
+  if (!strip_padding(h, &p, &len)) {
+    session_error(s, H2_PROTOCOL_ERROR);
+    return true;
+  }
+
+  uh2_stream_t *st = find_stream(s, h->stream_id);
+  bool forward = st && !st->remote_done && st->status != 0 && !st->no_body;
+  if (forward && (st->pending || client_room(st->conn) < len + UH2_CHUNK_OVERHEAD)) {
+    s->stalled = st;
+    return false;
+  }
+
+  s->recv_credit += h->length;
+  if (!st) {
+    if (h->stream_id >= s->next_id)
+      session_error(s, H2_PROTOCOL_ERROR);
+    return true;
+  }
+  if (st->remote_done)
+    return true;
+  st->recv_window -= h->length;
+  st->recv_credit += h->length;
+  if (st->recv_window < 0) {
+    stream_abort(s, st, H2_FLOW_CONTROL_ERROR, "peer overran the stream window");
+    return true;
+  }
+  if (st->status == 0) {
+    stream_abort(s, st, H2_PROTOCOL_ERROR, "DATA before the response head");
+    return true;
+  }
+
+  bool end = (h->flags & H2_FLAG_END_STREAM) != 0;
+  if (forward && st->chunked) {
+    if (len > 0) {
+      char size[24];
+      int n = snprintf(size, sizeof(size), "%zx\r\n", len);
+      client_append(st->conn, size, (usize)n);
+      client_append(st->conn, p, len);
+      client_append(st->conn, "\r\n", 2);
+    }
+    if (end)
+      client_append(st->conn, "0\r\n\r\n", 5);
+  } else if (forward) {
+    client_append(st->conn, p, len);
+  }
+  if (end)
+    st->remote_done = st->done = true;
+  st->notify = true;
+  return true;
+}
+
+static void on_settings(upstream_h2_session_t *s, const h2_frame_hdr_t *h, const u8 *payload) {
+  if (h->stream_id != 0) {
+    session_error(s, H2_PROTOCOL_ERROR);
+    return;
+  }
+  if (h->flags & H2_FLAG_ACK) {
+    if (h->length != 0)
+      session_error(s, H2_FRAME_SIZE_ERROR);
+    return;
+  }
+  if (h->length % 6 != 0) {
+    session_error(s, H2_FRAME_SIZE_ERROR);
+    return;
+  }
+
+  for (u32 off = 0; off < h->length; off += 6) {
+    u16 id = (u16)((payload[off] << 8) | payload[off + 1]);
+    u32 value = h2_get_u32(payload + off + 2);
+    if (id == H2_SETTINGS_MAX_CONCURRENT_STREAMS) {
+      s->peer_max_streams = value < UPSTREAM_H2_MAX_STREAMS ? value : UPSTREAM_H2_MAX_STREAMS;
+    } else if (id == H2_SETTINGS_INITIAL_WINDOW_SIZE) {
+      if (value > H2_MAX_WINDOW) {
+        session_error(s, H2_FLOW_CONTROL_ERROR);
+        return;
+      }
+      i64 delta = (i64)value - s->peer_initial_window;
+      for (int i = 0; i < UPSTREAM_H2_MAX_STREAMS; i++) {
+        if (s->streams[i].conn && s->streams[i].id != 0)
+          s->streams[i].send_window += delta;
+      }
+      s->peer_initial_window = value;
+    } else if (id == H2_SETTINGS_MAX_FRAME_SIZE) {
+      if (value < H2_DEFAULT_FRAME_SIZE || value > H2_MAX_FRAME_SIZE) {
+        session_error(s, H2_PROTOCOL_ERROR);
+        return;
+      }
+    }
+  }
+  h2_frame_put(&s->wbuf, H2_SETTINGS, H2_FLAG_ACK, 0, NULL, 0);
+  s->settings_seen = true;
+  wake_senders(s);
+}
+
+static void on_window_update(upstream_h2_session_t *s, const h2_frame_hdr_t *h,
+                             const u8 *payload) {
+  if (h->length != 4) {
+    session_error(s, H2_FRAME_SIZE_ERROR);
+    return;
+  }
+  u32 inc = h2_get_u32(payload) & 0x7fffffff;
+  if (h->stream_id == 0) {
+    s->send_window += inc;
+    if (inc == 0 || s->send_window > H2_MAX_WINDOW)
+      session_error(s, inc == 0 ? H2_PROTOCOL_ERROR : H2_FLOW_CONTROL_ERROR);
+    else
+      wake_senders(s);
+    return;
+  }
+
+  uh2_stream_t *st = find_stream(s, h->stream_id);
+  if (!st || st->done)
+    return;
+  st->send_window += inc;
+  if (inc == 0 || st->send_window > H2_MAX_WINDOW)
+    stream_abort(s, st, inc == 0 ? H2_PROTOCOL_ERROR : H2_FLOW_CONTROL_ERROR,
+                 "bad WINDOW_UPDATE");
+  else if (st->body_blocked)
+    wake_senders(s);
+}
+
+static void on_rst_stream(upstream_h2_session_t *s, const h2_frame_hdr_t *h, const u8 *payload) {
+  if (h->stream_id == 0) {
+    session_error(s, H2_PROTOCOL_ERROR);
+    return;
+  }
+  if (h->length != 4) {
+    session_error(s, H2_FRAME_SIZE_ERROR);
+    return;
+  }
+  uh2_stream_t *st = find_stream(s, h->stream_id);
+  if (!st)
+    return;
+  // A refused stream was never processed; one without a body can simply be sent again.
+  if (h2_get_u32(payload) == H2_REFUSED_STREAM && st->status == 0 && !st->has_body) {
+    st->id = 0;
+    st->end_sent = false;
+    s->open--;
+    return;
+  }
+  // After a complete response this only means the rest of the request body is not wanted.
+  if (!st->remote_done) {
+    log_debug("upstream h2: stream %u reset by peer, code %u", st->id, h2_get_u32(payload));
+    st->done = st->failed = true;
+    st->remote_done = true;
+  }
+  st->end_sent = true;
+  st->body_blocked = false;
+}
+
+static void on_goaway(upstream_h2_session_t *s, const h2_frame_hdr_t *h, const u8 *payload) {
+  if (h->stream_id != 0 || h->length < 8) {
+    session_error(s, h->stream_id != 0 ? H2_PROTOCOL_ERROR : H2_FRAME_SIZE_ERROR);
+    return;
+  }
+  u32 last = h2_get_u32(payload) & 0x7fffffff;
+  log_debug("upstream h2 %s:%d: GOAWAY last=%u code=%u", s->be->host, s->be->port, last,
+            h2_get_u32(payload + 4));
+  // No new streams go to this connection; the ones the peer never saw fail.
+  if (!s->goaway) {
+    s->goaway = true;
+    session_unlink(s);
+  }
+  for (int i = 0; i < UPSTREAM_H2_MAX_STREAMS; i++) {
+    uh2_stream_t *st = &s->streams[i];
+    if (st->conn && !st->done && (st->id == 0 || st->id > last)) {
+      st->done = st->failed = true;
+      st->remote_done = st->end_sent = true;
+    }
+  }
+}
+
+static bool handle_frame(upstream_h2_session_t *s, const h2_frame_hdr_t *h, const u8 *payload) {
+  if (s->hdr_stream != 0 && (h->type != H2_CONTINUATION || h->stream_id != s->hdr_stream)) {
+    session_error(s, H2_PROTOCOL_ERROR);
+    return true;
+  }
+
+  switch (h->type) {
+    case H2_DATA:
+      return on_data(s, h, payload);
+    case H2_HEADERS:
+      on_headers(s, h, payload);
+      break;
+    case H2_CONTINUATION:
+      if (s->hdr_stream == 0)
+        session_error(s, H2_PROTOCOL_ERROR);
+      else
+        on_continuation(s, h, payload);
+      break;
+    case H2_SETTINGS:
+      on_settings(s, h, payload);
+      break;
+    case H2_WINDOW_UPDATE:
+      on_window_update(s, h, payload);
+      break;
+    case H2_RST_STREAM:
+      on_rst_stream(s, h, payload);
+      break;
+    case H2_PING:
+      if (h->stream_id != 0 || h->length != 8)
+        session_error(s, h->stream_id != 0 ? H2_PROTOCOL_ERROR : H2_FRAME_SIZE_ERROR);
+      else if (!(h->flags & H2_FLAG_ACK))
+        h2_frame_put(&s->wbuf, H2_PING, H2_FLAG_ACK, 0, payload, 8);
+      break;
+    case H2_GOAWAY:
+      on_goaway(s, h, payload);
+      break;
+    case H2_PUSH_PROMISE:
+      // Push is disabled in our SETTINGS.
+      session_error(s, H2_PROTOCOL_ERROR);
+      break;
+    default:
+      break;
+  }
+  return true;
+}
+
+static void process_frames(upstream_h2_session_t *s) {
+  np_buf_t *in = &s->rbuf;
+
+  while (!s->dead && !s->stalled) {
+    usize avail = buf_readable(in);
+    if (avail < H2_FRAME_HEADER_LEN)
+      break;
+    h2_frame_hdr_t h;
+    h2_frame_parse_header(buf_read_ptr(in), &h);
+    if (h.length > H2_DEFAULT_FRAME_SIZE) {
+      session_error(s, H2_FRAME_SIZE_ERROR);
+      break;
+    }
+    if (avail < H2_FRAME_HEADER_LEN + h.length)
+      break;
+    if (!handle_frame(s, &h, buf_read_ptr(in) + H2_FRAME_HEADER_LEN))
+      break;
+    buf_consume(in, H2_FRAME_HEADER_LEN + h.length);
+  }
+  if (s->dead)
+    return;
+  buf_compact(in);
+  if (s->recv_credit >= UH2_CONN_WINDOW / 2 &&
+      h2_frame_put_u32(&s->wbuf, H2_WINDOW_UPDATE, 0, (u32)s->recv_credit) == NP_OK)
+    s->recv_credit = 0;
+}
+
+static void session_read(upstream_h2_session_t *s) {
+  while (!s->dead && !s->stalled) {
+    process_frames(s);
+    if (s->dead || s->stalled)
+      return;
+    isize n = buf_read_fd(&s->rbuf, s->fd);
+    if (n == NP_ERR_AGAIN)
+      return;
+    if (n <= 0) {
+      session_fail(s, n == NP_ERR_CLOSED ? "connection closed by peer" : "read failed");
+      return;
+    }
+  }
+}
+
+// Runs the proxy callbacks for everything the last events produced. Callbacks may close
+// client connections, which detaches their streams, so each pass re-checks every slot.
+static void session_settle(upstream_h2_session_t *s) {
+  if (s->depth > 0)
+    return;
+  s->depth++;
+  bool work = true;
+  while (work) {
+    work = false;
+    for (int i = 0; i < UPSTREAM_H2_MAX_STREAMS; i++) {
+      uh2_stream_t *st = &s->streams[i];
+      conn_t *c = st->conn;
+      if (!c)
+        continue;
+      if (st->done && !st->pending) {
+        bool failed = st->failed;
+        upstream_release(s->pool, s->be, failed);
+        stream_release(s, st);
+        proxy_on_upstream_h2(c, failed ? NP_ERR : NP_ERR_CLOSED);
+        work = true;
+        continue;
+      }
+      if (st->notify) {
+        st->notify = false;
+        proxy_on_upstream_h2(c, NP_OK);
+        if (st->conn == c)
+          grant_window(s, st);
+        work = true;
+      }
+      if (st->conn == c && st->want_body) {
+        st->want_body = false;
+        proxy_pump_request_body(c);
+        work = true;
+      }
+    }
+    if (!s->dead)
+      start_queued(s);
+  }
+  session_flush(s);
+  s->depth--;
+  if (s->used == 0 && (s->dead || s->goaway)) {
+    session_unlink(s);
+    session_free(s);
+  }
+}
+
+static void session_on_event(int fd, u32 events, void *arg) {
+  NP_UNUSED(fd);
+  upstream_h2_session_t *s = (upstream_h2_session_t *)arg;
+
+  s->depth++;
+  if (events & EV_WRITE) {
+    session_flush(s);
+    if (!s->dead && buf_readable(&s->wbuf) == 0)
+      wake_senders(s);
+  }
+  if (!s->dead && (events & (EV_READ | EV_HUP | EPOLLHUP | EPOLLERR)))
+    session_read(s);
+  s->depth--;
+  session_settle(s);
+}
+
+// Re-arms write interest so the next loop iteration runs the session's deferred work.
+static void session_kick(upstream_h2_session_t *s) {
+  if (s->dead)
+    return;
+  s->want_write = true;
+  event_loop_mod(s->loop, s->fd, EV_WRITE | EV_READ | EV_HUP | EV_EDGE, session_on_event, s);
+}
+
+static void put_setting(u8 *p, u16 id, u32 value) {
+  p[0] = (u8)(id >> 8);
+  p[1] = (u8)id;
+  h2_put_u32(p + 2, value);
+}
+
+static upstream_h2_session_t *session_create(upstream_pool_t *pool, upstream_backend_t *be,
+                                             event_loop_t *loop) {
+  upstream_h2_session_t *s = calloc(1, sizeof(*s));
+  if (!s)
+    return NULL;
+  s->fd = -1;
+  s->loop = loop;
+  if (buf_init(&s->rbuf, NP_READ_BUF_SIZE) != NP_OK ||
+      buf_init(&s->wbuf, NP_WRITE_BUF_SIZE) != NP_OK ||
+      !(s->head = malloc(UH2_MAX_HEADER_BLOCK)) ||
+      !(s->hdr_block = malloc(UH2_MAX_HEADER_BLOCK)) || !(s->arena = arena_create(NP_ARENA_SIZE)) ||
+      hpack_table_init(&s->hpack, HPACK_DEFAULT_TABLE_SIZE) != NP_OK) {
+    session_free(s);
+    return NULL;
+  }
+  if (socket_connect_nonblock(&s->fd, be->host, be->port) != NP_OK) {
+    log_warn("upstream h2: cannot connect to %s:%d", be->host, be->port);
+    s->fd = -1;
+    session_free(s);
+    return NULL;
+  }
+  s->pool = pool;
+  s->be = be;
+  s->next_id = 1;
+  s->peer_max_streams = UPSTREAM_H2_MAX_STREAMS;
+  s->peer_initial_window = H2_DEFAULT_WINDOW;
+  s->send_window = H2_DEFAULT_WINDOW;
+
+  memcpy(buf_write_ptr(&s->wbuf), H2_PREFACE, H2_PREFACE_LEN);
+  buf_produce(&s->wbuf, H2_PREFACE_LEN);
+  u8 settings[12];
+  put_setting(settings, H2_SETTINGS_ENABLE_PUSH, 0);
+  put_setting(settings + 6, H2_SETTINGS_INITIAL_WINDOW_SIZE, UH2_STREAM_WINDOW);
+  h2_frame_put(&s->wbuf, H2_SETTINGS, 0, 0, settings, sizeof(settings));
+  h2_frame_put_u32(&s->wbuf, H2_WINDOW_UPDATE, 0, UH2_CONN_WINDOW - H2_DEFAULT_WINDOW);
+
+  s->want_write = true;
+  event_loop_add(loop, s->fd, EV_WRITE | EV_READ | EV_HUP | EV_EDGE, session_on_event, s);
+  be->h2_sessions[be->h2_count++] = s;
+  log_debug("upstream h2: new connection to %s:%d fd=%d", be->host, be->port, s->fd);
+  return s;
+}
+
+// Spreads streams over up to pool->h2_conns connections. When every connection is at the
+// peer's stream limit the stream queues on the least busy one.
+static upstream_h2_session_t *session_pick(upstream_pool_t *pool, upstream_backend_t *be,
+                                           event_loop_t *loop) {
+  upstream_h2_session_t *best = NULL;
+  for (int i = 0; i < be->h2_count; i++) {
+    upstream_h2_session_t *s = be->h2_sessions[i];
+    if (s->used < UPSTREAM_H2_MAX_STREAMS && (!best || s->used < best->used))
+      best = s;
+  }
+  if ((!best || best->used > 0) && be->h2_count < pool->h2_conns) {
+    upstream_h2_session_t *s = session_create(pool, be, loop);
+    if (s)
+      return s;
+  }
+  return best;
+}
+
+np_status_t upstream_h2_open(upstream_pool_t *pool, upstream_backend_t *be, conn_t *conn,
+                             http_request_t *req, bool has_body) {
+  upstream_h2_session_t *s = session_pick(pool, be, conn->loop);
+  if (!s)
+    return NP_ERR;
+
+  uh2_stream_t *st = NULL;
+  for (int i = 0; i < UPSTREAM_H2_MAX_STREAMS && !st; i++) {
+    if (!s->streams[i].conn)
+      st = &s->streams[i];
+  }
+  if (!st)
+    return NP_ERR;
+  memset(st, 0, sizeof(*st));
+  st->session = s;
+  st->conn = conn;
+  st->has_body = has_body;
+  st->head_only = req->method == HTTP_METHOD_HEAD;
+  st->te_trailers = str_ieq(str_trim(request_header(req, STR("TE"))), STR("trailers"));
+  s->used++;
+  conn->upstream_h2 = st;
+
+  if (s->settings_seen && (u32)s->open < s->peer_max_streams && stream_start(s, st))
+    session_flush(s);
+  // A queued stream encodes its head later, after the client connection has read on into rbuf.
+  if (st->id == 0 && conn_detach_request(conn) != NP_OK)
+    st->failed = true;
+  if (st->failed) {
+    stream_release(s, st);
+    session_settle(s);
+    return NP_ERR;
+  }
+  // The body is pumped from the event handler, once the caller has finished setting up.
+  if (has_body && st->id != 0) {
+    st->want_body = true;
+    session_kick(s);
+  }
+  return NP_OK;
+}
+
+np_status_t upstream_h2_send_body(conn_t *conn, bool last) {
+  uh2_stream_t *st = (uh2_stream_t *)conn->upstream_h2;
+  if (!st || st->id == 0 || st->end_sent)
+    return NP_OK;
+  upstream_h2_session_t *s = st->session;
+  np_buf_t *in = &conn->upstream_wbuf;
+
+  st->body_blocked = false;
+  for (;;) {
+    usize avail = buf_readable(in);
+    i64 window = st->send_window < s->send_window ? st->send_window : s->send_window;
+    usize n = window > 0 ? (usize)window : 0;
+    if (n > H2_DEFAULT_FRAME_SIZE)
+      n = H2_DEFAULT_FRAME_SIZE;
+    if (n > avail)
+      n = avail;
+    if (n == 0 && !(last && avail == 0)) {
+      st->body_blocked = avail > 0;
+      break;
+    }
+    if (buf_writable(&s->wbuf) < H2_FRAME_HEADER_LEN + n)
+      buf_compact(&s->wbuf);
+    if (buf_writable(&s->wbuf) < H2_FRAME_HEADER_LEN + n) {
+      st->body_blocked = true;
+      break;
+    }
+    bool end = last && n == avail;
+    h2_frame_put(&s->wbuf, H2_DATA, end ? H2_FLAG_END_STREAM : 0, st->id, buf_read_ptr(in), n);
+    buf_consume(in, n);
+    st->send_window -= (i64)n;
+    s->send_window -= (i64)n;
+    if (end) {
+      st->end_sent = true;
+      break;
+    }
+  }
+
+  session_flush(s);
+  if (st->failed) {
+    stream_release(s, st);
+    session_settle(s);
+    return NP_ERR;
+  }
+  return NP_OK;
+}
+
+void upstream_h2_resume(conn_t *conn) {
+  uh2_stream_t *st = (uh2_stream_t *)conn->upstream_h2;
+  upstream_h2_session_t *s = st->session;
+
+  if (st->pending && client_room(conn) >= st->pending_len) {
+    client_append(conn, st->pending, st->pending_len);
+    free(st->pending);
+    st->pending = NULL;
+    st->pending_len = 0;
+    st->notify = true;
+    if (s->stalled == st) {
+      s->stalled = NULL;
+      s->depth++;
+      session_read(s);
+      s->depth--;
+    }
+  }
+  grant_window(s, st);
+  // Not enough room for a window update yet: have the client side call back once it drains.
+  if (!st->remote_done && st->recv_credit >= UH2_STREAM_WINDOW / 2)
+    st->notify = true;
+  session_settle(s);
+}
+
+void upstream_h2_detach(conn_t *conn) {
+  uh2_stream_t *st = (uh2_stream_t *)conn->upstream_h2;
+  upstream_h2_session_t *s = st->session;
+  bool stalled = s->stalled == st;
+
+  upstream_release(s->pool, s->be, false);
+  stream_release(s, st);
+  if (stalled && !s->dead) {
+    s->depth++;
+    session_read(s);
+    s->depth--;
+  }
+  session_settle(s);
+}
+
+void upstream_h2_close_all(upstream_backend_t *be) {
+  while (be->h2_count > 0) {
+    upstream_h2_session_t *s = be->h2_sessions[0];
+    for (int i = 0; i < UPSTREAM_H2_MAX_STREAMS; i++) {
+      uh2_stream_t *st = &s->streams[i];
+      if (st->conn) {
+        st->conn->upstream_h2 = NULL;
+        free(st->pending);
+      }
+    }
+    session_unlink(s);
+    session_free(s);
+  }
+}
@@ -0,0 +1,27 @@
+#ifndef NPROXY_UPSTREAM_H2_H
+#define NPROXY_UPSTREAM_H2_H
+
+#include "core/types.h"
+#include "http/request.h"
+#include "net/conn.h"
+#include "proxy/upstream.h"
+
+#define UPSTREAM_H2_MAX_STREAMS 128
+
+// Opens a stream for `req` on one of the backend's multiplexed h2c connections, connecting a
+// new one while the pool allows more. The response is translated back to HTTP/1.1 in
+// conn->upstream_rbuf and announced through proxy_on_upstream_h2().
+np_status_t upstream_h2_open(upstream_pool_t *pool, upstream_backend_t *be, conn_t *conn,
+                             http_request_t *req, bool has_body);
+
+// Sends what the proxy staged in conn->upstream_wbuf as DATA frames, as far as flow control
+// allows; `last` ends the request once all of it is out. Returns NP_ERR if the stream failed,
+// in which case it is already detached from `conn`.
+np_status_t upstream_h2_send_body(conn_t *conn, bool last);
+
+// The client side drained conn->upstream_rbuf: hand over more of the response.
+void upstream_h2_resume(conn_t *conn);
+void upstream_h2_detach(conn_t *conn);
+void upstream_h2_close_all(upstream_backend_t *be);
+
+#endif
@@ -0,0 +1,147 @@
+#include "static/bundle.h"
+
+#include <fcntl.h>
+#include <stdalign.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "core/log.h"
+
+struct bundle {
+  int fd;
+  void *map;
+  usize map_len;
+  const bundle_entry_t *index;
+  u32 count;
+  const char *strings;
+};
+
+// Orders paths the way nproxy-pack sorts them.
+static int path_cmp(const char *a, usize alen, const char *b, usize blen) {
+  int c = memcmp(a, b, alen < blen ? alen : blen);
+  if (c != 0)
+    return c;
+  return alen < blen ? -1 : alen > blen;
+}
+
+static bool span_ok(u64 off, u64 len, u64 size) {
+  return off <= size && len <= size - off;
+}
+
+// Everything a lookup or a response will read, checked once so that a truncated or hand-edited
+// bundle cannot send a worker out of bounds later.
+static const char *check(const bundle_header_t *h, const u8 *map, u64 size) {
+  if (memcmp(h->magic, BUNDLE_MAGIC, sizeof(h->magic)) != 0)
+    return "not a bundle";
+  if (h->version != BUNDLE_VERSION)
+    return "unsupported version";
+  if (h->index_off % alignof(bundle_entry_t) != 0 ||
+      !span_ok(h->index_off, (u64)h->count * sizeof(bundle_entry_t), size))
+    return "index out of bounds";
+  if (h->strings_len == 0 || h->strings_len > UINT32_MAX ||
+      !span_ok(h->strings_off, h->strings_len, size) ||
+      map[h->strings_off + h->strings_len - 1] != '\0')
+    return "bad string table";
+
+  const bundle_entry_t *index = (const bundle_entry_t *)(map + h->index_off);
+  const char *strings = (const char *)(map + h->strings_off);
+  for (u32 i = 0; i < h->count; i++) {
+    const bundle_entry_t *e = &index[i];
+    if (!span_ok(e->path_off, e->path_len, h->strings_len - 1) || e->path_len == 0 ||
+        strings[e->path_off] != '/' || memchr(strings + e->path_off, '\0', e->path_len))
+      return "bad entry path";
+    if (e->mime_off >= h->strings_len || e->etag_off >= h->strings_len ||
+        e->gz_etag_off >= h->strings_len)
+      return "bad entry string";
+    if (!span_ok(e->data_off, e->data_len, size) || !span_ok(e->gz_off, e->gz_len, size) ||
+        e->data_len > INT64_MAX || e->gz_len > INT64_MAX)
+      return "payload out of bounds";
+    if (i > 0 && path_cmp(strings + index[i - 1].path_off, index[i - 1].path_len,
+                          strings + e->path_off, e->path_len) >= 0)
+      return "index not sorted";
+  }
+  return NULL;
+}
+
+bundle_t *bundle_open(const char *path) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    log_error_errno("static_bundle: cannot open %s", path);
+    return NULL;
+  }
+  struct stat st;
+  bundle_header_t h;
+  if (fstat(fd, &st) < 0 || pread(fd, &h, sizeof(h), 0) != (isize)sizeof(h)) {
+    log_error("static_bundle: %s: cannot read header", path);
+    close(fd);
+    return NULL;
+  }
+
+  // Only the header, index and strings are mapped; the payloads after them are never touched
+  // through the mapping.
+  u64 size = (u64)st.st_size;
+  u64 map_len = sizeof(h);
+  if (span_ok(h.index_off, (u64)h.count * sizeof(bundle_entry_t), size) &&
+      h.index_off + (u64)h.count * sizeof(bundle_entry_t) > map_len)
+    map_len = h.index_off + (u64)h.count * sizeof(bundle_entry_t);
+  if (span_ok(h.strings_off, h.strings_len, size) && h.strings_off + h.strings_len > map_len)
+    map_len = h.strings_off + h.strings_len;
+  void *map = mmap(NULL, map_len, PROT_READ, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED) {
+    log_error_errno("static_bundle: mmap %s", path);
+    close(fd);
+    return NULL;
+  }
+  const char *why = check(&h, map, size);
+  bundle_t *b = why ? NULL : calloc(1, sizeof(*b));
+  if (!b) {
+    log_error("static_bundle: %s: %s", path, why ? why : "out of memory");
+    munmap(map, map_len);
+    close(fd);
+    return NULL;
+  }
+  madvise(map, map_len, MADV_WILLNEED);
+  b->fd = fd;
+  b->map = map;
+  b->map_len = map_len;
+  b->index = (const bundle_entry_t *)((const u8 *)map + h.index_off);
+  b->count = h.count;
+  b->strings = (const char *)map + h.strings_off;
+  log_debug("static_bundle: %s, %u file(s)", path, h.count);
+  return b;
+}
+
+void bundle_close(bundle_t *b) {
+  if (!b)
+    return;
+  munmap(b->map, b->map_len);
+  close(b->fd);
+  free(b);
+}
+
+int bundle_fd(const bundle_t *b) {
+  return b->fd;
+}
+
+const bundle_entry_t *bundle_find(const bundle_t *b, const char *path, usize len) {
+  u32 lo = 0, hi = b->count;
+  while (lo < hi) {
+    u32 mid = lo + (hi - lo) / 2;
+    const bundle_entry_t *e = &b->index[mid];
+    int c = path_cmp(b->strings + e->path_off, e->path_len, path, len);
+    if (c == 0)
+      return e;
+    if (c < 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return NULL;
+}
+
+const char *bundle_string(const bundle_t *b, u32 off) {
+  return b->strings + off;
+}
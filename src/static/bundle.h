@@ -0,0 +1,20 @@
+#ifndef NPROXY_BUNDLE_H
+#define NPROXY_BUNDLE_H
+
+#include "core/types.h"
+#include "static/bundle_format.h"
+
+// A static bundle built by tools/nproxy-pack, open for the life of a worker. The index and
+// strings are mapped; payloads are sent from bundle_fd() at the offsets the entries give.
+typedef struct bundle bundle_t;
+
+// Opens and checks the bundle at `path`; NULL, with the reason logged, if it is not one.
+bundle_t *bundle_open(const char *path);
+void bundle_close(bundle_t *b);
+
+int bundle_fd(const bundle_t *b);
+// The entry for the request path `path` ("/dir/name"), or NULL.
+const bundle_entry_t *bundle_find(const bundle_t *b, const char *path, usize len);
+const char *bundle_string(const bundle_t *b, u32 off);
+
+#endif
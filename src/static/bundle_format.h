@@ -0,0 +1,41 @@
+#ifndef NPROXY_BUNDLE_FORMAT_H
+#define NPROXY_BUNDLE_FORMAT_H
+
+#include "core/types.h"
+
+// On-disk layout of a static bundle (static_bundle), shared with tools/nproxy-pack. A bundle is
+// one header, the index, the string table and then the payloads, in host byte order. Workers
+// map everything up to the end of the string table and send payloads straight from the file.
+#define BUNDLE_MAGIC "NPXBNDL\0"
+#define BUNDLE_VERSION 1
+
+typedef struct {
+  char magic[8];
+  u32 version;
+  u32 count;  // index entries
+  u64 index_off;
+  u64 strings_off;
+  u64 strings_len;  // the last byte is a NUL
+  u64 reserved[3];
+} bundle_header_t;
+
+// Entries are sorted by path, compared bytewise with the shorter path first on a tie, and name
+// their strings by offset into the string table; every string is NUL-terminated.
+typedef struct {
+  u64 data_off;
+  u64 data_len;
+  u64 gz_off;  // gzip variant of the payload; gz_len is 0 when there is none
+  u64 gz_len;
+  i64 mtime;
+  u32 path_off;  // "/dir/name", without a NUL in it
+  u32 path_len;
+  u32 mime_off;
+  u32 etag_off;  // strong validators, quotes included
+  u32 gz_etag_off;
+  u32 reserved;
+} bundle_entry_t;
+
+_Static_assert(sizeof(bundle_header_t) == 64, "bundle header is 64 bytes");
+_Static_assert(sizeof(bundle_entry_t) == 64, "bundle index entries are 64 bytes");
+
+#endif
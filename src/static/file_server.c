@@ -4,141 +4,529 @@
 #include <fcntl.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/sendfile.h>
 #include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "core/log.h"
 #include "core/string_util.h"
+#include "features/compress.h"
 #include "http/response.h"
-#include "net/event_loop.h"
 #include "proc/worker.h"
-#include "static/mime.h"
+#include "static/bundle.h"
+#include "static/open_file_cache.h"
 
 static bool path_is_safe(const char *path) {
   return strstr(path, "..") == NULL;
 }
 
-static const char *file_extension(const char *path) {
-  const char *dot = strrchr(path, '.');
-  if (!dot || dot == path)
-    return NULL;
-  return dot + 1;
+// If-None-Match uses the weak comparison: "W/" prefixes do not matter.
+static bool etag_matches(str_t header, const char *etag) {
+  str_t tag = str_trim(header);
+  str_t ours = str_from_cstr(etag);
+  if (str_starts_with(tag, STR("W/")))
+    tag = str_slice(tag, 2, tag.len);
+  if (str_starts_with(ours, STR("W/")))
+    ours = str_slice(ours, 2, ours.len);
+  return str_eq(tag, ours);
 }
 
-static void etag_from_stat(const struct stat *st, char *buf, usize bufsz) {
-  snprintf(buf, bufsz, "\"%lx-%lx\"", (unsigned long)st->st_mtime, (unsigned long)st->st_size);
-}
+// Larger sets are answered with the whole file: every part costs a header and a seek.
+#define FILE_MAX_RANGES 16
 
-int file_server_handle(conn_t *conn, http_request_t *req, np_server_config_t *cfg) {
-  char resolved[8192];
-  char path[4096];
-  usize plen = req->path.len;
-  if (plen >= sizeof(path))
-    plen = sizeof(path) - 1;
+typedef struct {
+  off_t start;
+  off_t len;
+} byte_range_t;
 
-  strncpy(path, req->path.ptr, plen);
-  path[plen] = '\0';
+typedef struct {
+  int count;
+  int next;  // part whose header goes out next; `count` means the closing delimiter
+  off_t size;
+  off_t base;  // where the file's bytes start in file_fd
+  const char *mime;
+  char boundary[24];
+  byte_range_t r[FILE_MAX_RANGES];
+} range_set_t;
 
-  if (!path_is_safe(path)) {
-    response_write_error(&conn->wbuf, 403, req->keep_alive);
-    conn->state = CONN_WRITING_RESPONSE;
-    return 403;
-  }
+typedef enum {
+  RANGE_IGNORE = 0,  // absent, malformed or too many: the full file is sent
+  RANGE_OK,
+  RANGE_UNSATISFIABLE,
+} range_result_t;
 
-  int fd = -1;
-  struct stat st;
+// Digits only, no sign or spaces; false on overflow.
+static bool parse_offset(str_t s, off_t *out) {
+  if (s.len == 0 || s.len > 18)
+    return false;
+  off_t v = 0;
+  for (usize i = 0; i < s.len; i++) {
+    if (s.ptr[i] < '0' || s.ptr[i] > '9')
+      return false;
+    v = v * 10 + (s.ptr[i] - '0');
+  }
+  *out = v;
+  return true;
+}
 
-  if (cfg->try_files.count > 0) {
-    for (int i = 0; i < cfg->try_files.count; i++) {
-      char tmp_path[8192] = {0};
-      char *src = cfg->try_files.paths[i];
-      char *tgt = tmp_path;
-      while (*src && (tgt - tmp_path) < (isize)sizeof(tmp_path) - 1) {
-        if (strncmp(src, "$uri", 4) == 0) {
-          int ulen = snprintf(tgt, sizeof(tmp_path) - (tgt - tmp_path), "%s", path);
-          if (ulen > 0)
-            tgt += ulen;
-          src += 4;
-        } else {
-          *tgt++ = *src++;
-        }
-      }
-      *tgt = '\0';
-
-      snprintf(resolved, sizeof(resolved), "%s%s", cfg->static_root, tmp_path);
-      fd = open(resolved, O_RDONLY | O_CLOEXEC);
-      if (fd >= 0) {
-        if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
-          break;  // found a matching file
-        }
-        close(fd);
-        fd = -1;
-      }
-    }
-  } else {
-    if (path[plen - 1] == '/') {
-      snprintf(resolved, sizeof(resolved), "%s%sindex.html", cfg->static_root, path);
+// Parses "bytes=a-b, c-, -n" against a file of `size` bytes. Specs past the end are dropped;
+// when none is left the request is unsatisfiable.
+static range_result_t parse_ranges(str_t header, off_t size, range_set_t *set) {
+  str_t spec = str_trim(header);
+  if (size <= 0 || spec.len < 6 || strncasecmp(spec.ptr, "bytes=", 6) != 0)
+    return RANGE_IGNORE;
+  spec = str_slice(spec, 6, spec.len);
+  set->count = 0;
+  bool any = false;
+  while (spec.len > 0) {
+    const char *comma = memchr(spec.ptr, ',', spec.len);
+    usize len = comma ? (usize)(comma - spec.ptr) : spec.len;
+    str_t item = str_trim((str_t){spec.ptr, len});
+    spec = comma ? str_slice(spec, len + 1, spec.len) : STR_NULL;
+    if (item.len == 0)
+      continue;
+    const char *dash = memchr(item.ptr, '-', item.len);
+    if (!dash)
+      return RANGE_IGNORE;
+    str_t first = str_trim((str_t){item.ptr, (usize)(dash - item.ptr)});
+    str_t last = str_trim(str_slice(item, (usize)(dash - item.ptr) + 1, item.len));
+    off_t a, b;
+    if (first.len == 0) {
+      if (!parse_offset(last, &b))
+        return RANGE_IGNORE;
+      any = true;
+      if (b == 0)
+        continue;
+      a = b < size ? size - b : 0;
+      b = size - 1;
     } else {
-      snprintf(resolved, sizeof(resolved), "%s%s", cfg->static_root, path);
-    }
-    fd = open(resolved, O_RDONLY | O_CLOEXEC);
-    if (fd >= 0 && (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode))) {
-      close(fd);
-      fd = -1;
+      if (!parse_offset(first, &a) || (last.len > 0 && !parse_offset(last, &b)))
+        return RANGE_IGNORE;
+      if (last.len == 0 || b >= size)
+        b = size - 1;
+      else if (b < a)
+        return RANGE_IGNORE;
+      any = true;
+      if (a >= size)
+        continue;
     }
+    if (set->count == FILE_MAX_RANGES)
+      return RANGE_IGNORE;
+    set->r[set->count++] = (byte_range_t){a, b - a + 1};
   }
+  if (!any)
+    return RANGE_IGNORE;
+  return set->count > 0 ? RANGE_OK : RANGE_UNSATISFIABLE;
+}
 
-  if (fd < 0) {
-    response_write_error(&conn->wbuf, 404, req->keep_alive);
-    conn->state = CONN_WRITING_RESPONSE;
-    return 404;
+// If-Range holds a strong ETag or the date the file was last modified; anything else, a weak
+// tag included, means the client's copy is stale and gets the whole file.
+static bool if_range_matches(str_t header, const char *etag, time_t mtime) {
+  str_t v = str_trim(header);
+  if (v.len == 0)
+    return true;
+  if (v.ptr[0] == '"')
+    return etag[0] == '"' && str_eq(v, str_from_cstr(etag));
+  char date[64];
+  if (v.len >= sizeof(date))
+    return false;
+  memcpy(date, v.ptr, v.len);
+  date[v.len] = '\0';
+  struct tm tm = {0};
+  const char *end = strptime(date, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+  return end && *end == '\0' && timegm(&tm) == mtime;
+}
+
+// The delimiter and headers in front of part `i`, or the closing delimiter for i == count.
+static int part_header(const range_set_t *set, int i, char *buf, usize cap) {
+  if (i == set->count)
+    return snprintf(buf, cap, "\r\n--%s--\r\n", set->boundary);
+  const byte_range_t *r = &set->r[i];
+  return snprintf(buf, cap,
+                  "\r\n--%s\r\nContent-Type: %s\r\nContent-Range: bytes %lld-%lld/%lld\r\n\r\n",
+                  set->boundary, set->mime, (long long)r->start,
+                  (long long)(r->start + r->len - 1), (long long)set->size);
+}
+
+bool file_server_next_part(conn_t *conn) {
+  range_set_t *set = conn->file_ranges;
+  if (!set || set->next > set->count)
+    return false;
+  usize room = buf_writable(&conn->wbuf);
+  int n = part_header(set, set->next, (char *)buf_write_ptr(&conn->wbuf), room);
+  if (n < 0 || (usize)n >= room)
+    return false;
+  buf_produce(&conn->wbuf, (usize)n);
+  if (set->next < set->count) {
+    conn->file_offset = set->base + set->r[set->next].start;
+    conn->file_remaining = set->r[set->next].len;
   }
+  set->next++;
+  return true;
+}
+
+// Swaps `*file` for the precompressed foo.gz beside `resolved` when there is one at least as new
+// as the file; its bytes then go out through sendfile like any other file. A missing sidecar is
+// remembered by the open-file cache like any other miss.
+static bool open_sidecar(const char *resolved, open_file_t **file) {
+  char gz_path[8200];
+  if (snprintf(gz_path, sizeof(gz_path), "%s.gz", resolved) >= (int)sizeof(gz_path))
+    return false;
+  open_file_t *gz = open_file_get(gz_path);
+  if (!gz)
+    return false;
+  if (gz->st.st_mtime < (*file)->st.st_mtime) {
+    open_file_release(gz);
+    return false;
+  }
+  open_file_release(*file);
+  *file = gz;
+  return true;
+}
 
-  char etag[64];
-  etag_from_stat(&st, etag, sizeof(etag));
+// Answers a plain 200 for a small file from its cached copy: the status and Date lines go
+// into wbuf ahead of the prebuilt head, and the body is sent straight from the cache entry.
+// HTTP/2 streams are framed from the file descriptor instead.
+static bool send_from_memory(conn_t *conn, http_request_t *req, open_file_t *file) {
+  if (conn->h2_stream)
+    return false;
+  str_t mime = str_from_cstr(file->mime);
+  char extra[96];
+  int elen = snprintf(extra, sizeof(extra), "ETag: %s\r\nAccept-Ranges: bytes\r\n", file->etag);
+  usize tail_max = RESPONSE_TAIL_MAX(mime.len, (usize)elen);
+  if (!file->body && !open_file_load(file, 2 * tail_max))
+    return false;
+
+  int ka = req->keep_alive ? 1 : 0;
+  if (!file->head[ka]) {
+    char *head = malloc(tail_max);
+    if (!head)
+      return false;
+    file->head_len[ka] = response_format_tail(head, mime, (u64)file->st.st_size,
+                                              (str_t){.ptr = extra, .len = (usize)elen}, ka);
+    file->head[ka] = head;
+  }
+  if (!response_write_tail(&conn->wbuf, 200, file->head[ka], file->head_len[ka]))
+    return false;
+
+  if (req->method == HTTP_METHOD_HEAD) {
+    open_file_release(file);
+  } else {
+    conn->wref = file->body;
+    conn->wref_len = (usize)file->st.st_size;
+    conn->file_ref = file;
+  }
+  conn->state = CONN_WRITING_RESPONSE;
+  return true;
+}
+
+// Where a response's bytes come from: a file of its own, or an entry of a static bundle.
+typedef struct {
+  open_file_t *file;  // NULL for a bundle entry; fd then stays open
+  int fd;
+  off_t base;  // offset of the first byte in fd
+  off_t size;
+  time_t mtime;
+  const char *mime;
+  const char *etag;
+  bool precompressed;
+} file_source_t;
+
+// Validators, ranges and headers for `src`, then its body through sendfile, from memory or
+// compressed on the fly. Takes over the caller's reference to src->file.
+static int respond(conn_t *conn, http_request_t *req, const file_source_t *src) {
+  // Bundle entries come with their own gzip variants and are never compressed on the fly.
+  open_file_t *file = src->file;
+  const char *mime = src->mime;
+  bool precompressed = src->precompressed;
+  bool gzip = file && !precompressed && conn->gzip_pool && req->method != HTTP_METHOD_HEAD &&
+              src->size > 0 && src->size >= conn->gzip_min_length &&
+              should_compress(str_from_cstr(mime));
+
+  // The gzipped body differs byte for byte from the file, so it gets a weak validator.
+  char weak_etag[48];
+  const char *etag = src->etag;
+  if (gzip) {
+    snprintf(weak_etag, sizeof(weak_etag), "W/%s", src->etag);
+    etag = weak_etag;
+  }
 
   str_t ims = request_header(req, STR("If-None-Match"));
   if (ims.len > 0) {
-    char ims_buf[64];
-    usize l = ims.len < sizeof(ims_buf) - 1 ? ims.len : sizeof(ims_buf) - 1;
-    memcpy(ims_buf, ims.ptr, l);
-    ims_buf[l] = '\0';
-    if (strcmp(ims_buf, etag) == 0) {
-      close(fd);
+    if (etag_matches(ims, etag)) {
+      open_file_release(file);
       response_write_simple(&conn->wbuf, 304, "Not Modified", NULL, NULL, req->keep_alive);
       conn->state = CONN_WRITING_RESPONSE;
       return 304;
     }
   }
 
-  const char *ext = file_extension(resolved);
-  const char *mime = mime_by_extension(ext);
+  if (gzip) {
+    conn->gzip = gzip_stream_acquire(conn->gzip_pool, conn->gzip_level);
+    if (!conn->gzip) {
+      gzip = false;
+      etag = src->etag;
+    }
+  }
+
+  // Ranges select bytes of what is on disk, so they do not combine with compressing on the fly.
+  range_set_t *set = NULL;
+  range_result_t ranged = RANGE_IGNORE;
+  str_t range = request_header(req, STR("Range"));
+  if (range.len > 0 && !gzip && req->method == HTTP_METHOD_GET &&
+      if_range_matches(request_header(req, STR("If-Range")), etag, src->mtime)) {
+    set = arena_new(conn->arena, range_set_t);
+    if (set)
+      ranged = parse_ranges(range, src->size, set);
+  }
 
-  char header[512];
-  int hn = snprintf(header, sizeof(header),
-                    "HTTP/1.1 200 OK\r\n"
-                    "Content-Type: %s\r\n"
-                    "Content-Length: %ld\r\n"
-                    "ETag: %s\r\n"
-                    "Connection: %s\r\n"
-                    "\r\n",
-                    mime, (long)st.st_size, etag, req->keep_alive ? "keep-alive" : "close");
+  if (ranged == RANGE_IGNORE && !gzip && !precompressed && file &&
+      send_from_memory(conn, req, file))
+    return 200;
 
-  if (hn > 0 && buf_writable(&conn->wbuf) >= (usize)hn) {
-    memcpy(buf_write_ptr(&conn->wbuf), header, (usize)hn);
-    buf_produce(&conn->wbuf, (usize)hn);
+  char extra[256];
+  int elen;
+  if (ranged == RANGE_UNSATISFIABLE) {
+    open_file_release(file);
+    elen = snprintf(extra, sizeof(extra), "Content-Range: bytes */%lld\r\n",
+                    (long long)src->size);
+    response_write_head(&conn->wbuf, 416, STR("text/plain"), 0,
+                        (str_t){.ptr = extra, .len = (usize)elen}, req->keep_alive);
+    conn->state = CONN_WRITING_RESPONSE;
+    return 416;
   }
 
-  buf_write_fd(&conn->wbuf, conn->fd);
+  elen = snprintf(extra, sizeof(extra), "ETag: %s\r\n%s%s", etag,
+                  gzip ? "" : "Accept-Ranges: bytes\r\n",
+                  gzip || precompressed ? "Content-Encoding: gzip\r\nVary: Accept-Encoding\r\n"
+                                        : "");
+  conn->file_fd = src->fd;
+  conn->file_ref = file;
+  conn->file_borrowed = file == NULL;
+  conn->file_offset = src->base;
+  conn->file_warm_start = conn->file_warm_end = 0;
+  conn->file_remaining = src->size;
+  conn->file_ranges = NULL;
+
+  int status = 200;
+  if (ranged == RANGE_OK && set->count == 1) {
+    status = 206;
+    conn->file_offset = src->base + set->r[0].start;
+    conn->file_remaining = set->r[0].len;
+    elen += snprintf(extra + elen, sizeof(extra) - (usize)elen,
+                     "Content-Range: bytes %lld-%lld/%lld\r\n", (long long)set->r[0].start,
+                     (long long)(set->r[0].start + set->r[0].len - 1), (long long)src->size);
+    response_write_head(&conn->wbuf, 206, str_from_cstr(mime), (u64)set->r[0].len,
+                        (str_t){.ptr = extra, .len = (usize)elen}, req->keep_alive);
+  } else if (ranged == RANGE_OK) {
+    // multipart/byteranges: each part's header is written as the previous part finishes, so
+    // the length is worked out up front.
+    static u32 seq;
+    status = 206;
+    set->next = 0;
+    set->size = src->size;
+    set->base = src->base;
+    set->mime = mime;
+    snprintf(set->boundary, sizeof(set->boundary), "%08x%08x", (unsigned)time(NULL),
+             (unsigned)++seq);
+    u64 total = 0;
+    for (int i = 0; i <= set->count; i++)
+      total += (u64)part_header(set, i, NULL, 0) + (i < set->count ? (u64)set->r[i].len : 0);
+    char ctype[64];
+    snprintf(ctype, sizeof(ctype), "multipart/byteranges; boundary=%s", set->boundary);
+    response_write_head(&conn->wbuf, 206, str_from_cstr(ctype), total,
+                        (str_t){.ptr = extra, .len = (usize)elen}, req->keep_alive);
+    conn->file_ranges = set;
+    conn->file_remaining = 0;
+    file_server_next_part(conn);
+  } else {
+    response_write_head(&conn->wbuf, 200, str_from_cstr(mime),
+                        gzip ? RESPONSE_CHUNKED : (u64)src->size,
+                        (str_t){.ptr = extra, .len = (usize)elen}, req->keep_alive);
+  }
 
-  conn->file_fd = fd;
-  conn->file_offset = 0;
-  conn->file_remaining = st.st_size;
   conn->state = CONN_SENDFILE;
+  worker_sendfile_start(conn);
 
-  worker_client_event_mod(conn, EV_WRITE | EV_READ | EV_HUP | EV_EDGE);
+  return status;
+}
+
+// Copies the request path into `path`; false, with a 403 queued, if it is not safe to serve.
+static bool request_path(conn_t *conn, http_request_t *req, char *path, usize cap, usize *len) {
+  usize plen = req->path.len;
+  if (plen >= cap)
+    plen = cap - 1;
 
-  return 200;
+  strncpy(path, req->path.ptr, plen);
+  path[plen] = '\0';
+  *len = plen;
+
+  if (!path_is_safe(path)) {
+    response_send_error(conn, 403, req->keep_alive);
+    conn->state = CONN_WRITING_RESPONSE;
+    return false;
+  }
+  return true;
+}
+
+// A try_files entry with $uri replaced by `path`.
+static void expand_try_file(const char *pattern, const char *path, char *out, usize cap) {
+  const char *src = pattern;
+  char *tgt = out;
+  while (*src && (usize)(tgt - out) < cap - 1) {
+    if (strncmp(src, "$uri", 4) == 0) {
+      int ulen = snprintf(tgt, cap - (usize)(tgt - out), "%s", path);
+      if (ulen > 0)
+        tgt += ulen;
+      src += 4;
+    } else {
+      *tgt++ = *src++;
+    }
+  }
+  *tgt = '\0';
+}
+
+static int not_found(conn_t *conn, http_request_t *req) {
+  response_send_error(conn, 404, req->keep_alive);
+  conn->state = CONN_WRITING_RESPONSE;
+  return 404;
+}
+
+int file_server_handle(conn_t *conn, http_request_t *req, np_server_config_t *cfg,
+                       const char *root) {
+  char resolved[8192];
+  char path[4096];
+  usize plen;
+  if (!request_path(conn, req, path, sizeof(path), &plen))
+    return 403;
+
+  open_file_t *file = NULL;
+
+  // A remembered resolution skips the candidates that are known to be missing, or all of
+  // them; if its file has gone since, the list is walked again.
+  const char *known;
+  bool settled = false;
+  if (cfg->try_files.count > 0 && open_file_resolved(cfg, path, &known)) {
+    settled = true;
+    if (known) {
+      strncpy(resolved, known, sizeof(resolved) - 1);
+      resolved[sizeof(resolved) - 1] = '\0';
+      file = open_file_get(resolved);
+      settled = file != NULL;
+    }
+  }
+
+  if (cfg->try_files.count > 0) {
+    for (int i = 0; i < cfg->try_files.count && !settled; i++) {
+      char tmp_path[8192];
+      expand_try_file(cfg->try_files.paths[i], path, tmp_path, sizeof(tmp_path));
+      snprintf(resolved, sizeof(resolved), "%s%s", root, tmp_path);
+      file = open_file_get(resolved);
+      if (file)
+        break;  // found a matching file
+    }
+    if (!settled)
+      open_file_remember(cfg, path, file ? resolved : NULL);
+  } else {
+    if (path[plen - 1] == '/') {
+      snprintf(resolved, sizeof(resolved), "%s%sindex.html", root, path);
+    } else {
+      snprintf(resolved, sizeof(resolved), "%s%s", root, path);
+    }
+    file = open_file_get(resolved);
+  }
+
+  if (!file)
+    return not_found(conn, req);
+
+  const char *mime = file->mime;
+  bool precompressed =
+      cfg->gzip.static_enabled && client_accepts_gzip(req) && open_sidecar(resolved, &file);
+  file_source_t src = {
+      .file = file,
+      .fd = file->fd,
+      .size = file->st.st_size,
+      .mtime = file->st.st_mtime,
+      .mime = mime,
+      .etag = file->etag,
+      .precompressed = precompressed,
+  };
+  return respond(conn, req, &src);
+}
+
+int file_server_handle_bundle(conn_t *conn, http_request_t *req, np_server_config_t *cfg,
+                              const bundle_t *bundle) {
+  char path[4096];
+  usize plen;
+  if (!request_path(conn, req, path, sizeof(path), &plen))
+    return 403;
+
+  // The same candidates as on disk, looked up in the bundle's index instead of opened.
+  char candidate[8192];
+  const bundle_entry_t *e = NULL;
+  if (cfg->try_files.count > 0) {
+    for (int i = 0; i < cfg->try_files.count && !e; i++) {
+      expand_try_file(cfg->try_files.paths[i], path, candidate, sizeof(candidate));
+      e = bundle_find(bundle, candidate, strlen(candidate));
+    }
+  } else if (plen > 0 && path[plen - 1] == '/') {
+    int n = snprintf(candidate, sizeof(candidate), "%sindex.html", path);
+    e = bundle_find(bundle, candidate, (usize)n);
+  } else {
+    e = bundle_find(bundle, path, plen);
+  }
+  if (!e)
+    return not_found(conn, req);
+
+  bool gz = e->gz_len > 0 && client_accepts_gzip(req);
+  file_source_t src = {
+      .fd = bundle_fd(bundle),
+      .base = (off_t)(gz ? e->gz_off : e->data_off),
+      .size = (off_t)(gz ? e->gz_len : e->data_len),
+      .mtime = (time_t)e->mtime,
+      .mime = bundle_string(bundle, e->mime_off),
+      .etag = bundle_string(bundle, gz ? e->gz_etag_off : e->etag_off),
+      .precompressed = gz,
+  };
+  return respond(conn, req, &src);
+}
+
+np_status_t file_server_write_gzip(conn_t *conn) {
+  for (;;) {
+    while (conn->file_remaining > 0) {
+      usize room;
+      u8 *in = gzip_stream_input(conn->gzip, &room);
+      if (room == 0)
+        break;
+      usize want = (usize)conn->file_remaining < room ? (usize)conn->file_remaining : room;
+      isize r = pread(conn->file_fd, in, want, conn->file_offset);
+      if (r <= 0) {
+        // The file shrank under us; the chunked body cannot be ended cleanly.
+        log_error_errno("gzip: pread fd=%d", conn->file_fd);
+        return NP_ERR;
+      }
+      gzip_stream_commit(conn->gzip, (usize)r);
+      conn->file_offset += r;
+      conn->file_remaining -= r;
+    }
+
+    gzip_flush_t flush = conn->file_remaining == 0 ? GZIP_FINISH : GZIP_NO_FLUSH;
+    np_status_t rc = gzip_stream_deflate(conn->gzip, &conn->wbuf, flush);
+    if (rc == NP_ERR)
+      return NP_ERR;
+
+    isize n;
+    do {
+      n = conn_flush(conn);
+    } while (n > 0);
+    if (n == NP_ERR)
+      return NP_ERR;
+    if (buf_readable(&conn->wbuf) > 0)
+      return NP_ERR_AGAIN;
+    if (rc == NP_OK && flush == GZIP_FINISH)
+      return NP_OK;
+  }
 }
@@ -5,7 +5,25 @@
 #include "core/types.h"
 #include "http/request.h"
 #include "net/conn.h"
+#include "static/bundle.h"
 
-int file_server_handle(conn_t *conn, http_request_t *req, np_server_config_t *cfg);
+// Serves the file for `req` from `root`, which is the server's static_root or the one of the
+// matched location.
+int file_server_handle(conn_t *conn, http_request_t *req, np_server_config_t *cfg,
+                       const char *root);
+// The same for a server with a static_bundle: the request path and its try_files candidates
+// are looked up in the bundle, and the entry goes out by sendfile from the bundle's fd.
+int file_server_handle_bundle(conn_t *conn, http_request_t *req, np_server_config_t *cfg,
+                              const bundle_t *bundle);
+
+// Queues the header of the next part of a multipart/byteranges response in wbuf and points
+// file_offset/file_remaining at its bytes; after the last part, the closing delimiter. Call it
+// once the current part is sent and wbuf has drained. Returns false when the body is complete.
+bool file_server_next_part(conn_t *conn);
+
+// Sends the rest of a gzipped file: reads feed the connection's gzip stream, whose chunks go out
+// through wbuf. Returns NP_OK once the last chunk is written, NP_ERR_AGAIN when the socket is
+// full, NP_ERR on a read or write failure.
+np_status_t file_server_write_gzip(conn_t *conn);
 
 #endif
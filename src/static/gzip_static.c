@@ -0,0 +1,138 @@
+#include "static/gzip_static.h"
+
+#include <fcntl.h>
+#include <ftw.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "core/log.h"
+#include "core/string_util.h"
+#include "features/compress.h"
+#include "static/mime.h"
+
+// nftw() callbacks take no context; the walk runs in its own process, one root at a time.
+static int g_min_length;
+static int g_written;
+
+static bool sidecar_current(const char *gz_path, const struct stat *st) {
+  struct stat gst;
+  return stat(gz_path, &gst) == 0 && S_ISREG(gst.st_mode) && gst.st_mtime >= st->st_mtime;
+}
+
+// Compresses `path` into a temporary file next to it, then renames it over `gz_path` so a worker
+// never opens a half-written sidecar. The sidecar takes the file's mtime, which is what marks it
+// current. One that would not be smaller is not kept.
+static void write_sidecar(const char *path, const char *gz_path, const struct stat *st) {
+  char tmp[4096];
+  if (snprintf(tmp, sizeof(tmp), "%s.XXXXXX", gz_path) >= (int)sizeof(tmp))
+    return;
+  int in = open(path, O_RDONLY | O_CLOEXEC);
+  if (in < 0)
+    return;
+  int out = mkstemp(tmp);
+  if (out < 0) {
+    log_error_errno("gzip_static: mkstemp for %s", path);
+    close(in);
+    return;
+  }
+  fchmod(out, st->st_mode & 0666);
+  gzFile gz = gzdopen(out, "wb9");
+  if (!gz) {
+    close(out);
+    close(in);
+    unlink(tmp);
+    return;
+  }
+
+  bool ok = true;
+  char buf[64 * 1024];
+  isize r;
+  while ((r = read(in, buf, sizeof(buf))) > 0) {
+    if (gzwrite(gz, buf, (unsigned)r) != (int)r) {
+      ok = false;
+      break;
+    }
+  }
+  close(in);
+  if (gzclose(gz) != Z_OK || r < 0)
+    ok = false;
+
+  struct stat gst;
+  if (ok && stat(tmp, &gst) == 0 && gst.st_size < st->st_size) {
+    struct timespec times[2] = {st->st_atim, st->st_mtim};
+    if (utimensat(AT_FDCWD, tmp, times, 0) == 0 && rename(tmp, gz_path) == 0) {
+      g_written++;
+      return;
+    }
+  }
+  unlink(tmp);
+}
+
+static int visit(const char *path, const struct stat *st, int type, struct FTW *ftw) {
+  (void)ftw;
+  if (type != FTW_F || !S_ISREG(st->st_mode) || st->st_size < g_min_length || st->st_size == 0)
+    return 0;
+  const char *slash = strrchr(path, '/');
+  const char *dot = strrchr(path, '.');
+  if (!dot || (slash && dot < slash))
+    return 0;
+  if (strcmp(dot, ".gz") == 0 || !should_compress(str_from_cstr(mime_by_extension(dot + 1))))
+    return 0;
+
+  char gz_path[4096];
+  if (snprintf(gz_path, sizeof(gz_path), "%s.gz", path) >= (int)sizeof(gz_path))
+    return 0;
+  if (!sidecar_current(gz_path, st))
+    write_sidecar(path, gz_path, st);
+  return 0;
+}
+
+static void generate_root(const char *root, int min_length) {
+  g_min_length = min_length;
+  if (nftw(root, visit, 16, FTW_PHYS) != 0)
+    log_error_errno("gzip_static: walk %s", root);
+}
+
+static void generate(const np_config_t *cfg) {
+  for (int i = 0; i < cfg->server_count; i++) {
+    const np_server_config_t *srv = &cfg->servers[i];
+    if (!srv->gzip.static_generate)
+      continue;
+    if (srv->static_root[0] != '\0')
+      generate_root(srv->static_root, srv->gzip.min_length);
+    for (int j = 0; j < srv->location_count; j++) {
+      if (srv->locations[j].static_root[0] != '\0')
+        generate_root(srv->locations[j].static_root, srv->gzip.min_length);
+    }
+  }
+  log_info("gzip_static: wrote %d sidecar(s)", g_written);
+}
+
+void gzip_static_spawn(const np_config_t *cfg) {
+  bool wanted = false;
+  for (int i = 0; i < cfg->server_count && !wanted; i++)
+    wanted = cfg->servers[i].gzip.static_generate;
+  if (!wanted)
+    return;
+
+  // The intermediate child exits at once and is reaped here, so the walker is reparented and
+  // neither the master nor a single worker has to collect it.
+  pid_t pid = fork();
+  if (pid < 0) {
+    log_error_errno("gzip_static: fork");
+    return;
+  }
+  if (pid == 0) {
+    if (fork() == 0) {
+      generate(cfg);
+      _exit(0);
+    }
+    _exit(0);
+  }
+  waitpid(pid, NULL, 0);
+}
@@ -0,0 +1,12 @@
+#ifndef NPROXY_GZIP_STATIC_H
+#define NPROXY_GZIP_STATIC_H
+
+#include "core/config.h"
+#include "core/types.h"
+
+// Walks the static roots of every server with gzip static_generate on and writes a foo.gz beside
+// each compressible foo that lacks a current one. Runs in a detached process so startup and
+// reloads do not wait on it; the server only picks up sidecars at least as new as their file.
+void gzip_static_spawn(const np_config_t *cfg);
+
+#endif
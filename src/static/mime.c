@@ -1,49 +1,134 @@
 #include "static/mime.h"
 
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
+#include "core/log.h"
+#include "static/mime_hash.h"
+
+#define MIME_DEFAULT "application/octet-stream"
+
 typedef struct {
   const char *ext;
   const char *type;
 } mime_entry_t;
 
-static const mime_entry_t mime_table[] = {{"html", "text/html; charset=utf-8"},
-                                          {"htm", "text/html; charset=utf-8"},
-                                          {"css", "text/css; charset=utf-8"},
-                                          {"js", "application/javascript"},
-                                          {"mjs", "application/javascript"},
-                                          {"json", "application/json"},
-                                          {"xml", "application/xml"},
-                                          {"txt", "text/plain; charset=utf-8"},
-                                          {"md", "text/plain; charset=utf-8"},
-                                          {"png", "image/png"},
-                                          {"jpg", "image/jpeg"},
-                                          {"jpeg", "image/jpeg"},
-                                          {"gif", "image/gif"},
-                                          {"webp", "image/webp"},
-                                          {"svg", "image/svg+xml"},
-                                          {"ico", "image/x-icon"},
-                                          {"wasm", "application/wasm"},
-                                          {"pdf", "application/pdf"},
-                                          {"zip", "application/zip"},
-                                          {"gz", "application/gzip"},
-                                          {"mp4", "video/mp4"},
-                                          {"webm", "video/webm"},
-                                          {"mp3", "audio/mpeg"},
-                                          {"ogg", "audio/ogg"},
-                                          {"woff", "font/woff"},
-                                          {"woff2", "font/woff2"},
-                                          {"ttf", "font/ttf"},
-                                          {"otf", "font/otf"},
-                                          {NULL, NULL}};
+// mime_phf_seeds and mime_phf_table, generated from src/static/mime.types.
+#include "static/mime_phf.h"
+
+// Types from the mime_types file: open addressing over words cut out of the file's text in
+// place, so the table and `text` are the only allocations.
+static struct {
+  char *text;
+  mime_entry_t *slots;
+  u32 mask;
+} g_types;
+
+static const mime_entry_t *builtin_lookup(const char *ext, usize len) {
+  u32 seed = mime_phf_seeds[mime_hash(ext, len, 0) % MIME_PHF_BUCKETS];
+  const mime_entry_t *e = &mime_phf_table[mime_hash(ext, len, seed) & MIME_PHF_MASK];
+  return e->ext && strcmp(e->ext, ext) == 0 ? e : NULL;
+}
+
+static mime_entry_t *custom_slot(mime_entry_t *slots, u32 mask, const char *ext, usize len) {
+  for (u32 i = mime_hash(ext, len, 0) & mask;; i = (i + 1) & mask) {
+    if (!slots[i].ext || strcmp(slots[i].ext, ext) == 0)
+      return &slots[i];
+  }
+}
 
 const char *mime_by_extension(const char *ext) {
   if (!ext)
-    return "application/octet-stream";
-  for (int i = 0; mime_table[i].ext; i++) {
-    if (strcasecmp(mime_table[i].ext, ext) == 0) {
-      return mime_table[i].type;
+    return MIME_DEFAULT;
+  char lower[MIME_EXT_MAX + 1];
+  usize len = 0;
+  for (; ext[len]; len++) {
+    if (len == MIME_EXT_MAX)
+      return MIME_DEFAULT;
+    char c = ext[len];
+    lower[len] = c >= 'A' && c <= 'Z' ? (char)(c + ('a' - 'A')) : c;
+  }
+  lower[len] = '\0';
+
+  if (g_types.slots) {
+    const mime_entry_t *e = custom_slot(g_types.slots, g_types.mask, lower, len);
+    if (e->ext)
+      return e->type;
+  }
+  const mime_entry_t *e = builtin_lookup(lower, len);
+  return e ? e->type : MIME_DEFAULT;
+}
+
+np_status_t mime_load(const char *path) {
+  if (!path || path[0] == '\0') {
+    mime_unload();
+    return NP_OK;
+  }
+  FILE *f = fopen(path, "r");
+  if (!f) {
+    log_error_errno("mime_types: cannot open %s", path);
+    return NP_ERR;
+  }
+  fseek(f, 0, SEEK_END);
+  long size = ftell(f);
+  rewind(f);
+  char *text = size >= 0 ? malloc((usize)size + 1) : NULL;
+  if (!text || fread(text, 1, (usize)size, f) != (usize)size) {
+    log_error("mime_types: cannot read %s", path);
+    free(text);
+    fclose(f);
+    return NP_ERR;
+  }
+  fclose(f);
+  text[size] = '\0';
+
+  // An extension takes at least two bytes of the file, so this bounds the load factor by 1/2.
+  u32 cap = 16;
+  while (cap < (u32)size + 1)
+    cap <<= 1;
+  mime_entry_t *slots = calloc(cap, sizeof(*slots));
+  if (!slots) {
+    free(text);
+    return NP_ERR_NOMEM;
+  }
+
+  int count = 0;
+  for (char *line = text, *next; line; line = next) {
+    next = strchr(line, '\n');
+    if (next)
+      *next++ = '\0';
+    char *rest;
+    const char *type = mime_line_type(line, &rest);
+    if (!type)
+      continue;
+    for (char *ext; (ext = mime_word(&rest)) != NULL;) {
+      usize len = strlen(ext);
+      if (len > MIME_EXT_MAX) {
+        log_warn("mime_types: %s: extension \"%s\" is too long, ignored", path, ext);
+        continue;
+      }
+      for (usize i = 0; i < len; i++)
+        ext[i] = ext[i] >= 'A' && ext[i] <= 'Z' ? (char)(ext[i] + ('a' - 'A')) : ext[i];
+      mime_entry_t *e = custom_slot(slots, cap - 1, ext, len);
+      if (!e->ext)
+        count++;
+      *e = (mime_entry_t){.ext = ext, .type = type};
     }
   }
-  return "application/octet-stream";
+
+  mime_unload();
+  g_types.text = text;
+  g_types.slots = slots;
+  g_types.mask = cap - 1;
+  log_info("mime_types: %d extension(s) from %s", count, path);
+  return NP_OK;
+}
+
+void mime_unload(void) {
+  free(g_types.slots);
+  free(g_types.text);
+  g_types.slots = NULL;
+  g_types.text = NULL;
 }
@@ -1,6 +1,16 @@
 #ifndef NPROXY_MIME_H
 #define NPROXY_MIME_H
 
+#include "core/types.h"
+
+// Content type for a file extension, without the dot and in any case. Types loaded by
+// mime_load() come first, then the built-in table from src/static/mime.types; anything else
+// is application/octet-stream. Does not allocate.
 const char *mime_by_extension(const char *ext);
 
+// Loads a mime_types file ("type ext..." per line) on top of the built-in types, replacing an
+// earlier one. An empty path only drops the earlier one.
+np_status_t mime_load(const char *path);
+void mime_unload(void);
+
 #endif
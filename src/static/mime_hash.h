@@ -0,0 +1,71 @@
+#ifndef NPROXY_MIME_HASH_H
+#define NPROXY_MIME_HASH_H
+
+#include <string.h>
+
+#include "core/types.h"
+
+// Shared with tools/mime-gen, which builds the perfect hash table for src/static/mime.types
+// with the same hash and the same reading of the file.
+
+// Longer extensions are never looked up.
+#define MIME_EXT_MAX 15
+
+// FNV-1a with a seed and a final mix, over an extension already in lower case.
+static inline u32 mime_hash(const char *s, usize len, u32 seed) {
+  u32 h = 2166136261u ^ (seed * 0x9e3779b9u);
+  for (usize i = 0; i < len; i++) {
+    h ^= (u8)s[i];
+    h *= 16777619u;
+  }
+  h ^= h >> 16;
+  h *= 0x85ebca6bu;
+  h ^= h >> 13;
+  return h;
+}
+
+static inline bool mime_is_space(char c) {
+  return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+// Cuts the next word out of `*s`, terminating it in place; NULL at the end of the line.
+static inline char *mime_word(char **s) {
+  char *p = *s;
+  while (mime_is_space(*p))
+    p++;
+  if (*p == '\0') {
+    *s = p;
+    return NULL;
+  }
+  char *w = p;
+  while (*p && !mime_is_space(*p))
+    p++;
+  if (*p)
+    *p++ = '\0';
+  *s = p;
+  return w;
+}
+
+// Reads one line of a mime.types file in place: returns its type, or NULL for a blank or
+// comment line, and leaves `*s` at the extensions for mime_word(). A type ending in ';' takes
+// the next word as a parameter, as in "text/html; charset=utf-8".
+static inline char *mime_line_type(char *line, char **s) {
+  char *comment = strchr(line, '#');
+  if (comment)
+    *comment = '\0';
+  *s = line;
+  char *type = mime_word(s);
+  if (!type)
+    return NULL;
+  usize len = strlen(type);
+  char *param;
+  while (type[len - 1] == ';' && (param = mime_word(s)) != NULL) {
+    usize plen = strlen(param);
+    type[len++] = ' ';
+    memmove(type + len, param, plen + 1);
+    len += plen;
+  }
+  return type;
+}
+
+#endif
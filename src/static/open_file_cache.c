@@ -0,0 +1,421 @@
+#include "static/open_file_cache.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#include "core/log.h"
+#include "static/mime.h"
+
+// Directories reached through more than one spelling ("/www/" and "/www//") share a watch, so
+// each watch keeps every prefix its files were cached under.
+typedef struct dir_prefix {
+  char *prefix;  // up to and including the last '/'
+  struct dir_prefix *next;
+} dir_prefix_t;
+
+// Where a try_files list led for one request path: the resolved file, or NULL if none of the
+// candidates exists.
+typedef struct {
+  const void *scope;
+  char *uri;
+  char *resolved;
+  u32 hash;
+  u32 generation;
+  time_t checked;
+} resolution_t;
+
+// Per worker.
+static struct {
+  int max_entries;
+  int valid;
+  usize mem_budget;
+  usize mem_max_file;
+  usize mem_used;
+  open_file_t **buckets;
+  u32 mask;
+  int count;
+  open_file_t *lru_head;  // most recently used
+  open_file_t *lru_tail;
+  int inotify_fd;
+  dir_prefix_t **dirs;  // indexed by watch descriptor
+  int dir_cap;
+  resolution_t *resolutions;  // direct-mapped; a store replaces whatever shared its slot
+  u32 res_mask;
+  u32 generation;  // bumped by every change seen; older resolutions are not used
+} g_ofc = {.inotify_fd = -1};
+
+static u32 path_hash(const char *s) {
+  u32 h = 2166136261u;
+  for (; *s; s++) {
+    h ^= (u8)*s;
+    h *= 16777619u;
+  }
+  return h;
+}
+
+static const char *mime_for(const char *path) {
+  const char *base = strrchr(path, '/');
+  base = base ? base + 1 : path;
+  const char *dot = strrchr(base, '.');
+  return mime_by_extension(dot && dot != base ? dot + 1 : NULL);
+}
+
+// Opens `path` into a fresh entry; a missing or irregular file gives an entry with fd -1.
+static open_file_t *file_open(const char *path) {
+  open_file_t *f = calloc(1, sizeof(*f));
+  if (!f)
+    return NULL;
+  f->fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (f->fd >= 0 && (fstat(f->fd, &f->st) < 0 || !S_ISREG(f->st.st_mode))) {
+    close(f->fd);
+    f->fd = -1;
+  }
+  if (f->fd >= 0) {
+    snprintf(f->etag, sizeof(f->etag), "\"%lx-%lx\"", (unsigned long)f->st.st_mtime,
+             (unsigned long)f->st.st_size);
+    f->mime = mime_for(path);
+  }
+  return f;
+}
+
+static void drop_body(open_file_t *f) {
+  if (!f->body)
+    return;
+  g_ofc.mem_used -= f->held;
+  f->held = 0;
+  free(f->body);
+  free(f->head[0]);
+  free(f->head[1]);
+  f->body = NULL;
+  f->head[0] = f->head[1] = NULL;
+  f->head_len[0] = f->head_len[1] = 0;
+}
+
+static void file_free(open_file_t *f) {
+  drop_body(f);
+  if (f->fd >= 0)
+    close(f->fd);
+  free(f->path);
+  free(f);
+}
+
+static void lru_unlink(open_file_t *f) {
+  if (f->lru_prev)
+    f->lru_prev->lru_next = f->lru_next;
+  else
+    g_ofc.lru_head = f->lru_next;
+  if (f->lru_next)
+    f->lru_next->lru_prev = f->lru_prev;
+  else
+    g_ofc.lru_tail = f->lru_prev;
+  f->lru_prev = f->lru_next = NULL;
+}
+
+static void lru_push_front(open_file_t *f) {
+  f->lru_next = g_ofc.lru_head;
+  if (g_ofc.lru_head)
+    g_ofc.lru_head->lru_prev = f;
+  g_ofc.lru_head = f;
+  if (!g_ofc.lru_tail)
+    g_ofc.lru_tail = f;
+}
+
+static open_file_t *lookup(const char *path, u32 hash) {
+  for (open_file_t *f = g_ofc.buckets[hash & g_ofc.mask]; f; f = f->next)
+    if (f->hash == hash && strcmp(f->path, path) == 0)
+      return f;
+  return NULL;
+}
+
+// Takes `f` out of the table. Requests still sending it keep it open until they release it.
+static void evict(open_file_t *f) {
+  open_file_t **pp = &g_ofc.buckets[f->hash & g_ofc.mask];
+  while (*pp != f)
+    pp = &(*pp)->next;
+  *pp = f->next;
+  lru_unlink(f);
+  g_ofc.count--;
+  f->cached = false;
+  if (f->refs == 0)
+    file_free(f);
+}
+
+// True if the file on disk is still the one `f` describes.
+static bool still_valid(const open_file_t *f) {
+  struct stat st;
+  bool exists = stat(f->path, &st) == 0 && S_ISREG(st.st_mode);
+  if (f->fd < 0)
+    return !exists;
+  return exists && st.st_ino == f->st.st_ino && st.st_dev == f->st.st_dev &&
+         st.st_size == f->st.st_size && st.st_mtim.tv_sec == f->st.st_mtim.tv_sec &&
+         st.st_mtim.tv_nsec == f->st.st_mtim.tv_nsec;
+}
+
+static void watch_dir(const char *path) {
+  const char *slash = strrchr(path, '/');
+  if (g_ofc.inotify_fd < 0 || !slash)
+    return;
+  usize len = (usize)(slash - path) + 1;
+  char dir[PATH_MAX];
+  if (len >= sizeof(dir))
+    return;
+  memcpy(dir, path, len);
+  dir[len] = '\0';
+
+  // Adding a watch that exists returns its descriptor again; misses are rare enough for that.
+  int wd = inotify_add_watch(g_ofc.inotify_fd, dir,
+                             IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MODIFY |
+                                 IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF);
+  if (wd < 0) {
+    // Out of watches: the entry is still checked every open_file_cache_valid seconds.
+    return;
+  }
+  if (wd >= g_ofc.dir_cap) {
+    int cap = g_ofc.dir_cap ? g_ofc.dir_cap : 64;
+    while (cap <= wd)
+      cap *= 2;
+    dir_prefix_t **dirs = realloc(g_ofc.dirs, (usize)cap * sizeof(*dirs));
+    if (!dirs)
+      return;
+    memset(dirs + g_ofc.dir_cap, 0, (usize)(cap - g_ofc.dir_cap) * sizeof(*dirs));
+    g_ofc.dirs = dirs;
+    g_ofc.dir_cap = cap;
+  }
+  for (dir_prefix_t *d = g_ofc.dirs[wd]; d; d = d->next)
+    if (strcmp(d->prefix, dir) == 0)
+      return;
+  dir_prefix_t *d = malloc(sizeof(*d));
+  if (!d || !(d->prefix = strdup(dir))) {
+    free(d);
+    return;
+  }
+  d->next = g_ofc.dirs[wd];
+  g_ofc.dirs[wd] = d;
+}
+
+static void forget_dir(int wd) {
+  if (wd < 0 || wd >= g_ofc.dir_cap)
+    return;
+  for (dir_prefix_t *d = g_ofc.dirs[wd], *next; d; d = next) {
+    next = d->next;
+    free(d->prefix);
+    free(d);
+  }
+  g_ofc.dirs[wd] = NULL;
+}
+
+static void invalidate_all(void) {
+  for (open_file_t *f = g_ofc.lru_head; f; f = f->lru_next)
+    f->checked = 0;
+  g_ofc.generation++;
+}
+
+static void on_inotify(int fd, u32 events, void *ctx) {
+  NP_UNUSED(events);
+  NP_UNUSED(ctx);
+  char buf[16384] __attribute__((aligned(__alignof__(struct inotify_event))));
+  for (;;) {
+    ssize_t n = read(fd, buf, sizeof(buf));
+    if (n <= 0)
+      return;
+    for (char *p = buf; p < buf + n;) {
+      const struct inotify_event *ev = (const struct inotify_event *)p;
+      p += sizeof(*ev) + ev->len;
+      if (ev->mask & (IN_Q_OVERFLOW | IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) {
+        // Lost events or a directory gone: nothing can be trusted without a look.
+        invalidate_all();
+        if (ev->mask & IN_IGNORED)
+          forget_dir(ev->wd);
+        continue;
+      }
+      if (ev->len == 0 || ev->wd < 0 || ev->wd >= g_ofc.dir_cap)
+        continue;
+      // Any file appearing or going away may change which try_files candidate wins.
+      g_ofc.generation++;
+      for (dir_prefix_t *d = g_ofc.dirs[ev->wd]; d; d = d->next) {
+        char path[PATH_MAX + NAME_MAX + 1];
+        snprintf(path, sizeof(path), "%s%s", d->prefix, ev->name);
+        open_file_t *f = lookup(path, path_hash(path));
+        if (f)
+          f->checked = 0;
+      }
+    }
+  }
+}
+
+void open_file_cache_init(const np_config_t *cfg, event_loop_t *loop) {
+  g_ofc.max_entries = cfg->open_file_cache.max_entries;
+  g_ofc.valid = cfg->open_file_cache.valid;
+  g_ofc.mem_budget = cfg->open_file_cache.memory > 0 ? (usize)cfg->open_file_cache.memory : 0;
+  g_ofc.mem_max_file =
+      cfg->open_file_cache.memory_max > 0 ? (usize)cfg->open_file_cache.memory_max : 0;
+  if (g_ofc.max_entries <= 0)
+    return;
+  u32 nbuckets = 16;
+  while (nbuckets < (u32)g_ofc.max_entries * 2)
+    nbuckets <<= 1;
+  g_ofc.buckets = calloc(nbuckets, sizeof(*g_ofc.buckets));
+  if (!g_ofc.buckets) {
+    g_ofc.max_entries = 0;
+    return;
+  }
+  g_ofc.mask = nbuckets - 1;
+  g_ofc.resolutions = calloc(nbuckets / 2, sizeof(*g_ofc.resolutions));
+  if (g_ofc.resolutions)
+    g_ofc.res_mask = nbuckets / 2 - 1;
+
+  if (!cfg->open_file_cache.watch)
+    return;
+  g_ofc.inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (g_ofc.inotify_fd < 0) {
+    log_error_errno("open_file_cache: inotify_init1");
+    return;
+  }
+  event_loop_add(loop, g_ofc.inotify_fd, EV_READ, on_inotify, NULL);
+}
+
+void open_file_cache_destroy(void) {
+  while (g_ofc.lru_head)
+    evict(g_ofc.lru_head);
+  free(g_ofc.buckets);
+  for (u32 i = 0; g_ofc.resolutions && i <= g_ofc.res_mask; i++) {
+    free(g_ofc.resolutions[i].uri);
+    free(g_ofc.resolutions[i].resolved);
+  }
+  free(g_ofc.resolutions);
+  for (int i = 0; i < g_ofc.dir_cap; i++)
+    forget_dir(i);
+  free(g_ofc.dirs);
+  if (g_ofc.inotify_fd >= 0)
+    close(g_ofc.inotify_fd);
+  memset(&g_ofc, 0, sizeof(g_ofc));
+  g_ofc.inotify_fd = -1;
+}
+
+open_file_t *open_file_get(const char *path) {
+  if (g_ofc.max_entries <= 0) {
+    open_file_t *f = file_open(path);
+    if (f && f->fd < 0) {
+      file_free(f);
+      return NULL;
+    }
+    if (f)
+      f->refs = 1;
+    return f;
+  }
+
+  time_t now = time(NULL);
+  u32 hash = path_hash(path);
+  open_file_t *f = lookup(path, hash);
+  if (f && (f->checked == 0 || now - f->checked >= g_ofc.valid)) {
+    if (still_valid(f)) {
+      f->checked = now;
+    } else {
+      evict(f);
+      f = NULL;
+      g_ofc.generation++;
+    }
+  }
+
+  if (!f) {
+    f = file_open(path);
+    if (!f || !(f->path = strdup(path))) {
+      if (f)
+        file_free(f);
+      return NULL;
+    }
+    f->hash = hash;
+    f->checked = now;
+    f->cached = true;
+    f->next = g_ofc.buckets[hash & g_ofc.mask];
+    g_ofc.buckets[hash & g_ofc.mask] = f;
+    lru_push_front(f);
+    if (++g_ofc.count > g_ofc.max_entries)
+      evict(g_ofc.lru_tail);
+    watch_dir(path);
+  } else if (f != g_ofc.lru_head) {
+    lru_unlink(f);
+    lru_push_front(f);
+  }
+
+  if (f->fd < 0)
+    return NULL;
+  f->refs++;
+  return f;
+}
+
+void open_file_release(open_file_t *f) {
+  if (!f)
+    return;
+  if (--f->refs == 0 && !f->cached)
+    file_free(f);
+}
+
+bool open_file_load(open_file_t *f, usize head_room) {
+  if (f->body)
+    return true;
+  usize size = (usize)f->st.st_size;
+  usize charge = size + head_room;
+  if (!f->cached || size == 0 || size > g_ofc.mem_max_file || charge > g_ofc.mem_budget)
+    return false;
+  for (open_file_t *v = g_ofc.lru_tail; v && g_ofc.mem_used + charge > g_ofc.mem_budget;
+       v = v->lru_prev) {
+    if (v->refs == 0)
+      drop_body(v);
+  }
+  if (g_ofc.mem_used + charge > g_ofc.mem_budget)
+    return false;
+
+  u8 *body = malloc(size);
+  if (!body)
+    return false;
+  ssize_t n = pread(f->fd, body, size, 0);
+  if (n != (ssize_t)size) {
+    free(body);
+    return false;
+  }
+  f->body = body;
+  f->held = charge;
+  g_ofc.mem_used += charge;
+  return true;
+}
+
+static u32 resolution_hash(const void *scope, const char *uri) {
+  return path_hash(uri) ^ (u32)(((uintptr_t)scope >> 4) * 0x9e3779b9u);
+}
+
+bool open_file_resolved(const void *scope, const char *uri, const char **resolved) {
+  if (!g_ofc.resolutions)
+    return false;
+  u32 hash = resolution_hash(scope, uri);
+  const resolution_t *r = &g_ofc.resolutions[hash & g_ofc.res_mask];
+  if (!r->uri || r->hash != hash || r->scope != scope || r->generation != g_ofc.generation ||
+      time(NULL) - r->checked >= g_ofc.valid || strcmp(r->uri, uri) != 0)
+    return false;
+  *resolved = r->resolved;
+  return true;
+}
+
+void open_file_remember(const void *scope, const char *uri, const char *resolved) {
+  if (!g_ofc.resolutions)
+    return;
+  u32 hash = resolution_hash(scope, uri);
+  resolution_t *r = &g_ofc.resolutions[hash & g_ofc.res_mask];
+  free(r->uri);
+  free(r->resolved);
+  *r = (resolution_t){.scope = scope, .hash = hash, .generation = g_ofc.generation,
+                      .checked = time(NULL)};
+  r->uri = strdup(uri);
+  r->resolved = resolved ? strdup(resolved) : NULL;
+  if (!r->uri || (resolved && !r->resolved)) {
+    free(r->uri);
+    free(r->resolved);
+    r->uri = r->resolved = NULL;
+  }
+}
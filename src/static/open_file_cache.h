@@ -0,0 +1,62 @@
+#ifndef NPROXY_OPEN_FILE_CACHE_H
+#define NPROXY_OPEN_FILE_CACHE_H
+
+#include <sys/stat.h>
+#include <time.h>
+
+#include "core/config.h"
+#include "core/types.h"
+#include "net/event_loop.h"
+
+// An open regular file with what a response needs from it. Requests hold a reference from
+// open_file_get() until open_file_release(); a cached file stays open between requests.
+typedef struct open_file {
+  int fd;  // -1 for a cached miss
+  struct stat st;
+  char etag[40];  // strong validator, "mtime-size"
+  const char *mime;
+
+  // A small file also kept in memory by open_file_load(), with the headers of its 200 response
+  // from Content-Type on, by keep-alive, filled in by the file server.
+  u8 *body;
+  char *head[2];
+  usize head_len[2];
+  usize held;  // bytes charged to the memory budget
+
+  // Cache bookkeeping.
+  char *path;
+  u32 hash;
+  int refs;
+  bool cached;  // still reachable from the table
+  time_t checked;  // when the entry last matched the disk; 0 forces a check
+  struct open_file *next;  // hash chain
+  struct open_file *lru_prev;
+  struct open_file *lru_next;
+} open_file_t;
+
+// Sets up the worker's cache from the open_file_cache settings. With inotify watching on, the
+// watches are read from `loop`.
+void open_file_cache_init(const np_config_t *cfg, event_loop_t *loop);
+void open_file_cache_destroy(void);
+
+// Returns the regular file at `path`, or NULL if there is none. A cached entry is used as it is
+// until open_file_cache_valid seconds have passed or inotify reports a change to its
+// directory; then one stat() decides whether it still stands. Misses are cached the same way.
+// Without a cache this opens the file for the one request.
+open_file_t *open_file_get(const char *path);
+void open_file_release(open_file_t *f);
+
+// Reads a cached file of at most open_file_cache_memory_max bytes into f->body, making room
+// in the open_file_cache_memory budget by dropping the bodies of the least recently used files
+// no request is sending. `head_room` bytes are charged for the headers the caller adds. Returns
+// false if the file is not eligible, does not fit, or cannot be read.
+bool open_file_load(open_file_t *f, usize head_room);
+
+// try_files resolutions, kept while the cache is on. open_file_remember() records which
+// candidate `uri` resolved to under `scope` (the server whose list it is), or NULL for none.
+// open_file_resolved() returns true with that answer while it is younger than
+// open_file_cache_valid and nothing has changed on disk since, as far as the cache has seen.
+bool open_file_resolved(const void *scope, const char *uri, const char **resolved);
+void open_file_remember(const void *scope, const char *uri, const char *resolved);
+
+#endif
@@ -0,0 +1,210 @@
+// mime-gen: builds the perfect hash table for the built-in MIME types at compile time.
+//
+//   mime-gen src/static/mime.types > mime_phf.h
+//
+// Hash and displace: an extension's bucket is mime_hash(ext, 0) % MIME_PHF_BUCKETS, and each
+// bucket has a seed that sends every extension in it to a slot of its own with
+// mime_hash(ext, seed) & MIME_PHF_MASK. A lookup is two hashes and one string compare.
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "static/mime_hash.h"
+
+#define MAX_SEED 65535
+
+typedef struct {
+  const char *ext;
+  const char *type;
+  u32 bucket;
+} entry_t;
+
+static entry_t *entries;
+static usize n;
+
+static int cmp_bucket_size(const void *a, const void *b, void *sizes) {
+  const u32 *sz = sizes;
+  u32 x = *(const u32 *)a, y = *(const u32 *)b;
+  if (sz[x] != sz[y])
+    return sz[x] < sz[y] ? 1 : -1;
+  return x < y ? -1 : x > y;
+}
+
+static char *read_all(const char *path) {
+  FILE *f = fopen(path, "r");
+  if (!f) {
+    perror(path);
+    return NULL;
+  }
+  usize cap = 1 << 14, len = 0;
+  char *buf = malloc(cap);
+  for (usize r; buf && (r = fread(buf + len, 1, cap - len - 1, f)) > 0;) {
+    len += r;
+    if (cap - len == 1) {
+      char *p = realloc(buf, cap *= 2);
+      if (!p)
+        free(buf);
+      buf = p;
+    }
+  }
+  fclose(f);
+  if (buf)
+    buf[len] = '\0';
+  return buf;
+}
+
+static int parse(char *text, const char *name) {
+  usize cap = 0;
+  int line_no = 0;
+  for (char *line = text, *next; line; line = next) {
+    line_no++;
+    next = strchr(line, '\n');
+    if (next)
+      *next++ = '\0';
+    char *rest;
+    const char *type = mime_line_type(line, &rest);
+    if (!type)
+      continue;
+    for (char *ext; (ext = mime_word(&rest)) != NULL;) {
+      usize len = strlen(ext);
+      if (len > MIME_EXT_MAX) {
+        fprintf(stderr, "%s:%d: extension \"%s\" is too long\n", name, line_no, ext);
+        return -1;
+      }
+      for (usize i = 0; i < len; i++)
+        ext[i] = (char)tolower((unsigned char)ext[i]);
+      for (usize i = 0; i < n; i++) {
+        if (strcmp(entries[i].ext, ext) == 0) {
+          fprintf(stderr, "%s:%d: extension \"%s\" is listed twice\n", name, line_no, ext);
+          return -1;
+        }
+      }
+      if (n == cap) {
+        cap = cap ? cap * 2 : 128;
+        entries = realloc(entries, cap * sizeof(*entries));
+        if (!entries)
+          return -1;
+      }
+      entries[n++] = (entry_t){.ext = ext, .type = type};
+    }
+  }
+  return 0;
+}
+
+// Finds a seed for every bucket, fullest first, with `slots` slots. Returns false if some
+// bucket has none.
+static bool place(u32 buckets, u32 slots, u16 *seeds, int *slot_of) {
+  u32 *size = calloc(buckets, sizeof(*size));
+  u32 *order = malloc(buckets * sizeof(*order));
+  bool *taken = calloc(slots, sizeof(*taken));
+  u32 *tried = malloc(n * sizeof(*tried));
+  bool ok = size && order && taken && tried;
+  for (usize i = 0; ok && i < n; i++) {
+    entries[i].bucket = mime_hash(entries[i].ext, strlen(entries[i].ext), 0) % buckets;
+    size[entries[i].bucket]++;
+  }
+  for (u32 b = 0; ok && b < buckets; b++)
+    order[b] = b;
+  if (ok)
+    qsort_r(order, buckets, sizeof(*order), cmp_bucket_size, size);
+
+  for (u32 k = 0; ok && k < buckets && size[order[k]] > 0; k++) {
+    u32 b = order[k];
+    bool found = false;
+    for (u32 seed = 1; seed <= MAX_SEED && !found; seed++) {
+      usize count = 0;
+      found = true;
+      for (usize i = 0; i < n && found; i++) {
+        if (entries[i].bucket != b)
+          continue;
+        u32 s = mime_hash(entries[i].ext, strlen(entries[i].ext), seed) & (slots - 1);
+        for (usize j = 0; j < count; j++)
+          found &= tried[j] != s;
+        found &= !taken[s];
+        tried[count++] = s;
+      }
+      if (!found)
+        continue;
+      seeds[b] = (u16)seed;
+      count = 0;
+      for (usize i = 0; i < n; i++) {
+        if (entries[i].bucket == b) {
+          taken[tried[count]] = true;
+          slot_of[i] = (int)tried[count++];
+        }
+      }
+    }
+    ok = found;
+  }
+  free(size);
+  free(order);
+  free(taken);
+  free(tried);
+  return ok;
+}
+
+static void put_c_string(const char *s) {
+  putchar('"');
+  for (; *s; s++) {
+    if (*s == '"' || *s == '\\')
+      putchar('\\');
+    putchar(*s);
+  }
+  putchar('"');
+}
+
+int main(int argc, char **argv) {
+  if (argc != 2) {
+    fprintf(stderr, "usage: mime-gen MIME_TYPES\n");
+    return 2;
+  }
+  char *text = read_all(argv[1]);
+  if (!text || parse(text, argv[1]) < 0 || n == 0) {
+    if (text && n == 0)
+      fprintf(stderr, "%s: no types\n", argv[1]);
+    return 1;
+  }
+
+  u32 buckets = (u32)n / 2 + 1;
+  u32 slots = 8;
+  while (slots < n + n / 4)
+    slots <<= 1;
+  u16 *seeds = calloc(buckets, sizeof(*seeds));
+  int *slot_of = malloc(n * sizeof(*slot_of));
+  if (!seeds || !slot_of)
+    return 1;
+  while (!place(buckets, slots, seeds, slot_of)) {
+    memset(seeds, 0, buckets * sizeof(*seeds));
+    slots <<= 1;
+    if (slots > (1u << 20)) {
+      fprintf(stderr, "%s: no perfect hash found\n", argv[1]);
+      return 1;
+    }
+  }
+
+  printf("// Generated by tools/mime-gen from %s; do not edit.\n\n", argv[1]);
+  printf("#define MIME_PHF_BUCKETS %uu\n#define MIME_PHF_MASK %uu\n\n", buckets, slots - 1);
+  printf("static const u16 mime_phf_seeds[MIME_PHF_BUCKETS] = {");
+  for (u32 b = 0; b < buckets; b++)
+    printf("%s%s%u", b ? "," : "", b % 16 ? " " : "\n    ", seeds[b]);
+  printf("\n};\n\nstatic const mime_entry_t mime_phf_table[MIME_PHF_MASK + 1] = {\n");
+  for (u32 s = 0; s < slots; s++) {
+    for (usize i = 0; i < n; i++) {
+      if (slot_of[i] != (int)s)
+        continue;
+      printf("    [%u] = {", s);
+      put_c_string(entries[i].ext);
+      printf(", ");
+      put_c_string(entries[i].type);
+      printf("},\n");
+    }
+  }
+  printf("};\n");
+  free(seeds);
+  free(slot_of);
+  free(entries);
+  free(text);
+  return 0;
+}
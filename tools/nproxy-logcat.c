@@ -0,0 +1,205 @@
+// nproxy-logcat: prints binary access logs (access_log_mode = binary) as text, JSON or CSV.
+//
+//   nproxy-logcat [-f text|json|csv] FILE...
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "features/access_log_bin.h"
+
+typedef enum { OUT_TEXT, OUT_JSON, OUT_CSV } out_format_t;
+
+// Same order as http_method_t.
+static const char *const methods[] = {"GET",  "POST",    "PUT",   "DELETE",
+                                      "HEAD", "OPTIONS", "PATCH", "UNKNOWN"};
+
+typedef struct {
+  char **by_id;
+  u32 cap;
+} path_map_t;
+
+static const char *method_name(u8 m) {
+  return m < sizeof(methods) / sizeof(methods[0]) ? methods[m] : "UNKNOWN";
+}
+
+static int path_define(path_map_t *pm, u32 id, const char *text, usize len) {
+  if (id >= pm->cap) {
+    u32 cap = pm->cap ? pm->cap : 1024;
+    while (cap <= id)
+      cap *= 2;
+    char **p = realloc(pm->by_id, cap * sizeof(*p));
+    if (!p)
+      return -1;
+    memset(p + pm->cap, 0, (cap - pm->cap) * sizeof(*p));
+    pm->by_id = p;
+    pm->cap = cap;
+  }
+  free(pm->by_id[id]);
+  pm->by_id[id] = strndup(text, len);
+  return pm->by_id[id] ? 0 : -1;
+}
+
+static const char *path_lookup(const path_map_t *pm, u32 id) {
+  return id < pm->cap && pm->by_id[id] ? pm->by_id[id] : "-";
+}
+
+static void path_map_free(path_map_t *pm) {
+  for (u32 i = 0; i < pm->cap; i++)
+    free(pm->by_id[i]);
+  free(pm->by_id);
+  memset(pm, 0, sizeof(*pm));
+}
+
+// Writes `s` as the inside of a JSON string.
+static void put_json(const char *s) {
+  for (; *s; s++) {
+    unsigned char c = (unsigned char)*s;
+    if (c == '"' || c == '\\')
+      printf("\\%c", c);
+    else if (c < 0x20 || c >= 0x7f)
+      printf("\\u%04x", c);
+    else
+      putchar(c);
+  }
+}
+
+static void put_csv(const char *s) {
+  putchar('"');
+  for (; *s; s++) {
+    if (*s == '"')
+      putchar('"');
+    putchar(*s);
+  }
+  putchar('"');
+}
+
+static void print_record(const access_log_bin_record_t *r, const char *path, out_format_t fmt) {
+  char ip[INET_ADDRSTRLEN];
+  inet_ntop(AF_INET, &r->ip, ip, sizeof(ip));
+  time_t sec = (time_t)(r->ts_us / 1000000);
+  struct tm tm;
+  gmtime_r(&sec, &tm);
+  char when[40];
+  int n = (int)strftime(when, sizeof(when), "%Y-%m-%dT%H:%M:%S", &tm);
+  snprintf(when + n, sizeof(when) - (usize)n, ".%06uZ", (unsigned)(r->ts_us % 1000000));
+  const char *method = method_name(r->method);
+  unsigned long long bytes = (unsigned long long)r->bytes;
+
+  switch (fmt) {
+  case OUT_TEXT:
+    printf("%s [%s] \"%s %s HTTP/%d.%d\" %u %llu %uus upstream=%u\n", ip, when, method, path,
+           r->version / 10, r->version % 10, r->status, bytes, r->latency_us, r->upstream_id);
+    break;
+  case OUT_JSON:
+    printf("{\"time\":\"%s\",\"remote_addr\":\"%s\",\"method\":\"%s\",\"path\":\"", when, ip,
+           method);
+    put_json(path);
+    printf("\",\"protocol\":\"HTTP/%d.%d\",\"status\":%u,\"bytes_sent\":%llu,"
+           "\"request_time_us\":%u,\"upstream_id\":%u}\n",
+           r->version / 10, r->version % 10, r->status, bytes, r->latency_us, r->upstream_id);
+    break;
+  case OUT_CSV:
+    printf("%s,%s,%s,", when, ip, method);
+    put_csv(path);
+    printf(",HTTP/%d.%d,%u,%llu,%u,%u\n", r->version / 10, r->version % 10, r->status, bytes,
+           r->latency_us, r->upstream_id);
+    break;
+  }
+}
+
+static int cat_file(const char *name, out_format_t fmt) {
+  int fd = open(name, O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) < 0) {
+    perror(name);
+    if (fd >= 0)
+      close(fd);
+    return -1;
+  }
+  usize size = (usize)st.st_size;
+  if (size < sizeof(access_log_bin_header_t)) {
+    fprintf(stderr, "%s: too short for a binary access log\n", name);
+    close(fd);
+    return -1;
+  }
+  const u8 *base = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED) {
+    perror(name);
+    return -1;
+  }
+
+  int rc = 0;
+  const access_log_bin_header_t *h = (const void *)base;
+  const usize rs = sizeof(access_log_bin_record_t);
+  if (memcmp(h->magic, ACCESS_LOG_BIN_MAGIC, sizeof(h->magic)) != 0 ||
+      h->version != ACCESS_LOG_BIN_VERSION || h->record_size != rs) {
+    fprintf(stderr, "%s: not a version %d binary access log\n", name, ACCESS_LOG_BIN_VERSION);
+    munmap((void *)base, size);
+    return -1;
+  }
+
+  // A log still being written may be longer than its tail; only complete slots are read.
+  usize end = h->tail < size ? (usize)h->tail : size;
+  path_map_t pm = {0};
+  for (usize off = sizeof(*h); off + rs <= end;) {
+    access_log_bin_record_t r;
+    memcpy(&r, base + off, rs);
+    off += rs;
+    if (r.kind == ACCESS_LOG_BIN_PATH) {
+      if (r.bytes > end - off) {
+        fprintf(stderr, "%s: truncated path at offset %zu\n", name, off - rs);
+        rc = -1;
+        break;
+      }
+      if (path_define(&pm, r.path_id, (const char *)base + off, (usize)r.bytes) < 0) {
+        fprintf(stderr, "%s: out of memory\n", name);
+        rc = -1;
+        break;
+      }
+      off += ((usize)r.bytes + rs - 1) / rs * rs;
+    } else if (r.kind == ACCESS_LOG_BIN_REQUEST) {
+      print_record(&r, path_lookup(&pm, r.path_id), fmt);
+    }
+  }
+  path_map_free(&pm);
+  munmap((void *)base, size);
+  return rc;
+}
+
+static void usage(void) {
+  fprintf(stderr, "usage: nproxy-logcat [-f text|json|csv] FILE...\n");
+  exit(2);
+}
+
+int main(int argc, char **argv) {
+  out_format_t fmt = OUT_TEXT;
+  int opt;
+  while ((opt = getopt(argc, argv, "f:h")) != -1) {
+    if (opt == 'f' && strcmp(optarg, "text") == 0)
+      fmt = OUT_TEXT;
+    else if (opt == 'f' && strcmp(optarg, "json") == 0)
+      fmt = OUT_JSON;
+    else if (opt == 'f' && strcmp(optarg, "csv") == 0)
+      fmt = OUT_CSV;
+    else
+      usage();
+  }
+  if (optind >= argc)
+    usage();
+
+  if (fmt == OUT_CSV)
+    printf("time,remote_addr,method,path,protocol,status,bytes_sent,request_time_us,upstream_id\n");
+  int rc = 0;
+  for (int i = optind; i < argc; i++)
+    if (cat_file(argv[i], fmt) < 0)
+      rc = 1;
+  return rc;
+}
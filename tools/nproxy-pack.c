@@ -0,0 +1,395 @@
+// nproxy-pack: packs a static site into one bundle file for static_bundle.
+//
+//   nproxy-pack [-m MIME_TYPES] [-z LEVEL] ROOT OUT
+//
+// Every regular file under ROOT becomes an entry for the request path "/<relative path>", with
+// its MIME type (from -m first, then the built-in table), a strong ETag over its contents and,
+// for compressible types, a gzip variant at LEVEL (default 9, 0 for none) when that saves at
+// least an eighth. OUT is written beside itself and renamed into place, so a server reloading
+// at any moment sees either the old bundle or the new one.
+
+#include <fcntl.h>
+#include <ftw.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "static/bundle_format.h"
+#include "static/mime_hash.h"
+
+typedef struct {
+  const char *ext;
+  const char *type;
+} mime_entry_t;
+
+// mime_phf_seeds and mime_phf_table, generated from src/static/mime.types.
+#include "static/mime_phf.h"
+
+#define ETAG_LEN 18     // "%016llx" in quotes
+#define GZ_ETAG_LEN 21  // "%016llx-gz" in quotes
+#define GZIP_MIN_SIZE 256
+#define MAX_TYPES 4096
+
+typedef struct {
+  char *path;  // request path
+  char *src;   // file to read
+  const char *mime;
+  u32 mime_off;
+  bundle_entry_t e;
+} pack_file_t;
+
+static pack_file_t *files;
+static u32 count, cap;
+static usize root_len;
+
+static mime_entry_t *custom;
+static usize custom_count;
+
+static char *read_all(const char *path) {
+  FILE *f = fopen(path, "r");
+  if (!f) {
+    perror(path);
+    return NULL;
+  }
+  usize size = 1 << 14, len = 0;
+  char *buf = malloc(size);
+  for (usize r; buf && (r = fread(buf + len, 1, size - len - 1, f)) > 0;) {
+    len += r;
+    if (size - len == 1) {
+      char *p = realloc(buf, size *= 2);
+      if (!p)
+        free(buf);
+      buf = p;
+    }
+  }
+  fclose(f);
+  if (buf)
+    buf[len] = '\0';
+  return buf;
+}
+
+// Extra types in the server's mime_types format; later lines win, as they do there.
+static int load_types(char *text) {
+  usize n = 0;
+  for (char *line = text, *next; line; line = next) {
+    next = strchr(line, '\n');
+    if (next)
+      *next++ = '\0';
+    char *rest;
+    const char *type = mime_line_type(line, &rest);
+    if (!type)
+      continue;
+    for (char *ext; (ext = mime_word(&rest)) != NULL;) {
+      for (char *c = ext; *c; c++)
+        *c = *c >= 'A' && *c <= 'Z' ? (char)(*c + ('a' - 'A')) : *c;
+      if (custom_count == n) {
+        n = n ? n * 2 : 64;
+        mime_entry_t *p = realloc(custom, n * sizeof(*custom));
+        if (!p)
+          return -1;
+        custom = p;
+      }
+      custom[custom_count++] = (mime_entry_t){.ext = ext, .type = type};
+    }
+  }
+  return 0;
+}
+
+static const char *mime_for(const char *path) {
+  const char *base = strrchr(path, '/');
+  const char *dot = strrchr(base ? base : path, '.');
+  char ext[MIME_EXT_MAX + 1];
+  usize len = dot ? strlen(dot + 1) : 0;
+  if (len == 0 || len > MIME_EXT_MAX)
+    return "application/octet-stream";
+  for (usize i = 0; i <= len; i++) {
+    char c = dot[1 + i];
+    ext[i] = c >= 'A' && c <= 'Z' ? (char)(c + ('a' - 'A')) : c;
+  }
+  for (usize i = custom_count; i-- > 0;) {
+    if (strcmp(custom[i].ext, ext) == 0)
+      return custom[i].type;
+  }
+  u32 seed = mime_phf_seeds[mime_hash(ext, len, 0) % MIME_PHF_BUCKETS];
+  const mime_entry_t *e = &mime_phf_table[mime_hash(ext, len, seed) & MIME_PHF_MASK];
+  return e->ext && strcmp(e->ext, ext) == 0 ? e->type : "application/octet-stream";
+}
+
+// The types the server would compress on the fly.
+static bool compressible(const char *mime) {
+  return strncmp(mime, "text/", 5) == 0 || strstr(mime, "json") || strstr(mime, "javascript") ||
+         strstr(mime, "xml") || strstr(mime, "svg");
+}
+
+static int visit(const char *fpath, const struct stat *sb, int flag, struct FTW *ftw) {
+  (void)ftw;
+  struct stat st = *sb;
+  if (flag == FTW_SL && stat(fpath, &st) < 0)
+    return 0;
+  if ((flag != FTW_F && flag != FTW_SL) || !S_ISREG(st.st_mode))
+    return 0;
+  if (count == cap) {
+    cap = cap ? cap * 2 : 1024;
+    pack_file_t *p = realloc(files, cap * sizeof(*files));
+    if (!p)
+      return -1;
+    files = p;
+  }
+  pack_file_t *f = &files[count];
+  memset(f, 0, sizeof(*f));
+  f->src = strdup(fpath);
+  f->path = strdup(fpath + root_len);
+  if (!f->src || !f->path) {
+    free(f->src);
+    free(f->path);
+    return -1;
+  }
+  f->mime = mime_for(f->path);
+  count++;
+  return 0;
+}
+
+static int cmp_path(const void *a, const void *b) {
+  return strcmp(((const pack_file_t *)a)->path, ((const pack_file_t *)b)->path);
+}
+
+static u64 fnv64(const u8 *p, usize len) {
+  u64 h = 14695981039346656037ull;
+  for (usize i = 0; i < len; i++) {
+    h ^= p[i];
+    h *= 1099511628211ull;
+  }
+  return h;
+}
+
+// gzip of `in` into a new buffer; 0 if it does not save an eighth.
+static usize gzip_buf(const u8 *in, usize len, int level, u8 **out) {
+  z_stream zs = {0};
+  if (deflateInit2(&zs, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+    return 0;
+  usize bound = deflateBound(&zs, (uLong)len);
+  *out = malloc(bound);
+  usize n = 0;
+  if (*out) {
+    zs.next_in = (Bytef *)in;
+    zs.avail_in = (uInt)len;
+    zs.next_out = *out;
+    zs.avail_out = (uInt)bound;
+    if (deflate(&zs, Z_FINISH) == Z_STREAM_END)
+      n = zs.total_out;
+  }
+  deflateEnd(&zs);
+  return n > 0 && n < len - len / 8 ? n : 0;
+}
+
+static bool write_at(int fd, const void *buf, usize len, u64 off) {
+  const u8 *p = buf;
+  while (len > 0) {
+    ssize_t w = pwrite(fd, p, len, (off_t)off);
+    if (w <= 0)
+      return false;
+    p += w;
+    len -= (usize)w;
+    off += (u64)w;
+  }
+  return true;
+}
+
+// Reads each file once: its bytes and gzip variant go out at `*pos`, its ETags into `strings`.
+static int pack_payloads(int fd, char *strings, u64 *pos, int level, u32 *gz_count) {
+  for (u32 i = 0; i < count; i++) {
+    pack_file_t *f = &files[i];
+    int in = open(f->src, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (in < 0 || fstat(in, &st) < 0) {
+      perror(f->src);
+      if (in >= 0)
+        close(in);
+      return -1;
+    }
+    usize len = (usize)st.st_size;
+    u8 *data = malloc(len ? len : 1);
+    usize got = 0;
+    for (ssize_t r; data && got < len && (r = read(in, data + got, len - got)) > 0;)
+      got += (usize)r;
+    close(in);
+    if (!data || got != len) {
+      fprintf(stderr, "%s: short read\n", f->src);
+      free(data);
+      return -1;
+    }
+
+    u64 h = fnv64(data, len);
+    snprintf(strings + f->e.etag_off, ETAG_LEN + 1, "\"%016llx\"", (unsigned long long)h);
+    f->e.data_off = *pos;
+    f->e.data_len = len;
+    f->e.mtime = st.st_mtime;
+    bool ok = write_at(fd, data, len, *pos);
+    *pos += len;
+
+    u8 *gz = NULL;
+    usize gz_len = 0;
+    if (ok && level > 0 && len >= GZIP_MIN_SIZE && len <= UINT32_MAX && compressible(f->mime))
+      gz_len = gzip_buf(data, len, level, &gz);
+    if (gz_len > 0) {
+      snprintf(strings + f->e.gz_etag_off, GZ_ETAG_LEN + 1, "\"%016llx-gz\"",
+               (unsigned long long)h);
+      f->e.gz_off = *pos;
+      f->e.gz_len = gz_len;
+      ok = write_at(fd, gz, gz_len, *pos);
+      *pos += gz_len;
+      (*gz_count)++;
+    }
+    free(gz);
+    free(data);
+    if (!ok) {
+      perror("write");
+      return -1;
+    }
+  }
+  return 0;
+}
+
+static void usage(const char *argv0) {
+  fprintf(stderr, "usage: %s [-m MIME_TYPES] [-z LEVEL] ROOT OUT\n", argv0);
+}
+
+int main(int argc, char **argv) {
+  int level = 9;
+  char *types = NULL;
+  int opt;
+  while ((opt = getopt(argc, argv, "m:z:h")) != -1) {
+    if (opt == 'm') {
+      free(types);
+      custom_count = 0;
+      types = read_all(optarg);
+      if (!types || load_types(types) < 0)
+        return 1;
+    } else if (opt == 'z') {
+      level = atoi(optarg);
+      if (level < 0 || level > 9) {
+        usage(argv[0]);
+        return 2;
+      }
+    } else {
+      usage(argv[0]);
+      return 2;
+    }
+  }
+  if (argc - optind != 2) {
+    usage(argv[0]);
+    return 2;
+  }
+  char *root = argv[optind];
+  const char *out = argv[optind + 1];
+  root_len = strlen(root);
+  while (root_len > 1 && root[root_len - 1] == '/')
+    root[--root_len] = '\0';
+  if (strcmp(root, "/") == 0)
+    root_len = 0;
+
+  int rc = 1;
+  int fd = -1;
+  char *strings = NULL;
+  char tmp[4096];
+  static const char *types_seen[MAX_TYPES];
+  static u32 type_offs[MAX_TYPES];
+  u32 type_count = 0;
+  if (nftw(root, visit, 64, FTW_PHYS) != 0) {
+    perror(root);
+    goto out;
+  }
+  qsort(files, count, sizeof(*files), cmp_path);
+
+  // Strings: each MIME type once, then per file its path and room for both ETags.
+  u64 strings_len = 0;
+  for (u32 i = 0; i < count; i++) {
+    u32 j = 0;
+    while (j < type_count && strcmp(types_seen[j], files[i].mime) != 0)
+      j++;
+    if (j == type_count) {
+      if (type_count == MAX_TYPES) {
+        fprintf(stderr, "%s: too many MIME types\n", root);
+        goto out;
+      }
+      types_seen[type_count] = files[i].mime;
+      type_offs[type_count++] = (u32)strings_len;
+      strings_len += strlen(files[i].mime) + 1;
+    }
+    files[i].mime_off = type_offs[j];
+  }
+  for (u32 i = 0; i < count; i++) {
+    bundle_entry_t *e = &files[i].e;
+    e->mime_off = files[i].mime_off;
+    e->path_off = (u32)strings_len;
+    e->path_len = (u32)strlen(files[i].path);
+    e->etag_off = e->path_off + e->path_len + 1;
+    e->gz_etag_off = e->etag_off + ETAG_LEN + 1;
+    strings_len += e->path_len + 1 + ETAG_LEN + 1 + GZ_ETAG_LEN + 1;
+    if (strings_len > UINT32_MAX) {
+      fprintf(stderr, "%s: too many files\n", root);
+      goto out;
+    }
+  }
+  strings_len++;
+  strings = calloc(1, strings_len);
+  if (!strings)
+    goto out;
+  for (u32 i = 0; i < count; i++) {
+    memcpy(strings + files[i].mime_off, files[i].mime, strlen(files[i].mime));
+    memcpy(strings + files[i].e.path_off, files[i].path, files[i].e.path_len);
+  }
+
+  bundle_header_t h = {.version = BUNDLE_VERSION, .count = count};
+  memcpy(h.magic, BUNDLE_MAGIC, sizeof(h.magic));
+  h.index_off = sizeof(h);
+  h.strings_off = h.index_off + (u64)count * sizeof(bundle_entry_t);
+  h.strings_len = strings_len;
+
+  if (snprintf(tmp, sizeof(tmp), "%s.tmp", out) >= (int)sizeof(tmp))
+    goto out;
+  fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    perror(tmp);
+    goto out;
+  }
+  u64 pos = h.strings_off + strings_len;
+  u32 gz_count = 0;
+  if (pack_payloads(fd, strings, &pos, level, &gz_count) < 0)
+    goto out;
+
+  bool ok = write_at(fd, &h, sizeof(h), 0) && write_at(fd, strings, strings_len, h.strings_off);
+  for (u32 i = 0; ok && i < count; i++)
+    ok = write_at(fd, &files[i].e, sizeof(files[i].e), h.index_off + i * sizeof(bundle_entry_t));
+  if (!ok || fsync(fd) < 0 || close(fd) < 0) {
+    perror(tmp);
+    fd = -1;
+    goto out;
+  }
+  fd = -1;
+  if (rename(tmp, out) < 0) {
+    perror(out);
+    goto out;
+  }
+  printf("%s: %u files, %u gzip variants, %llu bytes\n", out, count, gz_count,
+         (unsigned long long)pos);
+  rc = 0;
+
+out:
+  if (fd >= 0) {
+    close(fd);
+    unlink(tmp);
+  }
+  for (u32 i = 0; i < count; i++) {
+    free(files[i].path);
+    free(files[i].src);
+  }
+  free(files);
+  free(strings);
+  free(custom);
+  free(types);
+  return rc;
+}